@@ -0,0 +1,497 @@
+/**
+ * libpragma.c - Embedding API (see libpragma.h)
+ *
+ * A pragma_site is a loaded site plus the pragma_context that holds its module state
+ * (pragma_context.c). Every call locks the site, binds its context and locale to the
+ * calling thread, runs the same code the pragma binary runs, and unbinds again, so
+ * sites don't see each other's state and the host's locale is left alone.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#include "libpragma.h"
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+
+struct pragma_site {
+	pragma_context *context;
+	site_info *config;
+	pp_page *pages;			// sorted, parsed, with icons and related posts
+	char *source_dir;
+	char *output_dir;
+	pragma_log_fn log;
+	void *log_data;
+	locale_t locale;		// UTF-8 LC_CTYPE for character classes and collation
+	pthread_mutex_t lock;		// one call at a time per site
+};
+
+// What enter_site() replaced, for leave_site()
+typedef struct {
+	pragma_context *context;
+	locale_t locale;
+} site_call;
+
+/**
+ * enter_site(): Lock a site and bind its context and locale to the calling thread.
+ */
+static site_call enter_site(pragma_site *site) {
+	pthread_mutex_lock(&site->lock);
+	site_call call = { .context = context_bind(site->context), .locale = (locale_t)0 };
+	if (site->locale)
+		call.locale = uselocale(site->locale);
+	return call;
+}
+
+/**
+ * leave_site(): Undo enter_site().
+ */
+static void leave_site(pragma_site *site, site_call call) {
+	if (call.locale)
+		uselocale(call.locale);
+	context_bind(call.context);
+	pthread_mutex_unlock(&site->lock);
+}
+
+/**
+ * forward_log(): Logger sink that passes a site's messages to the host's callback.
+ */
+static void forward_log(log_level_t level, const char *message, void *user_data) {
+	pragma_site *site = user_data;
+	site->log((int)level, message, site->log_data);
+}
+
+/**
+ * html_to_utf8(): Convert a rendered page to UTF-8 (minified with minify:yes, as the write
+ * stage would) and free it.
+ */
+static char* html_to_utf8(pragma_site *site, pp_rope *page) {
+	wchar_t *html = rope_flatten(page);
+	rope_free(page);
+	if (!html)
+		return NULL;
+
+	size_t length = 0;
+	char *bytes = site->config->minify ? minify_html(html, &length) : wchar_to_utf8(html);
+	free(html);
+	return bytes;
+}
+
+/**
+ * prepare_pages(): Parse Markdown for a list of freshly loaded pages (queueing gallery
+ * thumbnails) and give them icons.
+ */
+static void prepare_pages(pragma_site *site, pp_page *pages) {
+	if (!pages)
+		return;
+
+	thumbnail_pipeline_init(true);
+	parse_site_markdown(pages);
+	thumbnail_pipeline_finish();
+	assign_icons(pages, site->config, site->source_dir);
+}
+
+/**
+ * prepare_assets(): Set up icon markup, fingerprinted assets, the stylesheet and the
+ * compiled header/footer so pages can be rendered before the first full build. Only
+ * supporting files are written. Returns false if the write stage couldn't be set up.
+ */
+static bool prepare_assets(pragma_site *site) {
+	if (output_stage_init(site->output_dir, site->config) != 0)
+		return false;
+	icon_catalog_init(site->config, site->output_dir);
+	fingerprint_assets(site->config, site->source_dir, site->output_dir);
+	prepare_stylesheet(site->config, site->source_dir, site->output_dir);
+	prepare_page_frames(site->config);
+	output_stage_discard();
+	return true;
+}
+
+/**
+ * pragma_site_open(): Load a site (see libpragma.h).
+ *
+ * arguments:
+ *  const char *source_dir (site source directory)
+ *  const char *output_dir (output directory; must exist)
+ *  pragma_log_fn log (message callback; NULL logs errors to stderr only)
+ *  void *user_data (passed through to log)
+ *
+ * returns:
+ *  pragma_site* (open site; NULL on error; caller must pragma_site_close())
+ */
+pragma_site* pragma_site_open(const char *source_dir, const char *output_dir,
+                              pragma_log_fn log, void *user_data) {
+	if (!source_dir || !output_dir)
+		return NULL;
+
+	pragma_site *site = calloc(1, sizeof(pragma_site));
+	if (!site)
+		return NULL;
+	site->context = context_create();
+	site->source_dir = strdup(source_dir);
+	site->output_dir = strdup(output_dir);
+	if (!site->context || !site->source_dir || !site->output_dir) {
+		context_destroy(site->context);
+		free(site->source_dir);
+		free(site->output_dir);
+		free(site);
+		return NULL;
+	}
+	site->log = log;
+	site->log_data = user_data;
+	site->locale = newlocale(LC_CTYPE_MASK, "en_US.UTF-8", (locale_t)0);
+	if (!site->locale)
+		site->locale = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t)0);
+	pthread_mutex_init(&site->lock, NULL);
+
+	site_call call = enter_site(site);
+	log_init(LOG_INFO, log == NULL);
+	if (log)
+		log_set_sink(forward_log, site);
+	if (!site->locale)
+		log_warn("no UTF-8 locale available; using the host's LC_CTYPE");
+
+	bool ok = false;
+	if (!check_dir(site->source_dir, S_IRUSR)) {
+		log_error("source directory '%s' does not exist or is not readable", source_dir);
+	} else if (!check_dir(site->output_dir, S_IWUSR)) {
+		log_error("output directory '%s' does not exist or is not writable", output_dir);
+	} else if ((site->config = load_site_config(site->source_dir, false)) == NULL) {
+		log_error("can't load the site configuration in %s", source_dir);
+	} else {
+		swprintf(site->config->base_dir, 256, L"%s", site->source_dir);
+
+		// The same steps as a pragma build, up to rendering
+		site->pages = load_site(LOAD_EVERYTHING, site->source_dir, 0);
+		image_probe_init(site->source_dir, site->output_dir);
+		char *icons_dir = char_convert(site->config->icons_dir);
+		if (icons_dir) {
+			load_site_icons(site->output_dir, icons_dir, site->config);
+			free(icons_dir);
+		}
+		prepare_pages(site, site->pages);
+		sort_site(&site->pages);
+		related_posts_build(site->pages, site->config, site->output_dir, true);
+		backlinks_build(site->pages, site->config);
+		ok = prepare_assets(site);
+	}
+	leave_site(site, call);
+
+	if (!ok) {
+		pragma_site_close(site);
+		return NULL;
+	}
+	return site;
+}
+
+/**
+ * pragma_render_markdown(): Render a Markdown document to an HTML fragment.
+ *
+ * arguments:
+ *  pragma_site *site (open site)
+ *  const char *markdown (UTF-8 Markdown)
+ *
+ * returns:
+ *  char* (UTF-8 HTML; NULL on error; free with pragma_free())
+ */
+char* pragma_render_markdown(pragma_site *site, const char *markdown) {
+	if (!site || !markdown)
+		return NULL;
+
+	site_call call = enter_site(site);
+	char *result = NULL;
+	// The parser expects lines to end in newlines, as they do in source files
+	size_t length = strlen(markdown);
+	char *text = malloc(length + 2);
+	wchar_t *source = NULL;
+	if (text) {
+		memcpy(text, markdown, length);
+		text[length] = '\n';
+		text[length + 1] = '\0';
+		source = utf8_to_wchar(text);
+		free(text);
+	}
+	if (source) {
+		bool has_gallery = false;
+		wchar_t *html = parse_markdown(source, &has_gallery, NULL);
+		free(source);
+		if (html) {
+			result = wchar_to_utf8(html);
+			free(html);
+		}
+	}
+	leave_site(site, call);
+	return result;
+}
+
+/**
+ * pragma_render_post(): Render a post's page.
+ *
+ * arguments:
+ *  pragma_site *site (open site)
+ *  const char *slug (source file name without .txt)
+ *
+ * returns:
+ *  char* (UTF-8 HTML document; NULL if there's no such post; free with pragma_free())
+ */
+char* pragma_render_post(pragma_site *site, const char *slug) {
+	if (!site || !slug)
+		return NULL;
+
+	site_call call = enter_site(site);
+	char *result = NULL;
+	wchar_t *name = utf8_to_wchar((utf8_path)slug);
+	if (name) {
+		for (pp_page *page = site->pages; page != NULL; page = page->next) {
+			if (page->source_filename && wcscmp(page->source_filename, name) == 0) {
+				result = html_to_utf8(site, build_single_page(page, site->config));
+				break;
+			}
+		}
+		free(name);
+	}
+	leave_site(site, call);
+	return result;
+}
+
+/**
+ * pragma_render_index(): Render one index page.
+ *
+ * arguments:
+ *  pragma_site *site (open site)
+ *  int page (0 for index.html)
+ *
+ * returns:
+ *  char* (UTF-8 HTML document; NULL if the page doesn't exist; free with pragma_free())
+ */
+char* pragma_render_index(pragma_site *site, int page) {
+	if (!site || page < 0)
+		return NULL;
+
+	site_call call = enter_site(site);
+	char *result = NULL;
+	int posts = 0;
+	for (pp_page *p = site->pages; p != NULL; p = p->next)
+		posts++;
+	int index_size = site->config->index_size;
+	if (index_size > 0 && page < (posts + index_size - 1) / index_size)
+		result = html_to_utf8(site, build_index(site->pages, site->config, page));
+	leave_site(site, call);
+	return result;
+}
+
+/**
+ * reload_sources(): Bring the page list up to date with dat/: parse new and modified
+ * sources, drop deleted ones, keep the rest as they are (icons included).
+ *
+ * returns:
+ *  int (number of posts added, changed or removed; -1 if dat/ can't be read)
+ */
+static int reload_sources(pragma_site *site) {
+	size_t length = strlen(site->source_dir);
+	char dat_dir[PATH_MAX];
+	snprintf(dat_dir, sizeof(dat_dir), "%s%s%s", site->source_dir,
+	         (length > 0 && site->source_dir[length - 1] == '/') ? "" : "/", SITE_SOURCES_DEFAULT_SUBDIR);
+
+	DIR *dir = utf8_opendir(dat_dir);
+	if (!dir) {
+		log_error("Can't open the source directory %s", dat_dir);
+		return -1;
+	}
+
+	int count = 0;
+	for (pp_page *p = site->pages; p != NULL; p = p->next)
+		count++;
+	pp_page **old = malloc((count + 1) * sizeof(pp_page*));
+	bool *kept = calloc(count + 1, sizeof(bool));
+	if (!old || !kept) {
+		free(old);
+		free(kept);
+		closedir(dir);
+		log_error("can't allocate memory while reloading sources");
+		return -1;
+	}
+	int i = 0;
+	for (pp_page *p = site->pages; p != NULL; p = p->next)
+		old[i++] = p;
+
+	// Same file filter as load_site()
+	pp_page *fresh = NULL;
+	int changes = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strstr(ent->d_name, ".txt") == NULL || ent->d_name[0] == '.')
+			continue;
+
+		char path[PATH_MAX];
+		struct stat st;
+		if (snprintf(path, sizeof(path), "%s%s", dat_dir, ent->d_name) >= (int)sizeof(path) ||
+		    utf8_stat(path, &st) != 0)
+			continue;
+
+		wchar_t *name = wchar_convert(ent->d_name);
+		if (!name)
+			continue;
+		size_t name_len = wcslen(name);
+		if (name_len > 4 && wcscmp(name + name_len - 4, L".txt") == 0)
+			name[name_len - 4] = L'\0';
+		int match = -1;
+		for (i = 0; i < count && match < 0; i++)
+			if (!kept[i] && wcscmp(old[i]->source_filename, name) == 0)
+				match = i;
+		free(name);
+
+		if (match >= 0 && old[match]->last_modified == st.st_mtime) {
+			kept[match] = true;
+			continue;
+		}
+
+		pp_page *page = parse_file(path);
+		if (!page) {
+			log_error("parse_file() returned null while trying to read %s!", ent->d_name);
+			continue;
+		}
+		page->next = fresh;
+		page->prev = NULL;
+		if (fresh)
+			fresh->prev = page;
+		fresh = page;
+		changes++;
+	}
+	closedir(dir);
+
+	// Count deletions: old pages that nothing replaced
+	for (i = 0; i < count; i++) {
+		if (kept[i])
+			continue;
+		bool replaced = false;
+		for (pp_page *p = fresh; p != NULL && !replaced; p = p->next)
+			replaced = wcscmp(p->source_filename, old[i]->source_filename) == 0;
+		if (!replaced)
+			changes++;
+	}
+
+	prepare_pages(site, fresh);
+
+	// New list: kept pages, then fresh ones; related lists are rebuilt after sorting
+	pp_page *head = NULL, *tail = NULL;
+	for (i = 0; i < count; i++) {
+		pp_page *page = old[i];
+		free(page->related);
+		page->related = NULL;
+		page->related_count = 0;
+		free(page->backlinks);
+		page->backlinks = NULL;
+		page->backlink_count = 0;
+		if (!kept[i]) {
+			page->next = NULL;
+			free_page(page);
+			continue;
+		}
+		page->prev = tail;
+		page->next = NULL;
+		if (tail)
+			tail->next = page;
+		else
+			head = page;
+		tail = page;
+	}
+	if (fresh) {
+		fresh->prev = tail;
+		if (tail)
+			tail->next = fresh;
+		else
+			head = fresh;
+	}
+	site->pages = head;
+
+	free(old);
+	free(kept);
+	return changes;
+}
+
+/**
+ * pragma_site_update(): Reload changed sources and rebuild the site into output_dir.
+ *
+ * arguments:
+ *  pragma_site *site (open site)
+ *
+ * returns:
+ *  int (number of posts added, changed or removed; -1 on error)
+ */
+int pragma_site_update(pragma_site *site) {
+	if (!site)
+		return -1;
+
+	site_call call = enter_site(site);
+	int changes = reload_sources(site);
+	if (changes >= 0) {
+		if (changes > 0)
+			log_info("%d post%s added, changed or removed", changes, changes == 1 ? "" : "s");
+		sort_site(&site->pages);
+		related_posts_build(site->pages, site->config, site->output_dir, true);
+		backlinks_build(site->pages, site->config);
+
+		search_index_init(site->config->search);
+		search_index_queue(site->pages);
+		if (build_site_output(site->pages, site->config, site->source_dir, site->output_dir, false) != 0)
+			changes = -1;
+		search_index_free();
+
+		// Save image sizes probed since the last update, and keep probing for renders
+		image_probe_finish(true);
+		image_probe_init(site->source_dir, site->output_dir);
+		if (changes >= 0)
+			update_last_run_time(site->source_dir);
+	}
+	leave_site(site, call);
+	return changes;
+}
+
+/**
+ * pragma_site_close(): Release a site.
+ *
+ * arguments:
+ *  pragma_site *site (site to close; may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void pragma_site_close(pragma_site *site) {
+	if (!site)
+		return;
+
+	// Module cleanup runs inside the site's context, so it releases the site's own state
+	site_call call = enter_site(site);
+	free_page_list(site->pages);
+	if (site->config)
+		free_site_info(site->config);
+	image_probe_finish(false);
+	free_asset_map();
+	icon_catalog_free();
+	work_pool_cleanup_global();
+	buffer_pool_cleanup_global();
+	leave_site(site, call);
+
+	context_destroy(site->context);
+	if (site->locale)
+		freelocale(site->locale);
+	pthread_mutex_destroy(&site->lock);
+	free(site->source_dir);
+	free(site->output_dir);
+	free(site);
+}
+
+/**
+ * pragma_free(): Free a string returned by the library.
+ *
+ * arguments:
+ *  void *p (string to free; may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void pragma_free(void *p) {
+	free(p);
+}
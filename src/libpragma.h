@@ -0,0 +1,113 @@
+/**
+ * libpragma.h - Embedding API for pragma-web (make lib => bin/libpragma.a, bin/libpragma.so)
+ *
+ * Tools that would otherwise run the pragma binary for every preview or import can open a
+ * site once and keep it in memory. Each open site has its own state (buffers, logging,
+ * caches), so a host can keep several sites open and call into different sites from
+ * different threads at the same time. Calls on one site take turns.
+ *
+ * Strings in and out are UTF-8. Returned strings belong to the caller; release them with
+ * pragma_free().
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#ifndef LIBPRAGMA_H
+#define LIBPRAGMA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define PRAGMA_API __attribute__((visibility("default")))
+#else
+#define PRAGMA_API
+#endif
+
+typedef struct pragma_site pragma_site;
+
+// Message levels passed to a pragma_log_fn (the same levels the pragma binary logs at)
+enum pragma_log_level {
+	PRAGMA_LOG_DEBUG = 0,
+	PRAGMA_LOG_INFO = 1,
+	PRAGMA_LOG_WARN = 2,
+	PRAGMA_LOG_ERROR = 3,
+	PRAGMA_LOG_FATAL = 4
+};
+
+// Receives a site's messages, without prefix or trailing newline
+typedef void (*pragma_log_fn)(int level, const char *message, void *user_data);
+
+/**
+ * pragma_site_open(): Load a site: configuration, sources (parsed to HTML), icons and
+ * related posts. Nothing is rendered into output_dir until pragma_site_update(), although
+ * gallery thumbnails and fingerprinted asset copies are created there, as in a build.
+ *
+ * arguments:
+ *  const char *source_dir (site source directory, as for pragma -s)
+ *  const char *output_dir (output directory, as for pragma -o; must exist)
+ *  pragma_log_fn log (receives the site's messages; NULL logs errors to stderr only)
+ *  void *user_data (passed through to log)
+ *
+ * returns:
+ *  pragma_site* (open site; NULL on error; caller must pragma_site_close())
+ */
+PRAGMA_API pragma_site* pragma_site_open(const char *source_dir, const char *output_dir,
+                                         pragma_log_fn log, void *user_data);
+
+/**
+ * pragma_render_markdown(): Render one Markdown document to HTML, the way post bodies
+ * are rendered (image sizes, srcsets and galleries included).
+ *
+ * returns:
+ *  char* (HTML fragment; NULL on error)
+ */
+PRAGMA_API char* pragma_render_markdown(pragma_site *site, const char *markdown);
+
+/**
+ * pragma_render_post(): Render a post's complete page, with navigation and related
+ * posts, as it would be written to c/{slug}.html.
+ *
+ * arguments:
+ *  const char *slug (source file name without .txt: "fido" for dat/fido.txt)
+ *
+ * returns:
+ *  char* (HTML document; NULL if there's no such post)
+ */
+PRAGMA_API char* pragma_render_post(pragma_site *site, const char *slug);
+
+/**
+ * pragma_render_index(): Render index page n (0 is index.html, 1 is index1.html, ...).
+ *
+ * returns:
+ *  char* (HTML document; NULL if the page doesn't exist)
+ */
+PRAGMA_API char* pragma_render_index(pragma_site *site, int page);
+
+/**
+ * pragma_site_update(): Pick up source changes and rebuild the site into output_dir.
+ * Only new and modified sources are parsed again (deleted ones are dropped); every
+ * output is rendered, and the write stage leaves unchanged files alone. Configuration,
+ * header and footer changes need the site to be reopened.
+ *
+ * returns:
+ *  int (number of posts added, changed or removed; -1 on error)
+ */
+PRAGMA_API int pragma_site_update(pragma_site *site);
+
+/**
+ * pragma_site_close(): Release a site and everything it holds. May be NULL.
+ */
+PRAGMA_API void pragma_site_close(pragma_site *site);
+
+/**
+ * pragma_free(): Free a string returned by the library.
+ */
+PRAGMA_API void pragma_free(void *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,7 +8,14 @@ void cleanup_buffer_pool(void) {
 }
 
 /**
- * parse_arguments(): Parse command-line arguments using getopt.
+ * cleanup_work_pool(): Finish background jobs and stop the worker pool at program exit.
+ */
+void cleanup_work_pool(void) {
+	work_pool_cleanup_global();
+}
+
+/**
+ * parse_arguments(): Parse command-line arguments using getopt_long.
  *
  * arguments:
  *  int argc (argument count)
@@ -21,22 +28,52 @@ void cleanup_buffer_pool(void) {
 int parse_arguments(int argc, char *argv[], pragma_options *opts) {
     int option;
 
+    // Long options only; their values are past any short option character
+    enum { OPTION_TAR = 256, OPTION_TAR_GZIP };
+    static const struct option long_options[] = {
+        { "tar", no_argument, NULL, OPTION_TAR },
+        { "tar-gz", no_argument, NULL, OPTION_TAR_GZIP },
+        { NULL, 0, NULL, 0 }
+    };
+
     // Initialize options to defaults
     memset(opts, 0, sizeof(pragma_options));
 
     // Parse options using getopt
-    while ((option = getopt(argc, argv, "s:o:c:funhdx")) != -1) {
+    while ((option = getopt_long(argc, argv, "s:o:c:t:b:funhdxj", long_options, NULL)) != -1) {
         switch (option) {
             case 's':
-                opts->source_dir = optarg;
+                if (opts->source_count == MAX_BATCH_SITES) {
+                    printf("Error: at most %d sites can be given with -s\n", MAX_BATCH_SITES);
+                    return -1;
+                }
+                opts->sources[opts->source_count++] = optarg;
+                if (!opts->source_dir)
+                    opts->source_dir = optarg;
                 break;
             case 'o':
-                opts->output_dir = optarg;
+                if (opts->output_count == MAX_BATCH_SITES) {
+                    printf("Error: at most %d sites can be given with -o\n", MAX_BATCH_SITES);
+                    return -1;
+                }
+                opts->outputs[opts->output_count++] = optarg;
+                if (!opts->output_dir)
+                    opts->output_dir = optarg;
+                break;
+            case 'b':
+                opts->batch_file = optarg;
                 break;
             case 'c':
                 opts->create_site = true;
                 opts->output_dir = optarg; // -c takes a directory argument
                 break;
+            case 't':
+                if (opts->target_count == MAX_BUILD_TARGETS) {
+                    printf("Error: at most %d targets can be given with -t\n", MAX_BUILD_TARGETS);
+                    return -1;
+                }
+                opts->targets[opts->target_count++] = optarg;
+                break;
             case 'f':
                 opts->force_all = true;
                 break;
@@ -55,6 +92,16 @@ int parse_arguments(int argc, char *argv[], pragma_options *opts) {
             case 'x':
                 opts->clean_stale = true;
                 break;
+            case 'j':
+                opts->json_log = true;
+                break;
+            case OPTION_TAR:
+                opts->tar = true;
+                break;
+            case OPTION_TAR_GZIP:
+                opts->tar = true;
+                opts->tar_gzip = true;
+                break;
             case '?':
                 // getopt prints error message for unknown options
                 return -1;
@@ -66,6 +113,13 @@ int parse_arguments(int argc, char *argv[], pragma_options *opts) {
     return 0;
 }
 
+/**
+ * batch_mode(): Whether the options ask for several sites (-b, or more than one -s/-o).
+ */
+static bool batch_mode(const pragma_options *opts) {
+    return opts->batch_file || opts->source_count > 1 || opts->output_count > 1;
+}
+
 /**
  * validate_options(): Validate parsed command-line options.
  *
@@ -98,6 +152,49 @@ int validate_options(pragma_options *opts) {
         return 2; // Special return code for create site (should exit after creation)
     }
 
+    // Validate conflicting options instead of just blasting on through with -f 
+    if (opts->force_all && opts->updated_only) {
+        printf("Error: cannot specify both -f (force all) and -u (updated only)\n");
+        return -1;
+    }
+
+    // same with -u / -n, though it's a little less egregious 
+    if (opts->updated_only && opts->new_only) {
+        printf("Error: cannot specify both -u (updated only) and -n (new only)\n");
+        return -1;
+    }
+
+    // An archive holds one site's outputs, and there's no output directory to clean
+    if (opts->tar) {
+        if (batch_mode(opts)) {
+            printf("Error: --tar builds one site; it can't be combined with -b or several -s/-o pairs\n");
+            return -1;
+        }
+        if (opts->target_count > 0) {
+            printf("Error: --tar writes one archive; it can't be combined with -t\n");
+            return -1;
+        }
+        if (opts->clean_stale) {
+            printf("Error: -x cleans up an output directory; it can't be combined with --tar\n");
+            return -1;
+        }
+    }
+
+    // A batch checks each site's directories when it gets to it, so one bad pair doesn't
+    // stop the rest; the pairs themselves have to line up, though
+    if (batch_mode(opts)) {
+        if (opts->source_count != opts->output_count) {
+            printf("Error: -s and -o must come in pairs (got %d -s and %d -o)\n",
+                   opts->source_count, opts->output_count);
+            return -1;
+        }
+        if (opts->batch_file && access(opts->batch_file, R_OK) != 0) {
+            printf("Error: batch file '%s' does not exist or is not readable\n", opts->batch_file);
+            return -1;
+        }
+        return 0;
+    }
+
     // For normal operation, we need both source and output
     if (!opts->source_dir) {
         printf("Error: must specify source directory with -s\n");
@@ -122,251 +219,443 @@ int validate_options(pragma_options *opts) {
         return -1;
     }
 
-    // Validate output directory
-    if (!check_dir(opts->output_dir, S_IWUSR)) {
+    // Validate output directory (with --tar, -o is the archive, which tar_open() creates)
+    if (!opts->tar && !check_dir(opts->output_dir, S_IWUSR)) {
         printf("Error: output directory '%s' does not exist or is not writable\n", opts->output_dir);
         return -1;
     }
 
-    // Validate conflicting options instead of just blasting on through with -f 
-    if (opts->force_all && opts->updated_only) {
-        printf("Error: cannot specify both -f (force all) and -u (updated only)\n");
-        return -1;
-    }
-
-    // same with -u / -n, though it's a little less egregious 
-    if (opts->updated_only && opts->new_only) {
-        printf("Error: cannot specify both -u (updated only) and -n (new only)\n");
-        return -1;
-    }
-
     return 0; // Valid for normal operation
 }
 
 /**
- * main(): Entry point for the `pragma web` static site generator.
- *
- * Parses CLI arguments using getopt, validates options, and dispatches
- * site-building operations.
+ * add_option_targets(): Add the -t DIR=URL targets to the ones from the config file,
+ * skipping any whose directory isn't writable.
  *
  * arguments:
- *  int   argc (number of command-line arguments)
- *  char *argv[] (array of argument strings)
+ *  const pragma_options *opts (command-line options)
+ *  site_info *config (site configuration; receives the targets)
  *
  * returns:
- *  int (EXIT_SUCCESS or EXIT_FAILURE)
+ *  void
  */
-int main(int argc, char *argv[]) {
-	// setlocale() needs to be called asap so that Unicode is handled properly
-	setlocale(LC_CTYPE, "en_US.UTF-8");
-
-	// Initialize global buffer pool for unified buffer management
-	buffer_pool_init_global();
-
-	// Register cleanup function for automatic cleanup at exit
-	atexit(cleanup_buffer_pool);
-
-    pragma_options opts;
-    char *posts_output_directory;
-
-	// Show usage if no arguments provided
-	if (argc == 1) {
-		usage();
-		exit(EXIT_FAILURE);
-	}
-
-    // Parse command-line arguments
-    if (parse_arguments(argc, argv, &opts) != 0) {
-        exit(EXIT_FAILURE);
+static void add_option_targets(const pragma_options *opts, site_info *config) {
+    for (int i = 0; i < opts->target_count; i++) {
+        char *spec = strdup(opts->targets[i]);
+        char *equals = spec ? strchr(spec, '=') : NULL;
+        if (!equals) {
+            log_error("target %s should look like DIR=URL; skipping it", opts->targets[i]);
+            free(spec);
+            continue;
+        }
+        *equals = '\0';
+        wchar_t *url = wchar_convert(equals + 1);
+        if (!url || !add_build_target(config, spec, url))
+            log_error("could not add target %s (at most %d targets)", opts->targets[i], MAX_BUILD_TARGETS);
+        free(url);
+        free(spec);
     }
 
-    // Validate options and handle immediate actions
-    int validation_result = validate_options(&opts);
-    if (validation_result == -1) {
-        exit(EXIT_FAILURE);
-    } else if (validation_result == 1) {
-        // Help was shown
-        exit(EXIT_SUCCESS);
-    } else if (validation_result == 2) {
-        // Create site and exit
-        printf("Will create a new pragma-web site in %s\n\n", opts.output_dir);
-        build_new_pragma_site(opts.output_dir);
-        exit(EXIT_SUCCESS);
+    // Like -o, pragma won't create target directories
+    for (int i = 0; i < config->target_count; ) {
+        if (check_dir(config->targets[i].output_dir, S_IWUSR)) {
+            i++;
+            continue;
+        }
+        log_error("target directory '%s' does not exist or is not writable; skipping it",
+                  config->targets[i].output_dir);
+        free(config->targets[i].output_dir);
+        free(config->targets[i].base_url);
+        config->targets[i] = config->targets[--config->target_count];
     }
+}
 
-    // Initialize logging system
-    log_level_t log_level = LOG_INFO;  // Default to info level
-    bool quiet_mode = opts.dry_run;    // Quiet mode for dry runs
-    log_init(log_level, quiet_mode);
+// What one site's build did, for the batch summary
+typedef struct site_stats {
+    int posts;
+    int written;        // outputs written, over every target
+    int unchanged;      // outputs left alone because they hadn't changed
+    int warnings;
+    int errors;
+    double seconds;
+    bool ok;
+} site_stats;
 
+/**
+ * build_site(): Load, render and write one site: everything a `pragma -s DIR -o DIR` run
+ * does once its options are checked.
+ *
+ * arguments:
+ *  const pragma_options *opts (command-line options; source_dir and output_dir say which site)
+ *  site_stats *stats (receives posts and outputs written; may be NULL)
+ *
+ * returns:
+ *  int (0 on success, -1 if the site couldn't be loaded)
+ */
+static int build_site(const pragma_options *opts, site_stats *stats) {
     // At this point we have valid source and output directories
-    log_info("Using source directory %s", opts.source_dir);
-    log_info("Using output directory %s", opts.output_dir);
-
-    // Set up posts output directory
-    posts_output_directory = malloc(strlen(opts.output_dir) + strlen(SITE_POSTS) + 64);
-    if (posts_output_directory == NULL) {
-        log_fatal("can't allocate memory for posts output path");
-        exit(EXIT_FAILURE);
-    }
-
-    // Build posts directory path
-    strcpy(posts_output_directory, opts.output_dir);
-	// accommodate trailing / or not
-    strcat(posts_output_directory, opts.output_dir[strlen(opts.output_dir)-1] != '/' ? "/" : "");
-    strcat(posts_output_directory, SITE_POSTS);
+    log_info("Using source directory %s", opts->source_dir);
+    if (opts->archive_path)
+        log_info("Writing a tar archive to %s", strcmp(opts->archive_path, "-") == 0 ? "standard output" : opts->archive_path);
+    else
+        log_info("Using output directory %s", opts->output_dir);
 
     // Load site configuration
-    site_info* config = load_site_yaml(opts.source_dir);
+    site_info* config = load_site_yaml(opts->source_dir);
     if (config == NULL) {
         log_fatal("Can't proceed without site configuration! Aborting.");
-        free(posts_output_directory);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    wcscpy(config->base_dir, wchar_convert(opts.source_dir));
+    wchar_t *base_dir = wchar_convert(opts->source_dir);
+    if (base_dir) {
+        swprintf(config->base_dir, 256, L"%ls", base_dir);
+        free(base_dir);
+    }
     // wprintf(L"%s\n", config->base_dir); ??? old debugging?
 
     // Determine loading mode based on options
     int load_mode = LOAD_EVERYTHING; // default to full site load
     time_t since_time = 0;
 
-    if (opts.updated_only) {
+    if (opts->updated_only) {
         load_mode = LOAD_UPDATED_ONLY;
-        since_time = get_last_run_time(opts.source_dir);
+        since_time = get_last_run_time(opts->source_dir);
         log_info("Loading files updated since last run");
-    } else if (opts.new_only) {
+    } else if (opts->new_only) {
         // TODO: Implement new-only mode
         log_info("New-only mode not yet implemented, loading everything");
-    } else if (opts.force_all) {
+    } else if (opts->force_all) {
         log_info("Force rebuilding all files");
     }
 
-    if (opts.dry_run) {
+    if (opts->dry_run) {
         log_info("DRY RUN MODE: No files will be written");
     }
 
 	log_debug("load = %d", load_mode);
     // Load the site sources
-    pp_page* pages = load_site(load_mode, opts.source_dir, since_time);
+    pp_page* pages = load_site(load_mode, opts->source_dir, since_time);
 
     if (pages == NULL) {
         log_error("no pages found or loaded");
-        free(posts_output_directory);
         free_site_info(config);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    // Process markdown content
+    // Process markdown content (content images get their dimensions probed here)
+    // and gallery thumbnails are queued on the worker pool
+    image_probe_init(opts->source_dir, opts->output_dir);
+    thumbnail_pipeline_init(!opts->dry_run);
     parse_site_markdown(pages);
+    image_probe_finish(!opts->dry_run);
+
+    // Tokenize posts for the search index on the worker pool while pages render
+    // The index covers every post, so it's only rebuilt from a full load: after -u it would
+    // shrink to the changed posts and prune everyone else's shards
+    bool full_load = load_mode == LOAD_EVERYTHING;
+    if (config->search && !opts->dry_run && !full_load)
+        log_info("search index left as it is (only changed posts were loaded)");
+    search_index_init(config->search && !opts->dry_run && full_load);
+    search_index_queue(pages);
 
     // Sort pages by date
     sort_site(&pages);
 
     // Load site icons
-    load_site_icons(opts.output_dir, char_convert(config->icons_dir), config);
+    char *icons_dir = char_convert(config->icons_dir);
+    if (icons_dir) {
+        load_site_icons(opts->output_dir, icons_dir, config);
+        free(icons_dir);
+    }
 
     // Assign icons to pages
-    assign_icons(pages, config, opts.source_dir);
-
-    // Build the site (unless dry run)
-    if (!opts.dry_run) {
-        // Build individual pages
-        pp_page *current_page = pages;
-        int page_count = 0;
-        while (current_page != NULL) {
-            log_info("Building page %d: %ls (tags: %ls)", ++page_count,
-                   current_page->title ? current_page->title : L"[no title]",
-                   current_page->tags ? current_page->tags : L"[no tags]");
-            wchar_t *page_html = build_single_page(current_page, config);
-            if (page_html) {
-                write_single_page(current_page, posts_output_directory, page_html);
-                free(page_html);
-            } else {
-                log_error("build_single_page returned NULL for page %d", page_count);
-            }
-            current_page = current_page->next;
-        }
-        log_info("Built %d individual pages.", page_count);
-        // Build index pages
-        if (config->index_size > 0) {
-            // Count total pages to determine how many index pages we need
-            int total_posts = 0;
-            for (pp_page *count_page = pages; count_page != NULL; count_page = count_page->next) {
-                total_posts++;
-            }
-
-            int total_index_pages = (total_posts + config->index_size - 1) / config->index_size; // Ceiling division
-            log_info("building %d index pages for %d posts...", total_index_pages, total_posts);
-
-            for (int page_num = 0; page_num < total_index_pages; page_num++) {
-                wchar_t *index_html = build_index(pages, config, page_num);
-                if (index_html) {
-                    char index_path[1024];
-                    if (page_num == 0) {
-                        // First page is index.html
-                        snprintf(index_path, sizeof(index_path), "%s/index.html", opts.output_dir);
-                    } else {
-                        // Subsequent pages are index1.html, index2.html, etc.
-                        snprintf(index_path, sizeof(index_path), "%s/index%d.html", opts.output_dir, page_num);
-                    }
-                    write_file_contents(index_path, index_html);
-                    free(index_html);
-                }
-            }
+    assign_icons(pages, config, opts->source_dir);
+
+    // Related posts and backlinks for single pages (need the whole, sorted list)
+    // From a partial load the lists would only cover the changed posts (and the signature
+    // cache would shrink to them), so they wait for the next full build
+    if (full_load)
+        related_posts_build(pages, config, opts->output_dir, !opts->dry_run);
+    else if (config->related_posts > 0)
+        log_info("related posts left out (only changed posts were loaded)");
+    if (full_load)
+        backlinks_build(pages, config);
+    else if (config->backlinks)
+        log_info("backlinks left out (only changed posts were loaded)");
+
+    int written = 0, unchanged = 0;
+
+    // Build the site (unless dry run): -o with the configured base URL, then any other targets
+    if (!opts->dry_run) {
+        add_option_targets(opts, config);
+        int target_count = config->target_count;
+        if (opts->archive_path && target_count > 0) {
+            log_warn("the archive holds the main output only; skipping %d other target%s",
+                     target_count, target_count == 1 ? "" : "s");
+            target_count = 0;
         }
 
-        // Build scroll (chronological index)
-        if (config->build_scroll) {
-			log_info("building scroll...");
-            wchar_t *scroll_html = build_scroll(pages, config);
-            if (scroll_html) {
-                char scroll_path[1024];
-                snprintf(scroll_path, sizeof(scroll_path), "%s/s/index.html", opts.output_dir);
-                write_file_contents(scroll_path, scroll_html);
-                free(scroll_html);
-            }
+        wchar_t *primary_base_url = config->base_url;
+        build_site_output(pages, config, opts->source_dir, opts->output_dir, opts->clean_stale);
+        output_stage_totals(&written, &unchanged);
+        for (int i = 0; i < target_count; i++) {
+            log_info("Building target %s (%ls)", config->targets[i].output_dir, config->targets[i].base_url);
+            config->base_url = config->targets[i].base_url;
+            build_site_output(pages, config, opts->source_dir, config->targets[i].output_dir, opts->clean_stale);
+            int target_written = 0, target_unchanged = 0;
+            output_stage_totals(&target_written, &target_unchanged);
+            written += target_written;
+            unchanged += target_unchanged;
         }
+        config->base_url = primary_base_url;
 
-        // Build tag indices
-        if (config->build_tags) {
-			log_info("building tag indices...");
-            wchar_t *tag_html = build_tag_index(pages, config);
-            if (tag_html) {
-                char tag_path[1024];
-                snprintf(tag_path, sizeof(tag_path), "%s/t/index.html", opts.output_dir);
-                write_file_contents(tag_path, tag_html);
-                free(tag_html);
-            }
-        }
-
-        // Build RSS feed
-		log_info("generating RSS feed...");
-        wchar_t *rss_xml = build_rss(pages, config);
-        if (rss_xml) {
-            char rss_path[1024];
-            snprintf(rss_path, sizeof(rss_path), "%s/feed.xml", opts.output_dir);
-            write_file_contents(rss_path, rss_xml);
-            free(rss_xml);
-        }
+        // Wait for thumbnails; the search index is written for every target by now
+        thumbnail_pipeline_finish();
+        search_index_free();
 
         // Update last run time
-        update_last_run_time(opts.source_dir);
+        update_last_run_time(opts->source_dir);
 
         log_info("Site generation complete.");
-
-        // Clean up stale files if requested
-        if (opts.clean_stale) {
-            cleanup_stale_files(opts.source_dir, opts.output_dir);
-        }
     } else {
         log_info("Dry run complete - no files written");
     }
 
+    if (stats) {
+        stats->posts = 0;
+        for (pp_page *p = pages; p != NULL; p = p->next)
+            stats->posts++;
+        stats->written = written;
+        stats->unchanged = unchanged;
+    }
+
     // Cleanup
-    free(posts_output_directory);
     free_page_list(pages);
     free_site_info(config);
+    free_asset_map();
+    icon_catalog_free();
+
+    return 0;
+}
+
+/**
+ * read_batch_file(): Add the "SOURCE OUTPUT" pairs in a batch file to the -s/-o pairs.
+ * Blank lines and lines starting with # are skipped. The strings are kept for the life of
+ * the process, like argv.
+ *
+ * arguments:
+ *  pragma_options *opts (options; receives the pairs)
+ *
+ * returns:
+ *  int (0 on success, -1 if the file can't be read or a line is malformed)
+ */
+static int read_batch_file(pragma_options *opts) {
+    FILE *batch = fopen(opts->batch_file, "r");
+    if (!batch) {
+        printf("Error: can't read batch file '%s'\n", opts->batch_file);
+        return -1;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    int line_number = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), batch)) {
+        line_number++;
+        char *source = strtok(line, " \t\r\n");
+        if (!source || source[0] == '#')
+            continue;
+        char *output = strtok(NULL, " \t\r\n");
+        if (!output || strtok(NULL, " \t\r\n")) {
+            printf("Error: %s:%d should be \"SOURCE OUTPUT\"\n", opts->batch_file, line_number);
+            result = -1;
+        } else if (opts->source_count == MAX_BATCH_SITES) {
+            printf("Error: at most %d sites can be built in one batch\n", MAX_BATCH_SITES);
+            result = -1;
+        } else {
+            opts->sources[opts->source_count++] = strdup(source);
+            opts->outputs[opts->output_count++] = strdup(output);
+        }
+    }
+    fclose(batch);
+    return result;
+}
+
+/**
+ * build_batch(): Build every site in the batch, one after another in this process.
+ *
+ * Each site gets its own context (pragma_context.c), so its configuration, caches and log
+ * counts are its own, but they all share the buffer pool and the worker pool; templates,
+ * icons and assets that several sites read come from the file cache. A site that fails
+ * is reported and the batch moves on to the next one.
+ *
+ * arguments:
+ *  const pragma_options *opts (command-line options, with the pairs in sources[]/outputs[])
+ *
+ * returns:
+ *  int (number of sites that failed)
+ */
+static int build_batch(const pragma_options *opts) {
+    site_stats *stats = calloc(opts->source_count, sizeof(site_stats));
+    if (!stats) {
+        log_fatal("out of memory starting the batch");
+        return opts->source_count;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < opts->source_count; i++) {
+        pragma_options site_opts = *opts;
+        site_opts.source_dir = opts->sources[i];
+        site_opts.output_dir = opts->outputs[i];
+        log_info("Site %d of %d: %s", i + 1, opts->source_count, site_opts.source_dir);
+
+        pragma_context *context = context_create_shared((1u << CONTEXT_BUFFERS) | (1u << CONTEXT_WORKERS));
+        if (!context) {
+            log_error("out of memory setting up %s; skipping it", site_opts.source_dir);
+            failed++;
+            continue;
+        }
+        context_bind(context);
+        log_init(LOG_INFO, opts->dry_run);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!check_dir(site_opts.source_dir, S_IRUSR)) {
+            log_error("source directory '%s' does not exist or is not readable", site_opts.source_dir);
+        } else if (!check_dir(site_opts.output_dir, S_IWUSR)) {
+            log_error("output directory '%s' does not exist or is not writable", site_opts.output_dir);
+        } else {
+            stats[i].ok = build_site(&site_opts, &stats[i]) == 0;
+        }
+
+        // Jobs carry this context; none may outlive it
+        work_pool_wait(work_pool_get_global());
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats[i].seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        log_counts(&stats[i].warnings, &stats[i].errors);
+
+        // Whatever a failed build left behind (build_site() cleans up after itself otherwise)
+        image_probe_finish(false);
+        thumbnail_pipeline_finish();
+        search_index_free();
+
+        context_bind(NULL);
+        context_destroy(context);
+        if (!stats[i].ok)
+            failed++;
+    }
+
+    int hits = 0, misses = 0;
+    file_cache_counts(&hits, &misses);
+    log_info("Batch complete: %d of %d sites built", opts->source_count - failed, opts->source_count);
+    log_info("%-6s %6s %8s %10s %6s %6s %8s  %s", "status", "posts", "written", "unchanged",
+             "warn", "error", "seconds", "site");
+    for (int i = 0; i < opts->source_count; i++) {
+        log_info("%-6s %6d %8d %10d %6d %6d %8.2f  %s", stats[i].ok ? "ok" : "FAILED",
+                 stats[i].posts, stats[i].written, stats[i].unchanged, stats[i].warnings,
+                 stats[i].errors, stats[i].seconds, opts->sources[i]);
+    }
+    log_info("Shared file cache: %d hits, %d misses", hits, misses);
+
+    free(stats);
+    return failed;
+}
+
+/**
+ * main(): Entry point for the `pragma web` static site generator.
+ *
+ * Parses CLI arguments using getopt_long, validates options, and dispatches
+ * site-building operations.
+ *
+ * arguments:
+ *  int   argc (number of command-line arguments)
+ *  char *argv[] (array of argument strings)
+ *
+ * returns:
+ *  int (EXIT_SUCCESS or EXIT_FAILURE)
+ */
+int main(int argc, char *argv[]) {
+	// Conversions are always UTF-8 (pragma_utf8.c), but character classes and collation
+	// still come from the locale, so ask for a UTF-8 one asap
+	if (!setlocale(LC_CTYPE, "en_US.UTF-8"))
+		setlocale(LC_CTYPE, "C.UTF-8");
+
+	// Initialize global buffer pool for unified buffer management
+	buffer_pool_init_global();
+
+	// Register cleanup function for automatic cleanup at exit
+	atexit(cleanup_buffer_pool);
+	atexit(cleanup_work_pool);
+
+    pragma_options opts;
+
+	// Show usage if no arguments provided
+	if (argc == 1) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
 
-    exit(EXIT_SUCCESS);
+    // Parse command-line arguments
+    if (parse_arguments(argc, argv, &opts) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Validate options and handle immediate actions
+    int validation_result = validate_options(&opts);
+    if (validation_result == -1) {
+        exit(EXIT_FAILURE);
+    } else if (validation_result == 1) {
+        // Help was shown
+        exit(EXIT_SUCCESS);
+    } else if (validation_result == 2) {
+        // Create site and exit
+        printf("Will create a new pragma-web site in %s\n\n", opts.output_dir);
+        build_new_pragma_site(opts.output_dir);
+        exit(EXIT_SUCCESS);
+    }
+
+    // The sites listed in a batch file join any given as -s/-o pairs
+    if (opts.batch_file && read_batch_file(&opts) != 0) {
+        exit(EXIT_FAILURE);
+    } else if (batch_mode(&opts) && opts.source_count == 0) {
+        printf("Error: batch file '%s' lists no sites\n", opts.batch_file);
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize logging system
+    log_level_t log_level = LOG_INFO;  // Default to info level
+    bool quiet_mode = opts.dry_run;    // Quiet mode for dry runs
+    log_init(log_level, quiet_mode);
+
+    // --tar: -o names the archive, and the source directory stands in for the output
+    // directory wherever existing files are read (icons, the stylesheet, images, caches).
+    // Opened before the log writer starts, since "-" moves log output to stderr
+    pp_tar *archive = NULL;
+    if (opts.tar) {
+        opts.archive_path = opts.output_dir;
+        opts.output_dir = opts.source_dir;
+        if (!opts.dry_run) {
+            archive = tar_open(opts.archive_path, opts.tar_gzip);
+            if (!archive)
+                exit(EXIT_FAILURE);
+            output_stage_archive(archive);
+        }
+    }
+    log_start_async(opts.json_log);
+
+    // Build every site in the batch (-b, or several -s/-o pairs), or just the one
+    if (batch_mode(&opts)) {
+        int failed = build_batch(&opts);
+        file_cache_free();
+        exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int result = build_site(&opts, NULL);
+    output_stage_archive(NULL);
+    if (archive && tar_close(archive) != 0) {
+        log_error("couldn't finish writing the archive to %s", opts.archive_path);
+        result = -1;
+    }
+    file_cache_free();
+    exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -0,0 +1,472 @@
+/**
+ * pragma_assets.c - Content-hashed asset fingerprinting
+ *
+ * With `fingerprint:yes`, the site stylesheet, the site JavaScript (when `js:yes`) and every
+ * icon are copied into the output directory under names that include a hash of their
+ * contents (p.css => p.3f9a1c0e.css). References to the plain names in generated pages are
+ * rewritten to the fingerprinted names in apply_common_tokens(), so the header, footer and
+ * templates keep using "/p.css" and "/img/icons/{ICON}".
+ *
+ * Since a fingerprinted file never changes, it can be served with
+ * "Cache-Control: public, max-age=31536000, immutable". The mapping is written to
+ * ASSET_MANIFEST_FILENAME in the output directory for server configuration and deploy scripts.
+ *
+ * Old fingerprinted copies are left in place so pages cached before a deploy keep working.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define ASSET_TABLE_SIZE	1031
+#define ASSET_HASH_DIGITS	8	// hex digits of the content hash kept in file names
+
+typedef struct asset_entry {
+	wchar_t *path;		// site-relative path, like "p.css" or "img/icons/fox.svg"
+	wchar_t *fingerprinted;	// same, with the content hash: "p.3f9a1c0e.css"
+	struct asset_entry *next;
+} asset_entry;
+
+// Asset map for the current build
+static struct asset_state {
+	asset_entry *buckets[ASSET_TABLE_SIZE];
+	int count;
+} g_assets = { .count = 0 };
+
+/**
+ * current_asset(): The asset map in use: g_assets, or the bound libpragma context's copy.
+ */
+static struct asset_state* current_asset(void) {
+	return context_state(CONTEXT_ASSETS, &g_assets, sizeof(g_assets));
+}
+
+/**
+ * asset_bucket(): Hash `length` wide characters of a path into the asset table.
+ */
+static unsigned int asset_bucket(const wchar_t *path, size_t length) {
+	return (unsigned int)(hash_bytes(path, length * sizeof(wchar_t)) % ASSET_TABLE_SIZE);
+}
+
+/**
+ * find_asset(): Look up an asset by the first `length` characters of `path`.
+ *
+ * returns:
+ *  asset_entry* (entry; NULL if the path isn't a fingerprinted asset)
+ */
+static asset_entry* find_asset(const wchar_t *path, size_t length) {
+	for (asset_entry *e = current_asset()->buckets[asset_bucket(path, length)]; e != NULL; e = e->next)
+		if (wcslen(e->path) == length && wcsncmp(e->path, path, length) == 0)
+			return e;
+	return NULL;
+}
+
+/**
+ * is_fingerprinted_name(): True if a file name already carries a content hash, i.e. looks
+ * like "name.0123abcd.ext". Used to keep fingerprinted copies out of the icon list.
+ *
+ * arguments:
+ *  const char *name (file name, without directory)
+ *
+ * returns:
+ *  bool
+ */
+bool is_fingerprinted_name(const char *name) {
+	const char *ext = strrchr(name, '.');
+	if (!ext || ext - name < ASSET_HASH_DIGITS + 2)
+		return false;
+
+	const char *hash = ext - ASSET_HASH_DIGITS;
+	if (hash[-1] != '.')
+		return false;
+	for (int i = 0; i < ASSET_HASH_DIGITS; i++)
+		if (!((hash[i] >= '0' && hash[i] <= '9') || (hash[i] >= 'a' && hash[i] <= 'f')))
+			return false;
+	return true;
+}
+
+/**
+ * is_generated_asset_name(): True if a file in an asset directory is something pragma
+ * wrote there rather than a source asset: a fingerprinted copy, or a gzip sibling
+ * (precompress:yes), whatever its stem. Neither is fingerprinted again or used as an icon.
+ *
+ * arguments:
+ *  const char *name (file name, without directory)
+ *
+ * returns:
+ *  bool
+ */
+bool is_generated_asset_name(const char *name) {
+	size_t length = strlen(name);
+	if (length > 3 && strcmp(name + length - 3, ".gz") == 0)
+		return true;
+	return is_fingerprinted_name(name);
+}
+
+/**
+ * fingerprint_bytes(): Hash one asset's bytes, write its fingerprinted copy and add it to the map.
+ *
+ * arguments:
+ *  const char *bytes (the asset's contents)
+ *  size_t length (number of bytes)
+ *  const char *relative_path (site-relative path, as referenced from pages)
+ *
+ * returns:
+ *  bool (true if the asset was fingerprinted)
+ */
+static bool fingerprint_bytes(const char *bytes, size_t length, const char *relative_path) {
+	// "dir/name.ext" => "dir/name.<hash>.ext"; the extension is the last dot in the base name
+	const char *base = strrchr(relative_path, '/');
+	base = base ? base + 1 : relative_path;
+	const char *ext = strrchr(base, '.');
+	size_t stem = ext ? (size_t)(ext - relative_path) : strlen(relative_path);
+
+	size_t out_len = strlen(relative_path) + ASSET_HASH_DIGITS + 2;
+	char *fingerprinted = malloc(out_len);
+	if (!fingerprinted)
+		return false;
+	snprintf(fingerprinted, out_len, "%.*s.%0*llx%s", (int)stem, relative_path, ASSET_HASH_DIGITS,
+		(unsigned long long)(hash_bytes(bytes, length) >> (64 - 4 * ASSET_HASH_DIGITS)),
+		ext ? ext : "");
+
+	int result = write_output_bytes(fingerprinted, bytes, length);
+
+	asset_entry *e = result == 0 ? malloc(sizeof(asset_entry)) : NULL;
+	if (e) {
+		e->path = wchar_convert(relative_path);
+		e->fingerprinted = wchar_convert(fingerprinted);
+	}
+	free(fingerprinted);
+
+	if (!e || !e->path || !e->fingerprinted) {
+		if (e) {
+			free(e->path);
+			free(e->fingerprinted);
+			free(e);
+		}
+		return false;
+	}
+
+	unsigned int b = asset_bucket(e->path, wcslen(e->path));
+	e->next = current_asset()->buckets[b];
+	current_asset()->buckets[b] = e;
+	current_asset()->count++;
+	return true;
+}
+
+/**
+ * fingerprint_one(): fingerprint_bytes() for an asset read from `disk_path`.
+ */
+static bool fingerprint_one(const char *disk_path, const char *relative_path) {
+	size_t length = 0;
+	char *bytes = file_cache_bytes(disk_path, &length);
+	if (!bytes)
+		return false;
+	bool done = fingerprint_bytes(bytes, length, relative_path);
+	free(bytes);
+	return done;
+}
+
+/**
+ * fingerprint_site_file(): Fingerprint a site-level asset (stylesheet, script), reading it
+ * from the source directory or, failing that, the output directory.
+ */
+static void fingerprint_site_file(const wchar_t *name, const char *source_dir, const char *output_dir) {
+	char *relative = char_convert(name);
+	if (!relative)
+		return;
+
+	const char *rel = relative;
+	while (*rel == '/')
+		rel++;
+
+	const char *roots[] = { source_dir, output_dir };
+	bool done = false;
+	for (size_t i = 0; i < SIZE_OF(roots) && !done; i++) {
+		char path[PATH_MAX];
+		bool slash = roots[i][strlen(roots[i]) - 1] == '/';
+		snprintf(path, sizeof(path), "%s%s%s", roots[i], slash ? "" : "/", rel);
+		done = fingerprint_one(path, rel);
+	}
+
+	if (!done)
+		log_warn("can't fingerprint %s: file not found", rel);
+	free(relative);
+}
+
+/**
+ * write_asset_manifest(): Write the original => fingerprinted map as JSON.
+ */
+static void write_asset_manifest(void) {
+	safe_buffer buf;
+	if (safe_buffer_init(&buf, 256 + current_asset()->count * 64) != 0)
+		return;
+
+	safe_append(L"{\n", &buf);
+	int written = 0;
+	for (int i = 0; i < ASSET_TABLE_SIZE; i++) {
+		for (asset_entry *e = current_asset()->buckets[i]; e != NULL; e = e->next) {
+			// asset paths come from file names; escape the two characters JSON cares about
+			safe_append(written++ ? L",\n  \"" : L"  \"", &buf);
+			for (const wchar_t *c = e->path; *c; c++) {
+				if (*c == L'"' || *c == L'\\')
+					safe_append_char(L'\\', &buf);
+				safe_append_char(*c, &buf);
+			}
+			safe_append(L"\": \"", &buf);
+			for (const wchar_t *c = e->fingerprinted; *c; c++) {
+				if (*c == L'"' || *c == L'\\')
+					safe_append_char(L'\\', &buf);
+				safe_append_char(*c, &buf);
+			}
+			safe_append(L"\"", &buf);
+		}
+	}
+	safe_append(L"\n}\n", &buf);
+
+	write_output(ASSET_MANIFEST_FILENAME, buf.buffer);
+	safe_buffer_free(&buf);
+}
+
+/**
+ * fingerprint_assets(): Fingerprint the site stylesheet, script (if enabled) and icons,
+ * write the fingerprinted copies and the asset manifest. Does nothing unless the site has
+ * `fingerprint:yes`. Must run after output_stage_init() and before pages are built.
+ *
+ * arguments:
+ *  site_info *site (site configuration; must not be NULL)
+ *  const char *source_dir (site source directory)
+ *  const char *output_dir (output directory; icons are read from here, like load_site_icons())
+ *
+ * returns:
+ *  int (number of assets fingerprinted)
+ */
+int fingerprint_assets(site_info *site, const char *source_dir, const char *output_dir) {
+	if (!site || !site->fingerprint)
+		return 0;
+
+	free_asset_map();
+
+	if (site->css && wcslen(site->css) > 0)
+		fingerprint_site_file(site->css, source_dir, output_dir);
+	if (site->include_js && site->js && wcslen(site->js) > 0)
+		fingerprint_site_file(site->js, source_dir, output_dir);
+	size_t sprite_length = 0;
+	const char *sprite = icon_sprite_bytes(&sprite_length);
+	if (sprite && !fingerprint_bytes(sprite, sprite_length, ICON_SPRITE_FILENAME))
+		log_warn("can't fingerprint %s", ICON_SPRITE_FILENAME);
+
+	// Icons: everything in the icons directory, minus earlier fingerprinted copies and .gz siblings
+	char *icons_dir = char_convert(site->icons_dir);
+	if (icons_dir) {
+		char dir_path[PATH_MAX];
+		bool slash = output_dir[strlen(output_dir) - 1] == '/';
+		snprintf(dir_path, sizeof(dir_path), "%s%s%s", output_dir, slash ? "" : "/", icons_dir);
+
+		char **names = NULL;
+		int count = 0;
+		directory_to_array(dir_path, &names, &count);
+		for (int i = 0; i < count; i++) {
+			if (names[i][0] != '.' && !is_generated_asset_name(names[i])) {
+				char path[PATH_MAX], relative[PATH_MAX];
+				if (snprintf(path, sizeof(path), "%s/%s", dir_path, names[i]) >= (int)sizeof(path) ||
+				    snprintf(relative, sizeof(relative), "%s/%s", icons_dir, names[i]) >= (int)sizeof(relative))
+					log_warn("icon path too long to fingerprint: %s/%s", icons_dir, names[i]);
+				else
+					fingerprint_one(path, relative);
+			}
+			free(names[i]);
+		}
+		free(names);
+		free(icons_dir);
+	}
+
+	write_asset_manifest();
+	log_info("Fingerprinted %d asset%s.", current_asset()->count, current_asset()->count == 1 ? "" : "s");
+	return current_asset()->count;
+}
+
+/**
+ * rewrite_asset_urls(): Point references to fingerprinted assets at their fingerprinted
+ * names. Looks at every quoted value that starts with "/" or with the site's base URL, so
+ * href="/p.css", src="/img/icons/fox.svg" and og:image URLs are all covered.
+ *
+ * arguments:
+ *  const wchar_t *html (page to rewrite; must not be NULL)
+ *  const wchar_t *base_url (site base URL; may be NULL)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated rewritten page; NULL if there's nothing to rewrite)
+ */
+wchar_t* rewrite_asset_urls(const wchar_t *html, const wchar_t *base_url) {
+	if (!html || current_asset()->count == 0)
+		return NULL;
+
+	size_t base_len = base_url ? wcslen(base_url) : 0;
+	safe_buffer buf;
+	if (safe_buffer_init(&buf, wcslen(html) + 256) != 0)
+		return NULL;
+
+	const wchar_t *copied = html;	// everything before this has been appended
+	for (const wchar_t *p = html; *p; p++) {
+		if (*p != L'"' && *p != L'\'')
+			continue;
+
+		const wchar_t *path = p + 1;
+		if (path[0] == L'/' && path[1] != L'/')
+			path++;
+		else if (base_len > 0 && wcsncmp(path, base_url, base_len) == 0)
+			path += base_len + (path[base_len] == L'/' ? 1 : 0);
+		else
+			continue;
+
+		const wchar_t *end = path;
+		while (*end && *end != *p && *end != L'?' && *end != L'#' && *end != L'>' && !iswspace(*end))
+			end++;
+
+		asset_entry *e = end > path ? find_asset(path, end - path) : NULL;
+		if (!e)
+			continue;
+
+		safe_append_n(copied, path - copied, &buf);
+		safe_append(e->fingerprinted, &buf);
+		copied = end;
+		p = end - 1;
+	}
+	safe_append(copied, &buf);
+
+	return buf.buffer; // hand over the buffer itself; caller frees
+}
+
+/**
+ * fingerprinted_path(): The fingerprinted name of one asset.
+ *
+ * arguments:
+ *  const wchar_t *path (site-relative path, like "p.css"; a leading "/" is ignored)
+ *
+ * returns:
+ *  const wchar_t* (don't free; valid until free_asset_map(); NULL if not fingerprinted)
+ */
+const wchar_t* fingerprinted_path(const wchar_t *path) {
+	if (!path)
+		return NULL;
+	while (*path == L'/')
+		path++;
+	asset_entry *e = find_asset(path, wcslen(path));
+	return e ? e->fingerprinted : NULL;
+}
+
+/**
+ * free_asset_map(): Release the asset map.
+ */
+void free_asset_map(void) {
+	for (int i = 0; i < ASSET_TABLE_SIZE; i++) {
+		asset_entry *e = current_asset()->buckets[i];
+		while (e) {
+			asset_entry *next = e->next;
+			free(e->path);
+			free(e->fingerprinted);
+			free(e);
+			e = next;
+		}
+		current_asset()->buckets[i] = NULL;
+	}
+	current_asset()->count = 0;
+}
+
+/**
+ * css_inlinable(): True if a stylesheet can be moved into a <style> element unchanged:
+ * no relative url()s (they'd resolve against the page, not the stylesheet) and nothing
+ * that would end the element early.
+ */
+static bool css_inlinable(const char *css) {
+	if (strstr(css, "</"))
+		return false;
+
+	for (const char *p = strstr(css, "url("); p; p = strstr(p + 4, "url(")) {
+		const char *u = p + 4;
+		while (*u == ' ' || *u == '"' || *u == '\'')
+			u++;
+		if (*u == '/' || *u == '#' || strncmp(u, "data:", 5) == 0)
+			continue;
+
+		// otherwise it has to be absolute ("https://..." before the closing paren)
+		const char *close = strchr(u, ')');
+		const char *scheme = strstr(u, "://");
+		if (!close || !scheme || scheme > close)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * prepare_stylesheet(): Build the markup for the {STYLESHEET} header token, once per build.
+ *
+ * With `css_inline:yes`, the stylesheet is read, minified and inlined as a <style> element
+ * when the result is at most `css_inline_max` bytes, saving a render-blocking request.
+ * Otherwise (or if it can't be inlined) it's a <link>, which apply_common_tokens() points
+ * at the fingerprinted copy when `fingerprint:yes`.
+ *
+ * arguments:
+ *  site_info *site (site configuration; must not be NULL)
+ *  const char *source_dir (site source directory)
+ *  const char *output_dir (output directory; second place to look for the stylesheet)
+ *
+ * returns:
+ *  void
+ */
+void prepare_stylesheet(site_info *site, const char *source_dir, const char *output_dir) {
+	free(site->stylesheet);
+	site->stylesheet = NULL;
+	if (!site->css || wcslen(site->css) == 0)
+		return;
+
+	const wchar_t *css_name = site->css;
+	while (*css_name == L'/')
+		css_name++;
+
+	if (site->css_inline) {
+		char *relative = char_convert(css_name);
+		char *css = NULL;
+		size_t length = 0;
+		const char *roots[] = { source_dir, output_dir };
+		for (size_t i = 0; relative && i < SIZE_OF(roots) && !css; i++) {
+			char path[PATH_MAX];
+			bool slash = roots[i][strlen(roots[i]) - 1] == '/';
+			snprintf(path, sizeof(path), "%s%s%s", roots[i], slash ? "" : "/", relative);
+			css = file_cache_bytes(path, &length);
+		}
+		free(relative);
+
+		size_t minified_length = 0;
+		char *minified = css ? minify_css(css, length, &minified_length) : NULL;
+		free(css);
+
+		if (minified && minified_length <= (size_t)site->css_inline_max && css_inlinable(minified)) {
+			wchar_t *wide = wchar_convert(minified);
+			if (wide) {
+				size_t size = wcslen(wide) + 16;
+				site->stylesheet = malloc(size * sizeof(wchar_t));
+				if (site->stylesheet)
+					swprintf(site->stylesheet, size, L"<style>%ls</style>", wide);
+				free(wide);
+			}
+		} else if (minified) {
+			log_info("Stylesheet not inlined (%zu bytes minified; css_inline_max is %d%s).",
+				minified_length, site->css_inline_max,
+				css_inlinable(minified) ? "" : "; it has relative url()s");
+		} else {
+			log_warn("can't read stylesheet %ls to inline it", css_name);
+		}
+		free(minified);
+
+		if (site->stylesheet) {
+			log_info("Inlined stylesheet (%zu characters).", wcslen(site->stylesheet));
+			return;
+		}
+	}
+
+	size_t size = wcslen(css_name) + 48;
+	site->stylesheet = malloc(size * sizeof(wchar_t));
+	if (site->stylesheet)
+		swprintf(site->stylesheet, size, L"<link rel=\"stylesheet\" href=\"/%ls\">", css_name);
+}
@@ -0,0 +1,477 @@
+/**
+ * pragma_budget.c - Page-weight budget report (budget_report:yes)
+ *
+ * Pages get heavy without anyone noticing: an index holding ten long posts without #MORE
+ * splits, or a post whose gallery pulls in hundreds of images. With `budget_report:yes`,
+ * every HTML output that goes through the write stage is measured:
+ *
+ * - HTML bytes, and gzip bytes (at gzip_level) for what actually crosses the wire;
+ * - the number of <img> elements, and the total size of the local files their src
+ *   attributes point at, found under the output root.
+ *
+ * Outputs over `budget_html_kb`, `budget_images` or `budget_image_kb` are flagged.
+ * BUDGET_REPORT_FILENAME in the output directory lists every page, heaviest first, and the
+ * heaviest BUDGET_TOP_OFFENDERS are logged at the end of the build.
+ *
+ * Measuring happens on the worker pool as outputs are committed. Image files are looked up
+ * once everything (gallery thumbnails included) has been written.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#include <ctype.h>
+#include <zlib.h>
+
+#define BUDGET_SIZE_TABLE	1031	// image sizes, shared by every page that shows the image
+
+// Measurements for one HTML output
+typedef struct budget_record {
+	char *path;		// relative to the output root
+	size_t html_bytes;
+	size_t gzip_bytes;
+	int images;		// <img> elements
+	char **image_paths;	// local images, relative to the output root
+	int image_path_count;
+	long long image_bytes;	// filled in by budget_report()
+	int over;		// BUDGET_OVER_* flags
+} budget_record;
+
+#define BUDGET_OVER_HTML	1
+#define BUDGET_OVER_IMAGES	2
+#define BUDGET_OVER_IMAGE_BYTES	4
+
+// Size of one referenced image file; -1 if it isn't under the output root
+typedef struct image_size {
+	char *path;
+	long long bytes;
+	struct image_size *next;
+} image_size;
+
+// Job handed to the worker pool; owns the copied bytes, fills in `record`
+typedef struct budget_job {
+	char *bytes;
+	size_t length;
+	budget_record *record;
+} budget_job;
+
+static struct budget_state {
+	bool enabled;
+	char *root;		// output directory, with trailing slash
+	char *base_url;		// absolute URLs under this are local too
+	int gzip_level;
+	size_t html_max;	// budgets, in bytes and elements
+	int images_max;
+	long long image_bytes_max;
+	budget_record **records;
+	int count;
+	int size;
+	pthread_mutex_t lock;	// guards records while jobs are running
+	image_size *sizes[BUDGET_SIZE_TABLE];
+} g_budget = { .enabled = false };
+
+/**
+ * current_budget(): Budget report state for the site being built.
+ */
+static struct budget_state* current_budget(void) {
+	return context_state(CONTEXT_BUDGET, &g_budget, sizeof(g_budget));
+}
+
+/**
+ * gzip_size(): Bytes a gzip-encoded response for `bytes` would take at `level`.
+ */
+static size_t gzip_size(const char *bytes, size_t length, int level) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+
+	// Only the size matters, so keep compressing into the same scratch block
+	unsigned char scratch[16384];
+	size_t total = 0;
+	zs.next_in = (Bytef*)bytes;
+	zs.avail_in = (uInt)length;
+	int status;
+	do {
+		zs.next_out = scratch;
+		zs.avail_out = sizeof(scratch);
+		status = deflate(&zs, Z_FINISH);
+		total += sizeof(scratch) - zs.avail_out;
+	} while (status == Z_OK);
+	deflateEnd(&zs);
+	return status == Z_STREAM_END ? total : 0;
+}
+
+/**
+ * local_image_path(): Output-relative path for an image URL, or NULL for external and
+ * data: URLs. Query strings and fragments are dropped. Caller must free().
+ */
+static char* local_image_path(const char *url, size_t length) {
+	const char *base = current_budget()->base_url;
+	size_t base_len = base ? strlen(base) : 0;
+
+	if (length >= 2 && url[0] == '/' && url[1] != '/') {
+		url++;
+		length--;
+	} else if (base_len > 0 && length > base_len && strncmp(url, base, base_len) == 0) {
+		url += base_len;
+		length -= base_len;
+		if (*url == '/') {
+			url++;
+			length--;
+		}
+	} else {
+		return NULL;
+	}
+
+	size_t end = 0;
+	while (end < length && url[end] != '?' && url[end] != '#')
+		end++;
+	if (end == 0)
+		return NULL;
+
+	char *path = malloc(end + 1);
+	if (path) {
+		memcpy(path, url, end);
+		path[end] = '\0';
+	}
+	return path;
+}
+
+/**
+ * scan_images(): Count <img> elements and note the local files they load.
+ */
+static void scan_images(const char *html, budget_record *record) {
+	int size = 0;
+	for (const char *p = strstr(html, "<img"); p != NULL; p = strstr(p + 4, "<img")) {
+		if (!isspace((unsigned char)p[4]) && p[4] != '/' && p[4] != '>')
+			continue;
+		record->images++;
+
+		const char *end = strchr(p, '>');
+		if (!end)
+			break;
+
+		// src="..." or src='...', not data-src or srcset
+		const char *src = p + 4;
+		while ((src = strstr(src, "src=")) != NULL && src < end) {
+			if (isspace((unsigned char)src[-1]) && (src[4] == '"' || src[4] == '\''))
+				break;
+			src += 4;
+		}
+		if (!src || src >= end)
+			continue;
+
+		char quote = src[4];
+		const char *value = src + 5;
+		const char *close = strchr(value, quote);
+		if (!close || close > end)
+			continue;
+
+		char *path = local_image_path(value, close - value);
+		if (!path)
+			continue;
+		if (record->image_path_count == size) {
+			int new_size = size ? size * 2 : 16;
+			char **grown = realloc(record->image_paths, new_size * sizeof(char*));
+			if (!grown) {
+				free(path);
+				continue;
+			}
+			record->image_paths = grown;
+			size = new_size;
+		}
+		record->image_paths[record->image_path_count++] = path;
+	}
+}
+
+/**
+ * measure_job(): Worker job: compressed size and image references for one output.
+ *
+ * arguments:
+ *  void *arg (budget_job*, freed here)
+ */
+static void measure_job(void *arg) {
+	budget_job *job = arg;
+	job->record->gzip_bytes = gzip_size(job->bytes, job->length, current_budget()->gzip_level);
+	scan_images(job->bytes, job->record);
+	free(job->bytes);
+	free(job);
+}
+
+/**
+ * image_bytes(): Size of an image under the output root, cached for the build.
+ *
+ * returns:
+ *  long long (file size; -1 if there's no such file)
+ */
+static long long image_bytes(const char *path) {
+	unsigned int b = (unsigned int)(hash_bytes(path, strlen(path)) % BUDGET_SIZE_TABLE);
+	for (image_size *s = current_budget()->sizes[b]; s != NULL; s = s->next)
+		if (strcmp(s->path, path) == 0)
+			return s->bytes;
+
+	char full_path[PATH_MAX];
+	snprintf(full_path, sizeof(full_path), "%s%s", current_budget()->root, path);
+	struct stat st;
+	long long bytes = (utf8_stat((utf8_path)full_path, &st) == 0 && S_ISREG(st.st_mode))
+		? (long long)st.st_size : -1;
+
+	image_size *s = malloc(sizeof(image_size));
+	if (s) {
+		s->path = strdup(path);
+		if (s->path) {
+			s->bytes = bytes;
+			s->next = current_budget()->sizes[b];
+			current_budget()->sizes[b] = s;
+		} else {
+			free(s);
+		}
+	}
+	return bytes;
+}
+
+/**
+ * page_weight(): What a reader downloads for a page: compressed HTML plus its images.
+ */
+static long long page_weight(const budget_record *r) {
+	return (long long)r->gzip_bytes + r->image_bytes;
+}
+
+/**
+ * compare_weight(): qsort comparator, heaviest page first (then by path).
+ */
+static int compare_weight(const void *a, const void *b) {
+	const budget_record *ra = *(budget_record* const*)a;
+	const budget_record *rb = *(budget_record* const*)b;
+	long long wa = page_weight(ra), wb = page_weight(rb);
+	if (wa != wb)
+		return wa < wb ? 1 : -1;
+	return strcmp(ra->path, rb->path);
+}
+
+/**
+ * over_flags(): Describe a record's budget flags ("html,images"; "-" if none).
+ */
+static void over_flags(int over, char *text, size_t size) {
+	snprintf(text, size, "%s%s%s%s%s",
+		(over & BUDGET_OVER_HTML) ? "html" : "",
+		(over & BUDGET_OVER_HTML) && (over & ~BUDGET_OVER_HTML) ? "," : "",
+		(over & BUDGET_OVER_IMAGES) ? "images" : "",
+		(over & BUDGET_OVER_IMAGES) && (over & BUDGET_OVER_IMAGE_BYTES) ? "," : "",
+		(over & BUDGET_OVER_IMAGE_BYTES) ? "image_kb" : "");
+	if (!text[0])
+		snprintf(text, size, "-");
+}
+
+/**
+ * release_budget(): Free the records and the image size cache.
+ */
+static void release_budget(void) {
+	for (int i = 0; i < current_budget()->count; i++) {
+		budget_record *r = current_budget()->records[i];
+		for (int j = 0; j < r->image_path_count; j++)
+			free(r->image_paths[j]);
+		free(r->image_paths);
+		free(r->path);
+		free(r);
+	}
+	free(current_budget()->records);
+	current_budget()->records = NULL;
+	current_budget()->count = 0;
+	current_budget()->size = 0;
+
+	for (int i = 0; i < BUDGET_SIZE_TABLE; i++) {
+		image_size *s = current_budget()->sizes[i];
+		while (s) {
+			image_size *next = s->next;
+			free(s->path);
+			free(s);
+			s = next;
+		}
+		current_budget()->sizes[i] = NULL;
+	}
+	free(current_budget()->root);
+	current_budget()->root = NULL;
+	free(current_budget()->base_url);
+	current_budget()->base_url = NULL;
+}
+
+/**
+ * budget_init(): Start measuring HTML outputs for a build into `output_dir`. Does nothing
+ * unless the site has `budget_report:yes`.
+ *
+ * arguments:
+ *  site_info *site (site configuration, with the budgets; must not be NULL)
+ *  const char *output_dir (output directory; images are looked up under it)
+ *
+ * returns:
+ *  void
+ */
+void budget_init(site_info *site, const char *output_dir) {
+	if (current_budget()->enabled) {
+		release_budget();
+		pthread_mutex_destroy(&current_budget()->lock);
+	}
+	current_budget()->enabled = site->budget_report;
+	if (!current_budget()->enabled)
+		return;
+
+	size_t len = strlen(output_dir);
+	current_budget()->root = malloc(len + 2);
+	if (!current_budget()->root) {
+		current_budget()->enabled = false;
+		return;
+	}
+	snprintf(current_budget()->root, len + 2, "%s%s", output_dir,
+		(len > 0 && output_dir[len - 1] == '/') ? "" : "/");
+	current_budget()->base_url = site->base_url ? char_convert(site->base_url) : NULL;
+	current_budget()->gzip_level = site->gzip_level;
+	current_budget()->html_max = (size_t)site->budget_html_kb * 1024;
+	current_budget()->images_max = site->budget_images;
+	current_budget()->image_bytes_max = (long long)site->budget_image_kb * 1024;
+	pthread_mutex_init(&current_budget()->lock, NULL);
+}
+
+/**
+ * budget_measure(): Measure one HTML output (called by the write stage for every HTML
+ * output, written or unchanged). The bytes are copied; the work happens on the pool.
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory)
+ *  const struct iovec *parts (the output's UTF-8 bytes, possibly in several ranges)
+ *  int count (number of ranges)
+ *  size_t length (total number of bytes)
+ *
+ * returns:
+ *  void
+ */
+void budget_measure(const char *relative_path, const struct iovec *parts, int count, size_t length) {
+	if (!current_budget()->enabled)
+		return;
+
+	budget_record *record = calloc(1, sizeof(budget_record));
+	budget_job *job = malloc(sizeof(budget_job));
+	char *copy = malloc(length + 1);
+	if (record)
+		record->path = strdup(relative_path);
+	if (!record || !record->path || !job || !copy) {
+		if (record)
+			free(record->path);
+		free(record);
+		free(job);
+		free(copy);
+		return;
+	}
+	size_t at = 0;
+	for (int i = 0; i < count; i++) {
+		memcpy(copy + at, parts[i].iov_base, parts[i].iov_len);
+		at += parts[i].iov_len;
+	}
+	copy[length] = '\0';
+	record->html_bytes = length;
+
+	pthread_mutex_lock(&current_budget()->lock);
+	if (current_budget()->count == current_budget()->size) {
+		int new_size = current_budget()->size ? current_budget()->size * 2 : 256;
+		budget_record **grown = realloc(current_budget()->records, new_size * sizeof(budget_record*));
+		if (grown) {
+			current_budget()->records = grown;
+			current_budget()->size = new_size;
+		}
+	}
+	bool added = current_budget()->count < current_budget()->size;
+	if (added)
+		current_budget()->records[current_budget()->count++] = record;
+	pthread_mutex_unlock(&current_budget()->lock);
+
+	if (!added) {
+		free(record->path);
+		free(record);
+		free(job);
+		free(copy);
+		return;
+	}
+
+	job->bytes = copy;
+	job->length = length;
+	job->record = record;
+	work_pool_submit(work_pool_get_global(), measure_job, job);
+}
+
+/**
+ * budget_report(): Wait for the measurements, add up image sizes, write
+ * BUDGET_REPORT_FILENAME and log the heaviest pages. Call after every page is written
+ * (and before output_stage_finish(), which shares the worker pool).
+ *
+ * The report has one line per HTML output, heaviest first:
+ * "<html bytes> <gzip bytes> <images> <image bytes> <over budget: html,images,image_kb or -> <path>".
+ *
+ * returns:
+ *  int (number of outputs over budget; -1 if the report is off)
+ */
+int budget_report(void) {
+	if (!current_budget()->enabled)
+		return -1;
+
+	work_pool_wait(work_pool_get_global());
+
+	int over_count = 0;
+	for (int i = 0; i < current_budget()->count; i++) {
+		budget_record *r = current_budget()->records[i];
+		for (int j = 0; j < r->image_path_count; j++) {
+			long long bytes = image_bytes(r->image_paths[j]);
+			if (bytes > 0)
+				r->image_bytes += bytes;
+		}
+
+		if (current_budget()->html_max > 0 && r->html_bytes > current_budget()->html_max)
+			r->over |= BUDGET_OVER_HTML;
+		if (current_budget()->images_max > 0 && r->images > current_budget()->images_max)
+			r->over |= BUDGET_OVER_IMAGES;
+		if (current_budget()->image_bytes_max > 0 && r->image_bytes > current_budget()->image_bytes_max)
+			r->over |= BUDGET_OVER_IMAGE_BYTES;
+		if (r->over)
+			over_count++;
+	}
+	qsort(current_budget()->records, current_budget()->count, sizeof(budget_record*), compare_weight);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s", current_budget()->root, BUDGET_REPORT_FILENAME);
+	FILE *file = utf8_fopen(path, "w");
+	if (!file)
+		log_error("can't write budget report %s", path);
+
+	for (int i = 0; i < current_budget()->count; i++) {
+		budget_record *r = current_budget()->records[i];
+		char flags[32];
+		over_flags(r->over, flags, sizeof(flags));
+		if (file)
+			fprintf(file, "%zu %zu %d %lld %s %s\n", r->html_bytes, r->gzip_bytes, r->images,
+			        r->image_bytes, flags, r->path);
+
+		if (i < BUDGET_TOP_OFFENDERS) {
+			if (i == 0)
+				log_info("Heaviest pages (gzip HTML + images):");
+			char line[PATH_MAX + 160];
+			snprintf(line, sizeof(line), "  %s: %zu KB html (%zu KB gzip), %d image%s, %lld KB of images%s%s",
+				r->path, r->html_bytes / 1024, r->gzip_bytes / 1024, r->images,
+				r->images == 1 ? "" : "s", r->image_bytes / 1024,
+				r->over ? "; over budget: " : "", r->over ? flags : "");
+			if (r->over)
+				log_warn("%s", line);
+			else
+				log_info("%s", line);
+		}
+	}
+	if (file)
+		fclose(file);
+
+	log_info("page weight: %d page%s measured, %d over budget (see %s)", current_budget()->count,
+		current_budget()->count == 1 ? "" : "s", over_count, BUDGET_REPORT_FILENAME);
+
+	release_budget();
+	pthread_mutex_destroy(&current_budget()->lock);
+	current_budget()->enabled = false;
+	return over_count;
+}
@@ -13,9 +13,16 @@
 
 #include "pragma_poison.h"
 
-// Global buffer pool for performance optimization
+// Global buffer pool for performance optimization (one per libpragma context; see current_pool())
 static buffer_pool *global_pool = NULL;
 
+/**
+ * current_pool(): The calling thread's "global" pool: global_pool, or the bound context's.
+ */
+static buffer_pool** current_pool(void) {
+    return context_state(CONTEXT_BUFFERS, &global_pool, sizeof(global_pool));
+}
+
 /**
  * safe_buffer_init(): Initialize a safe buffer with initial capacity.
  *
@@ -173,6 +180,81 @@ int safe_append_char(wchar_t c, safe_buffer *buf) {
     return safe_append(temp, buf);
 }
 
+/**
+ * safe_append_n(): Append the first `n` characters of `text` (no escaping; `text` need not
+ * be NUL-terminated).
+ *
+ * arguments:
+ *  const wchar_t *text (characters to append; must not be NULL)
+ *  size_t n (number of characters)
+ *  safe_buffer *buf (destination buffer; must not be NULL)
+ *
+ * returns:
+ *  int (0 on success; -1 on failure)
+ */
+int safe_append_n(const wchar_t *text, size_t n, safe_buffer *buf) {
+    if (!text || !buf || !buf->buffer)
+        return -1;
+
+    if (buf->used + n + 1 >= buf->size) {
+        size_t new_size = (buf->used + n + 1) * 3 / 2;
+        wchar_t *new_buffer = realloc(buf->buffer, new_size * sizeof(wchar_t));
+        if (!new_buffer)
+            return -1;
+
+        buf->buffer = new_buffer;
+        buf->size = new_size;
+    }
+
+    wmemcpy(buf->buffer + buf->used, text, n);
+    buf->used += n;
+    buf->buffer[buf->used] = L'\0';
+    return 0;
+}
+
+/**
+ * safe_append_json(): Append text as a quoted JSON string ("a \"b\"\n" style escapes).
+ *
+ * arguments:
+ *  const wchar_t *text (text to append; NULL is written as an empty string)
+ *  safe_buffer *buf (destination buffer; must not be NULL)
+ *
+ * returns:
+ *  int (0 on success; -1 on failure)
+ */
+int safe_append_json(const wchar_t *text, safe_buffer *buf) {
+    if (!buf || !buf->buffer)
+        return -1;
+    if (!text)
+        text = L"";
+
+    int status = safe_append_n(L"\"", 1, buf);
+    const wchar_t *run = text;
+    for (const wchar_t *c = text; *c && status == 0; c++) {
+        if (*c != L'"' && *c != L'\\' && *c >= 0x20)
+            continue;
+
+        // flush the plain run before this character, then escape it
+        status = safe_append_n(run, c - run, buf);
+        wchar_t escaped[8];
+        switch (*c) {
+            case L'"':  wcscpy(escaped, L"\\\""); break;
+            case L'\\': wcscpy(escaped, L"\\\\"); break;
+            case L'\n': wcscpy(escaped, L"\\n"); break;
+            case L'\t': wcscpy(escaped, L"\\t"); break;
+            default:    swprintf(escaped, SIZE_OF(escaped), L"\\u%04x", (unsigned)*c); break;
+        }
+        if (status == 0)
+            status = safe_append_n(escaped, wcslen(escaped), buf);
+        run = c + 1;
+    }
+    if (status == 0)
+        status = safe_append_n(run, wcslen(run), buf);
+    if (status == 0)
+        status = safe_append_n(L"\"", 1, buf);
+    return status;
+}
+
 /**
  * safe_buffer_reset(): Reset buffer for reuse without freeing memory.
  *
@@ -358,8 +440,9 @@ void buffer_pool_destroy(buffer_pool *pool) {
  * This should be called once at program startup.
  */
 void buffer_pool_init_global(void) {
-    if (!global_pool) {
-        global_pool = buffer_pool_create(32, 4096); // 32 buffers of 4KB each
+    buffer_pool **pool = current_pool();
+    if (!*pool) {
+        *pool = buffer_pool_create(32, 4096); // 32 buffers of 4KB each
     }
 }
 
@@ -368,9 +451,10 @@ void buffer_pool_init_global(void) {
  * This should be called once at program shutdown.
  */
 void buffer_pool_cleanup_global(void) {
-    if (global_pool) {
-        buffer_pool_destroy(global_pool);
-        global_pool = NULL;
+    buffer_pool **pool = current_pool();
+    if (*pool) {
+        buffer_pool_destroy(*pool);
+        *pool = NULL;
     }
 }
 
@@ -381,11 +465,12 @@ void buffer_pool_cleanup_global(void) {
  *  safe_buffer* (available buffer; creates new if no pool exists)
  */
 safe_buffer* buffer_pool_get_global(void) {
-    if (!global_pool) {
+    buffer_pool **pool = current_pool();
+    if (!*pool) {
         buffer_pool_init_global();
     }
 
-    safe_buffer *buf = buffer_pool_get(global_pool);
+    safe_buffer *buf = buffer_pool_get(*pool);
     if (!buf) {
         // Pool is full, allocate a new buffer
         buf = malloc(sizeof(safe_buffer));
@@ -411,15 +496,16 @@ void buffer_pool_return_global(safe_buffer *buf) {
     if (!buf)
         return;
 
-    if (!global_pool) {
+    buffer_pool **pool = current_pool();
+    if (!*pool) {
         safe_buffer_free(buf);
         free(buf);
         return;
     }
 
     // Try to return to pool, otherwise free it
-    buffer_pool_return(global_pool, buf);
-    if (!global_pool) {
+    buffer_pool_return(*pool, buf);
+    if (!*pool) {
         safe_buffer_free(buf);
         free(buf);
     }
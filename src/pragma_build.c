@@ -0,0 +1,436 @@
+/**
+ * pragma_build.c - Render and write a loaded site
+ *
+ * Shared by the pragma binary (once per output target) and libpragma (on every
+ * pragma_site_update()).
+ *
+ * Normally every post is rendered in list order, then the indices, scroll, tags and feed.
+ * With `publish_first:yes` (or a `publish_hook`), the outputs a reader of new content needs
+ * are rendered first: posts whose sources changed since the last run and their neighbours
+ * (whose older/newer links point at them), index.html and feed.xml. The hook command then
+ * runs (a partial deploy, say) with those paths on its standard input, and the long tail of
+ * older posts, index pages, scroll and tag pages follows. How soon a new post is out no
+ * longer depends on how big the archive is.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Output paths in the critical set, for the publish hook
+typedef struct published_list {
+    char **paths;
+    int count;
+    int size;
+} published_list;
+
+/**
+ * note_published(): Add a path to the critical set's list (copied).
+ */
+static void note_published(published_list *list, const char *path) {
+    if (!list || !path)
+        return;
+    if (list->count == list->size) {
+        int size = list->size ? list->size * 2 : 16;
+        char **grown = realloc(list->paths, size * sizeof(char*));
+        if (!grown)
+            return;
+        list->paths = grown;
+        list->size = size;
+    }
+    char *copy = strdup(path);
+    if (copy)
+        list->paths[list->count++] = copy;
+}
+
+/**
+ * build_post(): Render and write one post (and its JSON copy); note its path in `list`.
+ */
+static void build_post(pp_page *page, site_info *config, published_list *list) {
+    pp_rope *page_html = build_single_page(page, config);
+    if (!page_html) {
+        log_error("build_single_page returned NULL for %ls", page->title ? page->title : L"[no title]");
+        return;
+    }
+    write_single_page(page, SITE_POSTS, page_html);
+    rope_free(page_html);
+    write_post_json(page, config);
+
+    char *name = list && page->source_filename ? char_convert(page->source_filename) : NULL;
+    if (name) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s.html", SITE_POSTS, name);
+        note_published(list, path);
+        free(name);
+    }
+}
+
+/**
+ * build_index_page(): Render and write index page `page_num` (index.html, index1.html, ...)
+ * and its JSON listing.
+ */
+static void build_index_page(pp_page *pages, site_info *config, int page_num, int total_index_pages) {
+    pp_rope *index_html = build_index(pages, config, page_num);
+    if (index_html) {
+        char index_path[64];
+        if (page_num == 0) {
+            // First page is index.html
+            snprintf(index_path, sizeof(index_path), "index.html");
+        } else {
+            // Subsequent pages are index1.html, index2.html, etc.
+            snprintf(index_path, sizeof(index_path), "index%d.html", page_num);
+        }
+        write_output_rope(index_path, index_html);
+        rope_free(index_html);
+    }
+    write_index_json(pages, config, page_num, total_index_pages);
+}
+
+/**
+ * build_feed(): Render and write feed.xml.
+ */
+static void build_feed(pp_page *pages, site_info *config) {
+    log_info("generating RSS feed...");
+    wchar_t *rss_xml = build_rss(pages, config);
+    if (rss_xml) {
+        write_output("feed.xml", rss_xml);
+        free(rss_xml);
+    }
+}
+
+/**
+ * hook_environment(): The process environment plus PRAGMA_OUTPUT_DIR and PRAGMA_BASE_URL,
+ * for the hook only (the build's own environment isn't touched). Free with free_environment().
+ */
+static char** hook_environment(const char *output_dir, const char *url) {
+    int count = 0;
+    while (environ && environ[count])
+        count++;
+
+    char **envp = calloc(count + 3, sizeof(char*));
+    if (!envp)
+        return NULL;
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (strncmp(environ[i], "PRAGMA_OUTPUT_DIR=", 18) == 0 || strncmp(environ[i], "PRAGMA_BASE_URL=", 16) == 0)
+            continue;
+        envp[n++] = environ[i];
+    }
+
+    // Ours go last, which is how free_environment() finds them
+    size_t dir_len = strlen("PRAGMA_OUTPUT_DIR=") + strlen(output_dir) + 1;
+    size_t url_len = strlen("PRAGMA_BASE_URL=") + strlen(url) + 1;
+    char *dir_var = malloc(dir_len);
+    char *url_var = malloc(url_len);
+    if (!dir_var || !url_var) {
+        free(dir_var);
+        free(url_var);
+        free(envp);
+        return NULL;
+    }
+    snprintf(dir_var, dir_len, "PRAGMA_OUTPUT_DIR=%s", output_dir);
+    snprintf(url_var, url_len, "PRAGMA_BASE_URL=%s", url);
+    envp[n] = dir_var;
+    envp[n + 1] = url_var;
+    envp[n + 2] = NULL;
+    return envp;
+}
+
+/**
+ * free_environment(): Free what hook_environment() allocated (not the inherited strings).
+ */
+static void free_environment(char **envp) {
+    if (!envp)
+        return;
+    int n = 0;
+    while (envp[n])
+        n++;
+    if (n >= 2) {
+        free(envp[n - 2]);
+        free(envp[n - 1]);
+    }
+    free(envp);
+}
+
+/**
+ * write_hook_input(): Write the critical set's paths, one per line, to the hook's standard
+ * input. SIGPIPE is blocked for this thread while writing, so a hook that doesn't read its
+ * input (or exits early) shows up as EPIPE here instead of killing the build; one raised
+ * meanwhile is consumed before the old mask comes back. Nothing process-wide changes, so
+ * other threads (another site in a libpragma host) aren't affected.
+ */
+static void write_hook_input(int fd, const published_list *list) {
+    sigset_t pipe_set, old_set, pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigemptyset(&pending);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    sigpending(&pending);
+    bool was_pending = sigismember(&pending, SIGPIPE);
+
+    bool broken = false;
+    for (int i = 0; i < list->count && !broken; i++) {
+        const char *lines[2] = { list->paths[i], "\n" };
+        for (int j = 0; j < 2 && !broken; j++) {
+            const char *p = lines[j];
+            size_t left = strlen(p);
+            while (left > 0) {
+                ssize_t written = write(fd, p, left);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EPIPE)
+                        log_warn("can't write to the publish hook: %s", strerror(errno));
+                    broken = true;
+                    break;
+                }
+                p += written;
+                left -= written;
+            }
+        }
+    }
+    close(fd);
+
+    // Take back a SIGPIPE our writes raised, so unblocking doesn't deliver it
+    if (broken && !was_pending && !sigismember(&old_set, SIGPIPE)) {
+        struct timespec zero = { 0, 0 };
+        sigemptyset(&pending);
+        sigpending(&pending);
+        if (sigismember(&pending, SIGPIPE))
+            sigtimedwait(&pipe_set, NULL, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+}
+
+/**
+ * run_publish_hook(): Run the publish hook through the shell, with the critical set's paths
+ * (relative to the output directory, one per line) on its standard input and
+ * PRAGMA_OUTPUT_DIR and PRAGMA_BASE_URL in its environment. A failing hook is logged; the
+ * build carries on either way.
+ *
+ * arguments:
+ *  const wchar_t *hook (command line)
+ *  const published_list *list (critical outputs)
+ *  const char *output_dir (output directory of this build)
+ *  const wchar_t *base_url (base URL of this build; may be NULL)
+ *
+ * returns:
+ *  int (the hook's exit status; -1 if it couldn't be run)
+ */
+static int run_publish_hook(const wchar_t *hook, const published_list *list,
+                            const char *output_dir, const wchar_t *base_url) {
+    char *command = char_convert(hook);
+    char *url = base_url ? char_convert(base_url) : NULL;
+    char **envp = command ? hook_environment(output_dir, url ? url : "") : NULL;
+    free(url);
+    if (!envp) {
+        free(command);
+        return -1;
+    }
+
+    log_info("running publish hook: %s", command);
+    log_flush();
+    fflush(stdout);
+
+    int status = -1;
+    int fds[2];
+    if (pipe(fds) == 0) {
+        // Our end mustn't leak into the hook, or it would never see end of input
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+        if (fds[0] != STDIN_FILENO)
+            posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+        char *argv[] = { "sh", "-c", command, NULL };
+        pid_t pid;
+        int error = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, envp);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[0]);
+
+        if (error == 0) {
+            write_hook_input(fds[1], list);
+            int result;
+            pid_t waited;
+            while ((waited = waitpid(pid, &result, 0)) < 0 && errno == EINTR)
+                ;
+            if (waited == pid && WIFEXITED(result))
+                status = WEXITSTATUS(result);
+        } else {
+            close(fds[1]);
+            log_warn("can't start /bin/sh for the publish hook: %s", strerror(error));
+        }
+    }
+    free_environment(envp);
+
+    if (status != 0)
+        log_warn("publish hook %s %s%d; continuing with the rest of the site", command,
+                 status < 0 ? "couldn't be run or was killed" : "exited with status ",
+                 status < 0 ? 0 : status);
+    free(command);
+    return status;
+}
+
+/**
+ * build_site_output(): Render and write the whole site into one output target.
+ *
+ * Everything before this (loading, Markdown, sorting, icons, related posts, search
+ * tokenizing) is shared between targets; only URL-dependent rendering is repeated.
+ *
+ * arguments:
+ *  pp_page *pages (sorted page list)
+ *  site_info *config (site configuration, with base_url set for this target)
+ *  const char *source_dir (site source directory)
+ *  const char *output_dir (where this target is written)
+ *  bool clean_stale (remove pragma-generated files with no source afterward; -x)
+ *
+ * returns:
+ *  int (0 on success; -1 if the write stage couldn't be set up, so nothing was built)
+ */
+int build_site_output(pp_page *pages, site_info *config, const char *source_dir,
+                       const char *output_dir, bool clean_stale) {
+    // All outputs below go through the write stage, by path relative to the output dir
+    if (output_stage_init(output_dir, config) != 0)
+        return -1;
+    budget_init(config, output_dir);
+
+    // Icon markup (and the sprite sheet), then fingerprinted asset copies, so pages can refer to them
+    icon_catalog_init(config, output_dir);
+    fingerprint_assets(config, source_dir, output_dir);
+    prepare_stylesheet(config, source_dir, output_dir);
+    prepare_page_frames(config);
+
+    int total_pages = 0;
+    for (pp_page *p = pages; p != NULL; p = p->next)
+        total_pages++;
+    int total_index_pages = config->index_size > 0
+        ? (total_pages + config->index_size - 1) / config->index_size : 0; // Ceiling division
+
+    // Critical set first (publish_first:yes or a publish hook): changed posts and their
+    // neighbours, the front page and the feed
+    bool *built = calloc(total_pages > 0 ? total_pages : 1, sizeof(bool));
+    bool publish_first = (config->publish_first || config->publish_hook) && built;
+    bool feed_built = false;
+    int page_count = 0;
+    if (publish_first) {
+        time_t last_run = get_last_run_time(source_dir);
+        bool *critical = calloc(total_pages > 0 ? total_pages : 1, sizeof(bool));
+        int i = 0;
+        for (pp_page *p = pages; critical && p != NULL; p = p->next, i++) {
+            if (p->last_modified > last_run) {
+                critical[i] = true;
+                if (i > 0)
+                    critical[i - 1] = true;
+                if (p->next)
+                    critical[i + 1] = true;
+            }
+        }
+
+        published_list published = { NULL, 0, 0 };
+        i = 0;
+        for (pp_page *p = pages; critical && p != NULL; p = p->next, i++) {
+            if (!critical[i])
+                continue;
+            log_progress("pages", ++page_count, total_pages);
+            build_post(p, config, &published);
+            built[i] = true;
+        }
+        free(critical);
+        if (total_index_pages > 0) {
+            build_index_page(pages, config, 0, total_index_pages);
+            note_published(&published, "index.html");
+        }
+        build_feed(pages, config);
+        note_published(&published, "feed.xml");
+        feed_built = true;
+        log_info("published %d changed post%s, the front page and the feed first", page_count,
+                 page_count == 1 ? "" : "s");
+
+        // Gzip siblings are compressed on the pool; finish them before anything is deployed
+        if (config->precompress)
+            work_pool_wait(work_pool_get_global());
+        if (config->publish_hook)
+            run_publish_hook(config->publish_hook, &published, output_dir, config->base_url);
+
+        for (int j = 0; j < published.count; j++)
+            free(published.paths[j]);
+        free(published.paths);
+    }
+
+    // Build individual pages
+    int index = 0;
+    for (pp_page *current_page = pages; current_page != NULL; current_page = current_page->next, index++) {
+        if (publish_first && built[index])
+            continue;
+        log_debug("Building page %d: %ls (tags: %ls)", ++page_count,
+               current_page->title ? current_page->title : L"[no title]",
+               current_page->tags ? current_page->tags : L"[no tags]");
+        log_progress("pages", page_count, total_pages);
+        build_post(current_page, config, NULL);
+    }
+    free(built);
+    log_info("Built %d individual pages.", page_count);
+
+    // Build index pages
+    if (total_index_pages > 0) {
+        log_info("building %d index pages for %d posts...", total_index_pages, total_pages);
+        for (int page_num = publish_first ? 1 : 0; page_num < total_index_pages; page_num++)
+            build_index_page(pages, config, page_num, total_index_pages);
+    }
+
+    // Build scroll (chronological index)
+    if (config->build_scroll) {
+        log_info("building scroll...");
+        wchar_t *scroll_html = build_scroll(pages, config);
+        if (scroll_html) {
+            write_output(SITE_SCROLL "index.html", scroll_html);
+            free(scroll_html);
+        }
+    }
+
+    // Build tag indices
+    if (config->build_tags) {
+        log_info("building tag indices...");
+        pp_rope *tag_html = build_tag_index(pages, config);
+        if (tag_html) {
+            write_output_rope(SITE_TAG_INDEX "index.html", tag_html);
+            rope_free(tag_html);
+        }
+    }
+
+    // Build RSS feed
+    if (!feed_built)
+        build_feed(pages, config);
+
+    // Search index shards, once every post is tokenized
+    if (config->search)
+        search_index_write(config);
+
+    // Precache list for the service worker, from the hashes of everything written above
+    write_service_worker(pages, config, source_dir);
+
+    // Page weights, now that every image a page points at is in place
+    budget_report();
+
+    // Clean up stale files if requested, before the link check and the change report so
+    // both see the deleted pages as gone
+    if (clean_stale) {
+        cleanup_stale_files(source_dir, output_dir, config->json_api);
+    }
+
+    // Internal links, against this build's outputs and the files already under the output dir
+    link_check_report(pages, config, output_dir);
+
+    output_stage_finish();
+    return 0;
+}
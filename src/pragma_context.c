@@ -0,0 +1,151 @@
+/**
+ * pragma_context.c - Per-site module state for library hosts (see libpragma.c)
+ *
+ * The pragma binary builds one site per process, so each module keeps its state (write
+ * stage, image and icon catalogs, buffer pool, logger settings, ...) in a file-level
+ * struct. A host that links libpragma can keep several sites open at once, so that state
+ * has to belong to a site instead.
+ *
+ * A pragma_context holds one copy of each module's state. A thread works inside one
+ * context at a time (context_bind()), and modules look their state up with
+ * context_state(): the bound context's copy, created zeroed on first use, or the
+ * module's own process-wide copy when no context is bound (a single pragma build never
+ * binds one). Worker threads bind the context each job was queued from, so background
+ * jobs see the same state as the thread that queued them.
+ *
+ * A context can also share some slots with the process-wide state instead of keeping its
+ * own copy (context_create_shared()): `pragma -b` builds many sites one after another, each
+ * in its own context, but with one buffer pool and one worker pool between them.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+struct pragma_context {
+	void *state[CONTEXT_SLOT_COUNT];	// module state, allocated on first use
+	unsigned int shared;			// bit per slot: use the process-wide state
+	pthread_mutex_t lock;			// guards state[]; workers may look things up too
+};
+
+static pthread_key_t g_context_key;
+static pthread_once_t g_context_once = PTHREAD_ONCE_INIT;
+
+/**
+ * create_context_key(): Create the thread-specific key for the bound context (once).
+ */
+static void create_context_key(void) {
+	pthread_key_create(&g_context_key, NULL);
+}
+
+/**
+ * context_create(): Create an empty context. Module state is allocated as it's used.
+ *
+ * returns:
+ *  pragma_context* (new context; NULL on error; caller must context_destroy())
+ */
+pragma_context* context_create(void) {
+	return context_create_shared(0);
+}
+
+/**
+ * context_create_shared(): Create a context that uses the process-wide state for some
+ * modules. Those modules' cleanup functions then release the shared state, so don't call
+ * them for this context.
+ *
+ * arguments:
+ *  unsigned int shared_slots (bit (1u << CONTEXT_*) for each slot to share)
+ *
+ * returns:
+ *  pragma_context* (new context; NULL on error; caller must context_destroy())
+ */
+pragma_context* context_create_shared(unsigned int shared_slots) {
+	pthread_once(&g_context_once, create_context_key);
+
+	pragma_context *ctx = calloc(1, sizeof(pragma_context));
+	if (!ctx)
+		return NULL;
+	ctx->shared = shared_slots;
+	pthread_mutex_init(&ctx->lock, NULL);
+	return ctx;
+}
+
+/**
+ * context_destroy(): Free a context's state blocks.
+ *
+ * Modules own whatever their state points to; release that first (with the context bound)
+ * through the modules' own cleanup functions. See pragma_site_close().
+ *
+ * arguments:
+ *  pragma_context *ctx (context to free; may be NULL; must not be bound to any thread)
+ *
+ * returns:
+ *  void
+ */
+void context_destroy(pragma_context *ctx) {
+	if (!ctx)
+		return;
+
+	for (int i = 0; i < CONTEXT_SLOT_COUNT; i++)
+		free(ctx->state[i]);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+/**
+ * context_bind(): Make ctx the calling thread's current context.
+ *
+ * arguments:
+ *  pragma_context *ctx (context to bind; NULL returns the thread to process-wide state)
+ *
+ * returns:
+ *  pragma_context* (the previously bound context, for restoring it afterward)
+ */
+pragma_context* context_bind(pragma_context *ctx) {
+	pthread_once(&g_context_once, create_context_key);
+
+	pragma_context *previous = pthread_getspecific(g_context_key);
+	pthread_setspecific(g_context_key, ctx);
+	return previous;
+}
+
+/**
+ * context_current(): The calling thread's current context.
+ *
+ * returns:
+ *  pragma_context* (bound context; NULL if none)
+ */
+pragma_context* context_current(void) {
+	pthread_once(&g_context_once, create_context_key);
+	return pthread_getspecific(g_context_key);
+}
+
+/**
+ * context_state(): Find a module's state for the calling thread.
+ *
+ * arguments:
+ *  int slot (CONTEXT_* slot for the module)
+ *  void *process_state (the module's process-wide state, used when no context is bound)
+ *  size_t size (size of the state block; new blocks start zeroed)
+ *
+ * returns:
+ *  void* (the module's state; aborts if a context's block can't be allocated)
+ */
+void* context_state(int slot, void *process_state, size_t size) {
+	pragma_context *ctx = context_current();
+	if (!ctx || (ctx->shared & (1u << slot)))
+		return process_state;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (!ctx->state[slot])
+		ctx->state[slot] = calloc(1, size);
+	void *state = ctx->state[slot];
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (!state) {
+		// Nothing sensible to fall back on: another site's state would be worse
+		fprintf(stderr, "! FATAL: can't allocate module state\n");
+		abort();
+	}
+	return state;
+}
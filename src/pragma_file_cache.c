@@ -0,0 +1,210 @@
+/**
+ * pragma_file_cache.c - Process-wide cache of small supporting files
+ *
+ * Templates are read from disk for every page rendered with them, and icons, stylesheets
+ * and scripts once per build and target. When `pragma -b` builds dozens of sites in one
+ * process, many of them read the very same files (shared templates, a common icon set).
+ *
+ * This cache keeps the bytes of small files (up to FILE_CACHE_MAX_FILE, FILE_CACHE_MAX_TOTAL
+ * in all), and for templates their decoded text too. Entries are keyed by path and checked
+ * against the file's inode, size and mtime on every lookup, so an edited file is read again;
+ * callers always get their own copy.
+ *
+ * Unlike most module state, the cache isn't per-context: files are the same whichever site
+ * reads them, so one cache serves every site in the process (and is locked accordingly).
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define FILE_CACHE_TABLE	251
+#define FILE_CACHE_MAX_FILE	(256 * 1024)		// bytes; bigger files are read every time
+#define FILE_CACHE_MAX_TOTAL	(16 * 1024 * 1024)	// bytes; later files aren't kept
+
+typedef struct cached_file {
+	char *path;
+	ino_t inode;
+	off_t size;
+	time_t mtime;
+	char *bytes;
+	size_t length;
+	wchar_t *text;		// decoded on first file_cache_text(); NULL until then
+	size_t text_length;
+	struct cached_file *next;
+} cached_file;
+
+static struct file_cache {
+	cached_file *buckets[FILE_CACHE_TABLE];
+	size_t total;		// bytes held, text included
+	int hits;
+	int misses;
+	pthread_mutex_t lock;
+} g_file_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * find_cached(): The up-to-date entry for `path`, reading the file if needed. Call with
+ * the lock held. Returns NULL if the file can't be read or isn't worth caching; *readable
+ * tells the caller which.
+ */
+static cached_file* find_cached(const char *path, struct stat *st, bool *readable) {
+	*readable = utf8_stat((utf8_path)path, st) == 0 && S_ISREG(st->st_mode);
+	if (!*readable)
+		return NULL;
+
+	unsigned int b = (unsigned int)(hash_bytes(path, strlen(path)) % FILE_CACHE_TABLE);
+	cached_file **link = &g_file_cache.buckets[b];
+	for (cached_file *f = *link; f != NULL; link = &f->next, f = f->next) {
+		if (strcmp(f->path, path) != 0)
+			continue;
+		if (f->inode == st->st_ino && f->size == st->st_size && f->mtime == st->st_mtime) {
+			g_file_cache.hits++;
+			return f;
+		}
+		// stale: drop it and read the file again below
+		*link = f->next;
+		g_file_cache.total -= f->length + f->text_length * sizeof(wchar_t);
+		free(f->path);
+		free(f->bytes);
+		free(f->text);
+		free(f);
+		break;
+	}
+
+	g_file_cache.misses++;
+	if (st->st_size > FILE_CACHE_MAX_FILE || g_file_cache.total + st->st_size > FILE_CACHE_MAX_TOTAL)
+		return NULL;
+
+	cached_file *f = calloc(1, sizeof(cached_file));
+	if (!f)
+		return NULL;
+	f->path = strdup(path);
+	f->bytes = read_file_bytes(path, &f->length);
+	if (!f->path || !f->bytes) {
+		free(f->path);
+		free(f->bytes);
+		free(f);
+		return NULL;
+	}
+	f->inode = st->st_ino;
+	f->size = st->st_size;
+	f->mtime = st->st_mtime;
+	f->next = g_file_cache.buckets[b];
+	g_file_cache.buckets[b] = f;
+	g_file_cache.total += f->length;
+	return f;
+}
+
+/**
+ * file_cache_bytes(): Read a whole regular file, from the cache when it hasn't changed.
+ * Same contract as read_file_bytes().
+ *
+ * arguments:
+ *  const char *path (filesystem path to read; must not be NULL)
+ *  size_t *length (receives the number of bytes; must not be NULL)
+ *
+ * returns:
+ *  char* (heap-allocated contents, not NUL-terminated; NULL on error; caller must free)
+ */
+char* file_cache_bytes(const char *path, size_t *length) {
+	struct stat st;
+	bool readable;
+	pthread_mutex_lock(&g_file_cache.lock);
+	cached_file *f = find_cached(path, &st, &readable);
+	char *bytes = NULL;
+	if (f) {
+		bytes = malloc(f->length > 0 ? f->length : 1);
+		if (bytes) {
+			memcpy(bytes, f->bytes, f->length);
+			*length = f->length;
+		}
+	}
+	pthread_mutex_unlock(&g_file_cache.lock);
+
+	if (!f && readable)
+		bytes = read_file_bytes(path, length);
+	return bytes;
+}
+
+/**
+ * file_cache_text(): Read a whole UTF-8 text file (a template, say) as a wide string, from
+ * the cache when it hasn't changed. Invalid sequences become U+FFFD.
+ *
+ * arguments:
+ *  const char *path (filesystem path to read; must not be NULL)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated text; NULL on error; caller must free)
+ */
+wchar_t* file_cache_text(const char *path) {
+	struct stat st;
+	bool readable;
+	pthread_mutex_lock(&g_file_cache.lock);
+	cached_file *f = find_cached(path, &st, &readable);
+	if (f && !f->text) {
+		f->text = utf8_decode(f->bytes, f->length, &f->text_length, true);
+		if (f->text)
+			g_file_cache.total += f->text_length * sizeof(wchar_t);
+	}
+	wchar_t *text = NULL;
+	if (f && f->text) {
+		text = malloc((f->text_length + 1) * sizeof(wchar_t));
+		if (text)
+			wmemcpy(text, f->text, f->text_length + 1);
+	}
+	pthread_mutex_unlock(&g_file_cache.lock);
+
+	if (!f && readable) {
+		size_t length = 0;
+		char *bytes = read_file_bytes(path, &length);
+		if (bytes) {
+			text = utf8_decode(bytes, length, NULL, true);
+			free(bytes);
+		}
+	}
+	return text;
+}
+
+/**
+ * file_cache_counts(): Lookups answered from the cache, and lookups that had to read the
+ * file, since the process started.
+ *
+ * arguments:
+ *  int *hits (receives the hit count; may be NULL)
+ *  int *misses (receives the miss count; may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void file_cache_counts(int *hits, int *misses) {
+	pthread_mutex_lock(&g_file_cache.lock);
+	if (hits)
+		*hits = g_file_cache.hits;
+	if (misses)
+		*misses = g_file_cache.misses;
+	pthread_mutex_unlock(&g_file_cache.lock);
+}
+
+/**
+ * file_cache_free(): Drop every cached file.
+ *
+ * returns:
+ *  void
+ */
+void file_cache_free(void) {
+	pthread_mutex_lock(&g_file_cache.lock);
+	for (int i = 0; i < FILE_CACHE_TABLE; i++) {
+		cached_file *f = g_file_cache.buckets[i];
+		while (f) {
+			cached_file *next = f->next;
+			free(f->path);
+			free(f->bytes);
+			free(f->text);
+			free(f);
+			f = next;
+		}
+		g_file_cache.buckets[i] = NULL;
+	}
+	g_file_cache.total = 0;
+	pthread_mutex_unlock(&g_file_cache.lock);
+}
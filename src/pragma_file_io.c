@@ -3,7 +3,7 @@
 /**
  * write_file_contents(): Write wide-character content to a file path.
  *
- * Opens `path` for writing (truncating if it exists) and writes `content` via fwprintf().
+ * Opens `path` for writing (truncating if it exists) and writes `content` as UTF-8.
  *
  * arguments:
  *  const char    *path    (filesystem path to write; must not be NULL)
@@ -21,13 +21,6 @@ int write_file_contents(const utf8_path path, const wchar_t *content) {
 	}
 
 	// Convert wide characters to UTF-8 and write as bytes
-
-	// Find where the invalid character might be
-	size_t test_len = wcstombs(NULL, content, 0);
-	if (test_len == (size_t)-1) {
-		// Invalid wide character found, but continue without debug output
-	}
-
 	char *utf8_content = char_convert(content);
 	if (!utf8_content) {
 		fclose(file);
@@ -50,9 +43,10 @@ int write_file_contents(const utf8_path path, const wchar_t *content) {
 }
 
 /**
- * read_file_contents(): Read a file into a newly allocated wide-character buffer.
+ * read_file_contents(): Read a UTF-8 file into a newly allocated wide-character buffer.
  *
- * Reads the file as wide characters with fgetwc() and returns a heap-allocated buffer.
+ * Reads the raw bytes in one go and decodes them in one pass (pragma_utf8.c), so the
+ * result doesn't depend on the locale. Malformed sequences become U+FFFD, with a warning.
  * Caller owns the returned memory and must free().
  *
  * arguments:
@@ -62,50 +56,23 @@ int write_file_contents(const utf8_path path, const wchar_t *content) {
  *  wchar_t* (heap-allocated buffer containing the file contents; NULL on error)
  */
 wchar_t* read_file_contents(const utf8_path path) {
-	FILE *file = utf8_fopen(path, "r");
+	size_t length = 0;
+	char *bytes = read_file_bytes(path, &length);
 
-	if (!file) {
+	if (!bytes) {
 		log_error("Error opening file");
 		return NULL;
 	}
 
-	wint_t ch;
-	wchar_t *content = NULL;
-	size_t contentSize = 0;
-	size_t index = 0;
-
-	while ((ch = fgetwc(file)) != WEOF) {
-		if (index == contentSize) {
-			// Expand the buffer if needed
-			contentSize += 10;
-			wchar_t *temp = realloc(content, contentSize * sizeof(wchar_t));
-			if (!temp) {
-				log_error("realloc()");
-				free(content);
-				fclose(file);
-				return NULL;
-			}
-			content = temp;
-		}
-		content[index++] = ch;
+	wchar_t *content = utf8_decode(bytes, length, NULL, false);
+	if (!content) {
+		log_warn("%s isn't valid UTF-8; replacing the bad bytes with U+FFFD", path);
+		content = utf8_decode(bytes, length, NULL, true);
+		if (!content)
+			log_error("malloc() failed in read_file_contents()");
 	}
 
-	if (index < contentSize) {
-		content[index] = L'\0';
-	} else {
-		wchar_t *temp = realloc(content, (contentSize + 1) * sizeof(wchar_t));
-		if (!temp) {
-			log_error("realloc()");
-			free(content);
-			fclose(file);
-			return NULL;
-		}
-		content = temp;
-		content[index] = L'\0';
-	}
-
-	// Close the file
-	fclose(file);
+	free(bytes);
 	return content;
 }
 
@@ -204,7 +171,7 @@ utf8_path wchar_to_utf8(const wchar_t* wide_str) {
         return NULL;
     }
 
-    // char_convert uses wcstombs which respects UTF-8 locale
+    // char_convert always produces UTF-8 (pragma_utf8.c)
     return char_convert(wide_str);
 }
 
@@ -224,7 +191,7 @@ wchar_t* utf8_to_wchar(const utf8_path utf8_str) {
         return NULL;
     }
 
-    // wchar_convert uses mbstowcs which respects UTF-8 locale
+    // wchar_convert always decodes UTF-8 (pragma_utf8.c)
     return wchar_convert(utf8_str);
 }
 
@@ -399,16 +366,18 @@ bool source_file_exists(const char *html_filename, const char *source_dir) {
  *
  * Scans the output directory's /c/ folder for HTML files, checks if they were generated
  * by pragma-web, and if their corresponding source files no longer exist, asks the user
- * if they want to delete them.
+ * if they want to delete them. Their .gz siblings go too, and with json_api:yes so do the
+ * posts' JSON copies (c/<name>.json and .json.gz).
  *
  * arguments:
  *  const char *source_dir (source directory containing dat/ folder)
  *  const char *output_dir (output directory containing c/ folder)
+ *  bool json_api (the site writes JSON copies of posts)
  *
  * returns:
  *  void
  */
-void cleanup_stale_files(const char *source_dir, const char *output_dir) {
+void cleanup_stale_files(const char *source_dir, const char *output_dir, bool json_api) {
     // Build path to posts directory (c/)
     char posts_dir[1024];
     snprintf(posts_dir, sizeof(posts_dir), "%s/c", output_dir);
@@ -462,7 +431,7 @@ void cleanup_stale_files(const char *source_dir, const char *output_dir) {
     }
 
     log_info("\nDelete these stale files? [y/N]: ");
-    fflush(stdout);
+    log_flush();
 
     char response[10];
     if (fgets(response, sizeof(response), stdin)) {
@@ -476,6 +445,19 @@ void cleanup_stale_files(const char *source_dir, const char *output_dir) {
                 if (remove(file_path) == 0) {
                     log_info("  ✓ Deleted %s", stale_files[i]);
                     deleted++;
+
+                    // precompressed sibling, if the site uses precompress:yes
+                    strncat(file_path, ".gz", sizeof(file_path) - strlen(file_path) - 1);
+                    remove(file_path);
+
+                    // the post's JSON copy (json_api:yes) and its sibling
+                    int n = json_api ? snprintf(file_path, sizeof(file_path), "%s/%.*s.json", posts_dir,
+                                 (int)(strlen(stale_files[i]) - strlen(".html")), stale_files[i]) : -1;
+                    if (n >= 0 && (size_t)n < sizeof(file_path)) {
+                        remove(file_path);
+                        strncat(file_path, ".gz", sizeof(file_path) - strlen(file_path) - 1);
+                        remove(file_path);
+                    }
                 } else {
                     log_error("  ✗ Failed to delete %s", stale_files[i]);
                 }
@@ -487,4 +469,34 @@ void cleanup_stale_files(const char *source_dir, const char *output_dir) {
     } else {
         log_info("Stale file cleanup cancelled");
     }
-}
\ No newline at end of file
+}
+/**
+ * read_file_bytes(): Read a whole regular file as raw bytes.
+ *
+ * arguments:
+ *  const char *path (filesystem path to read; must not be NULL)
+ *  size_t *length (receives the number of bytes read; must not be NULL)
+ *
+ * returns:
+ *  char* (heap-allocated contents, not NUL-terminated; NULL on error; caller must free)
+ */
+char* read_file_bytes(const char *path, size_t *length) {
+	FILE *file = utf8_fopen((utf8_path)path, "rb");
+	if (!file)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+		fclose(file);
+		return NULL;
+	}
+
+	char *bytes = malloc(st.st_size > 0 ? st.st_size : 1);
+	if (!bytes) {
+		fclose(file);
+		return NULL;
+	}
+	*length = fread(bytes, 1, st.st_size, file);
+	fclose(file);
+	return bytes;
+}
@@ -0,0 +1,294 @@
+/**
+ * pragma_frames.c - The site header and footer, split into literal text and token slots
+ *
+ * Every page is framed by site->header and site->footer, which are full of tokens:
+ * {TITLE_FOR_META}, {DESCRIPTION}, {MAIN_IMAGE}, {PAGE_URL}, {STYLESHEET} and so on.
+ * apply_common_tokens() used to copy both into every page and rescan them once per token.
+ *
+ * Instead, each frame is scanned once per build (prepare_page_frames(), after the
+ * stylesheet and fingerprinted assets are known):
+ *
+ * - tokens with the same value on every page ({SITE_NAME}, {STYLESHEET}, {SERVICE_WORKER},
+ *   and {BACK}, {FORWARD} and {TITLE}, which are always empty here) are folded into the
+ *   surrounding text;
+ * - the text between per-page tokens becomes a literal piece, with its asset URLs
+ *   rewritten and its UTF-8 encoding worked out ahead of time;
+ * - per-page tokens become slots, which rope_apply_common_tokens() fills for each page.
+ *
+ * So a page carries only its own values between borrowed, pre-encoded literal chunks.
+ * Tokens this module doesn't know ({DATE}, {TAGS}, ...) are left in the literal text for
+ * the page builders, as before.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+typedef struct frame_piece {
+	wchar_t *text;		// literal text (NULL for a slot)
+	size_t length;
+	char *bytes;		// the literal as UTF-8 (NULL if it couldn't be encoded)
+	size_t byte_length;
+	int slot;		// SLOT_* (maybe | SLOT_QUOTED); 0 for a literal
+	bool finished;		// no tokens left for the page builders
+} frame_piece;
+
+struct page_frame {
+	const wchar_t *source;	// site->header, site->footer or site->gallery_footer
+	frame_piece *pieces;
+	int count;
+	int size;
+};
+
+// Tokens that differ from page to page
+static const struct {
+	const wchar_t *name;
+	int slot;
+} frame_slot_names[] = {
+	{ L"MAIN_IMAGE", SLOT_MAIN_IMAGE },
+	{ L"PAGE_URL", SLOT_PAGE_URL },
+	{ L"TITLE_FOR_META", SLOT_TITLE_FOR_META },
+	{ L"PAGETITLE", SLOT_PAGETITLE },
+	{ L"DESCRIPTION", SLOT_DESCRIPTION },
+	{ L"AUTHOR", SLOT_AUTHOR },
+};
+
+/**
+ * constant_token(): The build-wide value of a token that's the same on every page, or
+ * NULL if `name` isn't one of those.
+ */
+static const wchar_t* constant_token(const site_info *site, const wchar_t *name, size_t length) {
+	#define IS(token) (length == wcslen(token) && wcsncmp(name, token, length) == 0)
+	if (IS(L"BACK") || IS(L"FORWARD") || IS(L"TITLE"))
+		return L"";
+	if (IS(L"SITE_NAME"))
+		return site->site_name ? site->site_name : L"";
+	if (IS(L"SERVICE_WORKER"))
+		return site->service_worker ? SERVICE_WORKER_SCRIPT : L"";
+	if (IS(L"STYLESHEET"))
+		return site->stylesheet ? site->stylesheet : L"";
+	#undef IS
+	return NULL;
+}
+
+/**
+ * slot_token(): The SLOT_* for a per-page token, or 0.
+ */
+static int slot_token(const wchar_t *name, size_t length) {
+	for (size_t i = 0; i < sizeof(frame_slot_names) / sizeof(frame_slot_names[0]); i++) {
+		if (wcslen(frame_slot_names[i].name) == length && wcsncmp(name, frame_slot_names[i].name, length) == 0)
+			return frame_slot_names[i].slot;
+	}
+	return 0;
+}
+
+/**
+ * add_piece(): Append a piece to a frame; returns NULL if out of memory.
+ */
+static frame_piece* add_piece(struct page_frame *frame) {
+	if (frame->count == frame->size) {
+		int size = frame->size ? frame->size * 2 : 16;
+		frame_piece *grown = realloc(frame->pieces, size * sizeof(frame_piece));
+		if (!grown)
+			return NULL;
+		frame->pieces = grown;
+		frame->size = size;
+	}
+	frame_piece *piece = &frame->pieces[frame->count++];
+	memset(piece, 0, sizeof(*piece));
+	return piece;
+}
+
+/**
+ * add_literal(): Close off the literal text gathered so far: rewrite its asset URLs and
+ * encode it. Resets `literal`.
+ */
+static bool add_literal(struct page_frame *frame, safe_buffer *literal, bool finished, const site_info *site) {
+	if (literal->used == 0)
+		return true;
+
+	frame_piece *piece = add_piece(frame);
+	if (!piece)
+		return false;
+
+	wchar_t *rewritten = rewrite_asset_urls(literal->buffer, site->base_url);
+	piece->text = rewritten ? rewritten : wcsdup(literal->buffer);
+	safe_buffer_reset(literal);
+	if (!piece->text)
+		return false;
+	piece->length = wcslen(piece->text);
+	piece->bytes = utf8_encode(piece->text, piece->length, &piece->byte_length);
+	piece->finished = finished;
+	return true;
+}
+
+/**
+ * compile_frame(): Split one header or footer into literal pieces and slots.
+ *
+ * arguments:
+ *  const wchar_t *source (header or footer text)
+ *  const site_info *site (site configuration, with this build's stylesheet)
+ *
+ * returns:
+ *  struct page_frame* (heap-allocated; NULL on error)
+ */
+static struct page_frame* compile_frame(const wchar_t *source, const site_info *site) {
+	struct page_frame *frame = calloc(1, sizeof(struct page_frame));
+	safe_buffer literal;
+	if (!frame || safe_buffer_init(&literal, wcslen(source) + 1) != 0) {
+		free(frame);
+		return NULL;
+	}
+	frame->source = source;
+
+	bool ok = true;
+	bool finished = true;	// no tokens (or #MORE) left for the page builders in `literal`
+	const wchar_t *p = source;
+	while (*p && ok) {
+		const wchar_t *close = (*p == L'{') ? wcschr(p + 1, L'}') : NULL;
+		if (!close) {
+			if (*p == L'#' && wcsncmp(p, L"#MORE", 5) == 0)
+				finished = false;
+			safe_append_char(*p++, &literal);
+			continue;
+		}
+
+		const wchar_t *name = p + 1;
+		size_t length = close - name;
+		if (length == 0 || wcsspn(name, L"ABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789") != length) {
+			// a brace in a script or style block, not a token
+			safe_append_char(*p++, &literal);
+			continue;
+		}
+
+		const wchar_t *value = constant_token(site, name, length);
+		int slot = value ? 0 : slot_token(name, length);
+
+		if (value) {
+			// folded in; the value itself isn't scanned for tokens
+			safe_append(value, &literal);
+		} else if (slot) {
+			bool quoted = literal.used > 0 &&
+			              (literal.buffer[literal.used - 1] == L'"' || literal.buffer[literal.used - 1] == L'\'');
+			ok = add_literal(frame, &literal, finished, site);
+			frame_piece *piece = ok ? add_piece(frame) : NULL;
+			if (piece)
+				piece->slot = slot | (quoted ? SLOT_QUOTED : 0);
+			ok = piece != NULL;
+			finished = true;
+		} else {
+			// someone else's token ({DATE}, {TAGS}): leave it for the page builders
+			safe_append_n(p, length + 2, &literal);
+			finished = false;
+		}
+		p = close + 1;
+	}
+	ok = ok && add_literal(frame, &literal, finished, site);
+	safe_buffer_free(&literal);
+
+	if (!ok) {
+		log_error("out of memory splitting the site header/footer into slots");
+		for (int i = 0; i < frame->count; i++) {
+			free(frame->pieces[i].text);
+			free(frame->pieces[i].bytes);
+		}
+		free(frame->pieces);
+		free(frame);
+		return NULL;
+	}
+	return frame;
+}
+
+/**
+ * free_page_frames(): Release the compiled header and footer.
+ *
+ * arguments:
+ *  site_info *site (site whose frames to free; may be NULL)
+ */
+void free_page_frames(site_info *site) {
+	if (!site || !site->frames)
+		return;
+	for (int f = 0; f < site->frame_count; f++) {
+		struct page_frame *frame = site->frames[f];
+		for (int i = 0; i < frame->count; i++) {
+			free(frame->pieces[i].text);
+			free(frame->pieces[i].bytes);
+		}
+		free(frame->pieces);
+		free(frame);
+	}
+	free(site->frames);
+	site->frames = NULL;
+	site->frame_count = 0;
+}
+
+/**
+ * prepare_page_frames(): Split the header, footer and gallery footer into literal pieces
+ * and per-page slots, once per build. Call after prepare_stylesheet() and
+ * fingerprint_assets(), whose results are folded into the literal text.
+ *
+ * arguments:
+ *  site_info *site (site configuration, with base_url set for this build)
+ *
+ * returns:
+ *  void
+ */
+void prepare_page_frames(site_info *site) {
+	if (!site)
+		return;
+	free_page_frames(site);
+
+	const wchar_t *sources[] = { site->header, site->footer, site->gallery_footer };
+	int count = sizeof(sources) / sizeof(sources[0]);
+	site->frames = calloc(count, sizeof(struct page_frame*));
+	if (!site->frames)
+		return;
+
+	for (int i = 0; i < count; i++) {
+		if (!sources[i])
+			continue;
+		struct page_frame *frame = compile_frame(sources[i], site);
+		if (frame)
+			site->frames[site->frame_count++] = frame;
+	}
+
+	int slots = 0;
+	for (int f = 0; f < site->frame_count; f++) {
+		for (int i = 0; i < site->frames[f]->count; i++)
+			slots += site->frames[f]->pieces[i].slot ? 1 : 0;
+	}
+	log_debug("header and footer split into %d per-page slots", slots);
+}
+
+/**
+ * rope_frame(): Add the site header or footer to a page. Uses the compiled frame when
+ * there is one (literal pieces borrowed with their encoding, slots for per-page values);
+ * otherwise borrows the text itself.
+ *
+ * arguments:
+ *  pp_rope *rope (page being assembled)
+ *  const site_info *site (site configuration)
+ *  const wchar_t *part (site->header, site->footer or page_footer(); NULL adds nothing)
+ *
+ * returns:
+ *  void
+ */
+void rope_frame(pp_rope *rope, const site_info *site, const wchar_t *part) {
+	if (!rope || !part)
+		return;
+
+	for (int f = 0; site && f < site->frame_count; f++) {
+		struct page_frame *frame = site->frames[f];
+		if (frame->source != part)
+			continue;
+		for (int i = 0; i < frame->count; i++) {
+			frame_piece *piece = &frame->pieces[i];
+			if (piece->slot)
+				rope_slot(rope, piece->slot);
+			else
+				rope_borrow_encoded(rope, piece->text, piece->length, piece->bytes, piece->byte_length, piece->finished);
+		}
+		return;
+	}
+	rope_borrow(rope, part);
+}
@@ -426,11 +426,87 @@ wchar_t* html_paragraph(const wchar_t *text, const wchar_t *css_class, bool esca
     return result;
 }
 
+/**
+ * html_content_image(): Create an HTML image element for an image in post content.
+ *
+ * Like html_image(), but for local images also emits the intrinsic width/height (read
+ * from the image header; see pragma_images.c), a srcset when sized variants exist
+ * next to the image, and loading="lazy" decoding="async" so long posts don't fetch
+ * every image up front.
+ *
+ * Generates: <img src="url" alt="alt_text" class="css_class" width="W" height="H" srcset="..." loading="lazy" decoding="async">
+ *
+ * arguments:
+ *  const wchar_t *src (image URL; must not be NULL)
+ *  const wchar_t *alt (alt text; may be NULL)
+ *  const wchar_t *css_class (CSS class name; may be NULL)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated img element; NULL on error)
+ */
+wchar_t* html_content_image(const wchar_t *src, const wchar_t *alt, const wchar_t *css_class) {
+    if (!src) return NULL;
+
+    safe_buffer *attr_buf = buffer_pool_get_global();
+    if (!attr_buf) return NULL;
+
+    safe_append(L"src=\"", attr_buf);
+    attr_buf->auto_escape = true;
+    safe_append(src, attr_buf);
+    attr_buf->auto_escape = false;
+    safe_append(L"\"", attr_buf);
+
+    if (alt) {
+        safe_append(L" alt=\"", attr_buf);
+        attr_buf->auto_escape = true;
+        safe_append(alt, attr_buf);
+        attr_buf->auto_escape = false;
+        safe_append(L"\"", attr_buf);
+    }
+
+    if (css_class && wcslen(css_class) > 0) {
+        safe_append(L" class=\"", attr_buf);
+        attr_buf->auto_escape = true;
+        safe_append(css_class, attr_buf);
+        attr_buf->auto_escape = false;
+        safe_append(L"\"", attr_buf);
+    }
+
+    int width, height;
+    if (image_dimensions(src, &width, &height)) {
+        wchar_t dimensions[64];
+        swprintf(dimensions, 64, L" width=\"%d\" height=\"%d\"", width, height);
+        safe_append(dimensions, attr_buf);
+
+        wchar_t *srcset = image_srcset(src, width);
+        if (srcset) {
+            safe_append(L" srcset=\"", attr_buf);
+            attr_buf->auto_escape = true;
+            safe_append(srcset, attr_buf);
+            attr_buf->auto_escape = false;
+            safe_append(L"\"", attr_buf);
+            free(srcset);
+        }
+    }
+
+    safe_append(L" loading=\"lazy\" decoding=\"async\"", attr_buf);
+
+    wchar_t *attributes = safe_buffer_to_string(attr_buf);
+    buffer_pool_return_global(attr_buf);
+
+    if (!attributes) return NULL;
+
+    wchar_t *result = html_self_closing(L"img", attributes);
+    free(attributes);
+
+    return result;
+}
+
 /**
  * html_image_with_caption(): Create an HTML image element with caption.
  *
  * Generates: <figure class="css_class"><img src="url" alt="alt_text"><figcaption>caption</figcaption></figure>
- * If no caption is provided, falls back to html_image().
+ * If no caption is provided, falls back to html_content_image().
  * URL, alt text, and caption are automatically escaped.
  *
  * arguments:
@@ -447,11 +523,11 @@ wchar_t* html_image_with_caption(const wchar_t *src, const wchar_t *alt, const w
 
     // If no caption, just use regular image
     if (!caption || wcslen(caption) == 0) {
-        return html_image(src, alt, css_class);
+        return html_content_image(src, alt, css_class);
     }
 
     // Create the image element (without class - we'll put class on figure)
-    wchar_t *img_element = html_image(src, alt, NULL);
+    wchar_t *img_element = html_content_image(src, alt, NULL);
     if (!img_element) return NULL;
 
     // Create the figcaption element
@@ -513,11 +589,74 @@ wchar_t* html_image_with_caption(const wchar_t *src, const wchar_t *alt, const w
     return result;
 }
 
+/**
+ * append_gallery_item(): Append one gallery entry, a thumbnail linked to the full image for
+ * GLightbox, to the gallery buffer.
+ *
+ * Generates: <a href="dir/fox.jpg" class="glightbox" data-gallery="dir"><img src="dir/thumbfox.jpg" ...></a>
+ * Images we don't make thumbnails for (GIF, WebP, SVG) link to themselves.
+ *
+ * arguments:
+ *  safe_buffer *buf (gallery buffer; must not have auto_escape set)
+ *  wchar_t *full_path (URL of the full-size image; briefly split, but left unchanged)
+ *  size_t name_offset (where the file name starts in full_path)
+ *  const wchar_t *gallery_name (GLightbox group name)
+ *  bool has_thumbnail (true if pragma_thumbnails.c makes a thumbnail for this image)
+ *
+ * returns:
+ *  void
+ */
+static void append_gallery_item(safe_buffer *buf, wchar_t *full_path, size_t name_offset,
+                                const wchar_t *gallery_name, bool has_thumbnail) {
+    const wchar_t *filename = full_path + name_offset;
+
+    safe_append(L"<a href=\"", buf);
+    safe_append_escaped(full_path, buf);
+    safe_append(L"\" class=\"glightbox\" data-gallery=\"", buf);
+    safe_append_escaped(gallery_name, buf);
+    safe_append(L"\">", buf);
+
+    int width, height;
+    if (has_thumbnail && image_dimensions(full_path, &width, &height)) {
+        // The thumbnail may still be in the works, so size it from the original
+        int thumb_width, thumb_height;
+        thumbnail_size(width, height, &thumb_width, &thumb_height);
+
+        wchar_t prefix[32], dimensions[64];
+        swprintf(prefix, 32, L"%s", THUMBNAIL_PREFIX);
+        swprintf(dimensions, 64, L"\" width=\"%d\" height=\"%d\"", thumb_width, thumb_height);
+
+        // src: the directory part of full_path, then the prefixed name
+        wchar_t saved = full_path[name_offset];
+        full_path[name_offset] = L'\0';
+        safe_append(L"<img src=\"", buf);
+        safe_append_escaped(full_path, buf);
+        full_path[name_offset] = saved;
+        safe_append(prefix, buf);
+        safe_append_escaped(filename, buf);
+        safe_append(L"\" alt=\"", buf);
+        safe_append_escaped(filename, buf);
+        safe_append(L"\" class=\"gallery-image", buf);
+        safe_append(dimensions, buf);
+        safe_append(L" loading=\"lazy\" decoding=\"async\">", buf);
+    } else {
+        wchar_t *img_element = html_content_image(full_path, filename, L"gallery-image");
+        if (img_element) {
+            safe_append(img_element, buf);
+            free(img_element);
+        }
+    }
+
+    safe_append(L"</a>", buf);
+}
+
 /**
  * html_image_gallery(): Create an HTML image gallery from a directory path.
  *
- * Generates: <div class="gallery"><img src="path/image1.jpg"><img src="path/image2.jpg">...</div>
- * Scans the specified directory for image files and creates a gallery div containing all images.
+ * Generates: <div class="gallery"><a href="path/image1.jpg" class="glightbox" ...><img src="path/thumbimage1.jpg" ...></a>...</div>
+ * Lists the images in the directory (cached per build, in name order; see
+ * image_directory_listing()) and builds the whole gallery in one buffer. Thumbnails
+ * themselves are made by pragma_thumbnails.c.
  *
  * arguments:
  *  const wchar_t *directory_path (directory path to scan for images; must not be NULL)
@@ -527,75 +666,69 @@ wchar_t* html_image_with_caption(const wchar_t *src, const wchar_t *alt, const w
  *  wchar_t* (heap-allocated gallery div element; NULL on error)
  */
 wchar_t* html_image_gallery(const wchar_t *directory_path, const wchar_t *css_class) {
-    if (!directory_path) return NULL;
+    if (!directory_path || wcslen(directory_path) == 0) return NULL;
 
-    // Convert wide string path to char for directory operations
-    char *dir_path = char_convert(directory_path);
+    // Find the directory under the site (or, failing that, relative to where we're running)
+    char *dir_path = image_resolve_directory(directory_path);
     if (!dir_path) return NULL;
-
-    // Get array of image files in directory
-    char **filenames = NULL;
-    int count = 0;
-    directory_to_array(dir_path, &filenames, &count);
+    const image_listing *listing = image_directory_listing(dir_path);
     free(dir_path);
 
-    if (!filenames || count == 0) {
-        // Return empty gallery div if directory is empty or doesn't exist
-        return html_div(L"", css_class ? css_class : L"gallery", false);
-    }
+    // Group name for the lightbox: the directory's own name
+    const wchar_t *gallery_name = directory_path;
+    for (const wchar_t *p = directory_path; *p; p++)
+        if (*p == L'/' && p[1] != L'\0')
+            gallery_name = p + 1;
 
-    // Build gallery content
     safe_buffer *gallery_buf = buffer_pool_get_global();
-    if (!gallery_buf) {
-        // Free the filenames array
-        for (int i = 0; i < count; i++) {
-            free(filenames[i]);
-        }
-        free(filenames);
-        return NULL;
-    }
-
-    // Process each image file
-    for (int i = 0; i < count; i++) {
-        // Convert filename back to wide string
-        wchar_t *wide_filename = wchar_convert(filenames[i]);
-        if (wide_filename) {
-            // Build full image path
-            safe_buffer *path_buf = buffer_pool_get_global();
-            if (path_buf) {
-                safe_append(directory_path, path_buf);
-                if (directory_path[wcslen(directory_path) - 1] != L'/') {
-                    safe_append(L"/", path_buf);
-                }
-                safe_append(wide_filename, path_buf);
-
-                wchar_t *full_path = safe_buffer_to_string(path_buf);
-                if (full_path) {
-                    // Create image element without caption
-                    wchar_t *img_element = html_image(full_path, wide_filename, L"gallery-image");
-                    if (img_element) {
-                        safe_append(img_element, gallery_buf);
-                        free(img_element);
-                    }
-                    free(full_path);
-                }
-                buffer_pool_return_global(path_buf);
+    if (!gallery_buf) return NULL;
+
+    safe_append(L"<div class=\"", gallery_buf);
+    safe_append_escaped(css_class ? css_class : L"gallery", gallery_buf);
+    safe_append(L"\">", gallery_buf);
+
+    // One path buffer for the whole gallery: "directory_path/" followed by each file name
+    size_t dir_len = wcslen(directory_path);
+    bool slash = directory_path[dir_len - 1] == L'/';
+    size_t name_offset = dir_len + (slash ? 0 : 1);
+    size_t path_size = 0;
+    wchar_t *full_path = NULL;
+
+    for (int i = 0; listing && i < listing->count; i++) {
+        const char *name = listing->names[i];
+
+        // Thumbnails and sized variants (photo-480w.jpg) aren't gallery entries of their own
+        if (is_thumbnail_name(name) || is_image_variant(name))
+            continue;
+
+        wchar_t *wide_name = wchar_convert(name);
+        if (!wide_name)
+            continue;
+
+        size_t needed = name_offset + wcslen(wide_name) + 1;
+        if (needed > path_size) {
+            wchar_t *grown = realloc(full_path, needed * 2 * sizeof(wchar_t));
+            if (!grown) {
+                free(wide_name);
+                break;
             }
-            free(wide_filename);
+            full_path = grown;
+            path_size = needed * 2;
+            wmemcpy(full_path, directory_path, dir_len);
+            if (!slash)
+                full_path[dir_len] = L'/';
         }
-        free(filenames[i]);
-    }
-    free(filenames);
+        wcscpy(full_path + name_offset, wide_name);
+        free(wide_name);
 
-    wchar_t *gallery_content = safe_buffer_to_string(gallery_buf);
-    buffer_pool_return_global(gallery_buf);
-
-    if (!gallery_content) return NULL;
+        append_gallery_item(gallery_buf, full_path, name_offset, gallery_name, is_thumbnail_source(name));
+    }
+    free(full_path);
 
-    // Wrap in gallery div
-    wchar_t *result = html_div(gallery_content, css_class ? css_class : L"gallery", false);
-    free(gallery_content);
+    safe_append(L"</div>", gallery_buf);
 
+    wchar_t *result = safe_buffer_to_string(gallery_buf);
+    buffer_pool_return_global(gallery_buf);
     return result;
 }
 
@@ -0,0 +1,495 @@
+/**
+ * pragma_icons.c - Post icon markup: linked, inlined or from an SVG sprite
+ *
+ * Every post card shows its icon, so an index page with `index_size:10` can cost ten icon
+ * requests. The `icon_mode` setting picks how {ICON_HTML} and {ICON_SRC} are filled in:
+ *
+ * - link (default): <img class="icon" src="/img/icons/fox.svg">, as before;
+ * - inline: icons no bigger than `icon_inline_max` bytes become data: URIs, so they arrive
+ *   with the page; bigger ones are linked;
+ * - sprite: SVG icons are gathered into one sprite sheet (ICON_SPRITE_FILENAME) and drawn
+ *   with <svg><use href="/icons.svg#icon-fox"></svg>, one request for all of them; other
+ *   icons are inlined or linked as in inline mode.
+ *
+ * The markup for each icon in the catalog is built once per build, in icon_catalog_init().
+ * {ICON} (the bare file name) is unchanged, so existing templates keep working.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define ICON_SYMBOL_PREFIX	"icon-"
+
+typedef struct icon_entry {
+	wchar_t *name;		// file name in the icons directory, as in page->icon
+	wchar_t *src;		// URL or data: URI
+	wchar_t *html;		// complete icon element
+	struct icon_entry *next;
+} icon_entry;
+
+static struct icon_state {
+	icon_entry *icons;
+	wchar_t *url_prefix;	// "/img/icons/"
+	wchar_t *sprite_url;	// "/icons.svg"; NULL unless a sprite was written
+	char *sprite_bytes;	// the sheet as written (UTF-8), for fingerprinting without a file
+	size_t sprite_length;
+	int mode;
+	int inline_max;
+} g_icons = { .mode = ICON_MODE_LINK };
+
+/**
+ * current_icon(): Icon catalog for the calling thread (each libpragma site has its own).
+ */
+static struct icon_state* current_icon(void) {
+	return context_state(CONTEXT_ICONS, &g_icons, sizeof(g_icons));
+}
+
+static const char BASE64_DIGITS[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * icon_mime_type(): MIME type for an icon file name; NULL if we wouldn't inline it.
+ */
+static const wchar_t* icon_mime_type(const char *name) {
+	if (has_extension(name, ".svg"))
+		return L"image/svg+xml";
+	if (has_extension(name, ".png"))
+		return L"image/png";
+	if (has_extension(name, ".gif"))
+		return L"image/gif";
+	if (has_extension(name, ".jpg") || has_extension(name, ".jpeg"))
+		return L"image/jpeg";
+	if (has_extension(name, ".webp"))
+		return L"image/webp";
+	return NULL;
+}
+
+/**
+ * data_uri(): Encode bytes as a base64 data: URI.
+ *
+ * returns:
+ *  wchar_t* (heap-allocated URI; NULL on error)
+ */
+static wchar_t* data_uri(const wchar_t *mime_type, const unsigned char *bytes, size_t length) {
+	size_t prefix = wcslen(L"data:;base64,") + wcslen(mime_type);
+	size_t size = prefix + 4 * ((length + 2) / 3) + 1;
+	wchar_t *uri = malloc(size * sizeof(wchar_t));
+	if (!uri)
+		return NULL;
+
+	swprintf(uri, size, L"data:%ls;base64,", mime_type);
+	wchar_t *out = uri + prefix;
+	for (size_t i = 0; i < length; i += 3) {
+		unsigned long chunk = (unsigned long)bytes[i] << 16;
+		if (i + 1 < length)
+			chunk |= (unsigned long)bytes[i + 1] << 8;
+		if (i + 2 < length)
+			chunk |= bytes[i + 2];
+
+		*out++ = BASE64_DIGITS[(chunk >> 18) & 63];
+		*out++ = BASE64_DIGITS[(chunk >> 12) & 63];
+		*out++ = i + 1 < length ? BASE64_DIGITS[(chunk >> 6) & 63] : L'=';
+		*out++ = i + 2 < length ? BASE64_DIGITS[chunk & 63] : L'=';
+	}
+	*out = L'\0';
+	return uri;
+}
+
+/**
+ * symbol_id(): Sprite symbol id for an icon: "icon-" plus the name without its extension,
+ * with anything but letters, digits, '-' and '_' replaced by '-'.
+ */
+static void symbol_id(const char *name, char *id, size_t size) {
+	snprintf(id, size, "%s%s", ICON_SYMBOL_PREFIX, name);
+	char *dot = strrchr(id, '.');
+	if (dot && dot > id + strlen(ICON_SYMBOL_PREFIX))
+		*dot = '\0';
+	for (char *p = id + strlen(ICON_SYMBOL_PREFIX); *p; p++) {
+		unsigned char c = (unsigned char)*p;
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		      c == '-' || c == '_'))
+			*p = '-';
+	}
+}
+
+/**
+ * svg_attribute(): Copy the value of attribute `name` from an SVG start tag [tag, end).
+ *
+ * returns:
+ *  bool (true if found and it fit in `value`)
+ */
+static bool svg_attribute(const char *tag, const char *end, const char *name, char *value, size_t size) {
+	size_t name_len = strlen(name);
+	for (const char *p = tag; p + name_len + 2 < end; p++) {
+		if (strncmp(p, name, name_len) != 0 || p[name_len] != '=' ||
+		    (p > tag && p[-1] != ' ' && p[-1] != '\t' && p[-1] != '\n' && p[-1] != '\r'))
+			continue;
+
+		char quote = p[name_len + 1];
+		if (quote != '"' && quote != '\'')
+			return false;
+		const char *start = p + name_len + 2;
+		const char *close = memchr(start, quote, end - start);
+		if (!close || (size_t)(close - start) >= size)
+			return false;
+		memcpy(value, start, close - start);
+		value[close - start] = '\0';
+		return true;
+	}
+	return false;
+}
+
+/**
+ * append_sprite_symbol(): Add an SVG file to the sprite as a <symbol>. The root element's
+ * viewBox (or width and height) carries over; its other attributes are dropped.
+ *
+ * arguments:
+ *  const char *svg (file contents, NUL-terminated)
+ *  const char *id (symbol id)
+ *  safe_buffer *sprite (sprite being built)
+ *
+ * returns:
+ *  bool (false if the file doesn't look like an SVG we can use)
+ */
+static bool append_sprite_symbol(const char *svg, const char *id, safe_buffer *sprite) {
+	// Root element: the first "<svg", past any XML declaration, doctype or comments
+	const char *tag = strstr(svg, "<svg");
+	if (!tag)
+		return false;
+	const char *tag_end = tag;
+	char quote = 0;
+	for (; *tag_end; tag_end++) {
+		if (quote) {
+			if (*tag_end == quote)
+				quote = 0;
+		} else if (*tag_end == '"' || *tag_end == '\'') {
+			quote = *tag_end;
+		} else if (*tag_end == '>') {
+			break;
+		}
+	}
+	const char *close = NULL;
+	for (const char *p = strstr(tag_end, "</svg>"); p; p = strstr(p + 1, "</svg>"))
+		close = p;
+	if (*tag_end != '>' || tag_end[-1] == '/' || !close)
+		return false;
+
+	char view_box[128], width[32], height[32];
+	if (!svg_attribute(tag, tag_end, "viewBox", view_box, sizeof(view_box))) {
+		if (!svg_attribute(tag, tag_end, "width", width, sizeof(width)) ||
+		    !svg_attribute(tag, tag_end, "height", height, sizeof(height)))
+			return false;
+		snprintf(view_box, sizeof(view_box), "0 0 %g %g", atof(width), atof(height));
+	}
+
+	size_t inner_len = close - (tag_end + 1);
+	size_t length = strlen(id) + strlen(view_box) + inner_len + 64;
+	char *symbol = malloc(length);
+	if (!symbol)
+		return false;
+	snprintf(symbol, length, "<symbol id=\"%s\" viewBox=\"%s\">%.*s</symbol>\n",
+		id, view_box, (int)inner_len, tag_end + 1);
+
+	wchar_t *wide = wchar_convert(symbol);
+	free(symbol);
+	if (!wide)
+		return false;
+	safe_append(wide, sprite);
+	free(wide);
+	return true;
+}
+
+/**
+ * add_icon(): Add an icon to the catalog with the given src and element.
+ */
+static icon_entry* add_icon(const wchar_t *name, wchar_t *src, wchar_t *html) {
+	icon_entry *e = malloc(sizeof(icon_entry));
+	if (!e || !src || !html) {
+		free(e);
+		free(src);
+		free(html);
+		return NULL;
+	}
+	e->name = wcsdup(name);
+	if (!e->name) {
+		free(e);
+		free(src);
+		free(html);
+		return NULL;
+	}
+	e->src = src;
+	e->html = html;
+	e->next = current_icon()->icons;
+	current_icon()->icons = e;
+	return e;
+}
+
+/**
+ * img_element(): <img class="icon" alt="[icon]" src="..."> for a src value.
+ */
+static wchar_t* img_element(const wchar_t *src) {
+	size_t size = wcslen(src) + 64;
+	wchar_t *html = malloc(size * sizeof(wchar_t));
+	if (html)
+		swprintf(html, size, L"<img class=\"icon\" alt=\"[icon]\" src=\"%ls\">", src);
+	return html;
+}
+
+/**
+ * add_linked_icon(): Catalog an icon that's referenced by URL.
+ */
+static icon_entry* add_linked_icon(const wchar_t *name) {
+	size_t size = wcslen(current_icon()->url_prefix) + wcslen(name) + 1;
+	wchar_t *src = malloc(size * sizeof(wchar_t));
+	if (!src)
+		return NULL;
+	swprintf(src, size, L"%ls%ls", current_icon()->url_prefix, name);
+	return add_icon(name, src, img_element(src));
+}
+
+/**
+ * find_icon(): Catalog entry for an icon name; icons outside the catalog (a static_icon
+ * that's since been deleted, say) are added as links.
+ */
+static icon_entry* find_icon(const wchar_t *name) {
+	for (icon_entry *e = current_icon()->icons; e != NULL; e = e->next)
+		if (wcscmp(e->name, name) == 0)
+			return e;
+
+	if (!current_icon()->url_prefix) {
+		current_icon()->url_prefix = wcsdup(L"/img/icons/");
+		if (!current_icon()->url_prefix)
+			return NULL;
+	}
+	return add_linked_icon(name);
+}
+
+/**
+ * catalog_icon(): Build the markup for one icon file according to the icon mode.
+ */
+static void catalog_icon(const char *dir, const char *name, safe_buffer *sprite) {
+	wchar_t *wide_name = wchar_convert(name);
+	if (!wide_name)
+		return;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	const wchar_t *mime_type = icon_mime_type(name);
+	size_t length = 0;
+	char *bytes = (current_icon()->mode != ICON_MODE_LINK && mime_type) ? file_cache_bytes(path, &length) : NULL;
+
+	bool done = false;
+	if (bytes && sprite && has_extension(name, ".svg")) {
+		char *svg = realloc(bytes, length + 1);
+		if (svg) {
+			bytes = svg;
+			bytes[length] = '\0';
+
+			char id[256];
+			symbol_id(name, id, sizeof(id));
+			if (append_sprite_symbol(bytes, id, sprite)) {
+				wchar_t *wide_id = wchar_convert(id);
+				size_t size = wcslen(L"#") + strlen(id) + 1;
+				wchar_t *src = wide_id ? malloc(size * sizeof(wchar_t)) : NULL;
+				size_t html_size = strlen(id) + 160;
+				wchar_t *html = src ? malloc(html_size * sizeof(wchar_t)) : NULL;
+				if (html) {
+					// The sprite's URL isn't known until it's written; patched in icon_catalog_init()
+					swprintf(src, size, L"#%ls", wide_id);
+					swprintf(html, html_size, L"<svg class=\"icon\" role=\"img\" aria-label=\"[icon]\">"
+						L"<use href=\"{ICON_SPRITE}#%ls\"></use></svg>", wide_id);
+				}
+				free(wide_id);
+				done = add_icon(wide_name, src, html) != NULL;
+			}
+		}
+	}
+
+	if (!done && bytes && length <= (size_t)current_icon()->inline_max) {
+		wchar_t *src = data_uri(mime_type, (unsigned char *)bytes, length);
+		done = src && add_icon(wide_name, src, img_element(src));
+	}
+
+	if (!done)
+		add_linked_icon(wide_name);
+
+	free(bytes);
+	free(wide_name);
+}
+
+/**
+ * icon_catalog_init(): Build the icon markup for every icon in the site's catalog and, in
+ * sprite mode, write the sprite sheet. Must run after load_site_icons() and
+ * output_stage_init(), and before fingerprint_assets() so the sprite can be fingerprinted.
+ *
+ * arguments:
+ *  site_info *site (site configuration, with icons loaded; must not be NULL)
+ *  const char *output_dir (output directory; icons are read from here, like load_site_icons())
+ *
+ * returns:
+ *  int (number of icons cataloged)
+ */
+int icon_catalog_init(site_info *site, const char *output_dir) {
+	icon_catalog_free();
+	current_icon()->mode = site->icon_mode;
+	current_icon()->inline_max = site->icon_inline_max;
+
+	// URL prefix for linked icons: "/" + icons_dir + "/"
+	const wchar_t *icons_dir = site->icons_dir ? site->icons_dir : L"img/icons";
+	while (*icons_dir == L'/')
+		icons_dir++;
+	size_t dir_len = wcslen(icons_dir);
+	while (dir_len > 0 && icons_dir[dir_len - 1] == L'/')
+		dir_len--;
+	current_icon()->url_prefix = malloc((dir_len + 3) * sizeof(wchar_t));
+	if (!current_icon()->url_prefix)
+		return 0;
+	swprintf(current_icon()->url_prefix, dir_len + 3, L"/%.*ls/", (int)dir_len, icons_dir);
+
+	char *dir_rel = char_convert(current_icon()->url_prefix + 1);
+	if (!dir_rel)
+		return 0;
+	char dir[PATH_MAX];
+	bool slash = output_dir[strlen(output_dir) - 1] == '/';
+	snprintf(dir, sizeof(dir), "%s%s%s", output_dir, slash ? "" : "/", dir_rel);
+	free(dir_rel);
+	dir[strlen(dir) - 1] = '\0';	// drop the trailing slash
+
+	safe_buffer sprite;
+	bool use_sprite = current_icon()->mode == ICON_MODE_SPRITE && safe_buffer_init(&sprite, 4096) == 0;
+	if (use_sprite)
+		safe_append(L"<svg xmlns=\"http://www.w3.org/2000/svg\" "
+			L"xmlns:xlink=\"http://www.w3.org/1999/xlink\">\n", &sprite);
+	size_t empty_sprite = use_sprite ? sprite.used : 0;
+
+	int count = 0;
+	for (int i = 0; i < site->icon_sentinel; i++) {
+		catalog_icon(dir, site->icons[i], use_sprite ? &sprite : NULL);
+		count++;
+	}
+
+	if (use_sprite) {
+		if (sprite.used > empty_sprite) {
+			safe_append(L"</svg>\n", &sprite);
+			char *bytes = char_convert(sprite.buffer);
+			size_t length = bytes ? strlen(bytes) : 0;
+			if (bytes && write_output_bytes(ICON_SPRITE_FILENAME, bytes, length) == 0) {
+				current_icon()->sprite_bytes = bytes;
+				current_icon()->sprite_length = length;
+				bytes = NULL;
+				size_t size = strlen(ICON_SPRITE_FILENAME) + 2;
+				current_icon()->sprite_url = malloc(size * sizeof(wchar_t));
+				if (current_icon()->sprite_url)
+					swprintf(current_icon()->sprite_url, size, L"/%s", ICON_SPRITE_FILENAME);
+			}
+			free(bytes);
+		}
+		safe_buffer_free(&sprite);
+
+		// Point sprite icons at the sheet, or fall back to links if it couldn't be written
+		for (icon_entry *e = current_icon()->icons; e != NULL; e = e->next) {
+			if (e->src[0] != L'#')
+				continue;
+
+			wchar_t *html = NULL, *src = NULL;
+			if (current_icon()->sprite_url) {
+				html = replace_substring(e->html, L"{ICON_SPRITE}", current_icon()->sprite_url);
+				size_t size = wcslen(current_icon()->sprite_url) + wcslen(e->src) + 1;
+				src = malloc(size * sizeof(wchar_t));
+				if (src)
+					swprintf(src, size, L"%ls%ls", current_icon()->sprite_url, e->src);
+			} else {
+				size_t size = wcslen(current_icon()->url_prefix) + wcslen(e->name) + 1;
+				src = malloc(size * sizeof(wchar_t));
+				if (src) {
+					swprintf(src, size, L"%ls%ls", current_icon()->url_prefix, e->name);
+					html = img_element(src);
+				}
+			}
+			if (html && src) {
+				free(e->html);
+				free(e->src);
+				e->html = html;
+				e->src = src;
+			} else {
+				free(html);
+				free(src);
+			}
+		}
+	}
+
+	if (current_icon()->mode != ICON_MODE_LINK)
+		log_info("Prepared %d icon%s (%s).", count, count == 1 ? "" : "s",
+			current_icon()->sprite_url ? "sprite" : "inline");
+	return count;
+}
+
+/**
+ * icon_sprite_bytes(): The sprite sheet icon_catalog_init() wrote this build, as written.
+ * fingerprint_assets() hashes these rather than reading the file back, which a --tar build
+ * never writes.
+ *
+ * arguments:
+ *  size_t *length (receives the number of bytes; must not be NULL)
+ *
+ * returns:
+ *  const char* (don't free; valid until icon_catalog_free(); NULL if no sprite was written)
+ */
+const char* icon_sprite_bytes(size_t *length) {
+	*length = current_icon()->sprite_length;
+	return current_icon()->sprite_url ? current_icon()->sprite_bytes : NULL;
+}
+
+/**
+ * icon_src(): Value for {ICON_SRC}: the icon's URL, or a data: URI when it's inlined.
+ *
+ * arguments:
+ *  const wchar_t *icon (icon file name, as in page->icon; may be NULL)
+ *
+ * returns:
+ *  const wchar_t* (don't free; valid until icon_catalog_free(); NULL if icon is NULL)
+ */
+const wchar_t* icon_src(const wchar_t *icon) {
+	if (!icon || !*icon)
+		return NULL;
+	icon_entry *e = find_icon(icon);
+	return e ? e->src : NULL;
+}
+
+/**
+ * icon_html(): Value for {ICON_HTML}: the complete icon element for the current icon mode.
+ *
+ * arguments:
+ *  const wchar_t *icon (icon file name, as in page->icon; may be NULL)
+ *
+ * returns:
+ *  const wchar_t* (don't free; valid until icon_catalog_free(); NULL if icon is NULL)
+ */
+const wchar_t* icon_html(const wchar_t *icon) {
+	if (!icon || !*icon)
+		return NULL;
+	icon_entry *e = find_icon(icon);
+	return e ? e->html : NULL;
+}
+
+/**
+ * icon_catalog_free(): Release the icon catalog.
+ */
+void icon_catalog_free(void) {
+	icon_entry *e = current_icon()->icons;
+	while (e) {
+		icon_entry *next = e->next;
+		free(e->name);
+		free(e->src);
+		free(e->html);
+		free(e);
+		e = next;
+	}
+	free(current_icon()->url_prefix);
+	free(current_icon()->sprite_url);
+	free(current_icon()->sprite_bytes);
+	memset(current_icon(), 0, sizeof(g_icons));
+	current_icon()->mode = ICON_MODE_LINK;
+}
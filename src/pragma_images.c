@@ -0,0 +1,631 @@
+/**
+ * pragma_images.c - Build-time image probing for <img> attributes
+ *
+ * Reads the pixel dimensions of local PNG, JPEG, GIF and WebP images from their headers
+ * (never the whole file) so that content images can be emitted with width/height (no layout
+ * shift once they load) and srcset, when pre-sized variants sit next to the image:
+ *
+ *   img/fox.png, img/fox-480w.png, img/fox-960w.png
+ *     => srcset="/img/fox-480w.png 480w, /img/fox-960w.png 960w, /img/fox.png 1600w"
+ *
+ * Probe results are cached by path, mtime and size in IMAGE_CACHE_FILENAME in the output
+ * directory, so unchanged images are never reopened on later builds.
+ *
+ * Directory listings (for variants and galleries) are cached for the build, keyed by path
+ * and directory mtime; see image_directory_listing().
+ *
+ * Image URLs are resolved against the site source directory first, then the output directory.
+ * Remote images (http://, //cdn...) are left alone.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define IMAGE_TABLE_SIZE	1031
+#define IMAGE_HEADER_BYTES	32	// enough for PNG, GIF and WebP; JPEG is walked segment by segment
+
+typedef struct image_entry {
+	char *path;		// resolved file path
+	time_t mtime;
+	off_t size;
+	int width;		// 0 if the file isn't a recognizable image
+	int height;
+	struct image_entry *next;
+} image_entry;
+
+// File extensions treated as images in directory listings
+static const char *IMAGE_EXTENSIONS[] = {
+	".jpg", ".jpeg", ".png", ".gif", ".webp", ".svg", ".avif"
+};
+
+static struct image_state {
+	char *roots[2];		// source dir, output dir
+	char *cache_path;
+	image_entry *buckets[IMAGE_TABLE_SIZE];
+	image_listing *listings;	// newest first; stale ones are kept until image_probe_finish()
+	bool dirty;
+	bool initialized;
+} g_images = { .initialized = false };
+
+/**
+ * current_image(): Image probe state; per site when a libpragma context is bound.
+ */
+static struct image_state* current_image(void) {
+	return context_state(CONTEXT_IMAGES, &g_images, sizeof(g_images));
+}
+
+/**
+ * read_be16()/read_le16()/read_be32()/read_le24(): Decode integers from header bytes.
+ */
+static unsigned int read_be16(const unsigned char *p) { return (p[0] << 8) | p[1]; }
+static unsigned int read_le16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+static unsigned long read_be32(const unsigned char *p) {
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | (p[2] << 8) | p[3];
+}
+static unsigned long read_le24(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16);
+}
+
+/**
+ * probe_jpeg(): Walk JPEG segments to the first SOFn marker and read its dimensions.
+ *
+ * arguments:
+ *  FILE *file (open image, positioned just after the SOI marker)
+ *  int *width, int *height (receive the dimensions)
+ *
+ * returns:
+ *  bool (true if a frame header was found)
+ */
+static bool probe_jpeg(FILE *file, int *width, int *height) {
+	for (;;) {
+		int c = fgetc(file);
+		if (c != 0xFF)
+			return false;
+		while (c == 0xFF)	// fill bytes
+			c = fgetc(file);
+		if (c == EOF)
+			return false;
+
+		int marker = c;
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+			continue;	// standalone markers carry no length
+		if (marker == 0xD9 || marker == 0xDA)
+			return false;	// end of image / start of scan without a frame header
+
+		unsigned char len_bytes[2];
+		if (fread(len_bytes, 1, 2, file) != 2)
+			return false;
+		unsigned int length = read_be16(len_bytes);
+		if (length < 2)
+			return false;
+
+		// SOF0-SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			unsigned char frame[5];
+			if (fread(frame, 1, 5, file) != 5)
+				return false;
+			*height = (int)read_be16(frame + 1);
+			*width = (int)read_be16(frame + 3);
+			return *width > 0 && *height > 0;
+		}
+
+		if (fseek(file, length - 2, SEEK_CUR) != 0)
+			return false;
+	}
+}
+
+/**
+ * probe_image_file(): Read image dimensions from a file's header.
+ *
+ * arguments:
+ *  const char *path (image file)
+ *  int *width, int *height (receive the dimensions)
+ *
+ * returns:
+ *  bool (true if the format was recognized and the header was sane)
+ */
+static bool probe_image_file(const char *path, int *width, int *height) {
+	FILE *file = utf8_fopen((utf8_path)path, "rb");
+	if (!file)
+		return false;
+
+	unsigned char h[IMAGE_HEADER_BYTES];
+	size_t n = fread(h, 1, sizeof(h), file);
+	bool ok = false;
+	*width = *height = 0;
+
+	if (n >= 24 && memcmp(h, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(h + 12, "IHDR", 4) == 0) {
+		*width = (int)read_be32(h + 16);
+		*height = (int)read_be32(h + 20);
+		ok = true;
+	} else if (n >= 10 && (memcmp(h, "GIF87a", 6) == 0 || memcmp(h, "GIF89a", 6) == 0)) {
+		*width = (int)read_le16(h + 6);
+		*height = (int)read_le16(h + 8);
+		ok = true;
+	} else if (n >= 16 && memcmp(h, "RIFF", 4) == 0 && memcmp(h + 8, "WEBP", 4) == 0) {
+		if (n >= 30 && memcmp(h + 12, "VP8 ", 4) == 0) {
+			*width = (int)(read_le16(h + 26) & 0x3FFF);
+			*height = (int)(read_le16(h + 28) & 0x3FFF);
+			ok = true;
+		} else if (n >= 25 && memcmp(h + 12, "VP8L", 4) == 0 && h[20] == 0x2F) {
+			*width = 1 + (((h[22] & 0x3F) << 8) | h[21]);
+			*height = 1 + (((h[24] & 0x0F) << 10) | (h[23] << 2) | ((h[22] & 0xC0) >> 6));
+			ok = true;
+		} else if (n >= 30 && memcmp(h + 12, "VP8X", 4) == 0) {
+			*width = 1 + (int)read_le24(h + 24);
+			*height = 1 + (int)read_le24(h + 27);
+			ok = true;
+		}
+	} else if (n >= 2 && h[0] == 0xFF && h[1] == 0xD8) {
+		ok = fseek(file, 2, SEEK_SET) == 0 && probe_jpeg(file, width, height);
+	}
+
+	fclose(file);
+	return ok && *width > 0 && *height > 0;
+}
+
+/**
+ * image_bucket(): Hash an image path into the probe cache.
+ */
+static unsigned int image_bucket(const char *path) {
+	return (unsigned int)(hash_bytes(path, strlen(path)) % IMAGE_TABLE_SIZE);
+}
+
+static image_entry* find_image(const char *path) {
+	for (image_entry *e = current_image()->buckets[image_bucket(path)]; e != NULL; e = e->next)
+		if (strcmp(e->path, path) == 0)
+			return e;
+	return NULL;
+}
+
+static image_entry* add_image(const char *path) {
+	image_entry *e = calloc(1, sizeof(image_entry));
+	if (!e)
+		return NULL;
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		return NULL;
+	}
+	unsigned int b = image_bucket(path);
+	e->next = current_image()->buckets[b];
+	current_image()->buckets[b] = e;
+	return e;
+}
+
+/**
+ * load_image_cache(): Read probe results from the last build.
+ */
+static void load_image_cache(void) {
+	FILE *file = utf8_fopen(current_image()->cache_path, "r");
+	if (!file)
+		return;
+
+	char line[MAX_LINE_LENGTH];
+	while (fgets(line, sizeof(line), file)) {
+		strip_terminal_newline(NULL, line);
+
+		long long mtime, size;
+		int width, height, consumed = 0;
+		if (sscanf(line, "%lld %lld %d %d %n", &mtime, &size, &width, &height, &consumed) != 4 ||
+		    consumed == 0 || line[consumed] == '\0')
+			continue;
+
+		image_entry *e = find_image(line + consumed);
+		if (!e)
+			e = add_image(line + consumed);
+		if (!e)
+			continue;
+		e->mtime = (time_t)mtime;
+		e->size = (off_t)size;
+		e->width = width;
+		e->height = height;
+	}
+	fclose(file);
+}
+
+/**
+ * save_image_cache(): Write probe results for the next build.
+ */
+static void save_image_cache(void) {
+	FILE *file = utf8_fopen(current_image()->cache_path, "w");
+	if (!file) {
+		log_warn("can't write image cache %s", current_image()->cache_path);
+		return;
+	}
+	for (int i = 0; i < IMAGE_TABLE_SIZE; i++)
+		for (image_entry *e = current_image()->buckets[i]; e != NULL; e = e->next)
+			fprintf(file, "%lld %lld %d %d %s\n", (long long)e->mtime, (long long)e->size,
+				e->width, e->height, e->path);
+	fclose(file);
+}
+
+/**
+ * join_path(): Join a directory and a relative path. Caller must free().
+ */
+static char* join_path(const char *dir, const char *relative) {
+	size_t len = strlen(dir) + strlen(relative) + 2;
+	char *path = malloc(len);
+	if (path) {
+		bool slash = strlen(dir) > 0 && dir[strlen(dir) - 1] == '/';
+		snprintf(path, len, "%s%s%s", dir, slash ? "" : "/", relative);
+	}
+	return path;
+}
+
+/**
+ * is_local_url(): True if `src` refers to a file on this site (not http://, //host, data:).
+ */
+static bool is_local_url(const wchar_t *src) {
+	return src && *src && !wcsstr(src, L"://") && wcsncmp(src, L"//", 2) != 0 &&
+		wcsncmp(src, L"data:", 5) != 0;
+}
+
+/**
+ * resolve_site_path(): Find the file or directory behind a local URL.
+ *
+ * arguments:
+ *  const wchar_t *src (URL, like "/img/fox.png" or "img/gallery")
+ *  struct stat *st (receives the stat of what was found)
+ *  bool want_directory (look for a directory rather than a regular file)
+ *
+ * returns:
+ *  char* (heap-allocated path; NULL if not found; caller must free)
+ */
+static char* resolve_site_path(const wchar_t *src, struct stat *st, bool want_directory) {
+	if (!current_image()->initialized || !is_local_url(src))
+		return NULL;
+
+	char *relative = char_convert(src);
+	if (!relative)
+		return NULL;
+	relative[strcspn(relative, "?#")] = '\0';
+	const char *rel = relative;
+	while (*rel == '/')
+		rel++;
+
+	char *found = NULL;
+	for (size_t i = 0; i < SIZE_OF(current_image()->roots) && !found; i++) {
+		if (!current_image()->roots[i])
+			continue;
+		char *path = join_path(current_image()->roots[i], rel);
+		if (path && utf8_stat(path, st) == 0 &&
+		    (want_directory ? S_ISDIR(st->st_mode) : S_ISREG(st->st_mode)))
+			found = path;
+		else
+			free(path);
+	}
+	free(relative);
+	return found;
+}
+
+/**
+ * resolve_image(): Find the file behind a local image URL.
+ */
+static char* resolve_image(const wchar_t *src, struct stat *st) {
+	return resolve_site_path(src, st, false);
+}
+
+/**
+ * image_resolve_directory(): Find the directory behind a local URL, such as a gallery
+ * directory. Falls back to the URL itself as a path relative to the working directory
+ * (the old behavior) when it isn't found under the site roots.
+ *
+ * arguments:
+ *  const wchar_t *src (directory URL as written in the page)
+ *
+ * returns:
+ *  char* (heap-allocated path; NULL on error; caller must free)
+ */
+char* image_resolve_directory(const wchar_t *src) {
+	struct stat st;
+	char *path = resolve_site_path(src, &st, true);
+	return path ? path : char_convert(src);
+}
+
+/**
+ * probe_cached(): Dimensions for a resolved image file, from the cache when the file's
+ * mtime and size haven't changed.
+ */
+static bool probe_cached(const char *path, const struct stat *st, int *width, int *height) {
+	image_entry *e = find_image(path);
+	if (!e || e->mtime != st->st_mtime || e->size != st->st_size) {
+		if (!e)
+			e = add_image(path);
+		if (!e)
+			return probe_image_file(path, width, height);
+		if (!probe_image_file(path, &e->width, &e->height))
+			e->width = e->height = 0;	// remember failures too
+		e->mtime = st->st_mtime;
+		e->size = st->st_size;
+		current_image()->dirty = true;
+	}
+	*width = e->width;
+	*height = e->height;
+	return e->width > 0 && e->height > 0;
+}
+
+/**
+ * image_probe_init(): Set up image probing for a build and load the probe cache.
+ *
+ * arguments:
+ *  const char *source_dir (site source directory; images are looked up here first)
+ *  const char *output_dir (output directory; second lookup root and home of the cache)
+ *
+ * returns:
+ *  void
+ */
+void image_probe_init(const char *source_dir, const char *output_dir) {
+	if (current_image()->initialized)
+		image_probe_finish(false);
+
+	memset(current_image(), 0, sizeof(g_images));
+	current_image()->roots[0] = source_dir ? strdup(source_dir) : NULL;
+	current_image()->roots[1] = (output_dir && (!source_dir || strcmp(source_dir, output_dir) != 0))
+		? strdup(output_dir) : NULL;
+	current_image()->cache_path = join_path(output_dir ? output_dir : source_dir, IMAGE_CACHE_FILENAME);
+	current_image()->initialized = true;
+
+	if (current_image()->cache_path)
+		load_image_cache();
+}
+
+/**
+ * image_dimensions(): Pixel dimensions of a local image.
+ *
+ * arguments:
+ *  const wchar_t *src (image URL as written in the page)
+ *  int *width, int *height (receive the dimensions)
+ *
+ * returns:
+ *  bool (true if the image was found and its header could be read)
+ */
+bool image_dimensions(const wchar_t *src, int *width, int *height) {
+	struct stat st;
+	char *path = resolve_image(src, &st);
+	if (!path)
+		return false;
+
+	bool ok = probe_cached(path, &st, width, height);
+	free(path);
+	return ok;
+}
+
+/**
+ * variant_width(): If `name` is a sized variant of `stem`+`ext` ("fox-480w.png" for
+ * "fox" and ".png"), return its width; otherwise 0.
+ */
+static int variant_width(const char *name, const char *stem, size_t stem_len, const char *ext) {
+	if (strncmp(name, stem, stem_len) != 0 || name[stem_len] != '-')
+		return 0;
+
+	char *end;
+	long width = strtol(name + stem_len + 1, &end, 10);
+	if (end == name + stem_len + 1 || width <= 0 || *end != 'w' || strcmp(end + 1, ext) != 0)
+		return 0;
+	return (int)width;
+}
+
+/**
+ * is_image_variant(): True if `name` looks like a pre-sized variant ("fox-480w.png").
+ *
+ * arguments:
+ *  const char *name (file name, without directory)
+ *
+ * returns:
+ *  bool
+ */
+bool is_image_variant(const char *name) {
+	const char *ext = strrchr(name, '.');
+	if (!ext || ext == name || ext[-1] != 'w')
+		return false;
+
+	const char *p = ext - 2;
+	while (p > name && *p >= '0' && *p <= '9')
+		p--;
+	return p < ext - 2 && *p == '-' && p > name;
+}
+
+/**
+ * is_image_name(): True if `name` has one of the IMAGE_EXTENSIONS.
+ *
+ * arguments:
+ *  const char *name (file name)
+ *
+ * returns:
+ *  bool
+ */
+bool is_image_name(const char *name) {
+	for (size_t i = 0; i < SIZE_OF(IMAGE_EXTENSIONS); i++)
+		if (has_extension(name, IMAGE_EXTENSIONS[i]))
+			return true;
+	return false;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * image_directory_listing(): Sorted names of the images in a directory, cached for the
+ * build. A directory is listed again only when its mtime changes (say, thumbnails were
+ * written into it). Listings stay valid until image_probe_finish(), even after a newer
+ * one replaces them, so callers may hold one while calling back in here.
+ *
+ * arguments:
+ *  const char *dir (directory path)
+ *
+ * returns:
+ *  const image_listing* (NULL if `dir` isn't a readable directory; don't free)
+ */
+const image_listing* image_directory_listing(const char *dir) {
+	struct stat st;
+	if (!dir || utf8_stat((utf8_path)dir, &st) != 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	for (image_listing *l = current_image()->listings; l != NULL; l = l->next) {
+		if (strcmp(l->path, dir) == 0) {
+			if (l->mtime == st.st_mtime)
+				return l;
+			break;	// changed since we listed it
+		}
+	}
+
+	image_listing *l = calloc(1, sizeof(image_listing));
+	if (!l)
+		return NULL;
+	l->path = strdup(dir);
+	if (!l->path) {
+		free(l);
+		return NULL;
+	}
+	l->mtime = st.st_mtime;
+
+	char **names = NULL;
+	int count = 0;
+	directory_to_array((utf8_path)dir, &names, &count);
+
+	// Keep images only, in a stable order so rebuilds produce identical pages
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		if (is_image_name(names[i]))
+			names[kept++] = names[i];
+		else
+			free(names[i]);
+	}
+	if (kept > 1)
+		qsort(names, kept, sizeof(char*), compare_names);
+
+	l->names = names;
+	l->count = kept;
+	l->next = current_image()->listings;
+	current_image()->listings = l;
+	return l;
+}
+
+/**
+ * image_srcset(): Build a srcset value from sized variants next to an image.
+ *
+ * arguments:
+ *  const wchar_t *src (image URL as written in the page)
+ *  int width (intrinsic width of the image itself)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated srcset value; NULL if there are no variants)
+ */
+wchar_t* image_srcset(const wchar_t *src, int width) {
+	struct stat st;
+	char *path = resolve_image(src, &st);
+	if (!path)
+		return NULL;
+
+	// Split the file path into directory, stem and extension
+	char *slash = strrchr(path, '/');
+	char *name = slash ? slash + 1 : path;
+	char *ext = strrchr(name, '.');
+	if (!slash || !ext || ext == name) {
+		free(path);
+		return NULL;
+	}
+	*slash = '\0';
+	size_t stem_len = ext - name;
+
+	const image_listing *dir = image_directory_listing(path);
+	if (!dir || dir->count == 0) {
+		free(path);
+		return NULL;
+	}
+
+	// URL prefix: everything in src up to and including its last '/'
+	const wchar_t *url_name = wcsrchr(src, L'/');
+	size_t prefix_len = url_name ? (size_t)(url_name - src + 1) : 0;
+
+	safe_buffer buf;
+	if (safe_buffer_init(&buf, 256) != 0) {
+		free(path);
+		return NULL;
+	}
+
+	// Variants in ascending width order (name order isn't numeric)
+	int last = 0, variants = 0;
+	for (;;) {
+		int next = 0;
+		const char *next_name = NULL;
+		for (int i = 0; i < dir->count; i++) {
+			int w = variant_width(dir->names[i], name, stem_len, ext);
+			if (w > last && (next == 0 || w < next) && w != width) {
+				next = w;
+				next_name = dir->names[i];
+			}
+		}
+		if (!next_name)
+			break;
+
+		wchar_t *wide_name = wchar_convert(next_name);
+		if (wide_name) {
+			wchar_t descriptor[32];
+			swprintf(descriptor, 32, L" %dw, ", next);
+			safe_append_n(src, prefix_len, &buf);
+			safe_append(wide_name, &buf);
+			safe_append(descriptor, &buf);
+			free(wide_name);
+			variants++;
+		}
+		last = next;
+	}
+	free(path);
+
+	if (variants == 0) {
+		safe_buffer_free(&buf);
+		return NULL;
+	}
+
+	// ...and the original at its intrinsic width
+	wchar_t descriptor[32];
+	swprintf(descriptor, 32, L" %dw", width);
+	safe_append(src, &buf);
+	safe_append(descriptor, &buf);
+	return buf.buffer;
+}
+
+/**
+ * image_probe_finish(): Save the probe cache (if anything changed) and release state.
+ *
+ * arguments:
+ *  bool save_cache (false for dry runs)
+ *
+ * returns:
+ *  void
+ */
+void image_probe_finish(bool save_cache) {
+	if (!current_image()->initialized)
+		return;
+
+	if (save_cache && current_image()->dirty && current_image()->cache_path)
+		save_image_cache();
+
+	for (int i = 0; i < IMAGE_TABLE_SIZE; i++) {
+		image_entry *e = current_image()->buckets[i];
+		while (e) {
+			image_entry *next = e->next;
+			free(e->path);
+			free(e);
+			e = next;
+		}
+	}
+	image_listing *d = current_image()->listings;
+	while (d) {
+		image_listing *next = d->next;
+		for (int i = 0; i < d->count; i++)
+			free(d->names[i]);
+		free(d->names);
+		free(d->path);
+		free(d);
+		d = next;
+	}
+	for (size_t i = 0; i < SIZE_OF(current_image()->roots); i++)
+		free(current_image()->roots[i]);
+	free(current_image()->cache_path);
+	memset(current_image(), 0, sizeof(g_images));
+}
@@ -11,8 +11,8 @@
  #include "pragma_poison.h"
 
 /**
-* build_index(): build the site index and return it as a string. Allocates memory that 
-* must be freed. 
+* build_index(): build the site index and return it as a rope that borrows the site
+* header and footer. Must be freed with rope_free().
 *
 * arguments:
 * 	pp_page* pages (linked list of all pages in this site)
@@ -20,9 +20,9 @@
 *   int start_page (which index to generate, given the page size: 0 is the front page)
 *
 * returns: 
-* 	wchar_t* (the HTML of the index page)
+* 	pp_rope* (the HTML of the index page)
 */
-wchar_t* build_index( pp_page* pages, site_info* site, int start_page ) {
+pp_rope* build_index( pp_page* pages, site_info* site, int start_page ) {
 	if (!site) {
 		log_fatal("got null site_info in build_index()! Cannot build without site info -- aborting.");
 		// todo: abort gracefully instead of just offering nullity
@@ -36,25 +36,18 @@ wchar_t* build_index( pp_page* pages, site_info* site, int start_page ) {
 	int skipahead = (start_page * site->index_size) - 1; // zero index
 	int counter = 0;
 
-	// FIXME: Low priority and would break cleanly, but the index page could easily exceed 128KB.
-	size_t buffer_size = 131072;
-	wchar_t *index_output = malloc(buffer_size * sizeof(wchar_t));
-	
+	pp_rope *index_output = rope_new();
 
 	if (!index_output) {
 		// hmm, this seems like a pretty 'fatal' error
-		//wprintf(L"! Error allocating memory for building index page (start_page %d)!", start_page);
-		//perror("malloc(): ");
 		log_fatal("Error allocating memory for building index page %d. Aborting!", start_page);
 		return NULL;
 	}
 
 	// insert the HTML of the site header first; initialize page counter
-	wcscpy(index_output, site->header);
+	rope_frame(index_output, site, site->header);
 	int pages_processed = 0;
-	
-	// Track buffer usage to prevent overflow
-	// size_t current_length = wcslen(index_output); // Unused for now
+	bool has_gallery = false;	// any post on this page has one (it may be past #MORE; harmless)
 
 	// Find the right spot in the linked list:
 	for (pp_page *current = pages; current != NULL; current = current->next) {
@@ -73,8 +66,8 @@ wchar_t* build_index( pp_page* pages, site_info* site, int start_page ) {
 
 		wchar_t *rendered_item = render_index_item_with_template(current, site);
 		if (rendered_item) {
-			wcscat(index_output, rendered_item);
-			free(rendered_item);
+			rope_take(index_output, rendered_item);
+			has_gallery = has_gallery || current->has_gallery;
 		} else {
 			log_warn("Warning: template rendering failed for post, skipping\n");
 		}
@@ -83,56 +76,35 @@ wchar_t* build_index( pp_page* pages, site_info* site, int start_page ) {
 		
 		if (pages_processed == site->index_size || current->next == NULL) {
 			// we've either reached the end of the page list or processed the required # of pages
-			wcscat(index_output, L"<div class=\"foot\">\n");
+			rope_append(index_output, L"<div class=\"foot\">\n");
 			if (start_page > 0) {
 				// there must be newer content if there's already an index...
-				wcscat(index_output, L"<a href=\"index");
+				rope_append(index_output, L"<a href=\"index");
 				wchar_t *bucket = string_from_int(start_page - 1);
-				wcscat(index_output, bucket);
+				rope_append(index_output, bucket);
 				free(bucket);
-				wcscat(index_output, L".html\">&lt; newer </a>");
+				rope_append(index_output, L".html\">&lt; newer </a>");
 			}
 			if (current->next == NULL) // if nothing's left, make a note of it
-				wcscat(index_output, L"(these are the oldest things)\n"); // FIXME: -> site config
+				rope_append(index_output, L"(these are the oldest things)\n"); // FIXME: -> site config
 			else {
 				// basic logic: there must be older content if any pages remain in the list because
 				// it's sorted by date, descending.
 				if (start_page > 0)
-					wcscat(index_output, L" | ");
-				wcscat(index_output, L"<a href=\"index");
+					rope_append(index_output, L" | ");
+				rope_append(index_output, L"<a href=\"index");
 				wchar_t *bucket = string_from_int(start_page + 1);
-				wcscat(index_output, bucket);
+				rope_append(index_output, bucket);
 				free(bucket);
-				wcscat(index_output, L".html\">older &gt;");
+				rope_append(index_output, L".html\">older &gt;");
 			}
 			// close footer div and break the loop; logically, we must be done at this point
-			wcscat(index_output, L"</div>\n");
+			rope_append(index_output, L"</div>\n");
 			break;
 		}
 	}
 
-	//wcscat(index_output, L"</div>\n");
-	
-	
-	
-	// Check if we'll exceed buffer
-	size_t current_len = wcslen(index_output);
-	size_t footer_len = wcslen(site->footer);
-	if (current_len + footer_len >= buffer_size) {
-		log_warn("buffer overflow warning! (current %zu + footer %zu >= buffer %zu)\n", 
-		       current_len, footer_len, buffer_size);
-	}
-	
-	
-	// Use safest possible copy method to avoid any corruption
-	size_t current_pos = wcslen(index_output);
-	
-	
-	// Use wmemcpy which is safer than wcscpy/wcscat
-	wmemcpy(index_output + current_pos, site->footer, footer_len);
-	index_output[current_pos + footer_len] = L'\0';  // Manually null terminate
-	
-	
+	rope_frame(index_output, site, page_footer(site, has_gallery));
 
 	// Apply common token replacements using centralized function
 	// Build index URL path
@@ -150,13 +122,11 @@ wchar_t* build_index( pp_page* pages, site_info* site, int start_page ) {
 		swprintf(index_description, 256, L"Index of all posts on %ls", site->site_name);
 	}
 
-	wchar_t *processed_output = apply_common_tokens(index_output, site, actual_url, site->site_name, index_description, NULL, NULL, NULL);
-	free(index_output);
+	rope_apply_common_tokens(index_output, site, actual_url, site->site_name, index_description, NULL, NULL, NULL);
 	free(actual_url);
 	if (index_description) {
 		free(index_description);
 	}
-	index_output = processed_output;
 
 	return index_output;
 }
@@ -46,6 +46,14 @@ pp_page* parse_file(const utf8_path filename) {
 	page->static_icon = malloc(512);
 	page->source_filename = malloc(512);
 	page->parsed = true;
+	page->has_gallery = false;
+	page->related = NULL;
+	page->related_count = 0;
+	page->links.items = NULL;
+	page->links.count = 0;
+	page->links.size = 0;
+	page->backlinks = NULL;
+	page->backlink_count = 0;
 
 	// Extract just the filename from the full path and store it
 	if (page->source_filename) {
@@ -117,7 +125,7 @@ pp_page* parse_file(const utf8_path filename) {
 
 	// Read the file into wide-character strings until we hit the standard delimiter that 
 	// goes between yaml (metadata) and HTML/md (content). FIXME: it's hard-coded at the moment.
-	while (fgetws(line, MAX_LINE_LENGTH, file) != NULL && wcscmp(line, L"###\n") != 0) {
+	while (utf8_fgets(line, MAX_LINE_LENGTH, file) != NULL && wcscmp(line, L"###\n") != 0) {
 		// ...and for each line we read, see if it provides a metadata directive
 		if (wcsstr(line, L"title:") != NULL) {
 			wcscpy(page->title, line + wcslen(L"title:")); 
@@ -191,7 +199,7 @@ pp_page* parse_file(const utf8_path filename) {
 
 	// Read post content
 	size_t content_index = 0;
-	while (fgetws(line, MAX_LINE_LENGTH, file) != NULL) {
+	while (utf8_fgets(line, MAX_LINE_LENGTH, file) != NULL) {
 		if (wcscmp(line, L"###\n") == 0)
 			break;  // End of content
 		size_t line_len = wcslen(line);
@@ -215,6 +223,34 @@ pp_page* parse_file(const utf8_path filename) {
 	return page;
 }
 
+/**
+ * add_build_target(): Add an output target (directory + base URL) to the site configuration.
+ *
+ * arguments:
+ *  site_info *config (site configuration; must not be NULL)
+ *  const char *output_dir (output directory; copied)
+ *  const wchar_t *base_url (base URL for links in this target; copied)
+ *
+ * returns:
+ *  bool (false if the arguments are empty, or there are already MAX_BUILD_TARGETS targets)
+ */
+bool add_build_target(site_info *config, const char *output_dir, const wchar_t *base_url) {
+	if (!output_dir || !*output_dir || !base_url || !*base_url ||
+	    config->target_count == MAX_BUILD_TARGETS)
+		return false;
+
+	build_target *target = &config->targets[config->target_count];
+	target->output_dir = strdup(output_dir);
+	target->base_url = wcsdup(base_url);
+	if (!target->output_dir || !target->base_url) {
+		free(target->output_dir);
+		free(target->base_url);
+		return false;
+	}
+	config->target_count++;
+	return true;
+}
+
 /**
  * load_site_yaml(): Read in the configuration data for the whole site from the pragma_config.yml
  * file. FIXME: A key piece of technical debt here is the use of character instead of wide-character
@@ -224,9 +260,27 @@ pp_page* parse_file(const utf8_path filename) {
  * 	char* path (use the absolute path to the yaml configuration file)
  * 
  * returns:
- *  site_info* (pointer to a data structure containing the site configuration info)
+ *  site_info* (pointer to a data structure containing the site configuration info; NULL
+ *   if it can't be read, or if the user declines PRAGMA_LOCAL_BASE at the prompt)
  */
 site_info* load_site_yaml(char* path) {
+	return load_site_config(path, true);
+}
+
+/**
+ * load_site_config(): load_site_yaml() for callers that mustn't touch the terminal
+ * (libpragma). Never calls exit().
+ *
+ * arguments:
+ *  char *path (site source directory)
+ *  bool interactive (may ask for confirmation of PRAGMA_LOCAL_BASE on stdin, when that's
+ *   a terminal; otherwise the override just applies, with a note in the log)
+ *
+ * returns:
+ *  site_info* (site configuration; NULL on error or if the override was declined;
+ *   caller must free_site_info())
+ */
+site_info* load_site_config(char *path, bool interactive) {
 	if (!path)
 		return NULL;
 
@@ -256,6 +310,7 @@ site_info* load_site_yaml(char* path) {
 	config->header = malloc(4096 * sizeof(wchar_t));
 	config->base_url = malloc(256 * sizeof(wchar_t));
 	config->footer = malloc(4096 * sizeof(wchar_t));
+	config->gallery_footer = NULL;
 	config->tagline = malloc(256);
 	config->license = malloc(256 * sizeof(wchar_t));
 	config->default_image = malloc(256 * sizeof(wchar_t));
@@ -267,14 +322,64 @@ site_info* load_site_yaml(char* path) {
 	config->include_js = false;
 	config->build_tags = false;
 	config->build_scroll = false;
-
-	while (fgetws(line, MAX_LINE_LENGTH, file) != NULL) {
+	config->precompress = false;
+	config->gzip_level = 6;
+	config->minify = false;
+	config->fingerprint = false;
+	config->icon_mode = ICON_MODE_LINK;
+	config->icon_inline_max = ICON_INLINE_MAX;
+	config->css_inline = false;
+	config->css_inline_max = CSS_INLINE_MAX;
+	config->stylesheet = NULL;
+	config->frames = NULL;
+	config->frame_count = 0;
+	config->search = false;
+	config->related_posts = 0;
+	config->json_api = false;
+	config->service_worker = false;
+	config->precache_posts = PRECACHE_POSTS;
+	config->budget_report = false;
+	config->budget_html_kb = BUDGET_HTML_KB;
+	config->budget_images = BUDGET_IMAGES;
+	config->budget_image_kb = BUDGET_IMAGE_KB;
+	config->link_check = false;
+	config->backlinks = false;
+	config->publish_first = false;
+	config->publish_hook = NULL;
+	config->target_count = 0;
+	config->icon_sentinel = 0;	// load_site_icons() fills in the icons
+	wcscpy(config->js, L"j.js");	// the script file pragma -c creates
+	config->base_dir[0] = L'\0';	// the source directory; set by the caller
+
+	while (utf8_fgets(line, MAX_LINE_LENGTH, file) != NULL) {
 		// trim newlines first
 		size_t len = wcslen(line);
 		if (len > 0 && line[len-1] == L'\n')
 			line[len-1] = L'\0';
 
-		if (wcsstr(line, L"site_name:") != NULL)
+		if (wcsncmp(line, L"target:", wcslen(L"target:")) == 0) {
+			// target:/path/to/output https://base.url/ (checked first: URLs and paths can
+			// contain other keys)
+			wchar_t *value = line + wcslen(L"target:");
+			wchar_t *space = wcsrchr(value, L' ');
+			char *dir = NULL;
+			if (space) {
+				*space = L'\0';
+				dir = char_convert(value);
+			}
+			if (!dir || !add_build_target(config, dir, space + 1))
+				log_warn("bypassing target line; use target:DIR URL (at most %d targets).", MAX_BUILD_TARGETS);
+			free(dir);
+		}
+		else if (wcsncmp(line, L"publish_hook:", wcslen(L"publish_hook:")) == 0) {
+			// publish_hook:COMMAND (checked early too: a command line can contain anything)
+			wchar_t *value = line + wcslen(L"publish_hook:");
+			while (*value == L' ')
+				value++;
+			free(config->publish_hook);
+			config->publish_hook = *value ? wcsdup(value) : NULL;
+		}
+		else if (wcsstr(line, L"site_name:") != NULL)
 			wcscpy(config->site_name, line + wcslen(L"site_name:"));
 		else if (wcsstr(line, L"css:") != NULL)
 			wcscpy(config->css, line + wcslen(L"css:"));
@@ -364,6 +469,109 @@ site_info* load_site_yaml(char* path) {
 			wchar_t *value = line + wcslen(L"build_scroll:");
 			config->build_scroll = (wcsstr(value, L"yes") != NULL);
 		}
+		else if (wcsstr(line, L"precompress:") != NULL) {
+			wchar_t *value = line + wcslen(L"precompress:");
+			config->precompress = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"gzip_level:") != NULL) {
+			config->gzip_level = (int) wcstol(line + wcslen(L"gzip_level:"), NULL, 10);
+			if (config->gzip_level < 1 || config->gzip_level > 9) {
+				log_warn("invalid gzip_level in config file (use 1-9)! Defaulting to 6.");
+				config->gzip_level = 6;
+			}
+		}
+		else if (wcsstr(line, L"minify:") != NULL) {
+			wchar_t *value = line + wcslen(L"minify:");
+			config->minify = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"fingerprint:") != NULL) {
+			wchar_t *value = line + wcslen(L"fingerprint:");
+			config->fingerprint = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"icon_mode:") != NULL) {
+			wchar_t *value = line + wcslen(L"icon_mode:");
+			if (wcsstr(value, L"sprite") != NULL)
+				config->icon_mode = ICON_MODE_SPRITE;
+			else if (wcsstr(value, L"inline") != NULL)
+				config->icon_mode = ICON_MODE_INLINE;
+			else
+				config->icon_mode = ICON_MODE_LINK;
+		}
+		else if (wcsstr(line, L"icon_inline_max:") != NULL) {
+			config->icon_inline_max = (int) wcstol(line + wcslen(L"icon_inline_max:"), NULL, 10);
+			if (config->icon_inline_max < 0) {
+				log_warn("invalid icon_inline_max in config file! Defaulting to %d.", ICON_INLINE_MAX);
+				config->icon_inline_max = ICON_INLINE_MAX;
+			}
+		}
+		else if (wcsstr(line, L"css_inline:") != NULL) {
+			wchar_t *value = line + wcslen(L"css_inline:");
+			config->css_inline = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"css_inline_max:") != NULL) {
+			config->css_inline_max = (int) wcstol(line + wcslen(L"css_inline_max:"), NULL, 10);
+			if (config->css_inline_max < 0) {
+				log_warn("invalid css_inline_max in config file! Defaulting to %d.", CSS_INLINE_MAX);
+				config->css_inline_max = CSS_INLINE_MAX;
+			}
+		}
+		else if (wcsstr(line, L"search:") != NULL) {
+			wchar_t *value = line + wcslen(L"search:");
+			config->search = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"related_posts:") != NULL) {
+			config->related_posts = (int) wcstol(line + wcslen(L"related_posts:"), NULL, 10);
+			if (config->related_posts < 0 || config->related_posts > RELATED_POSTS_MAX) {
+				log_warn("invalid related_posts in config file! Use 0 to %d.", RELATED_POSTS_MAX);
+				config->related_posts = config->related_posts < 0 ? 0 : RELATED_POSTS_MAX;
+			}
+		}
+		else if (wcsstr(line, L"json_api:") != NULL) {
+			wchar_t *value = line + wcslen(L"json_api:");
+			config->json_api = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"service_worker:") != NULL) {
+			wchar_t *value = line + wcslen(L"service_worker:");
+			config->service_worker = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"precache_posts:") != NULL) {
+			config->precache_posts = (int) wcstol(line + wcslen(L"precache_posts:"), NULL, 10);
+			if (config->precache_posts < 0) {
+				log_warn("invalid precache_posts in config file! Using %d.", PRECACHE_POSTS);
+				config->precache_posts = PRECACHE_POSTS;
+			}
+		}
+		else if (wcsstr(line, L"budget_report:") != NULL) {
+			wchar_t *value = line + wcslen(L"budget_report:");
+			config->budget_report = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"budget_html_kb:") != NULL) {
+			config->budget_html_kb = (int) wcstol(line + wcslen(L"budget_html_kb:"), NULL, 10);
+			if (config->budget_html_kb < 0)
+				config->budget_html_kb = 0;
+		}
+		else if (wcsstr(line, L"budget_images:") != NULL) {
+			config->budget_images = (int) wcstol(line + wcslen(L"budget_images:"), NULL, 10);
+			if (config->budget_images < 0)
+				config->budget_images = 0;
+		}
+		else if (wcsstr(line, L"budget_image_kb:") != NULL) {
+			config->budget_image_kb = (int) wcstol(line + wcslen(L"budget_image_kb:"), NULL, 10);
+			if (config->budget_image_kb < 0)
+				config->budget_image_kb = 0;
+		}
+		else if (wcsstr(line, L"link_check:") != NULL) {
+			wchar_t *value = line + wcslen(L"link_check:");
+			config->link_check = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"backlinks:") != NULL) {
+			wchar_t *value = line + wcslen(L"backlinks:");
+			config->backlinks = (wcsstr(value, L"yes") != NULL);
+		}
+		else if (wcsstr(line, L"publish_first:") != NULL) {
+			wchar_t *value = line + wcslen(L"publish_first:");
+			config->publish_first = (wcsstr(value, L"yes") != NULL);
+		}
 		else if (wcsstr(line, L"---") != NULL) {
 			// clunky but I'm tired of seeing "unnown config option" for valid yaml
 		}
@@ -373,6 +581,17 @@ site_info* load_site_yaml(char* path) {
 
 	fclose(file);
 
+	// Lightbox assets only go on pages with galleries: keep one footer with the
+	// has_gallery block and one without, so builders just pick one
+	if (config->footer) {
+		config->gallery_footer = template_apply_condition(config->footer, L"has_gallery", true);
+		wchar_t *plain_footer = template_apply_condition(config->footer, L"has_gallery", false);
+		if (plain_footer) {
+			free(config->footer);
+			config->footer = plain_footer;
+		}
+	}
+
 	// Print concise configuration summary
 	log_info("Site configuration: %ls, index_size=%d",
 	       config->site_name ? config->site_name : L"[no name]",
@@ -382,6 +601,21 @@ site_info* load_site_yaml(char* path) {
 	if (config->include_js) log_info(", js");
 	if (config->build_tags) log_info(", tags");
 	if (config->build_scroll) log_info(", scroll");
+	if (config->precompress) log_info(", gzip level %d", config->gzip_level);
+	if (config->minify) log_info(", minify");
+	if (config->fingerprint) log_info(", fingerprinted assets");
+	if (config->icon_mode == ICON_MODE_INLINE) log_info(", inline icons");
+	if (config->icon_mode == ICON_MODE_SPRITE) log_info(", icon sprite");
+	if (config->css_inline) log_info(", inline css");
+	if (config->search) log_info(", search index");
+	if (config->related_posts > 0) log_info(", %d related posts", config->related_posts);
+	if (config->json_api) log_info(", json api");
+	if (config->service_worker) log_info(", service worker");
+	if (config->budget_report) log_info(", page-weight report");
+	if (config->link_check) log_info(", link check");
+	if (config->backlinks) log_info(", backlinks");
+	if (config->publish_first || config->publish_hook) log_info(", publish first%s", config->publish_hook ? " (with hook)" : "");
+	if (config->target_count > 0) log_info(", %d extra target%s", config->target_count, config->target_count == 1 ? "" : "s");
 	log_info("");
 
 	// Override base_url with environment variable if set (for local testing)
@@ -389,20 +623,24 @@ site_info* load_site_yaml(char* path) {
 	if (local_base) {
 		log_info("PRAGMA_LOCAL_BASE detected: %s", local_base);
 		log_info("This option will generate a site with URLs that are probably not suitable for production.");
-		log_info("Continue? (Press Enter to proceed, Ctrl+C to cancel): ");
-		fflush(stdout);
 
-		// Wait for user confirmation
+		// Ask for confirmation at a terminal; scripts and CI (no terminal) just proceed
 		char confirm[10];
-		if (fgets(confirm, sizeof(confirm), stdin)) {
+		interactive = interactive && isatty(STDIN_FILENO);
+		if (interactive) {
+			log_info("Continue? (Press Enter to proceed, Ctrl+C to cancel): ");
+			log_flush();
+		}
+		if (!interactive || fgets(confirm, sizeof(confirm), stdin)) {
 			// User pressed Enter (or typed something), continue
 			free(config->base_url);
 			config->base_url = wchar_convert(local_base);
 			log_info("Using local base URL: %s", local_base);
 		} else {
-			// Input error or EOF, abort
+			// Input error or EOF: no site
 			log_info("Aborting pragma-web.");
-			exit(EXIT_FAILURE);
+			free_site_info(config);
+			return NULL;
 		}
 	}
 
@@ -435,7 +673,7 @@ pp_page* load_site( int operation, char* directory, time_t since_time ) {
 
 	// Assumption is that the directory contains a subdirectory called `dat`, which
 	// in turn contains the raw source files. 
-	size_t new_length = strlen(directory) + strlen(SITE_SOURCES_DEFAULT_SUBDIR) + 1;
+	size_t new_length = strlen(directory) + strlen(SITE_SOURCES_DEFAULT_SUBDIR) + 2; // + slash, NUL
 	char* source_directory = malloc(new_length);
 
 	// malloc() has failed.
@@ -496,25 +734,27 @@ pp_page* load_site( int operation, char* directory, time_t since_time ) {
 		closedir(dir);
 	} else {
 		log_error("Can't open the source directory! Check to see that it's readable.");
+		free(source_directory);
 		return NULL;
 	} 
+	free(source_directory);
 	return head;
 }
 /**
  * write_single_page(): Write HTML content for a single page to disk.
  *
  * Takes a page and its pre-built HTML content and writes it to the appropriate
- * file in the posts directory. The filename is based on the page's date_stamp.
+ * file in the posts directory. The filename is based on the page's source filename.
  *
  * arguments:
  *  pp_page *page (page metadata; must not be NULL)
- *  char *path (posts output directory path; must not be NULL)
- *  wchar_t *html_content (pre-built HTML content to write; must not be NULL)
+ *  char *path (posts directory, relative to the output directory; must not be NULL)
+ *  pp_rope *html_content (pre-built HTML content to write; must not be NULL)
  *
  * returns:
  *  void
  */
-void write_single_page(pp_page* page, char *path, wchar_t* html_content) {
+void write_single_page(pp_page* page, char *path, pp_rope* html_content) {
 	if (!page || !path || !html_content)
 		return;
 
@@ -525,30 +765,31 @@ void write_single_page(pp_page* page, char *path, wchar_t* html_content) {
 		return;
 	}
 
-	// Build full output path: path + filename + .html
-	size_t full_path_len = strlen(path) + wcslen(filename) + 10; // ".html" + null + buffer
-	char *full_path = malloc(full_path_len);
-	if (!full_path) {
-		log_error("could not allocate memory for page path");
-		return;
-	}
-
 	// Convert filename to char* for path construction
 	char *filename_char = char_convert(filename);
 	if (!filename_char) {
 		log_error("could not convert filename to char");
-		free(full_path);
 		return;
 	}
 
-	snprintf(full_path, full_path_len, "%s/%s.html", path, filename_char);
+	// Build relative output path: path + filename + .html
+	size_t relative_path_len = strlen(path) + strlen(filename_char) + 7; // "/" + ".html" + null
+	char *relative_path = malloc(relative_path_len);
+	if (!relative_path) {
+		log_error("could not allocate memory for page path");
+		free(filename_char);
+		return;
+	}
+
+	bool has_slash = strlen(path) > 0 && path[strlen(path) - 1] == '/';
+	snprintf(relative_path, relative_path_len, "%s%s%s.html", path, has_slash ? "" : "/", filename_char);
 
-	// Write the HTML content to file
-	write_file_contents(full_path, html_content);
+	// Hand the page to the write stage (skips unchanged pages, precompresses if enabled)
+	write_output_rope(relative_path, html_content);
 
 	// Cleanup
 	free(filename_char);
-	free(full_path);
+	free(relative_path);
 }
 
 /**
@@ -573,8 +814,20 @@ void load_site_icons(char *root, char *subdir, site_info *config) {
 	// pass an integer pointer to directory_to_array(); it modifies that value based on the
 	// final size of the array so we can use it as a sentinel 
 	int c;	
+	free(config->icons);	// load_site_yaml()'s placeholder; directory_to_array() allocates
    	directory_to_array(path, &config->icons, &c);
 	free(path);
+
+	// fingerprinted copies (fingerprint:yes) and .gz siblings (precompress:yes) live
+	// alongside the originals; they aren't icons
+	int kept = 0;
+	for (int i = 0; i < c; i++) {
+		if (is_generated_asset_name(config->icons[i]))
+			free(config->icons[i]);
+		else
+			config->icons[kept++] = config->icons[i];
+	}
+	c = kept;
 	log_info("Loaded %d icons.", c);
 
 	// Save the sentinel value for the icon linked list
@@ -749,7 +1002,8 @@ void assign_icons(pp_page *pages, site_info *config, const char *source_dir) {
 
 /**
 * directory_to_array(): load filenames from a specified directory into an array.  Pass &count to
-* keep track of how many files were loaded. 
+* keep track of how many files were loaded. The array and each name in it are allocated here
+* and belong to the caller; on error, *filenames is NULL and *count is 0.
 *
 * arguments:
 *  const char *path (the directory we want to convert into an array of filenames)
@@ -760,6 +1014,9 @@ void assign_icons(pp_page *pages, site_info *config, const char *source_dir) {
 *  
 */
 void directory_to_array(const utf8_path path, char ***filenames, int *count) {
+	*filenames = NULL;
+	*count = 0;
+
 	// Basics: can we open it?
 	DIR *dir = utf8_opendir(path);
 	if (!dir) {
@@ -767,31 +1024,29 @@ void directory_to_array(const utf8_path path, char ***filenames, int *count) {
 		return;
 	}
 
-	// iterate over the directory entries, skipping . and .., to arrive at &count.
-	// This should probably be a side effect of the loop below.
+	// one pass over the entries, skipping . and .., growing the array as we go
 	struct dirent *entry;
-	*count = 0;
-	while ((entry = readdir(dir)) != NULL)
-		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) 
-			(*count)++;
-
-	// Allocate the filenames array based on count
-	*filenames = malloc(*count * sizeof(char*));
-	if (!*filenames) {
-		closedir(dir);
-		*count = 0;
-		return;
-	}
-
-	// roll it back and get the acutal names
-	rewinddir(dir);
-	int i = 0;
+	char **names = NULL;
+	int used = 0, size = 0;
 	while ((entry = readdir(dir)) != NULL) {
-		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-			(*filenames)[i] = malloc(strlen(entry->d_name) + 1);
-			strcpy((*filenames)[i], entry->d_name);
-			i++;
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		if (used == size) {
+			int new_size = size ? size * 2 : 16;
+			char **grown = realloc(names, new_size * sizeof(char*));
+			if (!grown)
+				break;
+			names = grown;
+			size = new_size;
 		}
+		char *name = strdup(entry->d_name);
+		if (!name)
+			break;
+		names[used++] = name;
 	}
 	closedir(dir);
+
+	*filenames = names;
+	*count = used;
 }
@@ -0,0 +1,201 @@
+/**
+ * pragma_json_api.c - JSON copies of posts and listings (json_api:yes)
+ *
+ * Apps and infinite-scroll scripts can fetch small pre-rendered documents instead of
+ * scraping HTML. The builders call in here as they go, from fields they've already derived:
+ *
+ * - c/{slug}.json: one post: title, date, timestamp, tags, description, url and the
+ *   rendered HTML;
+ * - api/index/{n}.json: index page n (0 is the front page), the same posts as index.html,
+ *   index1.html, ...: {"page", "pages", "next", "posts": [...]};
+ * - api/t/{tag}.json: every post with a tag, newest first.
+ *
+ * Listings carry post summaries (everything but the HTML) with a "json" link to the post.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+/**
+ * post_url(): Full URL of a post's HTML or JSON copy ("html" or "json"). Caller must free().
+ */
+static wchar_t* post_url(pp_page *page, site_info *site, const wchar_t *extension) {
+	wchar_t path[512];
+	swprintf(path, SIZE_OF(path), L"%s%ls.%ls", SITE_POSTS,
+	         page->source_filename ? page->source_filename : L"", extension);
+	return build_url(site->base_url, path);
+}
+
+/**
+ * append_post_fields(): Append a post's summary fields (no braces) to a JSON object.
+ */
+static void append_post_fields(pp_page *page, site_info *site, safe_buffer *buf) {
+	wchar_t *date = legible_date(page->date_stamp);
+	wchar_t *description = get_page_description(page);
+	wchar_t *html_url = post_url(page, site, L"html");
+	wchar_t *json_url = post_url(page, site, L"json");
+	wchar_t timestamp[32];
+	swprintf(timestamp, SIZE_OF(timestamp), L"%lld", (long long)page->date_stamp);
+
+	safe_append(L"\"title\":", buf);
+	safe_append_json(page->title, buf);
+	safe_append(L",\"date\":", buf);
+	safe_append_json(date, buf);
+	safe_append(L",\"timestamp\":", buf);
+	safe_append(timestamp, buf);
+
+	// "travel, food" => ["travel","food"]
+	safe_append(L",\"tags\":[", buf);
+	bool first = true;
+	for (const wchar_t *t = page->tags ? page->tags : L""; *t; ) {
+		while (*t == L',' || iswspace(*t))
+			t++;
+		const wchar_t *end = t;
+		while (*end && *end != L',')
+			end++;
+		const wchar_t *last = end;
+		while (last > t && iswspace(last[-1]))
+			last--;
+		if (last > t) {
+			wchar_t tag[256];
+			size_t length = (size_t)(last - t) < SIZE_OF(tag) ? (size_t)(last - t) : SIZE_OF(tag) - 1;
+			wmemcpy(tag, t, length);
+			tag[length] = L'\0';
+			if (!first)
+				safe_append_char(L',', buf);
+			safe_append_json(tag, buf);
+			first = false;
+		}
+		t = end;
+	}
+	safe_append_char(L']', buf);
+
+	safe_append(L",\"description\":", buf);
+	safe_append_json(description, buf);
+	safe_append(L",\"url\":", buf);
+	safe_append_json(html_url, buf);
+	safe_append(L",\"json\":", buf);
+	safe_append_json(json_url, buf);
+
+	free(date);
+	free(description);
+	free(html_url);
+	free(json_url);
+}
+
+/**
+ * write_post_json(): Write c/{slug}.json for one post.
+ *
+ * arguments:
+ *  pp_page *page (the post; must not be NULL)
+ *  site_info *site (site configuration; must not be NULL)
+ *
+ * returns:
+ *  void
+ */
+void write_post_json(pp_page *page, site_info *site) {
+	if (!site->json_api || !page->source_filename)
+		return;
+
+	safe_buffer *buf = buffer_pool_get_global();
+	safe_append_char(L'{', buf);
+	append_post_fields(page, site, buf);
+	safe_append(L",\"html\":", buf);
+	safe_append_json(page->content, buf);
+	safe_append(L"}\n", buf);
+
+	char *slug = char_convert(page->source_filename);
+	if (slug) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%s%s.json", SITE_POSTS, slug);
+		write_output(path, buf->buffer);
+		free(slug);
+	}
+	buffer_pool_return_global(buf);
+}
+
+/**
+ * write_index_json(): Write api/index/{n}.json, the posts on index page n.
+ *
+ * arguments:
+ *  pp_page *pages (sorted page list; must not be NULL)
+ *  site_info *site (site configuration; index_size posts per page)
+ *  int page_num (0 for the front page)
+ *  int total_pages (number of index pages)
+ *
+ * returns:
+ *  void
+ */
+void write_index_json(pp_page *pages, site_info *site, int page_num, int total_pages) {
+	if (!site->json_api || site->index_size <= 0)
+		return;
+
+	pp_page *page = pages;
+	for (int skip = page_num * site->index_size; page && skip > 0; skip--)
+		page = page->next;
+
+	safe_buffer *buf = buffer_pool_get_global();
+	wchar_t number[64];
+	swprintf(number, SIZE_OF(number), L"{\"page\":%d,\"pages\":%d,\"next\":", page_num, total_pages);
+	safe_append(number, buf);
+	if (page_num + 1 < total_pages) {
+		wchar_t next_path[64];
+		swprintf(next_path, SIZE_OF(next_path), L"%sindex/%d.json", SITE_API, page_num + 1);
+		wchar_t *next_url = build_url(site->base_url, next_path);
+		safe_append_json(next_url, buf);
+		free(next_url);
+	} else {
+		safe_append(L"null", buf);
+	}
+
+	safe_append(L",\"posts\":[", buf);
+	for (int i = 0; page && i < site->index_size; i++, page = page->next) {
+		safe_append(i > 0 ? L",\n{" : L"\n{", buf);
+		append_post_fields(page, site, buf);
+		safe_append_char(L'}', buf);
+	}
+	safe_append(L"]}\n", buf);
+
+	char path[64];
+	snprintf(path, sizeof(path), "%sindex/%d.json", SITE_API, page_num);
+	write_output(path, buf->buffer);
+	buffer_pool_return_global(buf);
+}
+
+/**
+ * write_tag_json(): Write api/t/{tag}.json, every post with one tag.
+ *
+ * arguments:
+ *  const wchar_t *tag (the tag; must not be NULL)
+ *  pp_page **posts (posts with the tag, newest first)
+ *  int count (number of posts)
+ *  site_info *site (site configuration; must not be NULL)
+ *
+ * returns:
+ *  void
+ */
+void write_tag_json(const wchar_t *tag, pp_page **posts, int count, site_info *site) {
+	if (!site->json_api)
+		return;
+
+	safe_buffer *buf = buffer_pool_get_global();
+	safe_append(L"{\"tag\":", buf);
+	safe_append_json(tag, buf);
+	safe_append(L",\"posts\":[", buf);
+	for (int i = 0; i < count; i++) {
+		safe_append(i > 0 ? L",\n{" : L"\n{", buf);
+		append_post_fields(posts[i], site, buf);
+		safe_append_char(L'}', buf);
+	}
+	safe_append(L"]}\n", buf);
+
+	char *tag_str = char_convert(tag);
+	if (tag_str) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%st/%s.json", SITE_API, tag_str);
+		write_output(path, buf->buffer);
+		free(tag_str);
+	}
+	buffer_pool_return_global(buf);
+}
@@ -0,0 +1,431 @@
+/**
+ * pragma_links.c - Internal link graph: broken links and backlinks
+ *
+ * The Markdown pass records the target of every [text](url) and ![alt](url) in a post
+ * (pp_page.links). A target is internal when it's root-relative (/t/), relative to the post
+ * (other.html, resolved against c/) or under base_url; it maps to a path in the output
+ * directory the way a web server would map it: query and fragment dropped, %-escapes
+ * decoded, and a trailing slash meaning index.html.
+ *
+ * - With `link_check:yes`, every internal target is looked up after the build: first among
+ *   the outputs this build produced (output_hash()), then as a file under the output root.
+ *   Lookups are cached by path, so a target shared by many posts is checked once. Broken
+ *   ones are logged and listed in LINK_REPORT_FILENAME.
+ * - With `backlinks:yes`, links between posts are reversed before rendering, so each post's
+ *   page can list the posts that link to it (<!-- LOOP backlinks --> in single_page.html).
+ *
+ * Only posts are scanned: links in the header, footer and templates aren't checked.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#include <ctype.h>
+
+#define LINK_TABLE_SIZE		1031	// resolved targets, shared by every post that links them
+
+// Whether one output-relative path exists (link check), or which post it is (backlinks)
+typedef struct link_entry {
+	char *path;
+	bool exists;
+	pp_page *page;
+	struct link_entry *next;
+} link_entry;
+
+typedef struct link_table {
+	link_entry *buckets[LINK_TABLE_SIZE];
+} link_table;
+
+/**
+ * link_list_add(): Record a link or image target found in a post's Markdown.
+ *
+ * arguments:
+ *  pp_link_list *list (the post's links; NULL records nothing)
+ *  const wchar_t *target (URL as written; copied)
+ *  bool image (an image rather than a link)
+ *
+ * returns:
+ *  void
+ */
+void link_list_add(pp_link_list *list, const wchar_t *target, bool image) {
+	if (!list || !target || !*target || *target == L'#')
+		return;
+
+	if (list->count == list->size) {
+		int size = list->size ? list->size * 2 : 8;
+		pp_link *grown = realloc(list->items, size * sizeof(pp_link));
+		if (!grown)
+			return;
+		list->items = grown;
+		list->size = size;
+	}
+	wchar_t *copy = wcsdup(target);
+	if (!copy)
+		return;
+	list->items[list->count].target = copy;
+	list->items[list->count].image = image;
+	list->count++;
+}
+
+/**
+ * link_list_free(): Free a post's recorded links and reset the list.
+ *
+ * arguments:
+ *  pp_link_list *list (may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void link_list_free(pp_link_list *list) {
+	if (!list)
+		return;
+	for (int i = 0; i < list->count; i++)
+		free(list->items[i].target);
+	free(list->items);
+	list->items = NULL;
+	list->count = 0;
+	list->size = 0;
+}
+
+/**
+ * hex_value(): Value of one hex digit, or -1.
+ */
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * has_scheme(): True for "http:", "mailto:", "data:" and the like.
+ */
+static bool has_scheme(const char *url) {
+	if (!isalpha((unsigned char)url[0]))
+		return false;
+	const char *p = url + 1;
+	while (isalnum((unsigned char)*p) || *p == '+' || *p == '-' || *p == '.')
+		p++;
+	return *p == ':';
+}
+
+/**
+ * link_output_path(): Output-relative path an internal link target points at.
+ *
+ * arguments:
+ *  const char *target (URL as written, UTF-8)
+ *  const char *base_url (site base URL, UTF-8; may be NULL)
+ *  const char *page_dir (directory of the linking page, e.g. SITE_POSTS; relative targets
+ *   resolve against it)
+ *
+ * returns:
+ *  char* (heap-allocated path like "c/fido.html"; NULL for external targets)
+ */
+static char* link_output_path(const char *target, const char *base_url, const char *page_dir) {
+	size_t base_len = base_url ? strlen(base_url) : 0;
+	const char *prefix = "";
+
+	if (base_len > 0 && strncmp(target, base_url, base_len) == 0) {
+		target += base_len;
+	} else if (target[0] == '/' && target[1] == '/') {
+		return NULL;	// protocol-relative: another host
+	} else if (has_scheme(target)) {
+		return NULL;
+	} else if (target[0] != '/') {
+		prefix = page_dir;
+	}
+	while (*target == '/')
+		target++;
+
+	size_t end = strcspn(target, "?#");
+
+	// prefix + target, %-decoded, with room for "index.html"
+	size_t capacity = strlen(prefix) + end + 16;
+	char *joined = malloc(capacity);
+	char *path = malloc(capacity);
+	if (!joined || !path) {
+		free(joined);
+		free(path);
+		return NULL;
+	}
+	size_t n = 0;
+	for (const char *p = prefix; *p; p++)
+		joined[n++] = *p;
+	for (size_t i = 0; i < end; i++) {
+		int high, low;
+		if (target[i] == '%' && i + 2 < end && (high = hex_value(target[i + 1])) >= 0 &&
+		    (low = hex_value(target[i + 2])) >= 0) {
+			joined[n++] = (char)(high * 16 + low);
+			i += 2;
+		} else {
+			joined[n++] = target[i];
+		}
+	}
+	joined[n] = '\0';
+
+	// Drop "." and empty segments; ".." climbs (never above the root, as browsers do)
+	size_t at = 0;
+	bool directory = false;	// the last segment names a directory ("", "." or "..")
+	char *segment = joined;
+	while (segment) {
+		char *slash = strchr(segment, '/');
+		if (slash)
+			*slash = '\0';
+		if (strcmp(segment, "..") == 0) {
+			if (at > 0)
+				at--;
+			while (at > 0 && path[at - 1] != '/')
+				at--;
+			directory = !slash;
+		} else if (segment[0] != '\0' && strcmp(segment, ".") != 0) {
+			size_t length = strlen(segment);
+			memcpy(path + at, segment, length);
+			at += length;
+			path[at++] = '/';
+			directory = false;
+		} else if (!slash) {
+			directory = true;
+		}
+		segment = slash ? slash + 1 : NULL;
+	}
+
+	if (directory) {
+		memcpy(path + at, "index.html", 11);
+	} else if (at > 0) {
+		path[at - 1] = '\0';	// no trailing slash after the last segment
+	} else {
+		memcpy(path, "index.html", 11);
+	}
+	free(joined);
+	return path;
+}
+
+/**
+ * table_find(): Look up (or add, if `add`) a path in a link table.
+ */
+static link_entry* table_find(link_table *table, const char *path, bool add) {
+	unsigned int b = (unsigned int)(hash_bytes(path, strlen(path)) % LINK_TABLE_SIZE);
+	for (link_entry *e = table->buckets[b]; e != NULL; e = e->next)
+		if (strcmp(e->path, path) == 0)
+			return e;
+	if (!add)
+		return NULL;
+
+	link_entry *e = calloc(1, sizeof(link_entry));
+	if (!e)
+		return NULL;
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		return NULL;
+	}
+	e->next = table->buckets[b];
+	table->buckets[b] = e;
+	return e;
+}
+
+/**
+ * table_free(): Free a link table's entries.
+ */
+static void table_free(link_table *table) {
+	for (int i = 0; i < LINK_TABLE_SIZE; i++) {
+		link_entry *e = table->buckets[i];
+		while (e) {
+			link_entry *next = e->next;
+			free(e->path);
+			free(e);
+			e = next;
+		}
+		table->buckets[i] = NULL;
+	}
+}
+
+/**
+ * page_output_path(): Where a post is written ("c/<source name>.html"); caller must free().
+ */
+static char* page_output_path(const pp_page *page) {
+	char *name = page->source_filename ? char_convert(page->source_filename) : NULL;
+	if (!name)
+		return NULL;
+	size_t length = strlen(SITE_POSTS) + strlen(name) + 6;
+	char *path = malloc(length);
+	if (path)
+		snprintf(path, length, "%s%s.html", SITE_POSTS, name);
+	free(name);
+	return path;
+}
+
+/**
+ * target_exists(): Whether a resolved target was produced by this build or is a file
+ * under the output root. A directory counts if it has an index.html.
+ */
+static bool target_exists(const char *path, const char *root) {
+	uint64_t hash;
+	if (output_hash(path, &hash))
+		return true;
+
+	char full_path[PATH_MAX];
+	snprintf(full_path, sizeof(full_path), "%s%s", root, path);
+	struct stat st;
+	if (utf8_stat((utf8_path)full_path, &st) != 0)
+		return false;
+	if (S_ISREG(st.st_mode))
+		return true;
+	if (!S_ISDIR(st.st_mode))
+		return false;
+
+	char index_path[PATH_MAX];
+	snprintf(index_path, sizeof(index_path), "%s/index.html", path);
+	if (output_hash(index_path, &hash))
+		return true;
+	snprintf(full_path, sizeof(full_path), "%s%s/index.html", root, path);
+	return utf8_stat((utf8_path)full_path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * backlinks_build(): Fill in each post's `backlinks` from the links in every other post.
+ * Does nothing (beyond clearing old lists) unless the site has `backlinks:yes`.
+ *
+ * arguments:
+ *  pp_page *pages (sorted page list; backlinks come out in the same order)
+ *  site_info *site (site configuration)
+ *
+ * returns:
+ *  void
+ */
+void backlinks_build(pp_page *pages, site_info *site) {
+	for (pp_page *p = pages; p != NULL; p = p->next) {
+		free(p->backlinks);
+		p->backlinks = NULL;
+		p->backlink_count = 0;
+	}
+	if (!site || !site->backlinks)
+		return;
+
+	link_table *posts = calloc(1, sizeof(link_table));
+	if (!posts)
+		return;
+	for (pp_page *p = pages; p != NULL; p = p->next) {
+		char *path = page_output_path(p);
+		link_entry *e = path ? table_find(posts, path, true) : NULL;
+		if (e)
+			e->page = p;
+		free(path);
+	}
+
+	char *base_url = site->base_url ? char_convert(site->base_url) : NULL;
+	int links = 0;
+	for (pp_page *p = pages; p != NULL; p = p->next) {
+		for (int i = 0; i < p->links.count; i++) {
+			if (p->links.items[i].image)
+				continue;
+			char *target = char_convert(p->links.items[i].target);
+			char *path = target ? link_output_path(target, base_url, SITE_POSTS) : NULL;
+			link_entry *e = path ? table_find(posts, path, false) : NULL;
+			free(target);
+			free(path);
+
+			pp_page *linked = e ? e->page : NULL;
+			if (!linked || linked == p)
+				continue;
+			// Pages are visited in order, so a repeat link from p is the last entry
+			if (linked->backlink_count > 0 && linked->backlinks[linked->backlink_count - 1] == p)
+				continue;
+			pp_page **grown = realloc(linked->backlinks, (linked->backlink_count + 1) * sizeof(pp_page*));
+			if (!grown)
+				continue;
+			linked->backlinks = grown;
+			linked->backlinks[linked->backlink_count++] = p;
+			links++;
+		}
+	}
+	free(base_url);
+	table_free(posts);
+	free(posts);
+
+	log_info("backlinks: %d link%s between posts", links, links == 1 ? "" : "s");
+}
+
+/**
+ * link_check_report(): Look up every internal link and image target in the posts, log the
+ * broken ones and list them in LINK_REPORT_FILENAME. Call after every page (and every
+ * asset) is written and before output_stage_finish(), whose output hashes it consults.
+ *
+ * The report has one line per broken target: "<post path> link|image <target as written>".
+ *
+ * arguments:
+ *  pp_page *pages (page list)
+ *  site_info *site (site configuration, with base_url set for this build)
+ *  const char *output_dir (output directory; files are looked up under it)
+ *
+ * returns:
+ *  int (number of broken targets; -1 if the check is off)
+ */
+int link_check_report(pp_page *pages, site_info *site, const char *output_dir) {
+	if (!site || !site->link_check)
+		return -1;
+
+	char root[PATH_MAX];
+	size_t len = strlen(output_dir);
+	char report_path[PATH_MAX];
+	int n = snprintf(root, sizeof(root), "%s%s", output_dir, (len > 0 && output_dir[len - 1] == '/') ? "" : "/");
+	int m = snprintf(report_path, sizeof(report_path), "%s%s", root, LINK_REPORT_FILENAME);
+	if (n < 0 || (size_t)n >= sizeof(root) || m < 0 || (size_t)m >= sizeof(report_path)) {
+		log_error("output path too long for the link report: %s", output_dir);
+		return -1;
+	}
+
+	FILE *file = utf8_fopen(report_path, "w");
+	if (!file)
+		log_error("can't write link report %s", report_path);
+
+	link_table *seen = calloc(1, sizeof(link_table));
+	if (!seen) {
+		if (file)
+			fclose(file);
+		return -1;
+	}
+
+	char *base_url = site->base_url ? char_convert(site->base_url) : NULL;
+	int checked = 0, broken = 0;
+	for (pp_page *p = pages; p != NULL; p = p->next) {
+		char *page_path = NULL;
+		for (int i = 0; i < p->links.count; i++) {
+			char *target = char_convert(p->links.items[i].target);
+			char *path = target ? link_output_path(target, base_url, SITE_POSTS) : NULL;
+			if (!path) {
+				free(target);
+				continue;
+			}
+
+			link_entry *e = table_find(seen, path, false);
+			if (!e) {
+				e = table_find(seen, path, true);
+				if (e)
+					e->exists = target_exists(path, root);
+			}
+			checked++;
+			if (e && !e->exists) {
+				broken++;
+				if (!page_path)
+					page_path = page_output_path(p);
+				const char *kind = p->links.items[i].image ? "image" : "link";
+				log_warn("broken %s in %s: %s", kind, page_path ? page_path : "?", target);
+				if (file)
+					fprintf(file, "%s %s %s\n", page_path ? page_path : "?", kind, target);
+			}
+			free(target);
+			free(path);
+		}
+		free(page_path);
+	}
+	if (file)
+		fclose(file);
+	free(base_url);
+	table_free(seen);
+	free(seen);
+
+	log_info("links: %d internal target%s checked, %d broken (see %s)", checked,
+		checked == 1 ? "" : "s", broken, LINK_REPORT_FILENAME);
+	return broken;
+}
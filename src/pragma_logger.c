@@ -3,17 +3,22 @@
  *
  * Provides consistent logging functionality across the entire codebase.
  * Replaced the ad hoc printf/wprintf/perror usage with a unified system.
- * 
+ *
  * (I know there's repetition of basic logic in the functions here, but it's
- * a caclaulted tradeoff for legibility and easier, less error-prone calls 
+ * a caclaulted tradeoff for legibility and easier, less error-prone calls
  * to the logging functions.)
  *
  * Features:
- * - Configurable log levels
+ * - Configurable log levels, checked before anything is formatted
  * - Consistent message formatting
- * - Wide character support for existing wprintf usage
+ * - Wide character support for existing wprintf usage (converted to UTF-8, so stdout
+ *   never mixes wide and narrow output)
  * - Quiet mode support for automation
  * - Proper output routing (stdout for info, stderr for errors)
+ * - Background writing (log_start_async()): callers format into a slot of a lock-free
+ *   ring buffer and move on; one thread drains it to stdout/stderr
+ * - JSON lines ({"time", "level", "msg"} per line, all on stdout) for log collectors
+ * - Rate-limited progress bars for long loops, instead of a line per item
  *
  * By Will Shaw <wsshaw@gmail.com>
  */
@@ -23,34 +28,92 @@
 #include <time.h>
 #include <errno.h>
 #include <string.h>
+#include <sched.h>
+#include <stddef.h>
+
+#define LOG_RING_SLOTS		256	// power of two
+#define LOG_RECORD_MAX		1024	// longer messages are truncated
+#define LOG_PROGRESS_INTERVAL_MS 100	// progress bars redraw at most this often
+#define LOG_PROGRESS_WIDTH	24	// characters inside the bar's brackets
+
+// What a record asks the writer to do
+enum log_record_kind {
+    LOG_RECORD_LINE,       // an ordinary message
+    LOG_RECORD_PROGRESS,   // a progress bar update, overwritten by the next one
+    LOG_RECORD_PROGRESS_END // the last update: the bar's line is finished
+};
 
-// Global logger state
-static struct {
+// One formatted message, waiting to be written
+typedef struct log_record {
+    size_t sequence;       // ring bookkeeping: whose turn this slot is (see log_enqueue())
+    log_level_t level;
+    int kind;
+    struct timespec when;
+    char text[LOG_RECORD_MAX];
+} log_record;
+
+// Global logger state (libpragma contexts each get their own; see current_logger())
+static struct logger_state {
     log_level_t min_level;
     bool quiet_mode;
     bool initialized;
+    log_sink_fn sink;      // when set, messages go here instead of stdout/stderr
+    void *sink_data;
+    struct timespec progress_shown; // last progress bar update
+    int warnings;          // logged so far (atomic: workers log too)
+    int errors;            // errors and fatal errors, likewise
 } g_logger = {
     .min_level = LOG_INFO,
     .quiet_mode = false,
     .initialized = false
 };
 
+// Ring buffer and writer thread. stdout and stderr belong to the process, so there's one
+// of these however many libpragma contexts there are.
+//
+// Producers claim slots by advancing `head` with compare-and-swap; a slot's sequence number
+// says whether it's free for position p (== p), published (== p + 1) or still being drained.
+// The writer is the only consumer, so `tail` is its own.
+static struct log_ring {
+    log_record slots[LOG_RING_SLOTS];
+    size_t head;           // next position to claim (atomic)
+    size_t tail;           // next position to write (writer thread; read atomically)
+    bool running;          // writer thread started and not yet stopped (atomic)
+    bool stopping;
+    bool sleeping;         // writer is waiting for records (atomic)
+    pthread_t thread;
+    pthread_mutex_t lock;  // only for sleeping and waking, never to publish records
+    pthread_cond_t wake;   // records were published, or stop
+    pthread_cond_t drained; // the writer caught up
+    bool json;             // write JSON lines instead of prefixed text
+    bool progress_open;    // a progress bar is on screen without its newline
+    bool terminal;         // stdout is a terminal, so progress bars can redraw
+} g_ring = {
+    .running = false,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * current_logger(): Logger state for the calling thread's context.
+ */
+static struct logger_state* current_logger(void) {
+    return context_state(CONTEXT_LOGGER, &g_logger, sizeof(g_logger));
+}
+
 // Log level prefixes
 static const char* LOG_PREFIXES[] = {
     "",           // LOG_DEBUG (no prefix, just the message)
-    "=> ",        // LOG_INFO (informational, not urgent) 
+    "=> ",        // LOG_INFO (informational, not urgent)
     "! ",         // LOG_WARN (i'm warnin' y'all)
     "! Error: ",  // LOG_ERROR (error, but not a fatal one)
     "! FATAL: "   // LOG_FATAL (error,   ...   a fatal one)
 };
 
-// Wide character prefixes for wprintf versions
-static const wchar_t* LOG_PREFIXES_W[] = {
-    L"",           // LOG_DEBUG
-    L"=> ",        // LOG_INFO
-    L"! ",         // LOG_WARN
-    L"! Error: ",  // LOG_ERROR
-    L"! FATAL: "   // LOG_FATAL
+// Level names for JSON lines
+static const char* LOG_LEVEL_NAMES[] = {
+    "debug", "info", "warn", "error", "fatal"
 };
 
 /**
@@ -64,9 +127,28 @@ static const wchar_t* LOG_PREFIXES_W[] = {
  *  void
  */
 void log_init(log_level_t min_level, bool quiet_mode) {
-    g_logger.min_level = min_level;
-    g_logger.quiet_mode = quiet_mode;
-    g_logger.initialized = true;
+    struct logger_state *logger = current_logger();
+    logger->min_level = min_level;
+    logger->quiet_mode = quiet_mode;
+    logger->initialized = true;
+}
+
+/**
+ * log_set_sink(): Send messages to a callback instead of stdout/stderr. Library hosts
+ * use this to collect a site's messages (it applies to the current context only).
+ *
+ * arguments:
+ *  log_sink_fn sink (receives the level and the formatted message, without prefix or
+ *   newline; NULL restores stdout/stderr)
+ *  void *user_data (passed through to sink)
+ *
+ * returns:
+ *  void
+ */
+void log_set_sink(log_sink_fn sink, void *user_data) {
+    struct logger_state *logger = current_logger();
+    logger->sink = sink;
+    logger->sink_data = user_data;
 }
 
 /**
@@ -79,18 +161,20 @@ void log_init(log_level_t min_level, bool quiet_mode) {
  *  bool (true if should log, false otherwise)
  */
 static bool should_log(log_level_t level) {
+    struct logger_state *logger = current_logger();
+
     // Auto-initialize with defaults if not initialized
-    if (!g_logger.initialized) {
+    if (!logger->initialized) {
         log_init(LOG_INFO, false);
     }
 
     // Don't log if in quiet mode (unless it's an error or fatal)
-    if (g_logger.quiet_mode && level < LOG_ERROR) {
+    if (logger->quiet_mode && level < LOG_ERROR) {
         return false;
     }
 
     // Check minimum level
-    return level >= g_logger.min_level;
+    return level >= logger->min_level;
 }
 
 /**
@@ -100,10 +184,332 @@ static bool should_log(log_level_t level) {
  *  log_level_t level (log level)
  *
  * returns:
- *  FILE* (stdout for info/debug, stderr for warnings/errors)
+ *  FILE* (stdout for info/debug, stderr for warnings/errors; stdout for all JSON lines)
  */
 static FILE* get_output_stream(log_level_t level) {
-    return (level >= LOG_WARN) ? stderr : stdout;
+    return (level >= LOG_WARN && !g_ring.json) ? stderr : stdout;
+}
+
+/**
+ * append_json_text(): Append `text` as the body of a JSON string (no quotes) to `out`.
+ *
+ * returns:
+ *  size_t (new length of out; stops short rather than overflow)
+ */
+static size_t append_json_text(char *out, size_t used, size_t size, const char *text) {
+    for (const unsigned char *c = (const unsigned char*)text; *c && used + 7 < size; c++) {
+        if (*c == '"' || *c == '\\') {
+            out[used++] = '\\';
+            out[used++] = (char)*c;
+        } else if (*c == '\n') {
+            out[used++] = '\\';
+            out[used++] = 'n';
+        } else if (*c < 0x20) {
+            used += snprintf(out + used, size - used, "\\u%04x", *c);
+        } else {
+            out[used++] = (char)*c;
+        }
+    }
+    out[used] = '\0';
+    return used;
+}
+
+/**
+ * write_record(): Write one record to its stream. Runs on the writer thread, or on the
+ * caller's when there's no writer.
+ */
+static void write_record(const log_record *r) {
+    FILE *stream = get_output_stream(r->level);
+
+    if (g_ring.json) {
+        // Progress bars would be one line per redraw; keep only where they end up
+        if (r->kind == LOG_RECORD_PROGRESS)
+            return;
+
+        struct tm tm;
+        gmtime_r(&r->when.tv_sec, &tm);
+        char line[LOG_RECORD_MAX * 2 + 128];
+        size_t used = strftime(line, sizeof(line), "{\"time\":\"%Y-%m-%dT%H:%M:%S", &tm);
+        used += snprintf(line + used, sizeof(line) - used, ".%03ldZ\",\"level\":\"%s\",\"msg\":\"",
+                         r->when.tv_nsec / 1000000L, LOG_LEVEL_NAMES[r->level]);
+        used = append_json_text(line, used, sizeof(line) - 3, r->text);
+        snprintf(line + used, sizeof(line) - used, "\"}\n");
+        fputs(line, stream);
+        return;
+    }
+
+    if (r->kind == LOG_RECORD_LINE) {
+        if (g_ring.progress_open)
+            fputs("\n", stdout);
+        g_ring.progress_open = false;
+        fprintf(stream, "%s%s\n", LOG_PREFIXES[r->level], r->text);
+    } else if (g_ring.terminal) {
+        // Redraw in place; \033[K clears whatever a longer previous update left behind
+        fprintf(stdout, "\r%s%s\033[K%s", LOG_PREFIXES[LOG_INFO], r->text,
+                r->kind == LOG_RECORD_PROGRESS_END ? "\n" : "");
+        g_ring.progress_open = (r->kind == LOG_RECORD_PROGRESS);
+    } else if (r->kind == LOG_RECORD_PROGRESS_END) {
+        // Not a terminal (a log file, CI): just the final state
+        fprintf(stdout, "%s%s\n", LOG_PREFIXES[LOG_INFO], r->text);
+    }
+}
+
+/**
+ * log_writer(): Writer thread: drain the ring in order, flushing whenever it runs dry.
+ */
+static void* log_writer(void *arg) {
+    (void)arg;
+    struct log_ring *ring = &g_ring;
+
+    for (;;) {
+        log_record *slot = &ring->slots[ring->tail & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == ring->tail + 1) {
+            write_record(slot);
+            // Hand the slot back for the producer one lap ahead
+            __atomic_store_n(&slot->sequence, ring->tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        // Caught up: flush, tell log_flush() callers, then sleep until there's more
+        fflush(stdout);
+        fflush(stderr);
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->drained);
+        if (ring->stopping) {
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        __atomic_store_n(&ring->sleeping, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != ring->tail + 1) {
+            // A producer that saw sleeping == false before we set it won't signal, so
+            // don't wait for long
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 50 * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ring->wake, &ring->lock, &until);
+        }
+        __atomic_store_n(&ring->sleeping, false, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return NULL;
+}
+
+/**
+ * wake_writer(): Signal the writer if it's asleep.
+ */
+static void wake_writer(void) {
+    if (__atomic_load_n(&g_ring.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&g_ring.lock);
+        pthread_cond_signal(&g_ring.wake);
+        pthread_mutex_unlock(&g_ring.lock);
+    }
+}
+
+/**
+ * log_enqueue(): Claim a ring slot, format the message into it and publish it.
+ * When the ring is full the caller yields until the writer frees a slot, so nothing is
+ * dropped and order is kept.
+ */
+static void log_enqueue(log_level_t level, int kind, const char *format, va_list args) {
+    struct log_ring *ring = &g_ring;
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    log_record *slot;
+
+    for (;;) {
+        slot = &ring->slots[pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == pos) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;   // slot is ours; pos was reloaded on failure
+        } else if ((ptrdiff_t)(sequence - pos) < 0) {
+            // Full: the writer is a lap behind
+            wake_writer();
+            sched_yield();
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+    slot->kind = kind;
+    clock_gettime(CLOCK_REALTIME, &slot->when);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    wake_writer();
+}
+
+/**
+ * log_message(): Deliver one message that passed should_log(): to the sink, the ring, or
+ * straight to stdout/stderr when there's no writer thread.
+ */
+static void log_message(log_level_t level, int kind, const char *format, va_list args) {
+    struct logger_state *logger = current_logger();
+
+    if (level == LOG_WARN)
+        __atomic_add_fetch(&logger->warnings, 1, __ATOMIC_RELAXED);
+    else if (level >= LOG_ERROR)
+        __atomic_add_fetch(&logger->errors, 1, __ATOMIC_RELAXED);
+
+    if (logger->sink) {
+        // Hosts get finished messages only, in the calling thread
+        if (kind == LOG_RECORD_PROGRESS)
+            return;
+        char message[MAX_LINE_LENGTH];
+        vsnprintf(message, sizeof(message), format, args);
+        logger->sink(level, message, logger->sink_data);
+        return;
+    }
+
+    if (__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE)) {
+        log_enqueue(level, kind, format, args);
+        return;
+    }
+
+    log_record record;
+    record.level = level;
+    record.kind = kind;
+    clock_gettime(CLOCK_REALTIME, &record.when);
+    vsnprintf(record.text, sizeof(record.text), format, args);
+    write_record(&record);
+    fflush(get_output_stream(level));
+}
+
+/**
+ * log_message_f(): log_message() with the arguments inline.
+ */
+static void log_message_f(log_level_t level, int kind, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_message(level, kind, format, args);
+    va_end(args);
+}
+
+/**
+ * log_message_w(): Format a wide message and deliver it as UTF-8.
+ */
+static void log_message_w(log_level_t level, const wchar_t *format, va_list args) {
+    wchar_t message[LOG_RECORD_MAX];
+    if (vswprintf(message, SIZE_OF(message), format, args) < 0)
+        message[SIZE_OF(message) - 1] = L'\0';	// truncated
+    char *utf8 = wchar_to_utf8(message);
+    log_message_f(level, LOG_RECORD_LINE, "%s", utf8 ? utf8 : "");
+    free(utf8);
+}
+
+/**
+ * log_start_async(): Write log output from a background thread from now on, so logging
+ * calls only format into the ring buffer. The pragma binary calls this once, after
+ * log_init(); output is flushed at exit (and by log_flush()).
+ *
+ * arguments:
+ *  bool json_lines (write one JSON object per message instead of prefixed text)
+ *
+ * returns:
+ *  void
+ */
+void log_start_async(bool json_lines) {
+    if (__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE))
+        return;
+
+    g_ring.json = json_lines;
+    g_ring.terminal = isatty(STDOUT_FILENO);
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++)
+        g_ring.slots[i].sequence = i;
+    g_ring.head = 0;
+    g_ring.tail = 0;
+    g_ring.stopping = false;
+
+    if (pthread_create(&g_ring.thread, NULL, log_writer, NULL) != 0)
+        return;	// keep writing synchronously
+    __atomic_store_n(&g_ring.running, true, __ATOMIC_RELEASE);
+    atexit(log_stop_async);
+}
+
+/**
+ * log_flush(): Wait until everything logged so far is written. Call before reading from
+ * the terminal, so a prompt shows up first.
+ *
+ * returns:
+ *  void
+ */
+void log_flush(void) {
+    if (!__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE)) {
+        fflush(stdout);
+        fflush(stderr);
+        return;
+    }
+
+    size_t target = __atomic_load_n(&g_ring.head, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&g_ring.lock);
+    while (__atomic_load_n(&g_ring.tail, __ATOMIC_ACQUIRE) < target) {
+        pthread_cond_signal(&g_ring.wake);
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec++;
+        pthread_cond_timedwait(&g_ring.drained, &g_ring.lock, &until);
+    }
+    pthread_mutex_unlock(&g_ring.lock);
+}
+
+/**
+ * log_stop_async(): Write what's left and stop the writer thread (registered with atexit()
+ * by log_start_async()). Later messages are written synchronously.
+ *
+ * returns:
+ *  void
+ */
+void log_stop_async(void) {
+    if (!__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE))
+        return;
+
+    log_flush();
+    pthread_mutex_lock(&g_ring.lock);
+    g_ring.stopping = true;
+    pthread_cond_signal(&g_ring.wake);
+    pthread_mutex_unlock(&g_ring.lock);
+    pthread_join(g_ring.thread, NULL);
+    __atomic_store_n(&g_ring.running, false, __ATOMIC_RELEASE);
+
+    // Anything a worker managed to publish during shutdown
+    for (;;) {
+        log_record *slot = &g_ring.slots[g_ring.tail & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != g_ring.tail + 1)
+            break;
+        write_record(slot);
+        __atomic_store_n(&slot->sequence, g_ring.tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        g_ring.tail++;
+    }
+    if (g_ring.progress_open)
+        fputs("\n", stdout);
+    g_ring.progress_open = false;
+    fflush(stdout);
+    fflush(stderr);
+}
+
+/**
+ * log_counts(): Warnings and errors logged so far in the calling thread's context.
+ *
+ * arguments:
+ *  int *warnings (receives the warning count; may be NULL)
+ *  int *errors (receives the error count, fatal errors included; may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void log_counts(int *warnings, int *errors) {
+    struct logger_state *logger = current_logger();
+    if (warnings)
+        *warnings = __atomic_load_n(&logger->warnings, __ATOMIC_RELAXED);
+    if (errors)
+        *errors = __atomic_load_n(&logger->errors, __ATOMIC_RELAXED);
 }
 
 /**
@@ -119,15 +525,10 @@ static FILE* get_output_stream(log_level_t level) {
 void log_debug(const char *format, ...) {
     if (!should_log(LOG_DEBUG)) return;
 
-    FILE *stream = get_output_stream(LOG_DEBUG);
     va_list args;
-
-    fprintf(stream, "%s", LOG_PREFIXES[LOG_DEBUG]);
     va_start(args, format);
-    vfprintf(stream, format, args);
+    log_message(LOG_DEBUG, LOG_RECORD_LINE, format, args);
     va_end(args);
-    fprintf(stream, "\n");
-    fflush(stream);
 }
 
 /**
@@ -143,15 +544,10 @@ void log_debug(const char *format, ...) {
 void log_info(const char *format, ...) {
     if (!should_log(LOG_INFO)) return;
 
-    FILE *stream = get_output_stream(LOG_INFO);
     va_list args;
-
-    fprintf(stream, "%s", LOG_PREFIXES[LOG_INFO]);
     va_start(args, format);
-    vfprintf(stream, format, args);
+    log_message(LOG_INFO, LOG_RECORD_LINE, format, args);
     va_end(args);
-    fprintf(stream, "\n");
-    fflush(stream);
 }
 
 /**
@@ -167,17 +563,12 @@ void log_info(const char *format, ...) {
 void log_warn(const char *format, ...) {
     if (!should_log(LOG_WARN)) return;
 
-    FILE *stream = get_output_stream(LOG_WARN);
-    va_list args;
-
     // for convenience we just use the variadic vprintf() here and in other core logging functions,
-    // hence the va_start() stuff 
-    fprintf(stream, "%s", LOG_PREFIXES[LOG_WARN]);
+    // hence the va_start() stuff
+    va_list args;
     va_start(args, format);
-    vfprintf(stream, format, args);
+    log_message(LOG_WARN, LOG_RECORD_LINE, format, args);
     va_end(args);
-    fprintf(stream, "\n");
-    fflush(stream);
 }
 
 /**
@@ -193,19 +584,15 @@ void log_warn(const char *format, ...) {
 void log_error(const char *format, ...) {
     if (!should_log(LOG_ERROR)) return;
 
-    FILE *stream = get_output_stream(LOG_ERROR);
     va_list args;
-
-    fprintf(stream, "%s", LOG_PREFIXES[LOG_ERROR]);
     va_start(args, format);
-    vfprintf(stream, format, args);
+    log_message(LOG_ERROR, LOG_RECORD_LINE, format, args);
     va_end(args);
-    fprintf(stream, "\n");
-    fflush(stream);
 }
 
 /**
- * log_fatal(): Log a fatal error message.
+ * log_fatal(): Log a fatal error message. Waits until it's written, since the caller is
+ * usually about to exit.
  *
  * arguments:
  *  const char *format (printf-style format string)
@@ -217,15 +604,51 @@ void log_error(const char *format, ...) {
 void log_fatal(const char *format, ...) {
     if (!should_log(LOG_FATAL)) return;
 
-    FILE *stream = get_output_stream(LOG_FATAL);
     va_list args;
-
-    fprintf(stream, "%s", LOG_PREFIXES[LOG_FATAL]);
     va_start(args, format);
-    vfprintf(stream, format, args);
+    log_message(LOG_FATAL, LOG_RECORD_LINE, format, args);
     va_end(args);
-    fprintf(stream, "\n");
-    fflush(stream);
+    log_flush();
+}
+
+/**
+ * log_progress(): Show a progress bar for a long loop, like
+ * "=> [#########...............] 120/300 pages", redrawn in place on a terminal.
+ * Call it for every item: updates closer together than LOG_PROGRESS_INTERVAL_MS are
+ * dropped before anything is formatted. The last one (done == total) is always shown and
+ * ends the line; that's also the only one a log file, a sink or JSON output gets.
+ *
+ * arguments:
+ *  const char *label (what's being counted, like "pages")
+ *  int done (items finished so far)
+ *  int total (items in all)
+ *
+ * returns:
+ *  void
+ */
+void log_progress(const char *label, int done, int total) {
+    if (!should_log(LOG_INFO)) return;
+
+    bool finished = done >= total;
+    struct logger_state *logger = current_logger();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!finished) {
+        long elapsed_ms = (now.tv_sec - logger->progress_shown.tv_sec) * 1000L +
+                          (now.tv_nsec - logger->progress_shown.tv_nsec) / 1000000L;
+        if (elapsed_ms < LOG_PROGRESS_INTERVAL_MS)
+            return;
+    }
+    logger->progress_shown = now;
+
+    char bar[LOG_PROGRESS_WIDTH + 1];
+    int filled = total > 0 ? (int)((long long)done * LOG_PROGRESS_WIDTH / total) : LOG_PROGRESS_WIDTH;
+    for (int i = 0; i < LOG_PROGRESS_WIDTH; i++)
+        bar[i] = i < filled ? '#' : '.';
+    bar[LOG_PROGRESS_WIDTH] = '\0';
+
+    log_message_f(LOG_INFO, finished ? LOG_RECORD_PROGRESS_END : LOG_RECORD_PROGRESS,
+                  "[%s] %d/%d %s", bar, done, total, label);
 }
 
 /**
@@ -241,15 +664,10 @@ void log_fatal(const char *format, ...) {
 void log_info_w(const wchar_t *format, ...) {
     if (!should_log(LOG_INFO)) return;
 
-    FILE *stream = get_output_stream(LOG_INFO);
     va_list args;
-
-    fwprintf(stream, L"%ls", LOG_PREFIXES_W[LOG_INFO]);
     va_start(args, format);
-    vfwprintf(stream, format, args);
+    log_message_w(LOG_INFO, format, args);
     va_end(args);
-    fwprintf(stream, L"\n");
-    fflush(stream);
 }
 
 /**
@@ -265,15 +683,10 @@ void log_info_w(const wchar_t *format, ...) {
 void log_warn_w(const wchar_t *format, ...) {
     if (!should_log(LOG_WARN)) return;
 
-    FILE *stream = get_output_stream(LOG_WARN);
     va_list args;
-
-    fwprintf(stream, L"%ls", LOG_PREFIXES_W[LOG_WARN]);
     va_start(args, format);
-    vfwprintf(stream, format, args);
+    log_message_w(LOG_WARN, format, args);
     va_end(args);
-    fwprintf(stream, L"\n");
-    fflush(stream);
 }
 
 /**
@@ -289,15 +702,10 @@ void log_warn_w(const wchar_t *format, ...) {
 void log_error_w(const wchar_t *format, ...) {
     if (!should_log(LOG_ERROR)) return;
 
-    FILE *stream = get_output_stream(LOG_ERROR);
     va_list args;
-
-    fwprintf(stream, L"%ls", LOG_PREFIXES_W[LOG_ERROR]);
     va_start(args, format);
-    vfwprintf(stream, format, args);
+    log_message_w(LOG_ERROR, format, args);
     va_end(args);
-    fwprintf(stream, L"\n");
-    fflush(stream);
 }
 
 /**
@@ -310,14 +718,11 @@ void log_error_w(const wchar_t *format, ...) {
  *  void
  */
 void log_system_error(const char *context) {
+    int error = errno;  // before should_log() (which may allocate) can touch it
     if (!should_log(LOG_ERROR)) return;
 
-    FILE *stream = get_output_stream(LOG_ERROR);
-
-    if (context && strlen(context) > 0) {
-        fprintf(stream, "%s%s: %s\n", LOG_PREFIXES[LOG_ERROR], context, strerror(errno));
-    } else {
-        fprintf(stream, "%s%s\n", LOG_PREFIXES[LOG_ERROR], strerror(errno));
-    }
-    fflush(stream);
-}
\ No newline at end of file
+    if (context && strlen(context) > 0)
+        log_message_f(LOG_ERROR, LOG_RECORD_LINE, "%s: %s", context, strerror(error));
+    else
+        log_message_f(LOG_ERROR, LOG_RECORD_LINE, "%s", strerror(error));
+}
@@ -36,6 +36,8 @@ typedef struct {
     int code;
     int underline;
     int indent_level;
+    bool has_gallery;   // emitted a !!(dir) gallery (the page needs the lightbox)
+    pp_link_list *links;    // link and image targets are recorded here (may be NULL)
 } md_parser_state;
 
 
@@ -324,6 +326,8 @@ void md_inline(wchar_t *original, safe_buffer *output, md_parser_state *state) {
 			wcsncpy(link_url, original + start, link_url_length);
 			link_url[link_url_length] = L'\0';
 
+			link_list_add(state->links, link_url, false);
+
 			// Construct the <a> tag using the HTML function
 			wchar_t *link_tag = html_link(link_url, link_text, NULL, false);
 			if (link_tag) {
@@ -446,6 +450,9 @@ void md_inline(wchar_t *original, safe_buffer *output, md_parser_state *state) {
 					continue;
 				} 
 
+				if (image_url)
+					link_list_add(state->links, image_url, true);
+
 				// Construct the image tag, using caption if available
 				wchar_t *image_tag = html_image_with_caption(image_url, alt_text, caption, L"post");
 				if (image_tag) {
@@ -489,11 +496,13 @@ void md_inline(wchar_t *original, safe_buffer *output, md_parser_state *state) {
 					wcsncpy(dir_path, original + start, dir_path_length);
 					dir_path[dir_path_length] = L'\0';
 
-					// Generate gallery HTML
+					// Queue thumbnails for this gallery, then generate gallery HTML
+					queue_gallery_thumbnails(dir_path);
 					wchar_t *gallery_html = html_image_gallery(dir_path, L"gallery");
 					if (gallery_html) {
 						safe_append(gallery_html, output);
 						free(gallery_html);
+						state->has_gallery = true;
 					}
 
 					free(dir_path);
@@ -524,11 +533,13 @@ void md_inline(wchar_t *original, safe_buffer *output, md_parser_state *state) {
  *
  * arguments:
  *  wchar_t *input (entire Markdown document as a single wide string; must not be NULL)
+ *  bool *has_gallery (set if the document contains a !!(dir) gallery; may be NULL)
+ *  pp_link_list *links (receives link and image targets, for pragma_links.c; may be NULL)
  *
  * returns:
  *  wchar_t* (heap-allocated HTML output buffer; caller must free)
  */
-wchar_t* parse_markdown(wchar_t *input) {
+wchar_t* parse_markdown(wchar_t *input, bool *has_gallery, pp_link_list *links) {
 	if (!input)
 		return NULL;
 
@@ -540,6 +551,7 @@ wchar_t* parse_markdown(wchar_t *input) {
 
 	// Initialize parser state
 	md_parser_state state = {0};
+	state.links = links;
 
 	// placemarkers while parsing out the line
   	wchar_t *s, *e;
@@ -684,6 +696,9 @@ wchar_t* parse_markdown(wchar_t *input) {
 		safe_append(L"</u>", &output);
 	
 	// Return the buffer, caller is responsible for freeing
+	if (has_gallery)
+		*has_gallery = state.has_gallery;
+
 	wchar_t *result = output.buffer;
 	// Don't free the buffer since we're returning it
 	output.buffer = NULL;
@@ -0,0 +1,381 @@
+/**
+ * pragma_minify.c - HTML minification for the output write stage (and CSS for inlining)
+ *
+ * minify_html() makes a single pass over a rendered page and produces the UTF-8 bytes that
+ * go to disk, so minifying costs no extra whole-document copy: the minifier *is* the
+ * wide-to-narrow conversion for HTML outputs when `minify:yes` is set.
+ *
+ * What it does:
+ * - collapses whitespace runs in text to a single character (a newline if the run had one,
+ *   otherwise a space) and drops leading whitespace;
+ * - collapses whitespace inside tags, leaving quoted attribute values alone;
+ * - strips comments, except IE-style conditional comments (<!--[if ...]>);
+ * - copies <pre>, <code>, <textarea>, <script> and <style> elements verbatim.
+ *
+ * It never removes whitespace outright between two pieces of text or inline elements, so
+ * rendering is unchanged.
+ *
+ * minify_css() does the same for the stylesheet when it's inlined into pages
+ * (`css_inline:yes`).
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define MINIFY_TAG_NAME_MAX	16
+
+// Elements whose contents are copied byte-for-byte
+static const wchar_t *VERBATIM_ELEMENTS[] = {
+	L"pre", L"code", L"textarea", L"script", L"style"
+};
+
+// Growing UTF-8 output buffer
+typedef struct {
+	char *bytes;
+	size_t used;
+	size_t size;
+	bool failed;
+} byte_sink;
+
+/**
+ * sink_reserve(): Make room for `extra` more bytes (plus a terminator).
+ */
+static bool sink_reserve(byte_sink *sink, size_t extra) {
+	if (sink->failed)
+		return false;
+	if (sink->used + extra + 1 <= sink->size)
+		return true;
+
+	size_t new_size = sink->size * 2;
+	while (new_size < sink->used + extra + 1)
+		new_size *= 2;
+
+	char *grown = realloc(sink->bytes, new_size);
+	if (!grown) {
+		sink->failed = true;
+		return false;
+	}
+	sink->bytes = grown;
+	sink->size = new_size;
+	return true;
+}
+
+/**
+ * sink_put(): Encode one character into the sink. ASCII goes straight through; anything
+ * else is encoded as UTF-8 by utf8_encode_char(), same as char_convert().
+ */
+static void sink_put(byte_sink *sink, wchar_t c) {
+	if (c >= 0 && c < 0x80) {
+		if (sink_reserve(sink, 1))
+			sink->bytes[sink->used++] = (char)c;
+		return;
+	}
+
+	if (!sink_reserve(sink, 4))
+		return;
+	size_t n = utf8_encode_char(c, sink->bytes + sink->used);
+	if (n == 0) {
+		sink->failed = true;
+		return;
+	}
+	sink->used += n;
+}
+
+/**
+ * sink_put_range(): Encode characters [start, end) into the sink.
+ */
+static void sink_put_range(byte_sink *sink, const wchar_t *start, const wchar_t *end) {
+	for (const wchar_t *p = start; p < end && !sink->failed; p++)
+		sink_put(sink, *p);
+}
+
+static bool is_space(wchar_t c) {
+	return c == L' ' || c == L'\t' || c == L'\n' || c == L'\r' || c == L'\f';
+}
+
+static bool is_name_char(wchar_t c) {
+	return iswalnum(c) || c == L'-' || c == L':';
+}
+
+/**
+ * is_verbatim_element(): True if `name` (lowercase) is an element whose contents must be
+ * preserved exactly.
+ */
+static bool is_verbatim_element(const wchar_t *name) {
+	for (size_t i = 0; i < SIZE_OF(VERBATIM_ELEMENTS); i++)
+		if (wcscmp(name, VERBATIM_ELEMENTS[i]) == 0)
+			return true;
+	return false;
+}
+
+/**
+ * find_close_tag(): Find "</name" (case-insensitive) at or after `p`.
+ *
+ * returns:
+ *  const wchar_t* (position of the '<'; the terminating NUL if there's no closing tag)
+ */
+static const wchar_t* find_close_tag(const wchar_t *p, const wchar_t *name) {
+	size_t len = wcslen(name);
+	for (; *p; p++) {
+		if (p[0] != L'<' || p[1] != L'/')
+			continue;
+		size_t i = 0;
+		while (i < len && p[2 + i] && (wchar_t)towlower(p[2 + i]) == name[i])
+			i++;
+		if (i == len && !is_name_char(p[2 + len]))
+			return p;
+	}
+	return p;
+}
+
+/**
+ * copy_tag(): Copy one tag starting at `p` (which points at '<') into the sink, collapsing
+ * whitespace between attributes.
+ *
+ * arguments:
+ *  const wchar_t *p (start of tag)
+ *  byte_sink *sink (output)
+ *  wchar_t *name (receives the lowercased element name; MINIFY_TAG_NAME_MAX wide chars)
+ *  bool *closing (set if this is a closing tag)
+ *  bool *self_closing (set if the tag ends in "/>")
+ *
+ * returns:
+ *  const wchar_t* (position just past the tag)
+ */
+static const wchar_t* copy_tag(const wchar_t *p, byte_sink *sink, wchar_t *name,
+                               bool *closing, bool *self_closing) {
+	size_t name_len = 0;
+	wchar_t quote = 0;
+	wchar_t last = 0;
+	bool pending_space = false;
+
+	*closing = false;
+	*self_closing = false;
+
+	sink_put(sink, *p++);
+	if (*p == L'/') {
+		*closing = true;
+		sink_put(sink, *p++);
+	}
+
+	while (is_name_char(*p)) {
+		if (name_len < MINIFY_TAG_NAME_MAX - 1)
+			name[name_len++] = (wchar_t)towlower(*p);
+		sink_put(sink, *p++);
+	}
+	name[name_len] = L'\0';
+
+	for (; *p; p++) {
+		wchar_t c = *p;
+
+		if (quote) {
+			sink_put(sink, c);
+			if (c == quote)
+				quote = 0;
+			continue;
+		}
+
+		if (is_space(c)) {
+			pending_space = true;
+			continue;
+		}
+
+		if (c == L'>') {
+			// a space before '>' is never significant
+			*self_closing = (last == L'/');
+			sink_put(sink, c);
+			return p + 1;
+		}
+
+		if (pending_space) {
+			sink_put(sink, L' ');
+			pending_space = false;
+		}
+		if (c == L'"' || c == L'\'')
+			quote = c;
+		sink_put(sink, c);
+		last = c;
+	}
+
+	return p; // unterminated tag; copied as-is
+}
+
+/**
+ * minify_html(): Minify an HTML document and encode it as UTF-8 in one pass.
+ *
+ * arguments:
+ *  const wchar_t *html (rendered document; must not be NULL)
+ *  size_t *length (receives the byte length of the result; may be NULL)
+ *
+ * returns:
+ *  char* (heap-allocated, NUL-terminated bytes; NULL on error; caller must free)
+ */
+char* minify_html(const wchar_t *html, size_t *length) {
+	if (!html)
+		return NULL;
+
+	byte_sink sink;
+	memset(&sink, 0, sizeof(sink));
+	sink.size = wcslen(html) + 1; // a good guess for mostly-ASCII pages
+	sink.bytes = malloc(sink.size);
+	if (!sink.bytes) {
+		log_error("malloc() failed in minify_html()");
+		return NULL;
+	}
+
+	const wchar_t *p = html;
+	bool pending_space = false;
+	bool pending_newline = false;
+	bool at_start = true;
+
+	while (*p && !sink.failed) {
+		wchar_t c = *p;
+
+		if (is_space(c)) {
+			pending_space = true;
+			if (c == L'\n')
+				pending_newline = true;
+			p++;
+			continue;
+		}
+
+		// Comments: drop them, but leave surrounding whitespace pending as-is
+		if (c == L'<' && wcsncmp(p, L"<!--", 4) == 0) {
+			const wchar_t *end = wcsstr(p + 4, L"-->");
+			const wchar_t *after = end ? end + 3 : p + wcslen(p);
+			if (p[4] == L'[') {
+				// conditional comment: keep it
+				if (pending_space && !at_start)
+					sink_put(&sink, pending_newline ? L'\n' : L' ');
+				pending_space = pending_newline = false;
+				at_start = false;
+				sink_put_range(&sink, p, after);
+			}
+			p = after;
+			continue;
+		}
+
+		if (pending_space && !at_start)
+			sink_put(&sink, pending_newline ? L'\n' : L' ');
+		pending_space = pending_newline = false;
+		at_start = false;
+
+		bool starts_tag = (c == L'<') && (iswalpha(p[1]) || p[1] == L'/' || p[1] == L'!' || p[1] == L'?');
+		if (!starts_tag) {
+			sink_put(&sink, c);
+			p++;
+			continue;
+		}
+
+		wchar_t name[MINIFY_TAG_NAME_MAX];
+		bool closing, self_closing;
+		p = copy_tag(p, &sink, name, &closing, &self_closing);
+
+		if (!closing && !self_closing && is_verbatim_element(name)) {
+			const wchar_t *end = find_close_tag(p, name);
+			sink_put_range(&sink, p, end);
+			p = end;
+		}
+	}
+
+	if (pending_newline && !at_start)
+		sink_put(&sink, L'\n');
+
+	if (sink.failed) {
+		log_error("conversion failed in minify_html()");
+		free(sink.bytes);
+		return NULL;
+	}
+
+	sink.bytes[sink.used] = '\0';
+	if (length)
+		*length = sink.used;
+	return sink.bytes;
+}
+
+/**
+ * css_is_tight(): True for characters that need no whitespace on either side in CSS.
+ *
+ * (Not ':' -- "a :hover" and "a:hover" are different selectors -- and not '+' or '-',
+ * which calc() needs spaced.)
+ */
+static bool css_is_tight(char c) {
+	return c == '{' || c == '}' || c == ';' || c == ',' || c == '>';
+}
+
+/**
+ * minify_css(): Minify a stylesheet: strip comments, collapse whitespace, drop whitespace
+ * around braces, semicolons, commas and child combinators (and after colons), and drop the
+ * last semicolon in each block. Quoted strings are left alone. Works on UTF-8 bytes.
+ *
+ * arguments:
+ *  const char *css (stylesheet; must not be NULL)
+ *  size_t length (bytes in css)
+ *  size_t *out_length (receives the byte length of the result; may be NULL)
+ *
+ * returns:
+ *  char* (heap-allocated, NUL-terminated result; NULL on error; caller must free)
+ */
+char* minify_css(const char *css, size_t length, size_t *out_length) {
+	if (!css)
+		return NULL;
+
+	char *out = malloc(length + 1);
+	if (!out) {
+		log_error("malloc() failed in minify_css()");
+		return NULL;
+	}
+
+	size_t used = 0;
+	bool pending_space = false;
+	for (size_t i = 0; i < length; i++) {
+		char c = css[i];
+
+		if (c == '/' && i + 1 < length && css[i + 1] == '*') {
+			const char *end = NULL;
+			for (size_t j = i + 2; j + 1 < length; j++) {
+				if (css[j] == '*' && css[j + 1] == '/') {
+					end = css + j;
+					break;
+				}
+			}
+			i = end ? (size_t)(end - css) + 1 : length;
+			pending_space = true;	// a comment separates tokens like whitespace does
+			continue;
+		}
+
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f') {
+			pending_space = true;
+			continue;
+		}
+
+		if (pending_space && used > 0 && !css_is_tight(out[used - 1]) && !css_is_tight(c) &&
+		    out[used - 1] != ':')
+			out[used++] = ' ';
+		pending_space = false;
+
+		if (c == '}' && used > 0 && out[used - 1] == ';')
+			used--;
+
+		if (c == '"' || c == '\'') {
+			// copy the string through its closing quote, honoring backslash escapes
+			out[used++] = c;
+			for (i++; i < length; i++) {
+				out[used++] = css[i];
+				if (css[i] == '\\' && i + 1 < length)
+					out[used++] = css[++i];
+				else if (css[i] == c)
+					break;
+			}
+			continue;
+		}
+
+		out[used++] = c;
+	}
+
+	out[used] = '\0';
+	if (out_length)
+		*out_length = used;
+	return out;
+}
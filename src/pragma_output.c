@@ -0,0 +1,1015 @@
+/**
+ * pragma_output.c - Write stage for generated site files
+ *
+ * Every generated text output (posts, indices, scroll, tag pages, feed.xml) goes through
+ * write_output() (or write_output_rope(), for pages assembled from segments) with a path
+ * relative to the output directory. The write stage:
+ *
+ * - converts the page to UTF-8 once (minifying HTML on the way if `minify:yes` is set; see
+ *   pragma_minify.c) and hashes the bytes;
+ * - skips the write entirely when the bytes match what the previous build produced
+ *   (and the file is still on disk), so unchanged outputs keep their mtimes;
+ * - optionally writes a gzip-compressed sibling (foo.html.gz) for servers that can serve
+ *   precompressed files (nginx gzip_static, etc.). Compression happens on the worker pool
+ *   while the main thread keeps rendering.
+ *
+ * Output hashes are kept in OUTPUT_MANIFEST_FILENAME in the output directory, one line per
+ * output: "<hash> <bytes> <gzip bytes> <relative path>".
+ *
+ * Comparing those hashes also tells us which public URLs changed: CHANGES_FILENAME lists
+ * every output created, changed or deleted by the build, so a deploy can purge just those
+ * URLs from a CDN instead of everything.
+ *
+ * With an archive attached (--tar; see pragma_tar.c) nothing is written to the output
+ * directory: every output, unchanged or not, is appended to the tar stream as it's
+ * committed, gzip siblings right after their files. The output directory is then only
+ * read from, and no manifest or change report is kept.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#define OUTPUT_TABLE_SIZE	4099	// prime; tag-heavy sites produce thousands of outputs
+#define OUTPUT_IOV_BATCH	64	// ranges per writev() call (well under any IOV_MAX)
+
+typedef struct output_entry {
+	char *path;		// relative to the output root
+	uint64_t hash;		// hash of the uncompressed bytes
+	size_t bytes;
+	size_t gz_bytes;	// 0 if no compressed sibling was written
+	bool seen;		// produced (written or skipped) during this build
+	bool previous;		// listed in the previous build's manifest
+	bool written;		// bytes changed (or are new) this build
+	struct output_entry *next;
+} output_entry;
+
+// Write stage state for the current build
+static struct output_state {
+	char *root;		// output directory, with trailing slash
+	char *base_url;		// public URL of the output root, for the change report
+	bool precompress;
+	int gzip_level;
+	bool minify;
+	output_entry *buckets[OUTPUT_TABLE_SIZE];
+	pthread_mutex_t lock;	// guards gz_bytes, which compression jobs fill in
+	int written;
+	int unchanged;
+	pp_tar *archive;	// outputs go here instead of into files (kept across builds)
+	bool initialized;
+} g_output = { .initialized = false };
+
+/**
+ * current_output(): The write stage for the calling thread's context (g_output in the pragma binary).
+ */
+static struct output_state* current_output(void) {
+	return context_state(CONTEXT_OUTPUT, &g_output, sizeof(g_output));
+}
+
+// Compression job handed to the worker pool; owns everything it points to except entry
+typedef struct gzip_job {
+	char *gz_path;
+	char *bytes;
+	size_t length;
+	int level;
+	output_entry *entry;
+} gzip_job;
+
+/**
+ * path_bucket(): Hash a relative output path into the entry table.
+ */
+static unsigned int path_bucket(const char *path) {
+	return (unsigned int)(hash_bytes(path, strlen(path)) % OUTPUT_TABLE_SIZE);
+}
+
+/**
+ * find_entry(): Look up an output by relative path.
+ *
+ * returns:
+ *  output_entry* (entry; NULL if this path hasn't been seen before)
+ */
+static output_entry* find_entry(const char *path) {
+	for (output_entry *e = current_output()->buckets[path_bucket(path)]; e != NULL; e = e->next)
+		if (strcmp(e->path, path) == 0)
+			return e;
+	return NULL;
+}
+
+/**
+ * add_entry(): Insert a new output into the entry table.
+ *
+ * returns:
+ *  output_entry* (new entry; NULL on allocation failure)
+ */
+static output_entry* add_entry(const char *path) {
+	output_entry *e = calloc(1, sizeof(output_entry));
+	if (!e)
+		return NULL;
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		return NULL;
+	}
+	unsigned int b = path_bucket(path);
+	e->next = current_output()->buckets[b];
+	current_output()->buckets[b] = e;
+	return e;
+}
+
+/**
+ * file_exists(): True if `path` names an existing regular file.
+ */
+static bool file_exists(const char *path) {
+	struct stat st;
+	return utf8_stat((utf8_path)path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * is_html_path(): True if an output path names an HTML file (the only outputs we minify).
+ */
+static bool is_html_path(const char *path) {
+	const char *dot = strrchr(path, '.');
+	return dot && strcmp(dot, ".html") == 0;
+}
+
+/**
+ * is_compressible_path(): True for text formats worth precompressing. Images and other
+ * already-compressed formats don't get a .gz sibling.
+ */
+static bool is_compressible_path(const char *path) {
+	static const char *extensions[] = { ".html", ".xml", ".css", ".js", ".svg", ".json", ".txt" };
+	const char *dot = strrchr(path, '.');
+	if (!dot)
+		return false;
+	for (size_t i = 0; i < SIZE_OF(extensions); i++)
+		if (strcmp(dot, extensions[i]) == 0)
+			return true;
+	return false;
+}
+
+/**
+ * manifest_path(): Full path of the output manifest. Caller must free().
+ */
+static char* manifest_path(void) {
+	size_t len = strlen(current_output()->root) + strlen(OUTPUT_MANIFEST_FILENAME) + 1;
+	char *path = malloc(len);
+	if (path)
+		snprintf(path, len, "%s%s", current_output()->root, OUTPUT_MANIFEST_FILENAME);
+	return path;
+}
+
+/**
+ * load_manifest(): Read the previous build's output hashes, if any.
+ */
+static void load_manifest(void) {
+	char *path = manifest_path();
+	if (!path)
+		return;
+
+	FILE *file = utf8_fopen(path, "r");
+	free(path);
+	if (!file)
+		return; // first build into this directory
+
+	char line[MAX_LINE_LENGTH];
+	while (fgets(line, sizeof(line), file)) {
+		strip_terminal_newline(NULL, line);
+
+		char *cursor = line;
+		char *end;
+		uint64_t hash = strtoull(cursor, &end, 16);
+		if (end == cursor || *end != ' ') continue;
+		cursor = end + 1;
+		size_t bytes = strtoull(cursor, &end, 10);
+		if (end == cursor || *end != ' ') continue;
+		cursor = end + 1;
+		size_t gz_bytes = strtoull(cursor, &end, 10);
+		if (end == cursor || *end != ' ') continue;
+		cursor = end + 1;
+		if (*cursor == '\0') continue;
+
+		output_entry *e = find_entry(cursor);
+		if (!e)
+			e = add_entry(cursor);
+		if (!e)
+			continue;
+		e->hash = hash;
+		e->bytes = bytes;
+		e->gz_bytes = gz_bytes;
+		e->previous = true;
+	}
+	fclose(file);
+}
+
+/**
+ * save_manifest(): Write hashes for this build's outputs. Entries from earlier builds that
+ * weren't produced this time are kept as long as the file is still on disk (e.g. posts
+ * that a -u run didn't reload).
+ */
+static void save_manifest(void) {
+	char *path = manifest_path();
+	if (!path)
+		return;
+
+	FILE *file = utf8_fopen(path, "w");
+	if (!file) {
+		log_error("can't write output manifest %s", path);
+		free(path);
+		return;
+	}
+	free(path);
+
+	for (int i = 0; i < OUTPUT_TABLE_SIZE; i++) {
+		for (output_entry *e = current_output()->buckets[i]; e != NULL; e = e->next) {
+			if (!e->seen) {
+				char *full_path = output_full_path(e->path);
+				bool still_there = full_path && file_exists(full_path);
+				free(full_path);
+				if (!still_there)
+					continue;
+			}
+			fprintf(file, "%016llx %zu %zu %s\n", (unsigned long long)e->hash,
+				e->bytes, e->gz_bytes, e->path);
+		}
+	}
+	fclose(file);
+}
+
+/**
+ * make_parent_dirs(): Create the directories above `path` that are missing, below the
+ * output root (outputs like search/ and api/t/ don't exist in a fresh output directory).
+ */
+static void make_parent_dirs(const char *path) {
+	char *copy = strdup(path);
+	if (!copy)
+		return;
+	size_t root_len = strlen(current_output()->root);
+	for (char *slash = strchr(copy + root_len, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		utf8_mkdir((utf8_path)copy, 0755);
+		*slash = '/';
+	}
+	free(copy);
+}
+
+/**
+ * write_parts(): Write a list of byte ranges to `path` with writev(), truncating any
+ * existing file. Pages arrive as segments (pragma_rope.c) and are never joined up.
+ *
+ * arguments:
+ *  const char *path (full path)
+ *  const struct iovec *parts (byte ranges, in order)
+ *  int count (number of ranges)
+ *
+ * returns:
+ *  int (0 on success; -1 on error)
+ */
+static int write_parts(const char *path, const struct iovec *parts, int count) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 && strncmp(path, current_output()->root, strlen(current_output()->root)) == 0) {
+		make_parent_dirs(path);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+	if (fd < 0) {
+		log_error("Unable to open %s for writing!", path);
+		return -1;
+	}
+
+	// writev() may stop short (and takes at most IOV_MAX ranges), so keep going from
+	// wherever it left off
+	struct iovec pending[OUTPUT_IOV_BATCH];
+	int next = 0;
+	size_t offset = 0;	// bytes of parts[next] already written
+	bool failed = false;
+	while (next < count && !failed) {
+		int batch = 0;
+		for (int i = next; i < count && batch < OUTPUT_IOV_BATCH; i++, batch++) {
+			pending[batch] = parts[i];
+			if (i == next) {
+				pending[batch].iov_base = (char*)parts[i].iov_base + offset;
+				pending[batch].iov_len -= offset;
+			}
+		}
+		ssize_t written = writev(fd, pending, batch);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			failed = true;
+			break;
+		}
+		size_t left = (size_t)written;
+		while (next < count && left >= parts[next].iov_len - offset) {
+			left -= parts[next].iov_len - offset;
+			offset = 0;
+			next++;
+		}
+		offset += left;
+	}
+
+	if (close(fd) != 0 || failed) {
+		log_error("Unable to write %s!", path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * write_bytes(): Write a byte buffer to `path`, truncating any existing file.
+ */
+static int write_bytes(const char *path, const char *bytes, size_t length) {
+	struct iovec part = { (void*)bytes, length };
+	return write_parts(path, &part, 1);
+}
+
+/**
+ * gzip_bytes(): Compress a buffer into gzip format. zlib writes a zero mtime into the
+ * wrapper, so the result is reproducible.
+ *
+ * arguments:
+ *  const char *bytes (data to compress)
+ *  size_t length (bytes in data)
+ *  int level (zlib compression level)
+ *  size_t *gz_length (receives the compressed length)
+ *  const char *name (path for error messages)
+ *
+ * returns:
+ *  char* (heap-allocated compressed data; NULL on error; caller must free)
+ */
+static char* gzip_bytes(const char *bytes, size_t length, int level, size_t *gz_length, const char *name) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	// windowBits 15 + 16 => gzip wrapper
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		log_error("can't initialize zlib for %s", name);
+		return NULL;
+	}
+
+	uLong bound = deflateBound(&zs, (uLong)length);
+	char *out = malloc(bound);
+	if (out) {
+		zs.next_in = (Bytef*)bytes;
+		zs.avail_in = (uInt)length;
+		zs.next_out = (Bytef*)out;
+		zs.avail_out = (uInt)bound;
+		if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+			*gz_length = zs.total_out;
+		} else {
+			log_error("gzip compression failed for %s", name);
+			free(out);
+			out = NULL;
+		}
+	}
+	deflateEnd(&zs);
+	return out;
+}
+
+/**
+ * gzip_output_job(): Worker job: gzip one output's bytes into its .gz sibling.
+ *
+ * arguments:
+ *  void *arg (gzip_job*, freed here)
+ */
+static void gzip_output_job(void *arg) {
+	gzip_job *job = arg;
+	size_t gz_length = 0;
+
+	char *out = gzip_bytes(job->bytes, job->length, job->level, &gz_length, job->gz_path);
+	if (out && write_bytes(job->gz_path, out, gz_length) != 0)
+		gz_length = 0;
+	free(out);
+
+	pthread_mutex_lock(&current_output()->lock);
+	job->entry->gz_bytes = gz_length;
+	pthread_mutex_unlock(&current_output()->lock);
+
+	free(job->gz_path);
+	free(job->bytes);
+	free(job);
+}
+
+/**
+ * compare_lines(): qsort comparator for the change report's lines.
+ */
+static int compare_lines(const void *a, const void *b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * add_change(): Add "<status> <url>" lines for one output to the change report. Directory
+ * indexes ("t/index.html") are reported under both of their URLs ("t/" too).
+ *
+ * returns:
+ *  int (number of lines added)
+ */
+static int add_change(char **lines, int at, const char *status, const char *path) {
+	const char *base = current_output()->base_url ? current_output()->base_url : "/";
+	bool slash = strlen(base) > 0 && base[strlen(base) - 1] == '/';
+	int added = 0;
+
+	size_t len = strlen(status) + strlen(base) + strlen(path) + 3;
+	lines[at] = malloc(len);
+	if (lines[at]) {
+		snprintf(lines[at], len, "%s %s%s%s", status, base, slash ? "" : "/", path);
+		added++;
+	}
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	if (strcmp(name, "index.html") == 0) {
+		lines[at + added] = malloc(len);
+		if (lines[at + added]) {
+			snprintf(lines[at + added], len, "%s %s%s%.*s", status, base, slash ? "" : "/",
+			         (int)(name - path), path);
+			added++;
+		}
+	}
+	return added;
+}
+
+/**
+ * save_change_report(): Write CHANGES_FILENAME: the public URL of every output that was
+ * created, changed or deleted since the previous build, one "<status> <url>" line each,
+ * for targeted CDN invalidation. Outputs the write stage didn't produce (gallery thumbnails)
+ * aren't listed.
+ *
+ * returns:
+ *  int (number of URLs listed)
+ */
+static int save_change_report(void) {
+	int capacity = 0;
+	for (int i = 0; i < OUTPUT_TABLE_SIZE; i++)
+		for (output_entry *e = current_output()->buckets[i]; e != NULL; e = e->next)
+			capacity += 2;
+
+	char **lines = malloc((capacity > 0 ? capacity : 1) * sizeof(char*));
+	if (!lines)
+		return 0;
+
+	int count = 0;
+	for (int i = 0; i < OUTPUT_TABLE_SIZE; i++) {
+		for (output_entry *e = current_output()->buckets[i]; e != NULL; e = e->next) {
+			const char *status = NULL;
+			if (e->written) {
+				status = e->previous ? "changed" : "created";
+			} else if (!e->seen && e->previous) {
+				// not produced this time: only a change if the file is gone
+				char *full_path = output_full_path(e->path);
+				if (full_path && !file_exists(full_path))
+					status = "deleted";
+				free(full_path);
+			}
+			if (status)
+				count += add_change(lines, count, status, e->path);
+		}
+	}
+	qsort(lines, count, sizeof(char*), compare_lines);
+
+	size_t len = strlen(current_output()->root) + strlen(CHANGES_FILENAME) + 1;
+	char *path = malloc(len);
+	FILE *file = NULL;
+	if (path) {
+		snprintf(path, len, "%s%s", current_output()->root, CHANGES_FILENAME);
+		file = utf8_fopen(path, "w");
+		if (!file)
+			log_error("can't write change report %s", path);
+	}
+	for (int i = 0; i < count; i++) {
+		if (file)
+			fprintf(file, "%s\n", lines[i]);
+		free(lines[i]);
+	}
+	if (file)
+		fclose(file);
+	free(path);
+	free(lines);
+	return count;
+}
+
+/**
+ * output_stage_init(): Prepare the write stage for a build into `output_dir`.
+ *
+ * arguments:
+ *  const char *output_dir (output directory; must not be NULL)
+ *  site_info *site (site configuration, for precompression settings; must not be NULL)
+ *
+ * returns:
+ *  int (0 on success; -1 if out of memory, in which case nothing may be written)
+ */
+int output_stage_init(const char *output_dir, site_info *site) {
+	if (current_output()->initialized)
+		output_stage_finish();
+
+	size_t len = strlen(output_dir);
+	current_output()->root = malloc(len + 2);
+	if (!current_output()->root) {
+		log_error("can't allocate memory for output path");
+		return -1;
+	}
+	strcpy(current_output()->root, output_dir);
+	if (len == 0 || output_dir[len - 1] != '/')
+		strcat(current_output()->root, "/");
+
+	current_output()->precompress = site ? site->precompress : false;
+	current_output()->gzip_level = site ? site->gzip_level : Z_DEFAULT_COMPRESSION;
+	current_output()->minify = site ? site->minify : false;
+	current_output()->base_url = (site && site->base_url) ? char_convert(site->base_url) : NULL;
+	memset(current_output()->buckets, 0, sizeof(current_output()->buckets));
+	current_output()->written = 0;
+	current_output()->unchanged = 0;
+	pthread_mutex_init(&current_output()->lock, NULL);
+	current_output()->initialized = true;
+
+	if (!current_output()->archive)
+		load_manifest();
+	return 0;
+}
+
+/**
+ * output_stage_archive(): Send outputs into a tar stream instead of the output directory,
+ * for this and later builds (the pragma binary's --tar). Outputs are added in the order
+ * they're committed, which is always on the thread running the build.
+ *
+ * arguments:
+ *  pp_tar *archive (open archive, or NULL to write files again; the caller closes it)
+ *
+ * returns:
+ *  void
+ */
+void output_stage_archive(pp_tar *archive) {
+	current_output()->archive = archive;
+}
+
+/**
+ * output_stage_archiving(): True if outputs are going into a tar stream, so the output
+ * directory must be left alone (nothing there is pruned or rewritten).
+ *
+ * returns:
+ *  bool (true while an archive is attached)
+ */
+bool output_stage_archiving(void) {
+	return current_output()->archive != NULL;
+}
+
+/**
+ * output_full_path(): Join a relative output path onto the output root.
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory, like "c/foo.html")
+ *
+ * returns:
+ *  char* (heap-allocated path; NULL on error; caller must free)
+ */
+char* output_full_path(const char *relative_path) {
+	if (!current_output()->root || !relative_path)
+		return NULL;
+
+	while (*relative_path == '/')
+		relative_path++;
+
+	size_t len = strlen(current_output()->root) + strlen(relative_path) + 1;
+	char *path = malloc(len);
+	if (path)
+		snprintf(path, len, "%s%s", current_output()->root, relative_path);
+	return path;
+}
+
+/**
+ * join_parts(): Copy byte ranges into one new buffer (NUL-terminated).
+ */
+static char* join_parts(const struct iovec *parts, int count, size_t length) {
+	char *bytes = malloc(length + 1);
+	if (!bytes)
+		return NULL;
+	size_t at = 0;
+	for (int i = 0; i < count; i++) {
+		memcpy(bytes + at, parts[i].iov_base, parts[i].iov_len);
+		at += parts[i].iov_len;
+	}
+	bytes[at] = '\0';
+	return bytes;
+}
+
+/**
+ * archive_output(): commit_output() for an archive build: add the bytes to the tar stream,
+ * and with precompress:yes a gzip copy right after them. Nothing is skipped, since the
+ * archive has to hold the whole site.
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory, without leading slash)
+ *  const struct iovec *parts (the output's bytes, in order; the caller keeps them)
+ *  int count (number of ranges)
+ *  size_t length (total bytes)
+ *  uint64_t hash (hash of the bytes)
+ *  bool compress (add a .gz copy)
+ *  char *bytes (the same bytes in one buffer, or NULL; freed here)
+ *
+ * returns:
+ *  int (0 on success; -1 on error)
+ */
+static int archive_output(const char *relative_path, const struct iovec *parts, int count,
+                          size_t length, uint64_t hash, bool compress, char *bytes) {
+	if (tar_add(current_output()->archive, relative_path, parts, count) != 0) {
+		log_error("Unable to add %s to the archive!", relative_path);
+		free(bytes);
+		return -1;
+	}
+	current_output()->written++;
+
+	output_entry *entry = find_entry(relative_path);
+	if (!entry)
+		entry = add_entry(relative_path);
+	if (entry) {
+		entry->hash = hash;
+		entry->bytes = length;
+		entry->gz_bytes = 0;
+		entry->seen = true;
+		entry->written = true;
+	}
+
+	if (compress && !bytes)
+		bytes = join_parts(parts, count, length);
+	char *gz_path = (compress && bytes) ? malloc(strlen(relative_path) + 4) : NULL;
+	if (gz_path) {
+		sprintf(gz_path, "%s.gz", relative_path);
+		size_t gz_length = 0;
+		char *gz = gzip_bytes(bytes, length, current_output()->gzip_level, &gz_length, gz_path);
+		struct iovec part = { gz, gz_length };
+		if (gz && tar_add(current_output()->archive, gz_path, &part, 1) == 0 && entry)
+			entry->gz_bytes = gz_length;
+		free(gz);
+		free(gz_path);
+	}
+	free(bytes);
+	return 0;
+}
+
+/**
+ * commit_output(): Write finished bytes for one output, unless they match the last build.
+ * Queues a gzip job for compressible outputs when precompression is enabled.
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory, without leading slash)
+ *  const struct iovec *parts (the output's bytes, in order; the caller keeps them)
+ *  int count (number of ranges)
+ *  char *bytes (the same bytes in one buffer, if the caller has that, or NULL; ownership
+ *   passes to this function)
+ *
+ * returns:
+ *  int (0 on success, including skipped writes; -1 on error)
+ */
+static int commit_output(const char *relative_path, const struct iovec *parts, int count, char *bytes) {
+	size_t length = 0;
+	uint64_t hash = HASH_SEED;
+	for (int i = 0; i < count; i++) {
+		hash = hash_update(hash, parts[i].iov_base, parts[i].iov_len);
+		length += parts[i].iov_len;
+	}
+	bool compress = current_output()->precompress && is_compressible_path(relative_path);
+
+	// Page weights are measured whether or not the file needs writing
+	if (is_html_path(relative_path))
+		budget_measure(relative_path, parts, count, length);
+
+	if (current_output()->archive)
+		return archive_output(relative_path, parts, count, length, hash, compress, bytes);
+
+	char *full_path = output_full_path(relative_path);
+	char *gz_path = full_path ? malloc(strlen(full_path) + 4) : NULL;
+	if (!full_path || !gz_path) {
+		log_error("can't allocate memory for output path %s", relative_path);
+		free(full_path);
+		free(bytes);
+		return -1;
+	}
+	sprintf(gz_path, "%s.gz", full_path);
+
+	output_entry *entry = find_entry(relative_path);
+
+	if (entry && entry->hash == hash && entry->bytes == length && file_exists(full_path) &&
+	    (!compress || file_exists(gz_path))) {
+		// Same bytes as last time: leave the file (and its .gz) alone
+		if (!compress && entry->gz_bytes > 0) {
+			// precompression was switched off since the last build
+			unlink(gz_path);
+			entry->gz_bytes = 0;
+		}
+		entry->seen = true;
+		current_output()->unchanged++;
+		free(bytes);
+		free(full_path);
+		free(gz_path);
+		return 0;
+	}
+
+	if (write_parts(full_path, parts, count) != 0) {
+		free(bytes);
+		free(full_path);
+		free(gz_path);
+		return -1;
+	}
+	current_output()->written++;
+
+	if (!entry)
+		entry = add_entry(relative_path);
+	if (entry) {
+		entry->hash = hash;
+		entry->bytes = length;
+		entry->gz_bytes = 0;
+		entry->seen = true;
+		entry->written = true;
+	}
+
+	// The gzip job outlives the caller's ranges, so it needs its own copy
+	if (compress && entry && !bytes)
+		bytes = join_parts(parts, count, length);
+	gzip_job *job = (compress && entry && bytes) ? malloc(sizeof(gzip_job)) : NULL;
+	if (job) {
+		job->gz_path = gz_path;
+		job->bytes = bytes;
+		job->length = length;
+		job->level = current_output()->gzip_level;
+		job->entry = entry;
+		work_pool_submit(work_pool_get_global(), gzip_output_job, job);
+	} else {
+		// A stale sibling from an earlier precompressed build would be served instead
+		// of the new content, so don't leave one lying around.
+		if (!compress)
+			unlink(gz_path);
+		free(gz_path);
+		free(bytes);
+	}
+
+	free(full_path);
+	return 0;
+}
+
+/**
+ * write_output(): Write one generated output through the write stage.
+ *
+ * Skips the write if the content is byte-identical to the previous build's output and
+ * the file still exists. Otherwise writes the file and, if precompression is enabled,
+ * queues a gzip job for the .gz sibling.
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory, like "c/foo.html")
+ *  const wchar_t *content (rendered output; must not be NULL)
+ *
+ * returns:
+ *  int (0 on success, including skipped writes; -1 on error)
+ */
+int write_output(const char *relative_path, const wchar_t *content) {
+	if (!relative_path || !content)
+		return -1;
+
+	if (!current_output()->initialized) {
+		log_error("write_output() called before output_stage_init()");
+		return -1;
+	}
+
+	while (*relative_path == '/')
+		relative_path++;
+
+	size_t length = 0;
+	char *bytes = (current_output()->minify && is_html_path(relative_path))
+		? minify_html(content, &length)
+		: char_convert(content);
+	if (!bytes) {
+		log_error("Unable to convert content to UTF-8 for %s", relative_path);
+		return -1;
+	}
+	if (length == 0)
+		length = strlen(bytes);
+
+	struct iovec part = { bytes, length };
+	return commit_output(relative_path, &part, 1, bytes);
+}
+
+/**
+ * write_output_rope(): Write a page held as a rope (pragma_rope.c) through the write stage.
+ * Each segment is encoded on its own and the lot goes out in one writev(); with
+ * minify:yes the page is joined first, since the minifier works across segment boundaries.
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory, like "index.html")
+ *  const pp_rope *content (rendered page; must not be NULL)
+ *
+ * returns:
+ *  int (0 on success, including skipped writes; -1 on error)
+ */
+int write_output_rope(const char *relative_path, const pp_rope *content) {
+	if (!relative_path || !content)
+		return -1;
+
+	if (content->failed) {
+		log_error("Unable to assemble %s (out of memory)", relative_path);
+		return -1;
+	}
+
+	if (current_output()->minify && is_html_path(relative_path)) {
+		wchar_t *page = rope_flatten(content);
+		int result = page ? write_output(relative_path, page) : -1;
+		free(page);
+		return result;
+	}
+
+	if (!current_output()->initialized) {
+		log_error("write_output_rope() called before output_stage_init()");
+		return -1;
+	}
+
+	while (*relative_path == '/')
+		relative_path++;
+
+	struct iovec *parts = malloc((content->count > 0 ? content->count : 1) * sizeof(struct iovec));
+	if (!parts) {
+		log_error("can't allocate memory for output %s", relative_path);
+		return -1;
+	}
+
+	int count = 0;
+	int result = 0;
+	for (int i = 0; i < content->count; i++) {
+		const rope_segment *segment = &content->segments[i];
+		if (segment->bytes) {
+			// encoded once per build (pragma_frames.c)
+			parts[count].iov_base = (void*)segment->bytes;
+			parts[count++].iov_len = segment->byte_length;
+			continue;
+		}
+		size_t length = 0;
+		char *bytes = utf8_encode(segment->text, segment->length, &length);
+		if (!bytes) {
+			log_error("Unable to convert content to UTF-8 for %s", relative_path);
+			result = -1;
+			break;
+		}
+		parts[count].iov_base = bytes;
+		parts[count++].iov_len = length;
+	}
+
+	// a lone encoded segment is already the whole page, so commit_output() can have it
+	bool hand_over = result == 0 && count == 1 && !content->segments[0].bytes;
+	if (result == 0)
+		result = commit_output(relative_path, parts, count, hand_over ? parts[0].iov_base : NULL);
+	for (int i = hand_over ? 1 : 0; i < count; i++) {
+		if (!content->segments[i].bytes)
+			free(parts[i].iov_base);
+	}
+	free(parts);
+	return result;
+}
+
+/**
+ * write_output_bytes(): Write a binary (or already-encoded) output through the write stage,
+ * e.g. a copied asset. Same skip/precompress behavior as write_output(); only text formats
+ * get a .gz sibling.
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory)
+ *  const void *data (bytes to write; must not be NULL)
+ *  size_t length (number of bytes)
+ *
+ * returns:
+ *  int (0 on success, including skipped writes; -1 on error)
+ */
+int write_output_bytes(const char *relative_path, const void *data, size_t length) {
+	if (!relative_path || !data)
+		return -1;
+
+	if (!current_output()->initialized) {
+		log_error("write_output_bytes() called before output_stage_init()");
+		return -1;
+	}
+
+	while (*relative_path == '/')
+		relative_path++;
+
+	char *bytes = malloc(length + 1);
+	if (!bytes) {
+		log_error("can't allocate memory for output %s", relative_path);
+		return -1;
+	}
+	memcpy(bytes, data, length);
+	bytes[length] = '\0';
+
+	struct iovec part = { bytes, length };
+	return commit_output(relative_path, &part, 1, bytes);
+}
+
+/**
+ * output_hash(): Content hash of an output produced during this build, for manifests that
+ * list other outputs (the service worker's precache list).
+ *
+ * arguments:
+ *  const char *relative_path (path within the output directory)
+ *  uint64_t *hash (receives the hash of the uncompressed bytes)
+ *
+ * returns:
+ *  bool (false if the path hasn't been written or skipped by this build)
+ */
+bool output_hash(const char *relative_path, uint64_t *hash) {
+	if (!relative_path || !current_output()->initialized)
+		return false;
+
+	while (*relative_path == '/')
+		relative_path++;
+
+	output_entry *e = find_entry(relative_path);
+	if (!e || !e->seen)
+		return false;
+	*hash = e->hash;
+	return true;
+}
+
+/**
+ * output_stage_totals(): Outputs written and left unchanged by the current build, or by
+ * the last one once output_stage_finish() has run.
+ *
+ * arguments:
+ *  int *written (receives the number written; may be NULL)
+ *  int *unchanged (receives the number skipped as unchanged; may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void output_stage_totals(int *written, int *unchanged) {
+	if (written)
+		*written = current_output()->written;
+	if (unchanged)
+		*unchanged = current_output()->unchanged;
+}
+
+/**
+ * release_stage(): Free the write stage's entries and paths.
+ */
+static void release_stage(void) {
+	for (int i = 0; i < OUTPUT_TABLE_SIZE; i++) {
+		output_entry *e = current_output()->buckets[i];
+		while (e) {
+			output_entry *next = e->next;
+			free(e->path);
+			free(e);
+			e = next;
+		}
+		current_output()->buckets[i] = NULL;
+	}
+
+	pthread_mutex_destroy(&current_output()->lock);
+	free(current_output()->root);
+	current_output()->root = NULL;
+	free(current_output()->base_url);
+	current_output()->base_url = NULL;
+	current_output()->initialized = false;
+}
+
+/**
+ * output_stage_finish(): Wait for pending compression jobs, save the output manifest
+ * and release write stage state.
+ *
+ * returns:
+ *  void
+ */
+void output_stage_finish(void) {
+	if (!current_output()->initialized)
+		return;
+
+	work_pool_wait(work_pool_get_global());
+	if (current_output()->archive) {
+		log_info("Added %d output%s to the archive%s%s", current_output()->written,
+			current_output()->written == 1 ? "" : "s",
+			current_output()->minify ? ", minified" : "",
+			current_output()->precompress ? ", with gzip siblings" : "");
+		release_stage();
+		return;
+	}
+
+	int changed = save_change_report();
+	save_manifest();
+
+	log_info("Wrote %d output%s (%d unchanged)%s%s", current_output()->written,
+		current_output()->written == 1 ? "" : "s", current_output()->unchanged,
+		current_output()->minify ? ", minified" : "",
+		current_output()->precompress ? ", with gzip siblings" : "");
+	log_info("%d changed URL%s listed in %s", changed, changed == 1 ? "" : "s", CHANGES_FILENAME);
+
+	release_stage();
+}
+
+/**
+ * output_stage_discard(): Release write stage state without saving the manifest or a
+ * change report, for a stage that only wrote a few supporting files (libpragma sets up
+ * icons and assets this way before the first full build).
+ *
+ * returns:
+ *  void
+ */
+void output_stage_discard(void) {
+	if (!current_output()->initialized)
+		return;
+
+	work_pool_wait(work_pool_get_global());
+	release_stage();
+}
@@ -1,5 +1,39 @@
 #include "pragma_poison.h"
 
+// Page-specific token values, for apply_page_tokens()
+typedef struct page_tokens {
+	wchar_t *description;
+	wchar_t *title;
+	wchar_t *tags;
+	wchar_t *date;
+} page_tokens;
+
+/**
+ * apply_page_tokens(): rope_map() transform that removes the #MORE delimiter and fills in
+ * {DESCRIPTION}, {TITLE}, {TAGS} and {DATE} in one segment of a single page.
+ */
+static wchar_t* apply_page_tokens(const wchar_t *text, void *arg) {
+	page_tokens *tokens = arg;
+	if (!wcschr(text, L'{') && !wcsstr(text, L"#MORE"))
+		return NULL;
+
+	// Remove #MORE delimiter (not a {TOKEN} so use replace_substring)
+	wchar_t *result = replace_substring((wchar_t*)text, L"#MORE", L"");
+	if (!result)
+		return NULL;
+
+	const wchar_t *names[] = { L"DESCRIPTION", L"TITLE", L"TAGS", L"DATE" };
+	const wchar_t *values[] = { tokens->description, tokens->title, tokens->tags, tokens->date };
+	for (int i = 0; i < 4; i++) {
+		wchar_t *temp = template_replace_token(result, names[i], values[i] ? values[i] : L"");
+		if (temp) {
+			free(result);
+			result = temp;
+		}
+	}
+	return result;
+}
+
 /**
  * build_single_page(): Assemble a full HTML page for a single post.
  *
@@ -9,17 +43,17 @@
  * and {PAGE_URL}.
  *
  * Memory:
- *  Returns a heap-allocated wide-character buffer containing the final HTML.
- *  The caller is responsible for free()'ing the returned pointer.
+ *  Returns the final HTML as a rope that borrows the site header and footer.
+ *  The caller is responsible for rope_free()'ing it.
  *
  * arguments:
  *  pp_page  *page  (the post to render; must not be NULL)
  *  site_info*site  (site configuration, header/footer, base_url, etc.; must not be NULL)
  *
  * returns:
- *  wchar_t* (heap-allocated HTML buffer on success; NULL on error)
+ *  pp_rope* (the page on success; NULL on error)
  */
-wchar_t* build_single_page(pp_page* page, site_info* site) {
+pp_rope* build_single_page(pp_page* page, site_info* site) {
 	if (!page || !site) {
 		if (PRAGMA_DEBUG) {
 			log_debug("error: no page/site in build_single_page, page = %s, site = %s", !page?"no":"yes", !site?"no":"yes");
@@ -40,9 +74,6 @@ wchar_t* build_single_page(pp_page* page, site_info* site) {
 	}
 	wcscat(page_url, L".html");
 
-	// Try to make reasonable assumptions about the memory to allocate: page, header, footer, some wiggle room.
-	size_t j = (wcslen(page->content) + wcslen(site->header) + wcslen(site->footer) + 1024) * sizeof(wchar_t);
-	wchar_t *page_output = malloc(j);
 	wchar_t *share_image = malloc(512 * sizeof(wchar_t));
 
 	if (page->icon) {
@@ -67,11 +98,6 @@ wchar_t* build_single_page(pp_page* page, site_info* site) {
 		}
 	}
 
-	if (!page_output) {
-		log_error("Unable to allocate memory for assembling page '%ls'!", page->title);
-		return NULL;
-	}
-
 	// get links to previous and next posts, if available
 	wchar_t *prev_href = NULL;
 	wchar_t *next_href = NULL;
@@ -100,70 +126,36 @@ wchar_t* build_single_page(pp_page* page, site_info* site) {
 	free(next_href);
 
 	// Use template system to render the complete page
-	page_output = render_page_with_template(page, site);
+	free(share_image);
+	pp_rope *page_output = render_page_with_template(page, site);
 	if (!page_output) {
 		log_error("Error: template rendering failed for page '%ls'", page->title);
+		free(navigation_links);
+		free(page_url);
 		return NULL;
 	} 
 
-	// Remove #MORE delimiter (not a {TOKEN} so use replace_substring)
 	// Note: Common tokens (PAGETITLE, FORWARD, BACK, MAIN_IMAGE, SITE_NAME, etc.)
 	// are already handled by apply_common_tokens() in render_page_with_template()
-	wchar_t *temp = replace_substring(page_output, L"#MORE", L"");
-	if (temp != page_output) {
-		free(page_output);
-		page_output = temp;
-	}
-
-	// Add description for Open Graph and meta tags
-	// Note: DESCRIPTION might not be handled by apply_common_tokens
-	wchar_t *description = get_page_description(page);
-	temp = template_replace_token(page_output, L"DESCRIPTION", description ? description : L"");
-	if (temp) {
-		free(page_output);
-		page_output = temp;
-	}
-	if (description) {
-		free(description);
-	}
-
-	// Free memory from string manufacturing; return page output
-	free(navigation_links);
-
 	// Note: TITLE_FOR_META and PAGE_URL are already handled by apply_common_tokens()
 	// Skip these to avoid double replacement
+	page_tokens tokens;
+	tokens.description = get_page_description(page);	// DESCRIPTION might not be handled by apply_common_tokens
+	tokens.title = html_heading(3, page->title, NULL, true);
+	tokens.tags = explode_tags(page->tags);
+	wchar_t *date = legible_date(page->date_stamp);
+	tokens.date = wrap_with_element(date, L"<i>", L"</i><br>");
+	free(date);
 
-	// Replace page-specific TITLE token (different from TITLE_FOR_META)
-	wchar_t* title_element = html_heading(3, page->title, NULL, true);
-	temp = template_replace_token(page_output, L"TITLE", title_element);
-	if (temp) {
-		free(page_output);
-		page_output = temp;
-	}
-	free(title_element);
-
-	//printf("DEBUG: About to call explode_tags with tags: %ls\n", page->tags ? page->tags : L"[NULL]");
-
-	// Replace page-specific TAGS token
-	wchar_t* tag_element = explode_tags(page->tags);
-	temp = template_replace_token(page_output, L"TAGS", tag_element ? tag_element : L"");
-	if (temp) {
-		free(page_output);
-		page_output = temp;
-	}
-	if (tag_element) {
-		free(tag_element);
-	}
-
-	// Replace page-specific DATE token
-	wchar_t *formatted_date = wrap_with_element(legible_date(page->date_stamp), L"<i>", L"</i><br>");
-	temp = template_replace_token(page_output, L"DATE", formatted_date);
-	if (temp) {
-		free(page_output);
-		page_output = temp;
-	}
-	free(formatted_date);
+	// Replace page-specific tokens in every segment of the page
+	rope_map(page_output, apply_page_tokens, &tokens);
 
+	// Free memory from string manufacturing; return page output
+	free(tokens.description);
+	free(tokens.title);
+	free(tokens.tags);
+	free(tokens.date);
+	free(navigation_links);
 	free(page_url);
 	return page_output;
 }
@@ -39,8 +39,9 @@ void parse_site_markdown(pp_page* page_list) {
 		if (!current->parsed)
 			continue;
 
-		// Parse the content with the markdown parser...
-		wchar_t *markdown_out = parse_markdown(current->content);
+		// Parse the content with the markdown parser (noting its links for pragma_links.c)...
+		link_list_free(&current->links);
+		wchar_t *markdown_out = parse_markdown(current->content, &current->has_gallery, &current->links);
 
 		// ...and try to reallocate memory in a more efficient way...
 		wchar_t *new_content = realloc(current->content, (wcslen(markdown_out)+1) * sizeof(wchar_t));
@@ -232,6 +233,9 @@ void free_page(pp_page *page) {
 	free(page->icon);
 	free(page->source_filename);
 	free(page->static_icon);
+	free(page->related);
+	link_list_free(&page->links);
+	free(page->backlinks);
 	free(page);
 }
 
@@ -256,12 +260,21 @@ void free_site_info(site_info *config) {
 	free(config->header);
 	free(config->base_url);
 	free(config->footer);
+	free(config->gallery_footer);
+	free(config->stylesheet);
+	free(config->publish_hook);
+	free_page_frames(config);
 	free(config->tagline);
 	free(config->license);
 	free(config->default_image);
 	free(config->icons_dir);
 	free(config->base_dir);
 
+	for (int i = 0; i < config->target_count; i++) {
+		free(config->targets[i].output_dir);
+		free(config->targets[i].base_url);
+	}
+
 	if (config->icons) {
 		for (int i = 0; i < config->icon_sentinel; i++) {
 			free(config->icons[i]);
@@ -294,6 +307,68 @@ void free_page_list(pp_page *head) {
 	}
 }
 
+/**
+ * page_footer(): The site footer to use for a page.
+ *
+ * arguments:
+ *  const site_info *site (site configuration; must not be NULL)
+ *  bool has_gallery (the page has galleries)
+ *
+ * returns:
+ *  const wchar_t* (footer with the lightbox block if has_gallery, otherwise without; don't free)
+ */
+const wchar_t* page_footer(const site_info *site, bool has_gallery) {
+	return (has_gallery && site->gallery_footer) ? site->gallery_footer : site->footer;
+}
+
+/**
+ * page_image_url(): Full URL of a page's share image ({MAIN_IMAGE}): the featured image if
+ * there is one, then the post icon, then the site default.
+ *
+ * arguments:
+ *  site_info *site (site configuration; must not be NULL)
+ *  const wchar_t *page_icon (may be NULL)
+ *  const wchar_t *page_featured_image (may be NULL)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated URL; NULL on allocation failure)
+ */
+static wchar_t* page_image_url(site_info *site, const wchar_t *page_icon, const wchar_t *page_featured_image) {
+	wchar_t *full_image_url;
+	if (page_featured_image && wcslen(page_featured_image) > 0) {
+		// Use featured image - build full URL
+		if (wcsstr(page_featured_image, L"://")) {
+			// Already a full URL
+			full_image_url = wcsdup(page_featured_image);
+		} else {
+			// Make it a full URL using utility function
+			full_image_url = build_url(site->base_url, page_featured_image);
+		}
+	} else if (page_icon && wcslen(page_icon) > 0) {
+		// Use page icon - build full URL
+		wchar_t *icon_path = malloc((wcslen(L"img/icons/") + wcslen(page_icon) + 1) * sizeof(wchar_t));
+		if (icon_path) {
+			wcscpy(icon_path, L"img/icons/");
+			wcscat(icon_path, page_icon);
+			full_image_url = build_url(site->base_url, icon_path);
+			free(icon_path);
+		} else {
+			full_image_url = NULL;
+		}
+	} else {
+		// Use default image
+		if (wcsstr(site->default_image, L"://")) {
+			// Already a full URL
+			full_image_url = wcsdup(site->default_image);
+		} else {
+			// Make it a full URL using utility function
+			full_image_url = build_url(site->base_url, site->default_image);
+		}
+	}
+
+	return full_image_url;
+}
+
 /**
  * apply_common_tokens(): Apply standard token replacements to HTML output.
  *
@@ -344,38 +419,7 @@ wchar_t* apply_common_tokens(wchar_t *output, site_info *site, const wchar_t *pa
 	}
 	// Note: {TAGS} and {DATE} are handled by individual page builders
 	// Build full URL for page image (featured_image takes priority, then icon, then default)
-	wchar_t *full_image_url;
-	if (page_featured_image && wcslen(page_featured_image) > 0) {
-		// Use featured image - build full URL
-		if (wcsstr(page_featured_image, L"://")) {
-			// Already a full URL
-			full_image_url = wcsdup(page_featured_image);
-		} else {
-			// Make it a full URL using utility function
-			full_image_url = build_url(site->base_url, page_featured_image);
-		}
-	} else if (page_icon && wcslen(page_icon) > 0) {
-		// Use page icon - build full URL
-		wchar_t *icon_path = malloc((wcslen(L"img/icons/") + wcslen(page_icon) + 1) * sizeof(wchar_t));
-		if (icon_path) {
-			wcscpy(icon_path, L"img/icons/");
-			wcscat(icon_path, page_icon);
-			full_image_url = build_url(site->base_url, icon_path);
-			free(icon_path);
-		} else {
-			full_image_url = NULL;
-		}
-	} else {
-		// Use default image
-		if (wcsstr(site->default_image, L"://")) {
-			// Already a full URL
-			full_image_url = wcsdup(site->default_image);
-		} else {
-			// Make it a full URL using utility function
-			full_image_url = build_url(site->base_url, site->default_image);
-		}
-	}
-
+	wchar_t *full_image_url = page_image_url(site, page_icon, page_featured_image);
 	if (full_image_url) {
 		temp = template_replace_token(result, L"MAIN_IMAGE", full_image_url);
 		if (temp) {
@@ -429,5 +473,122 @@ wchar_t* apply_common_tokens(wchar_t *output, site_info *site, const wchar_t *pa
 		result = temp;
 	}
 
+	// Service worker registration (service_worker:yes); empty otherwise
+	temp = template_replace_token(result, L"SERVICE_WORKER", site->service_worker ? SERVICE_WORKER_SCRIPT : L"");
+	if (temp) {
+		free(result);
+		result = temp;
+	}
+
+	// Stylesheet last, so an inlined one isn't scanned for the tokens above
+	temp = template_replace_token(result, L"STYLESHEET", site->stylesheet);
+	if (temp) {
+		free(result);
+		result = temp;
+	}
+
+	// Point stylesheet/script/icon references at fingerprinted copies (fingerprint:yes)
+	temp = rewrite_asset_urls(result, site->base_url);
+	if (temp) {
+		free(result);
+		result = temp;
+	}
+
+	return result;
+}
+
+// Page values for rope_apply_common_tokens(), passed through rope_map()
+typedef struct common_tokens {
+	site_info *site;
+	const wchar_t *page_url;
+	const wchar_t *page_title;
+	const wchar_t *page_description;
+	const wchar_t *page_icon;
+	const wchar_t *page_author;
+	const wchar_t *page_featured_image;
+} common_tokens;
+
+/**
+ * common_slot_value(): rope_fill_slots() callback: the value of one header/footer slot
+ * (pragma_frames.c), with asset URLs rewritten as apply_common_tokens() would have done
+ * for the whole page.
+ */
+static wchar_t* common_slot_value(int slot, void *arg) {
+	common_tokens *tokens = arg;
+	wchar_t *image = NULL;
+	const wchar_t *value = L"";
+
+	switch (slot & ~SLOT_QUOTED) {
+	case SLOT_MAIN_IMAGE:
+		image = page_image_url(tokens->site, tokens->page_icon, tokens->page_featured_image);
+		value = image ? image : L"{MAIN_IMAGE}";
+		break;
+	case SLOT_PAGE_URL:
+		value = tokens->page_url ? tokens->page_url : L"{PAGE_URL}";
+		break;
+	case SLOT_TITLE_FOR_META:
+	case SLOT_PAGETITLE:
+		value = tokens->page_title ? tokens->page_title : tokens->site->site_name;
+		break;
+	case SLOT_DESCRIPTION:
+		value = tokens->page_description ? tokens->page_description : L"";
+		break;
+	case SLOT_AUTHOR:
+		value = tokens->page_author ? tokens->page_author : L"";
+		break;
+	}
+
+	wchar_t *result;
+	if (slot & SLOT_QUOTED) {
+		// rewrite_asset_urls() only looks at quoted values, so give it the opening quote
+		size_t length = wcslen(value);
+		wchar_t *quoted = malloc((length + 2) * sizeof(wchar_t));
+		if (!quoted) {
+			free(image);
+			return NULL;
+		}
+		quoted[0] = L'"';
+		wmemcpy(quoted + 1, value, length + 1);
+		wchar_t *rewritten = rewrite_asset_urls(quoted, tokens->site->base_url);
+		result = wcsdup((rewritten ? rewritten : quoted) + 1);
+		free(rewritten);
+		free(quoted);
+	} else {
+		result = rewrite_asset_urls(value, tokens->site->base_url);
+		if (!result)
+			result = wcsdup(value);
+	}
+	free(image);
 	return result;
-}
\ No newline at end of file
+}
+
+/**
+ * apply_tokens_to_segment(): rope_map() transform for rope_apply_common_tokens(). Segments
+ * with no tokens and no quoted values (so no asset URLs) are left as they are.
+ */
+static wchar_t* apply_tokens_to_segment(const wchar_t *text, void *arg) {
+	common_tokens *tokens = arg;
+	if (!wcspbrk(text, L"{\"'"))
+		return NULL;
+	wchar_t *result = apply_common_tokens((wchar_t*)text, tokens->site, tokens->page_url, tokens->page_title,
+	                                      tokens->page_description, tokens->page_icon, tokens->page_author,
+	                                      tokens->page_featured_image);
+	return result == text ? NULL : result;
+}
+
+/**
+ * rope_apply_common_tokens(): apply_common_tokens() for a page held as a rope. Header and
+ * footer slots are filled with this page's values; other segments that may contain tokens
+ * become owned, replaced copies.
+ *
+ * arguments:
+ *  pp_rope *rope (page to process; must not be NULL)
+ *  (the rest as for apply_common_tokens())
+ */
+void rope_apply_common_tokens(pp_rope *rope, site_info *site, const wchar_t *page_url, const wchar_t *page_title, const wchar_t *page_description, const wchar_t *page_icon, const wchar_t *page_author, const wchar_t *page_featured_image) {
+	if (!rope || !site)
+		return;
+	common_tokens tokens = { site, page_url, page_title, page_description, page_icon, page_author, page_featured_image };
+	rope_fill_slots(rope, common_slot_value, &tokens);
+	rope_map(rope, apply_tokens_to_segment, &tokens);
+}
@@ -3,17 +3,22 @@
 #include <string.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #ifdef __APPLE__
 #include <malloc/malloc.h>
 #endif
 #include <stdbool.h>
 #include <wchar.h>
+#include <wctype.h>
 #include <time.h>
 #include <limits.h>
 #include <locale.h>
 #include <stddef.h>
 #include <time.h>
 #include <unistd.h>  // for getopt()
+#include <getopt.h>  // for getopt_long()
+#include <stdint.h>
+#include <pthread.h>
 
 // UTF-8 string type for filesystem operations
 typedef char* utf8_path;
@@ -38,21 +43,33 @@ wchar_t* utf8_to_wchar(const utf8_path utf8_str);
 #define SITE_POSTS	"c/"			// Directory (within SITE_ROOT) for all generated posts
 #define SITE_SCROLL	"s/"			// Directory (within SITE_ROOT) for the scroll, i.e. index of all posts by date
 #define SITE_TAG_INDEX	"t/"			// Directory (within SITE_ROOT) for the indices of posts per tag
+#define SITE_SEARCH	"search/"		// Directory (within SITE_ROOT) for the search index (search:yes)
+#define SITE_API	"api/"			// Directory (within SITE_ROOT) for JSON listings (json_api:yes)
 #define SITE_IMAGES	"img/"			// Directory (within SITE_ROOT) where images are located
 #define SITE_ICONS	"img/icons/"		// Directory (within SITE_ROOT) where icons are located
 #define SITE_DEFAULT_IMG "img/default.png"	// general fallback image for the site...favico ish
                 
 #define PRAGMA_DEBUG	0
 
-#define PRAGMA_USAGE	"Usage: pragma -s [source] -o [output]\n\nwhere [source] is the site source directory and [output] is where you want the rendered site.\n\n\t-f: regenerate all html for all nodes\n\t-d: dry run, status report only\n\t-u: regenerate html only for nodes whose source was modified since last successful run\n\t-n: generate html output for new nodes (i.e., created since last run)\n\t-x: clean up stale pragma-generated files after build\n\t-h: show this 'help'\n\nPlease see README.txt for usage details and examples.\n\n"
+#define PRAGMA_USAGE	"Usage: pragma -s [source] -o [output]\n\nwhere [source] is the site source directory and [output] is where you want the rendered site.\n\n\t-f: regenerate all html for all nodes\n\t-d: dry run, status report only\n\t-u: regenerate html only for nodes whose source was modified since last successful run\n\t-n: generate html output for new nodes (i.e., created since last run)\n\t-x: clean up stale pragma-generated files after build\n\t-t [dir]=[url]: also build the site into [dir] with base URL [url] (repeatable)\n\t-j: log JSON lines (one object per message) instead of text\n\t--tar: write the site to [output] as a tar stream instead of into a directory (- for stdout)\n\t--tar-gz: the same, gzip-compressed\n\t-b [file]: build every site listed in [file], one \"[source] [output]\" pair per line, in one process\n\t\t(several -s/-o pairs on the command line do the same)\n\t-h: show this 'help'\n\nPlease see README.txt for usage details and examples.\n\n"
 
 /**
 * Default file contents when creating a new site.  Some of these strings are hideous, but I prefer
 * to generate the files from this source rather than template files.  (The pragma executable should
 * be able to live anywhere with no supporting files)
 */
-#define DEFAULT_YAML	L"---\nsite_name:Web disaster\njs:no\nbuild_tags:yes\nbuild_scroll:yes\ncss:p.css\nheader:_header.html\nfooter:_footer.html\nindex_size:10\nicons_dir:img/icons\ntagline:Comparison is always true due to limited range of data type.\nread_more:-1\ndefault_image:/img/default.png\nbase_url:https://yourdomain.edu/"
+#define DEFAULT_YAML	L"---\nsite_name:Web disaster\njs:no\nbuild_tags:yes\nbuild_scroll:yes\ncss:p.css\nheader:_header.html\nfooter:_footer.html\nindex_size:10\nicons_dir:img/icons\ntagline:Comparison is always true due to limited range of data type.\nread_more:-1\ndefault_image:/img/default.png\nbase_url:https://yourdomain.edu/\nprecompress:no\ngzip_level:6\nminify:no\nfingerprint:no\nicon_mode:link\nicon_inline_max:4096\ncss_inline:no\ncss_inline_max:14000\nsearch:no\nrelated_posts:5\njson_api:no\nservice_worker:no\nprecache_posts:10\nbudget_report:no\nbudget_html_kb:100\nbudget_images:40\nbudget_image_kb:2000\nlink_check:no\nbacklinks:no\npublish_first:no"
 #define DEFAULT_YAML_FILENAME "pragma_config.yml"
+#define OUTPUT_MANIFEST_FILENAME ".pragma_outputs"	// hashes of last build's outputs, kept in the output dir
+#define CHANGES_FILENAME ".pragma_changes"	// URLs created/changed/deleted by the last build, in the output dir
+#define ASSET_MANIFEST_FILENAME "asset_manifest.json"	// fingerprinted asset names, written to the output dir
+#define SERVICE_WORKER_FILENAME "sw.js"	// service worker (service_worker:yes), at the output root so its scope is the site
+#define PRECACHE_MANIFEST_FILENAME "precache-manifest.json"	// what sw.js precaches, with revisions
+#define BUDGET_REPORT_FILENAME ".pragma_budget"	// page weights from the last build (budget_report:yes), in the output dir
+#define LINK_REPORT_FILENAME ".pragma_links"	// broken internal links from the last build (link_check:yes), in the output dir
+#define IMAGE_CACHE_FILENAME ".pragma_images"	// cached image dimensions, kept in the output dir
+#define RELATED_CACHE_FILENAME ".pragma_related"	// cached related-post signatures, kept in the output dir
+#define ICON_SPRITE_FILENAME "icons.svg"	// SVG icon sprite sheet (icon_mode:sprite), in the output dir
 #define DEFAULT_CSS	L"body {\n  margin-left:10em;\n  max-width:50%;\n}\n\n" \
 L"h2 {\n margin-bottom:2px;\n}\n\n" \
 L"div.post_title h3 {\n  margin-bottom:2px;\n  margin-top:0px;\n}\n\n" \
@@ -87,7 +104,7 @@ L"<meta property=\"og:url\" content=\"{PAGE_URL}\">"\
 L"<meta name=\"description\" content=\"{DESCRIPTION}\">"\
 L"<title>pragma-web | {PAGETITLE}</title>"\
 L"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">"\
-L"<link rel=\"stylesheet\" href=\"/p.css\">"\
+L"{STYLESHEET}"\
 L"<link rel=\"preconnect\" href=\"https://fonts.googleapis.com\">"\
 L"<link rel=\"preconnect\" href=\"https://fonts.gstatic.com\" crossorigin>"\
 L"<link href=\"https://fonts.googleapis.com/css2?family=Merriweather:ital,opsz,wght@0,18..144,300..900;1,18..144,300..900&display=swap\" rel=\"stylesheet\">"\
@@ -105,7 +122,7 @@ L"{TITLE}"\
 L"{DATE}"\
 L"{TAGS}"
 
-#define DEFAULT_FOOTER	L"</div></body><script src=\"https://cdn.jsdelivr.net/npm/glightbox/dist/js/glightbox.min.js\"></script><link href=\"https://cdn.jsdelivr.net/npm/glightbox/dist/css/glightbox.min.css\" rel=\"stylesheet\"><script>const lightbox = GLightbox();</script></html>"
+#define DEFAULT_FOOTER	L"</div></body><!-- IF has_gallery --><script src=\"https://cdn.jsdelivr.net/npm/glightbox/dist/js/glightbox.min.js\"></script><link href=\"https://cdn.jsdelivr.net/npm/glightbox/dist/css/glightbox.min.css\" rel=\"stylesheet\"><script>const lightbox = GLightbox();</script><!-- END IF -->{SERVICE_WORKER}</html>"
 
 #define DEFAULT_SAMPLE_POST L"title:Welcome to pragma-web!\n"\
 L"tags:welcome,sample\n"\
@@ -130,7 +147,7 @@ L"</svg>"
 #define DEFAULT_TEMPLATE_POST_CARD L"<div class=\"post_card\">\n"\
 L"  <div class=\"post_head\">\n"\
 L"    <div class=\"post_icon\">\n"\
-L"      <img class=\"icon\" alt=\"[icon]\" src=\"/img/icons/{ICON}\">\n"\
+L"      {ICON_HTML}\n"\
 L"    </div>\n"\
 L"    <div class=\"post_title\">\n"\
 L"      <h3><a href=\"{POST_URL}\">{TITLE}</a></h3>\n"\
@@ -150,7 +167,7 @@ L"</div>\n"
 #define DEFAULT_TEMPLATE_SINGLE_PAGE L"<div class=\"post_card\">\n"\
 L"  <div class=\"post_head\">\n"\
 L"    <div class=\"post_icon\">\n"\
-L"      <img class=\"icon\" alt=\"[icon]\" src=\"/img/icons/{ICON}\">\n"\
+L"      {ICON_HTML}\n"\
 L"    </div>\n"\
 L"    <div class=\"post_title\">\n"\
 L"      <h3>{TITLE}</h3>\n"\
@@ -163,6 +180,12 @@ L"    <!-- END LOOP -->\n"\
 L"    <!-- END IF -->\n"\
 L"  </div>\n"\
 L"  {CONTENT}\n"\
+L"  <!-- IF has_related -->\n"\
+L"  <div class=\"related_posts\">Related: <!-- LOOP related --><a href=\"{RELATED_URL}\">{RELATED_TITLE}</a> <!-- END LOOP --></div>\n"\
+L"  <!-- END IF -->\n"\
+L"  <!-- IF has_backlinks -->\n"\
+L"  <div class=\"backlinks\">Linked from: <!-- LOOP backlinks --><a href=\"{BACKLINK_URL}\">{BACKLINK_TITLE}</a> <!-- END LOOP --></div>\n"\
+L"  <!-- END IF -->\n"\
 L"</div>\n"
 
 #define DEFAULT_TEMPLATE_NAVIGATION L"<!-- IF has_navigation -->\n"\
@@ -186,6 +209,21 @@ L"<!-- END IF -->\n"
 
 #define READ_MORE_DELIMITER	L"#MORE"
 
+// How post icons are emitted (icon_mode: in the site config; see pragma_icons.c)
+#define ICON_MODE_LINK		0	// <img src="/img/icons/...">
+#define ICON_MODE_INLINE	1	// data: URIs for icons up to icon_inline_max bytes
+#define ICON_MODE_SPRITE	2	// SVG icons from one sprite sheet
+#define ICON_INLINE_MAX		4096
+#define CSS_INLINE_MAX		14000	// keeps the head well inside the first round trip
+
+// One output of a build: where it's written and the base URL its links use
+#define MAX_BUILD_TARGETS	8
+#define MAX_BATCH_SITES	256	// sites one `pragma -b` run will build
+typedef struct build_target {
+	char *output_dir;
+	wchar_t *base_url;
+} build_target;
+
 extern const char *pragma_directories[];
 extern const char *pragma_basic_files[];
 
@@ -199,7 +237,8 @@ typedef struct site_info {
 	wchar_t *css;
 	wchar_t *js;
 	wchar_t *header;
-	wchar_t *footer;
+	wchar_t *footer;		// <!-- IF has_gallery --> blocks removed
+	wchar_t *gallery_footer;	// ...and kept, for pages that need the lightbox
 	int index_size;
 	int read_more;
 	wchar_t *tagline;
@@ -208,9 +247,47 @@ typedef struct site_info {
 	wchar_t *base_dir;
 	char **icons;
 	int icon_sentinel;
+	bool precompress;	// write .gz siblings next to generated outputs
+	int gzip_level;		// zlib level for precompressed outputs (1-9)
+	bool minify;		// minify HTML outputs on their way to disk
+	bool fingerprint;	// serve css/js/icons under content-hashed names
+	int icon_mode;		// ICON_MODE_LINK, ICON_MODE_INLINE or ICON_MODE_SPRITE
+	int icon_inline_max;	// largest icon (bytes) inlined as a data: URI
+	bool css_inline;	// inline the minified stylesheet when it's small enough
+	int css_inline_max;	// largest minified stylesheet (bytes) to inline
+	wchar_t *stylesheet;	// {STYLESHEET} markup for this build (prepare_stylesheet())
+	struct page_frame **frames;	// header/footer split into literals and slots (prepare_page_frames())
+	int frame_count;
+	bool search;		// build the static search index in search/
+	int related_posts;	// related posts listed on single pages (0 = off)
+	bool json_api;		// write JSON copies of posts and listings
+	bool service_worker;	// write sw.js and precache-manifest.json
+	int precache_posts;	// most recent posts (and their index pages) to precache
+	bool budget_report;	// measure HTML outputs and write the page-weight report
+	int budget_html_kb;	// page-weight budgets (0 = no limit)
+	int budget_images;
+	int budget_image_kb;
+	bool link_check;	// check internal links and images after the build
+	bool backlinks;		// list the posts that link to each post on its page
+	bool publish_first;	// render changed posts, index.html and feed.xml before the rest
+	wchar_t *publish_hook;	// command run once those are written (implies publish_first); NULL if none
+	build_target targets[MAX_BUILD_TARGETS];	// outputs besides -o (target: lines and -t)
+	int target_count;
 } site_info;
      
 struct pp_page;	// (forward declaration)
+
+// Link and image targets in a post's Markdown, as written (pragma_links.c)
+typedef struct pp_link {
+	wchar_t *target;
+	bool image;		// ![alt](target) rather than [text](target)
+} pp_link;
+
+typedef struct pp_link_list {
+	pp_link *items;
+	int count;
+	int size;
+} pp_link_list;
 // Basic data type for holding page information 
 typedef struct pp_page {
 	wchar_t *title;
@@ -228,6 +305,12 @@ typedef struct pp_page {
 	wchar_t *static_icon;
 	wchar_t *source_filename;
 	bool parsed;
+	bool has_gallery;	// content has a !!(dir) gallery (needs the lightbox)
+	struct pp_page **related;	// most similar posts, best first (pragma_related.c)
+	int related_count;
+	pp_link_list links;	// link and image targets in the Markdown (parse_site_markdown())
+	struct pp_page **backlinks;	// posts that link here, newest first (backlinks:yes)
+	int backlink_count;
 } pp_page; 
 
 struct tag_dict;
@@ -242,28 +325,78 @@ enum sort_types {
 	LAST_MODIFIED
 };
 
+// A page as a list of borrowed and owned segments (pragma_rope.c)
+typedef struct rope_segment {
+	const wchar_t *text;
+	size_t length;		// wchar_t, not counting the terminator
+	size_t capacity;	// > 0 while this is the open segment rope_append() grows
+	const char *bytes;	// the text already encoded as UTF-8 (borrowed), or NULL
+	size_t byte_length;
+	int slot;		// > 0: placeholder for a per-page value (pragma_frames.c)
+	bool owned;		// freed by rope_free()
+	bool finished;		// tokens already replaced; rope_map() leaves it alone
+} rope_segment;
+
+typedef struct pp_rope {
+	rope_segment *segments;
+	int count;
+	int size;
+	bool failed;		// an allocation failed; the page is incomplete
+} pp_rope;
+
+pp_rope* rope_new(void);
+void rope_free(pp_rope *rope);
+void rope_borrow(pp_rope *rope, const wchar_t *text);
+void rope_take(pp_rope *rope, wchar_t *text);
+void rope_append(pp_rope *rope, const wchar_t *text);
+void rope_borrow_encoded(pp_rope *rope, const wchar_t *text, size_t length, const char *bytes, size_t byte_length, bool finished);
+void rope_slot(pp_rope *rope, int slot);
+void rope_fill_slots(pp_rope *rope, wchar_t* (*value)(int slot, void *arg), void *arg);
+void rope_map(pp_rope *rope, wchar_t* (*transform)(const wchar_t *text, void *arg), void *arg);
+size_t rope_length(const pp_rope *rope);
+wchar_t* rope_flatten(const pp_rope *rope);
+
+// Site header and footer, split into literals and per-page slots (pragma_frames.c)
+enum frame_slots {
+	SLOT_MAIN_IMAGE = 1,
+	SLOT_PAGE_URL,
+	SLOT_TITLE_FOR_META,
+	SLOT_PAGETITLE,
+	SLOT_DESCRIPTION,
+	SLOT_AUTHOR
+};
+#define SLOT_QUOTED	0x100	// the slot starts a quoted attribute value
+
+void prepare_page_frames(site_info *site);
+void free_page_frames(site_info *site);
+void rope_frame(pp_rope *rope, const site_info *site, const wchar_t *part);
+
 pp_page* parse_file(const utf8_path filename);
 bool check_dir( const utf8_path p, int mode );
 wchar_t* build_url(const wchar_t *base_url, const wchar_t *path);
+bool has_extension(const char *name, const char *ext);
 void usage();
 void build_new_pragma_site( char *t );
 wchar_t *read_file_contents(utf8_path path);
+char* read_file_bytes(const char *path, size_t *length);
 int write_file_contents(utf8_path path, const wchar_t *content);
 pp_page* load_site(int operation, char* directory, time_t since_time);
-wchar_t* parse_markdown(wchar_t *markdown);
+wchar_t* parse_markdown(wchar_t *markdown, bool *has_gallery, pp_link_list *links);
 void append(wchar_t *string, wchar_t *result, size_t *j);
 pp_page* merge(pp_page* list1, pp_page* list2);
 pp_page* merge_sort(pp_page* head);
 void sort_site(pp_page** head);
-wchar_t* build_index(pp_page* pages, site_info *site, int start_page);
-wchar_t* build_single_page(pp_page* page, site_info *site);
+pp_rope* build_index(pp_page* pages, site_info *site, int start_page);
+pp_rope* build_single_page(pp_page* page, site_info *site);
 wchar_t* build_scroll(pp_page* pages, site_info *site);
 wchar_t* build_rss(pp_page* pages, site_info *site);
 void parse_site_markdown(pp_page* page_list);
 char* char_convert(const wchar_t* w);
 site_info* load_site_yaml(char* path); 
+site_info* load_site_config(char *path, bool interactive);
+bool add_build_target(site_info *config, const char *output_dir, const wchar_t *base_url);
 wchar_t* replace_substring(wchar_t *str, const wchar_t *find, const wchar_t *replace);
-void write_single_page(pp_page* page, char* path, wchar_t* html_content);
+void write_single_page(pp_page* page, char* path, pp_rope* html_content);
 void strip_terminal_newline(wchar_t *s, char *t);
 wchar_t* explode_tags(wchar_t* input);
 wchar_t* legible_date(time_t when);
@@ -274,13 +407,15 @@ void directory_to_array(const utf8_path path, char ***filenames, int *count);
 void assign_icons(pp_page *pages, site_info *config, const char *source_dir);
 wchar_t* wchar_convert(const char* c);
 pp_page* get_item_by_key(time_t target, pp_page* list);
-wchar_t* build_tag_index(pp_page* pages, site_info* site);
+pp_rope* build_tag_index(pp_page* pages, site_info* site);
 void append_tag(wchar_t *tag, tag_dict *tags);
 bool tag_list_contains(wchar_t *tag, tag_dict *tags);
 bool page_is_tagged(pp_page* p, wchar_t *t);
 void swap(tag_dict *a, tag_dict *b);
 void sort_tag_list(tag_dict *head);
 bool split_before(wchar_t *delim, const wchar_t *input, wchar_t *output);
+const wchar_t* page_footer(const site_info *site, bool has_gallery);
+void rope_apply_common_tokens(pp_rope *rope, site_info *site, const wchar_t *page_url, const wchar_t *page_title, const wchar_t *page_description, const wchar_t *page_icon, const wchar_t *page_author, const wchar_t *page_featured_image);
 wchar_t* apply_common_tokens(wchar_t *output, site_info *site, const wchar_t *page_url, const wchar_t *page_title, const wchar_t *page_description, const wchar_t *page_icon, const wchar_t *page_author, const wchar_t *page_featured_image);
 
 // HTML element generation functions
@@ -289,6 +424,7 @@ wchar_t* html_element(const wchar_t *tag, const wchar_t *content, const wchar_t
 wchar_t* html_self_closing(const wchar_t *tag, const wchar_t *attributes);
 wchar_t* html_link(const wchar_t *href, const wchar_t *text, const wchar_t *css_class, bool escape_content);
 wchar_t* html_image(const wchar_t *src, const wchar_t *alt, const wchar_t *css_class);
+wchar_t* html_content_image(const wchar_t *src, const wchar_t *alt, const wchar_t *css_class);
 wchar_t* html_image_with_caption(const wchar_t *src, const wchar_t *alt, const wchar_t *caption, const wchar_t *css_class);
 wchar_t* html_image_gallery(const wchar_t *directory_path, const wchar_t *css_class);
 wchar_t* html_div(const wchar_t *content, const wchar_t *css_class, bool escape_content);
@@ -329,12 +465,24 @@ typedef struct {
     wchar_t **tag_urls;
     int tag_count;
 
+    // Related posts
+    wchar_t **related_titles;
+    wchar_t **related_urls;
+    int related_count;
+
+    // Posts linking here
+    wchar_t **backlink_titles;
+    wchar_t **backlink_urls;
+    int backlink_count;
+
     // Boolean flags
     bool has_prev;
     bool has_next;
     bool has_navigation;
     bool has_next_only;
     bool has_tags;
+    bool has_related;
+    bool has_backlinks;
 } template_data;
 
 // Template functions
@@ -344,12 +492,13 @@ wchar_t* load_template_file(const char *template_path);
 wchar_t* template_replace_token(wchar_t *template, const wchar_t *token_name, const wchar_t *replacement_value);
 wchar_t* template_process_loop(wchar_t *template, template_data *data);
 wchar_t* template_process_conditionals(wchar_t *template, template_data *data);
+wchar_t* template_apply_condition(const wchar_t *text, const wchar_t *condition, bool value);
 wchar_t* apply_template(const char *template_path, template_data *data);
 
 // Template helper functions
 wchar_t* render_post_card_with_template(pp_page *page, site_info *site);
 wchar_t* render_navigation_with_template(pp_page *page, site_info *site);
-wchar_t* render_page_with_template(pp_page *page, site_info *site);
+pp_rope* render_page_with_template(pp_page *page, site_info *site);
 wchar_t* render_index_item_with_template(pp_page *page, site_info *site);
 wchar_t* strip_html_tags(const wchar_t *input);
 wchar_t* get_page_description(pp_page *page);
@@ -380,6 +529,8 @@ int safe_buffer_init_with_escape(safe_buffer *buf, size_t initial_size, bool aut
 int safe_append(const wchar_t *text, safe_buffer *buf);
 int safe_append_escaped(const wchar_t *text, safe_buffer *buf);
 int safe_append_char(wchar_t c, safe_buffer *buf);
+int safe_append_n(const wchar_t *text, size_t n, safe_buffer *buf);
+int safe_append_json(const wchar_t *text, safe_buffer *buf);
 void safe_buffer_reset(safe_buffer *buf);
 void safe_buffer_free(safe_buffer *buf);
 wchar_t* safe_buffer_to_string(safe_buffer *buf);
@@ -398,8 +549,13 @@ void buffer_pool_return_global(safe_buffer *buf);
 
 // Command-line options structure
 typedef struct {
-    char *source_dir;
-    char *output_dir;
+    char *source_dir;   // the first -s (the only one, outside batch mode)
+    char *output_dir;   // the first -o, or -c's directory
+    char *sources[MAX_BATCH_SITES];	// every -s, in order: several -s/-o pairs make a batch
+    char *outputs[MAX_BATCH_SITES];	// every -o, paired with sources[] by position
+    int source_count;
+    int output_count;
+    char *batch_file;   // -b FILE: build the "SOURCE OUTPUT" pairs listed in FILE
     bool create_site;   // make a new pragma-web site
     bool force_all;     // force update
     bool updated_only;
@@ -409,6 +565,12 @@ typedef struct {
     bool clean_stale;   
     // clean_stale = whether we want to delete orphaned html files, i.e. old
     // pragma-generated files that have no corresponding data source in this site
+    char *targets[MAX_BUILD_TARGETS];	// -t DIR=URL: more outputs with their own base URLs
+    int target_count;
+    bool json_log;      // -j: log JSON lines instead of text
+    bool tar;           // --tar/--tar-gz: -o names a tar archive ("-" for stdout), not a directory
+    bool tar_gzip;      // --tar-gz
+    char *archive_path; // where the archive goes (the -o argument, once main() has it)
 } pragma_options;
 
 // Logging system
@@ -423,12 +585,23 @@ typedef enum {
 // Initialize logger (call once at program start)
 void log_init(log_level_t min_level, bool quiet_mode);
 
+// Route messages to a callback instead of stdout/stderr (library hosts)
+typedef void (*log_sink_fn)(log_level_t level, const char *message, void *user_data);
+void log_set_sink(log_sink_fn sink, void *user_data);
+
 // Main logging functions
 void log_debug(const char *format, ...);
 void log_info(const char *format, ...);
 void log_warn(const char *format, ...);
 void log_error(const char *format, ...);
 void log_fatal(const char *format, ...);
+void log_progress(const char *label, int done, int total);
+void log_counts(int *warnings, int *errors);
+
+// Background writing (the pragma binary; sinks stay synchronous)
+void log_start_async(bool json_lines);
+void log_flush(void);
+void log_stop_async(void);
 
 // Wide character versions for existing wprintf usage
 void log_info_w(const wchar_t *format, ...);
@@ -439,4 +612,163 @@ void log_error_w(const wchar_t *format, ...);
 void log_system_error(const char *context);
 
 // Stale file cleanup function
-void cleanup_stale_files(const char *source_dir, const char *output_dir);
+void cleanup_stale_files(const char *source_dir, const char *output_dir, bool json_api);
+
+// Render and write a loaded site into one output directory (pragma_build.c)
+int build_site_output(pp_page *pages, site_info *config, const char *source_dir,
+                       const char *output_dir, bool clean_stale);
+
+// Background worker pool (pragma_workers.c)
+typedef void (*work_fn)(void *arg);
+typedef struct work_pool work_pool;
+int work_pool_default_threads(void);
+work_pool* work_pool_create(int threads);
+void work_pool_submit(work_pool *pool, work_fn fn, void *arg);
+void work_pool_wait(work_pool *pool);
+void work_pool_destroy(work_pool *pool);
+work_pool* work_pool_get_global(void);
+void work_pool_cleanup_global(void);
+
+// Output write stage (pragma_output.c)
+typedef struct pp_tar pp_tar;	// an open tar stream (pragma_tar.c)
+int output_stage_init(const char *output_dir, site_info *site);
+char* output_full_path(const char *relative_path);
+int write_output(const char *relative_path, const wchar_t *content);
+int write_output_rope(const char *relative_path, const pp_rope *content);
+int write_output_bytes(const char *relative_path, const void *data, size_t length);
+bool output_hash(const char *relative_path, uint64_t *hash);
+void output_stage_finish(void);
+void output_stage_totals(int *written, int *unchanged);
+void output_stage_discard(void);
+void output_stage_archive(pp_tar *archive);
+bool output_stage_archiving(void);
+
+// Tar stream output, for --tar (pragma_tar.c)
+pp_tar* tar_open(const char *path, bool gzip);
+int tar_add(pp_tar *tar, const char *path, const struct iovec *parts, int count);
+int tar_close(pp_tar *tar);
+
+// Asset fingerprinting (pragma_assets.c)
+int fingerprint_assets(site_info *site, const char *source_dir, const char *output_dir);
+bool is_fingerprinted_name(const char *name);
+bool is_generated_asset_name(const char *name);
+wchar_t* rewrite_asset_urls(const wchar_t *html, const wchar_t *base_url);
+const wchar_t* fingerprinted_path(const wchar_t *path);
+void free_asset_map(void);
+void prepare_stylesheet(site_info *site, const char *source_dir, const char *output_dir);
+
+// Image probing (pragma_images.c)
+typedef struct image_listing {
+	char *path;
+	time_t mtime;
+	char **names;	// image file names only, sorted
+	int count;
+	struct image_listing *next;
+} image_listing;
+void image_probe_init(const char *source_dir, const char *output_dir);
+bool image_dimensions(const wchar_t *src, int *width, int *height);
+wchar_t* image_srcset(const wchar_t *src, int width);
+bool is_image_variant(const char *name);
+bool is_image_name(const char *name);
+const image_listing* image_directory_listing(const char *dir);
+char* image_resolve_directory(const wchar_t *src);
+void image_probe_finish(bool save_cache);
+
+// Gallery thumbnails (pragma_thumbnails.c)
+#define THUMBNAIL_PREFIX	"thumb"	// fox.jpg => thumbfox.jpg
+#define THUMBNAIL_MAX		256	// max thumbnail width/height in pixels
+void thumbnail_pipeline_init(bool enabled);
+void queue_gallery_thumbnails(const wchar_t *gallery);
+bool is_thumbnail_name(const char *name);
+bool is_thumbnail_source(const char *name);
+void thumbnail_size(int width, int height, int *thumb_width, int *thumb_height);
+int thumbnail_pipeline_finish(void);
+
+// Static search index (pragma_search.c)
+#define SEARCH_TERM_MIN		2	// shorter terms aren't indexed
+#define SEARCH_TERM_MAX		32	// nor are longer ones (hashes, URLs run together)
+#define SEARCH_SHARD_PREFIX	2	// shards are keyed by this many leading characters
+void search_index_init(bool enabled);
+void search_index_queue(pp_page *pages);
+int search_index_write(site_info *site);
+void search_index_free(void);
+
+// JSON copies of posts and listings (pragma_json_api.c)
+void write_post_json(pp_page *page, site_info *site);
+void write_index_json(pp_page *pages, site_info *site, int page_num, int total_pages);
+void write_tag_json(const wchar_t *tag, pp_page **posts, int count, site_info *site);
+
+// Service worker and precache manifest (pragma_service_worker.c)
+#define PRECACHE_POSTS		10
+#define SERVICE_WORKER_SCRIPT	L"<script>if(\"serviceWorker\" in navigator)navigator.serviceWorker.register(\"/" SERVICE_WORKER_FILENAME "\");</script>"
+int write_service_worker(pp_page *pages, site_info *site, const char *source_dir);
+
+// Page-weight budget report (pragma_budget.c)
+#define BUDGET_HTML_KB		100
+#define BUDGET_IMAGES		40
+#define BUDGET_IMAGE_KB		2000
+#define BUDGET_TOP_OFFENDERS	10	// heaviest pages logged after the build
+void budget_init(site_info *site, const char *output_dir);
+void budget_measure(const char *relative_path, const struct iovec *parts, int count, size_t length);
+int budget_report(void);
+
+// Related posts (pragma_related.c)
+#define RELATED_POSTS_MAX	20
+void related_posts_build(pp_page *pages, site_info *site, const char *output_dir, bool save_cache);
+
+// Internal link graph (pragma_links.c)
+void link_list_add(pp_link_list *list, const wchar_t *target, bool image);
+void link_list_free(pp_link_list *list);
+void backlinks_build(pp_page *pages, site_info *site);
+int link_check_report(pp_page *pages, site_info *site, const char *output_dir);
+
+// Process-wide cache of templates and other small files (pragma_file_cache.c)
+char* file_cache_bytes(const char *path, size_t *length);
+wchar_t* file_cache_text(const char *path);
+void file_cache_counts(int *hits, int *misses);
+void file_cache_free(void);
+
+// Post icons (pragma_icons.c)
+int icon_catalog_init(site_info *site, const char *output_dir);
+const char* icon_sprite_bytes(size_t *length);
+const wchar_t* icon_src(const wchar_t *icon);
+const wchar_t* icon_html(const wchar_t *icon);
+void icon_catalog_free(void);
+
+// UTF-8 transcoding, independent of the locale (pragma_utf8.c)
+wchar_t* utf8_decode(const char *bytes, size_t length, size_t *out_length, bool replace_invalid);
+char* utf8_encode(const wchar_t *text, size_t length, size_t *out_length);
+size_t utf8_encode_char(wchar_t c, char *out);
+wchar_t* utf8_fgets(wchar_t *line, int size, FILE *file);
+
+// HTML minification (pragma_minify.c)
+char* minify_html(const wchar_t *html, size_t *length);
+char* minify_css(const char *css, size_t length, size_t *out_length);
+
+// Content hashing (64-bit FNV-1a)
+#define HASH_SEED	0xcbf29ce484222325ULL
+uint64_t hash_update(uint64_t hash, const void *data, size_t length);
+uint64_t hash_bytes(const void *data, size_t length);
+
+// Per-site module state for libpragma hosts (pragma_context.c)
+typedef struct pragma_context pragma_context;
+enum context_slots {
+	CONTEXT_BUFFERS,	// pragma_buffer.c
+	CONTEXT_WORKERS,	// pragma_workers.c
+	CONTEXT_LOGGER,		// pragma_logger.c
+	CONTEXT_OUTPUT,		// pragma_output.c
+	CONTEXT_ASSETS,		// pragma_assets.c
+	CONTEXT_ICONS,		// pragma_icons.c
+	CONTEXT_IMAGES,		// pragma_images.c
+	CONTEXT_SEARCH,		// pragma_search.c
+	CONTEXT_RELATED,	// pragma_related.c
+	CONTEXT_THUMBNAILS,	// pragma_thumbnails.c
+	CONTEXT_BUDGET,		// pragma_budget.c
+	CONTEXT_SLOT_COUNT
+};
+pragma_context* context_create(void);
+pragma_context* context_create_shared(unsigned int shared_slots);
+void context_destroy(pragma_context *ctx);
+pragma_context* context_bind(pragma_context *ctx);
+pragma_context* context_current(void);
+void* context_state(int slot, void *process_state, size_t size);
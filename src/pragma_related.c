@@ -0,0 +1,404 @@
+/**
+ * pragma_related.c - "Related posts" for single pages
+ *
+ * Comparing every post with every other post is O(N^2), which is too slow to run on every
+ * build of a large archive. Instead each post gets a MinHash signature over its features:
+ *
+ * - its tags, each counted RELATED_TAG_WEIGHT times so shared tags weigh more than words;
+ * - its words of RELATED_WORD_MIN or more letters (single-word shingles of the stripped text).
+ *
+ * The share of matching signature slots estimates the Jaccard similarity of two posts'
+ * feature sets. Signatures are split into RELATED_BANDS bands; posts that agree on a whole
+ * band land in the same bucket (locality-sensitive hashing), and only posts sharing a bucket
+ * are compared. Buckets with more than RELATED_BUCKET_MAX posts (a tag on everything) are
+ * ignored. The best `related_posts` candidates become the page's `related` list, which
+ * templates show with <!-- LOOP related --> ({RELATED_TITLE}, {RELATED_URL}).
+ *
+ * Signatures are cached in RELATED_CACHE_FILENAME in the output directory, keyed by a hash of
+ * the post's tags and content, so a build only recomputes signatures for changed posts.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define RELATED_HASHES		64	// signature length
+#define RELATED_BANDS		16	// RELATED_HASHES / RELATED_BANDS rows per band
+#define RELATED_ROWS		(RELATED_HASHES / RELATED_BANDS)
+#define RELATED_TAG_WEIGHT	4
+#define RELATED_WORD_MIN	4
+#define RELATED_BUCKET_MAX	256
+
+// A post's signature, and the hash of what it was computed from
+typedef struct signature {
+	uint64_t key;
+	uint32_t slots[RELATED_HASHES];
+} signature;
+
+// One post in one LSH bucket; sorting these by bucket makes each bucket a contiguous run
+typedef struct band_entry {
+	uint64_t bucket;
+	int post;
+} band_entry;
+
+// A candidate neighbor and its estimated similarity
+typedef struct candidate {
+	int post;
+	int matches;
+} candidate;
+
+static struct related_state {
+	signature *cached;	// loaded from the cache file, sorted by key
+	int cached_count;
+} g_related;
+
+/**
+ * current_related(): Cached signatures for the current site (see context_state()).
+ */
+static struct related_state* current_related(void) {
+	return context_state(CONTEXT_RELATED, &g_related, sizeof(g_related));
+}
+
+/**
+ * mix64(): Scramble a 64-bit value (the splitmix64 finalizer).
+ */
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/**
+ * compare_signatures(): qsort/bsearch comparator: signatures by key.
+ */
+static int compare_signatures(const void *a, const void *b) {
+	uint64_t x = ((const signature*)a)->key, y = ((const signature*)b)->key;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * compare_band_entries(): qsort comparator: by bucket, then post.
+ */
+static int compare_band_entries(const void *a, const void *b) {
+	const band_entry *x = a, *y = b;
+	if (x->bucket != y->bucket)
+		return x->bucket < y->bucket ? -1 : 1;
+	return x->post - y->post;
+}
+
+/**
+ * load_signature_cache(): Read cached signatures ("<key> <slot> <slot> ..." per line).
+ */
+static void load_signature_cache(const char *path) {
+	current_related()->cached = NULL;
+	current_related()->cached_count = 0;
+
+	FILE *file = utf8_fopen((utf8_path)path, "r");
+	if (!file)
+		return;
+
+	int size = 0;
+	signature sig;
+	unsigned long long key;
+	while (fscanf(file, "%llx", &key) == 1) {
+		sig.key = key;
+		int i = 0;
+		while (i < RELATED_HASHES && fscanf(file, "%x", &sig.slots[i]) == 1)
+			i++;
+		if (i < RELATED_HASHES)
+			break;	// truncated; what we have so far is still good
+
+		if (current_related()->cached_count == size) {
+			int new_size = size ? size * 2 : 256;
+			signature *grown = realloc(current_related()->cached, new_size * sizeof(signature));
+			if (!grown)
+				break;
+			current_related()->cached = grown;
+			size = new_size;
+		}
+		current_related()->cached[current_related()->cached_count++] = sig;
+	}
+	fclose(file);
+
+	if (current_related()->cached_count > 0)
+		qsort(current_related()->cached, current_related()->cached_count, sizeof(signature), compare_signatures);
+}
+
+/**
+ * save_signature_cache(): Write this build's signatures; posts that are gone drop out.
+ */
+static void save_signature_cache(const char *path, const signature *sigs, int count) {
+	FILE *file = utf8_fopen((utf8_path)path, "w");
+	if (!file) {
+		log_warn("can't write related posts cache %s", path);
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		fprintf(file, "%016llx", (unsigned long long)sigs[i].key);
+		for (int j = 0; j < RELATED_HASHES; j++)
+			fprintf(file, " %x", sigs[i].slots[j]);
+		fputc('\n', file);
+	}
+	fclose(file);
+}
+
+/**
+ * add_feature(): Fold one feature hash into a signature.
+ */
+static void add_feature(signature *sig, uint64_t feature) {
+	for (int i = 0; i < RELATED_HASHES; i++) {
+		uint32_t h = (uint32_t)mix64(feature ^ (0x9e3779b97f4a7c15ULL * (i + 1)));
+		if (h < sig->slots[i])
+			sig->slots[i] = h;
+	}
+}
+
+/**
+ * compute_signature(): MinHash signature of a post's tags and words.
+ */
+static void compute_signature(pp_page *page, signature *sig) {
+	for (int i = 0; i < RELATED_HASHES; i++)
+		sig->slots[i] = UINT32_MAX;
+
+	// Tags: "travel, food" => "travel", "food", each added RELATED_TAG_WEIGHT times
+	const wchar_t *tags = page->tags ? page->tags : L"";
+	while (*tags) {
+		while (*tags == L',' || iswspace(*tags))
+			tags++;
+		const wchar_t *end = tags;
+		while (*end && *end != L',')
+			end++;
+		const wchar_t *last = end;
+		while (last > tags && iswspace(last[-1]))
+			last--;
+		if (last > tags) {
+			uint64_t tag = hash_update(hash_bytes("tag", 3), tags, (last - tags) * sizeof(wchar_t));
+			for (uint64_t w = 0; w < RELATED_TAG_WEIGHT; w++)
+				add_feature(sig, mix64(tag + w));
+		}
+		tags = end;
+	}
+
+	// Words of the stripped text, lowercased
+	wchar_t *plain = strip_html_tags(page->content ? page->content : L"");
+	if (!plain)
+		return;
+	wchar_t word[64];
+	size_t length = 0;
+	for (const wchar_t *c = plain; ; c++) {
+		if (*c && iswalnum(*c)) {
+			if (length < SIZE_OF(word))
+				word[length++] = towlower(*c);
+			continue;
+		}
+		if (length >= RELATED_WORD_MIN && length < SIZE_OF(word))
+			add_feature(sig, hash_bytes(word, length * sizeof(wchar_t)));
+		length = 0;
+		if (!*c)
+			break;
+	}
+	free(plain);
+}
+
+/**
+ * page_key(): Hash of everything a signature depends on.
+ */
+static uint64_t page_key(pp_page *page) {
+	uint64_t h = HASH_SEED;
+	if (page->tags)
+		h = hash_update(h, page->tags, wcslen(page->tags) * sizeof(wchar_t));
+	h = hash_update(h, L"\n", sizeof(wchar_t));
+	if (page->content)
+		h = hash_update(h, page->content, wcslen(page->content) * sizeof(wchar_t));
+	return h;
+}
+
+/**
+ * compare_candidates(): qsort comparator: candidates by post.
+ */
+static int compare_candidates(const void *a, const void *b) {
+	return ((const candidate*)a)->post - ((const candidate*)b)->post;
+}
+
+/**
+ * add_candidate(): Record `post` as a candidate (duplicates are removed later).
+ *
+ * returns:
+ *  int (-1 on allocation failure; 0 otherwise)
+ */
+static int add_candidate(candidate **list, int *count, int *size, int post) {
+	if (*count == *size) {
+		int new_size = *size ? *size * 2 : 16;
+		candidate *grown = realloc(*list, new_size * sizeof(candidate));
+		if (!grown)
+			return -1;
+		*list = grown;
+		*size = new_size;
+	}
+	(*list)[(*count)++] = (candidate){ .post = post, .matches = 0 };
+	return 0;
+}
+
+/**
+ * related_posts_build(): Fill in each page's `related` list.
+ *
+ * arguments:
+ *  pp_page *pages (sorted page list; the lists point into it)
+ *  site_info *site (related_posts is the number of posts per list; 0 turns this off)
+ *  const char *output_dir (where RELATED_CACHE_FILENAME lives)
+ *  bool save_cache (false for dry runs)
+ *
+ * returns:
+ *  void
+ */
+void related_posts_build(pp_page *pages, site_info *site, const char *output_dir, bool save_cache) {
+	int k = site->related_posts;
+	if (k <= 0)
+		return;
+	if (k > RELATED_POSTS_MAX)
+		k = RELATED_POSTS_MAX;
+
+	int count = 0;
+	for (pp_page *p = pages; p != NULL; p = p->next)
+		count++;
+	if (count < 2)
+		return;
+
+	pp_page **posts = malloc(count * sizeof(pp_page*));
+	signature *sigs = malloc(count * sizeof(signature));
+	band_entry *bands = malloc((size_t)count * RELATED_BANDS * sizeof(band_entry));
+	size_t path_len = strlen(output_dir) + strlen(RELATED_CACHE_FILENAME) + 2;
+	char *cache_path = malloc(path_len);
+	if (!posts || !sigs || !bands || !cache_path) {
+		log_error("can't allocate memory for related posts");
+		free(posts);
+		free(sigs);
+		free(bands);
+		free(cache_path);
+		return;
+	}
+	bool slash = strlen(output_dir) > 0 && output_dir[strlen(output_dir) - 1] == '/';
+	snprintf(cache_path, path_len, "%s%s%s", output_dir, slash ? "" : "/", RELATED_CACHE_FILENAME);
+
+	// Signatures, from the cache when the post hasn't changed
+	load_signature_cache(cache_path);
+	int computed = 0, i = 0;
+	for (pp_page *p = pages; p != NULL; p = p->next, i++) {
+		posts[i] = p;
+		sigs[i].key = page_key(p);
+		signature *hit = current_related()->cached_count > 0
+			? bsearch(&sigs[i], current_related()->cached, current_related()->cached_count, sizeof(signature), compare_signatures)
+			: NULL;
+		if (hit) {
+			sigs[i] = *hit;
+		} else {
+			compute_signature(p, &sigs[i]);
+			computed++;
+		}
+	}
+	free(current_related()->cached);
+	current_related()->cached = NULL;
+	current_related()->cached_count = 0;
+	if (save_cache && computed > 0)
+		save_signature_cache(cache_path, sigs, count);
+	free(cache_path);
+
+	// Bucket every post once per band; equal buckets end up next to each other.
+	// Posts without tags or words have nothing to compare, so they stay out.
+	size_t entries = 0;
+	for (i = 0; i < count; i++) {
+		if (sigs[i].slots[0] == UINT32_MAX)
+			continue;
+		for (int b = 0; b < RELATED_BANDS; b++) {
+			uint64_t h = hash_update(HASH_SEED, &b, sizeof(b));
+			h = hash_update(h, &sigs[i].slots[b * RELATED_ROWS], RELATED_ROWS * sizeof(uint32_t));
+			bands[entries++] = (band_entry){ .bucket = h, .post = i };
+		}
+	}
+	qsort(bands, entries, sizeof(band_entry), compare_band_entries);
+
+	// Candidate neighbors per post: everyone it shares a bucket with
+	candidate **lists = calloc(count, sizeof(candidate*));
+	int *list_counts = calloc(count, sizeof(int));
+	int *list_sizes = calloc(count, sizeof(int));
+	if (!lists || !list_counts || !list_sizes) {
+		log_error("can't allocate memory for related posts");
+		free(lists);
+		free(list_counts);
+		free(list_sizes);
+		free(bands);
+		free(sigs);
+		free(posts);
+		return;
+	}
+
+	for (size_t run = 0; run < entries; ) {
+		size_t end = run + 1;
+		while (end < entries && bands[end].bucket == bands[run].bucket)
+			end++;
+		if (end - run > 1 && end - run <= RELATED_BUCKET_MAX) {
+			for (size_t a = run; a < end; a++)
+				for (size_t b = run; b < end; b++)
+					if (a != b)
+						add_candidate(&lists[bands[a].post], &list_counts[bands[a].post],
+						              &list_sizes[bands[a].post], bands[b].post);
+		}
+		run = end;
+	}
+	free(bands);
+
+	// Score the candidates and keep the best k; ties go to the newer post
+	int linked = 0;
+	for (i = 0; i < count; i++) {
+		pp_page *page = posts[i];
+		free(page->related);
+		page->related = NULL;
+		page->related_count = 0;
+
+		// Drop duplicates (posts that share several buckets), then score
+		candidate *list = lists[i];
+		int n = 0;
+		if (list_counts[i] > 0) {
+			qsort(list, list_counts[i], sizeof(candidate), compare_candidates);
+			for (int c = 0; c < list_counts[i]; c++)
+				if (n == 0 || list[n - 1].post != list[c].post)
+					list[n++] = list[c];
+		}
+		for (int c = 0; c < n; c++)
+			for (int s = 0; s < RELATED_HASHES; s++)
+				if (sigs[i].slots[s] == sigs[list[c].post].slots[s])
+					list[c].matches++;
+
+		int keep = n < k ? n : k;
+		if (keep > 0)
+			page->related = malloc(keep * sizeof(pp_page*));
+		if (page->related) {
+			for (int r = 0; r < keep; r++) {
+				int best = r;
+				for (int c = r + 1; c < n; c++) {
+					if (list[c].matches > list[best].matches ||
+					    (list[c].matches == list[best].matches &&
+					     posts[list[c].post]->date_stamp > posts[list[best].post]->date_stamp))
+						best = c;
+				}
+				candidate swap = list[r];
+				list[r] = list[best];
+				list[best] = swap;
+				page->related[r] = posts[list[r].post];
+			}
+			page->related_count = keep;
+			linked++;
+		}
+		free(list);
+	}
+
+	log_info("related posts: %d of %d posts linked (%d signatures computed)", linked, count, computed);
+
+	free(lists);
+	free(list_counts);
+	free(list_sizes);
+	free(sigs);
+	free(posts);
+}
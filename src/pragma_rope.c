@@ -0,0 +1,295 @@
+/**
+ * pragma_rope.c - Pages as lists of segments instead of one big string
+ *
+ * A page is the site header, whatever is particular to the page, and the footer. Building
+ * it as one wchar_t buffer meant copying the header and footer into every output (and
+ * guessing how big the buffer needed to be). A pp_rope holds the page as segments instead:
+ *
+ * - borrowed segments point at text that outlives the rope (site->header, site->footer,
+ *   string literals) and are never copied or freed;
+ * - owned segments are freed with the rope: rendered cards, or text appended piecewise,
+ *   which is gathered into one growing segment rather than one segment per call.
+ *
+ * The write stage encodes each segment and writes them all with one writev()
+ * (write_output_rope() in pragma_output.c), so the page is never joined into one buffer
+ * unless something needs it whole (minification, libpragma callers). Segments that were
+ * encoded ahead of time (the literal parts of the header and footer, see pragma_frames.c)
+ * are written as they are, and slots stand in for per-page values until they're filled.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define ROPE_INITIAL_SEGMENTS	16
+#define ROPE_INITIAL_TAIL	256	// wchar_t; the open segment doubles from here
+
+/**
+ * rope_new(): Create an empty rope.
+ *
+ * returns:
+ *  pp_rope* (free with rope_free(); NULL if out of memory)
+ */
+pp_rope* rope_new(void) {
+	pp_rope *rope = calloc(1, sizeof(pp_rope));
+	if (!rope)
+		return NULL;
+	rope->segments = malloc(ROPE_INITIAL_SEGMENTS * sizeof(rope_segment));
+	if (!rope->segments) {
+		free(rope);
+		return NULL;
+	}
+	rope->size = ROPE_INITIAL_SEGMENTS;
+	return rope;
+}
+
+/**
+ * rope_free(): Free a rope and its owned segments. Borrowed text is left alone.
+ *
+ * arguments:
+ *  pp_rope *rope (may be NULL)
+ */
+void rope_free(pp_rope *rope) {
+	if (!rope)
+		return;
+	for (int i = 0; i < rope->count; i++) {
+		if (rope->segments[i].owned)
+			free((wchar_t*)rope->segments[i].text);
+	}
+	free(rope->segments);
+	free(rope);
+}
+
+/**
+ * add_segment(): Append a segment record; closes the open tail. Returns NULL (and marks the
+ * rope failed) if out of memory.
+ */
+static rope_segment* add_segment(pp_rope *rope, const wchar_t *text, size_t length, bool owned) {
+	if (rope->count == rope->size) {
+		rope_segment *grown = realloc(rope->segments, rope->size * 2 * sizeof(rope_segment));
+		if (!grown) {
+			rope->failed = true;
+			return NULL;
+		}
+		rope->segments = grown;
+		rope->size *= 2;
+	}
+	rope_segment *segment = &rope->segments[rope->count++];
+	segment->text = text;
+	segment->length = length;
+	segment->capacity = 0;
+	segment->bytes = NULL;
+	segment->byte_length = 0;
+	segment->slot = 0;
+	segment->owned = owned;
+	segment->finished = false;
+	return segment;
+}
+
+/**
+ * rope_borrow(): Append text by reference. It must stay valid (and unchanged) until the
+ * rope is freed.
+ *
+ * arguments:
+ *  pp_rope *rope (destination)
+ *  const wchar_t *text (shared text; NULL or empty appends nothing)
+ */
+void rope_borrow(pp_rope *rope, const wchar_t *text) {
+	if (!rope || !text || !*text)
+		return;
+	add_segment(rope, text, wcslen(text), false);
+}
+
+/**
+ * rope_take(): Append a heap-allocated string; the rope frees it.
+ *
+ * arguments:
+ *  pp_rope *rope (destination)
+ *  wchar_t *text (heap string; NULL appends nothing)
+ */
+void rope_take(pp_rope *rope, wchar_t *text) {
+	if (!text)
+		return;
+	if (!rope || !add_segment(rope, text, wcslen(text), true))
+		free(text);
+}
+
+/**
+ * rope_append(): Append a copy of some text. Consecutive appends share one owned segment,
+ * so building a page from many small pieces doesn't make many segments.
+ *
+ * arguments:
+ *  pp_rope *rope (destination)
+ *  const wchar_t *text (copied; NULL or empty appends nothing)
+ */
+void rope_append(pp_rope *rope, const wchar_t *text) {
+	if (!rope || !text || !*text)
+		return;
+
+	size_t length = wcslen(text);
+	rope_segment *tail = rope->count > 0 ? &rope->segments[rope->count - 1] : NULL;
+	if (!tail || tail->capacity == 0) {
+		// no open segment: start one
+		size_t capacity = ROPE_INITIAL_TAIL;
+		while (capacity < length + 1)
+			capacity *= 2;
+		wchar_t *buffer = malloc(capacity * sizeof(wchar_t));
+		if (!buffer) {
+			rope->failed = true;
+			return;
+		}
+		buffer[0] = L'\0';
+		tail = add_segment(rope, buffer, 0, true);
+		if (!tail) {
+			free(buffer);
+			return;
+		}
+		tail->capacity = capacity;
+	} else if (tail->length + length + 1 > tail->capacity) {
+		size_t capacity = tail->capacity * 2;
+		while (capacity < tail->length + length + 1)
+			capacity *= 2;
+		wchar_t *grown = realloc((wchar_t*)tail->text, capacity * sizeof(wchar_t));
+		if (!grown) {
+			rope->failed = true;
+			return;
+		}
+		tail->text = grown;
+		tail->capacity = capacity;
+	}
+
+	wmemcpy((wchar_t*)tail->text + tail->length, text, length + 1);
+	tail->length += length;
+}
+
+/**
+ * rope_borrow_encoded(): Append text by reference along with its UTF-8 encoding, so the
+ * write stage doesn't encode it again for every page. Both must outlive the rope.
+ *
+ * arguments:
+ *  pp_rope *rope (destination)
+ *  const wchar_t *text (shared text)
+ *  size_t length (wchar_t in text)
+ *  const char *bytes (text as UTF-8; may be NULL to have it encoded at write time)
+ *  size_t byte_length (bytes in bytes)
+ *  bool finished (no tokens left in it: rope_map() skips it)
+ */
+void rope_borrow_encoded(pp_rope *rope, const wchar_t *text, size_t length, const char *bytes, size_t byte_length, bool finished) {
+	if (!rope || !text || length == 0)
+		return;
+	rope_segment *segment = add_segment(rope, text, length, false);
+	if (segment) {
+		segment->bytes = bytes;
+		segment->byte_length = byte_length;
+		segment->finished = finished;
+	}
+}
+
+/**
+ * rope_slot(): Append a placeholder for a value that's filled in later with
+ * rope_fill_slots(). Until then it reads as empty.
+ *
+ * arguments:
+ *  pp_rope *rope (destination)
+ *  int slot (caller-defined slot id; must be > 0)
+ */
+void rope_slot(pp_rope *rope, int slot) {
+	if (!rope || slot <= 0)
+		return;
+	rope_segment *segment = add_segment(rope, L"", 0, false);
+	if (segment)
+		segment->slot = slot;
+}
+
+/**
+ * rope_fill_slots(): Replace every placeholder with value(slot). Filled values count as
+ * finished: they aren't scanned for tokens afterward.
+ *
+ * arguments:
+ *  pp_rope *rope (rope to fill)
+ *  wchar_t* (*value)(int slot, void *arg) (returns a new heap string, or NULL for empty)
+ *  void *arg (passed to value)
+ */
+void rope_fill_slots(pp_rope *rope, wchar_t* (*value)(int slot, void *arg), void *arg) {
+	if (!rope || !value)
+		return;
+	for (int i = 0; i < rope->count; i++) {
+		rope_segment *segment = &rope->segments[i];
+		if (segment->slot <= 0)
+			continue;
+		wchar_t *text = value(segment->slot, arg);
+		segment->slot = 0;
+		segment->finished = true;
+		if (text) {
+			segment->text = text;
+			segment->length = wcslen(text);
+			segment->owned = true;
+		}
+	}
+}
+
+/**
+ * rope_map(): Replace each segment with transform(segment text), where the transform
+ * returns something different. Used for token replacement: tokens never span segments,
+ * so replacing them segment by segment is the same as replacing them in the whole page.
+ *
+ * arguments:
+ *  pp_rope *rope (rope to rewrite)
+ *  wchar_t* (*transform)(const wchar_t *text, void *arg) (returns a new heap string, or
+ *   NULL to keep the segment as it is)
+ *  void *arg (passed to transform)
+ */
+void rope_map(pp_rope *rope, wchar_t* (*transform)(const wchar_t *text, void *arg), void *arg) {
+	if (!rope || !transform)
+		return;
+	for (int i = 0; i < rope->count; i++) {
+		rope_segment *segment = &rope->segments[i];
+		if (segment->finished || segment->slot > 0)
+			continue;
+		wchar_t *result = transform(segment->text, arg);
+		if (!result || result == segment->text)
+			continue;
+		if (segment->owned)
+			free((wchar_t*)segment->text);
+		segment->text = result;
+		segment->length = wcslen(result);
+		segment->capacity = 0;	// closed: appends start a new segment
+		segment->bytes = NULL;
+		segment->owned = true;
+	}
+}
+
+/**
+ * rope_length(): Total length of a rope, in wide characters.
+ */
+size_t rope_length(const pp_rope *rope) {
+	size_t length = 0;
+	for (int i = 0; rope && i < rope->count; i++)
+		length += rope->segments[i].length;
+	return length;
+}
+
+/**
+ * rope_flatten(): Join a rope into one string, for callers that need the page whole.
+ *
+ * arguments:
+ *  const pp_rope *rope (rope to join)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated page; NULL if the rope is NULL, incomplete or out of memory)
+ */
+wchar_t* rope_flatten(const pp_rope *rope) {
+	if (!rope || rope->failed)
+		return NULL;
+
+	wchar_t *text = malloc((rope_length(rope) + 1) * sizeof(wchar_t));
+	if (!text)
+		return NULL;
+	size_t at = 0;
+	for (int i = 0; i < rope->count; i++) {
+		wmemcpy(text + at, rope->segments[i].text, rope->segments[i].length);
+		at += rope->segments[i].length;
+	}
+	text[at] = L'\0';
+	return text;
+}
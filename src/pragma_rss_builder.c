@@ -93,9 +93,10 @@ wchar_t* build_rss(pp_page* pages, site_info* site) {
         
         // Publication date (RFC 2822 format)
         wcscat(rss_output, L"<pubDate>");
-        struct tm *tm_info = localtime(&current->date_stamp);
+        struct tm tm_info;
+        localtime_r(&current->date_stamp, &tm_info);
         wchar_t *pub_date = malloc(64 * sizeof(wchar_t));
-        wcsftime(pub_date, 64, L"%a, %d %b %Y %H:%M:%S %z", tm_info);
+        wcsftime(pub_date, 64, L"%a, %d %b %Y %H:%M:%S %z", &tm_info);
         wcscat(rss_output, pub_date);
         free(pub_date);
         wcscat(rss_output, L"</pubDate>\n");
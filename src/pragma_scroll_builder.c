@@ -20,7 +20,7 @@
  *  wchar_t* (heap-allocated HTML buffer on success; NULL on error)
  *
  * notes:
- *  Uses localtime() per post (not thread-safe); the calendar array is sized from the
+ *  Uses localtime_r() per post (libpragma may build several sites at once); the calendar array is sized from the
  *  observed min/max year range and initialized to -1 for empty slots
  */
 wchar_t* build_scroll(pp_page* pages, site_info* site) {
@@ -30,12 +30,12 @@ wchar_t* build_scroll(pp_page* pages, site_info* site) {
 	// Find bounds and count posts in single pass
 	int min = INT_MAX, max = 0;
 	int c = 0, actual_year = 0;
-	struct tm *tm_info;
+	struct tm tm_info;
 
 	// First pass: just find min/max years and count posts
 	for (pp_page *p = pages; p != NULL ; p = p->next) {
-		tm_info = localtime(&p->date_stamp);
-		actual_year = tm_info->tm_year + 1900;
+		localtime_r(&p->date_stamp, &tm_info);
+		actual_year = tm_info.tm_year + 1900;
 
 		min = actual_year < min ? actual_year : min;
 		max = actual_year > max ? actual_year : max;
@@ -79,12 +79,12 @@ wchar_t* build_scroll(pp_page* pages, site_info* site) {
 
 	// Second pass: organize posts into calendar structure
 	for (pp_page *p = pages; p != NULL; p = p->next) {
-		tm_info = localtime(&p->date_stamp);
-		actual_year = (tm_info->tm_year + 1900) - min;	// actual_year = array offset here
+		localtime_r(&p->date_stamp, &tm_info);
+		actual_year = (tm_info.tm_year + 1900) - min;	// actual_year = array offset here
 		// Find the next available bucket to store this post pointer
 		for (int i = 0 ; i < MAX_MONTHLY_POSTS; i++ ) {
-			if (calendar[actual_year][tm_info->tm_mon][i] == NULL) {
-				calendar[actual_year][tm_info->tm_mon][i] = p;
+			if (calendar[actual_year][tm_info.tm_mon][i] == NULL) {
+				calendar[actual_year][tm_info.tm_mon][i] = p;
 				break;
 			}
 		}
@@ -130,7 +130,7 @@ wchar_t* build_scroll(pp_page* pages, site_info* site) {
 
 				if (k == 0) {
 					// First post of the month - create month heading
-					t = *localtime(&item->date_stamp);
+					localtime_r(&item->date_stamp, &t);
 					wchar_t month_name[64];
 					wcsftime(month_name, 64, L"%B", &t);
 
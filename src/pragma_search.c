@@ -0,0 +1,501 @@
+/**
+ * pragma_search.c - Static full-text search index (search:yes)
+ *
+ * Readers get search without a search server: the build writes an inverted index as static
+ * JSON files and a small client script (search/search.js) that fetches only what a query needs.
+ *
+ * - Each post's rendered content is stripped of tags and split into terms on the worker pool
+ *   while the main thread renders pages. Terms are lowercased runs of letters and digits,
+ *   SEARCH_TERM_MIN to SEARCH_TERM_MAX characters long.
+ * - search/meta.json lists the posts ({"t": title, "u": url}); a post's ID is its position
+ *   in that list. Posts are numbered by source file name, so IDs are stable between builds.
+ * - Posting lists are sharded by the first SEARCH_SHARD_PREFIX characters of the term:
+ *   search/<prefix>.json holds {"term":[id,tf,id,tf,...],...} for every term with that prefix.
+ *   Letters and digits below 0x80 name themselves; anything else is written as _<hex>_
+ *   ("été" => "_e9_t.json").
+ *
+ * Shards go through the write stage, so only shards whose terms changed are rewritten.
+ * Shards for prefixes that no longer occur are removed, except with --tar, which leaves
+ * the output directory alone. Since meta.json and the shards describe every post, the
+ * index is only built when the whole site was loaded.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+// Wide string literal for a numeric macro, so the client script agrees with the indexer
+#define NUMBER_TEXT_(n)	L ## #n
+#define NUMBER_TEXT(n)	NUMBER_TEXT_(n)
+
+// Terms and frequencies for one post; filled in by a worker job
+typedef struct search_doc {
+	pp_page *page;
+	wchar_t *text;		// copy of the rendered content; the job frees it
+	wchar_t **terms;	// sorted, unique
+	int *counts;
+	int term_count;
+	struct search_doc *next;
+} search_doc;
+
+// One (term, post, frequency) entry, for sorting the whole index by term
+typedef struct search_posting {
+	const wchar_t *term;
+	int doc;
+	int count;
+} search_posting;
+
+static struct search_state {
+	bool enabled;
+	search_doc *docs;
+	int doc_count;
+} g_search = { .enabled = false };
+
+/**
+ * current_search(): Search index state (g_search unless a libpragma context is bound).
+ */
+static struct search_state* current_search(void) {
+	return context_state(CONTEXT_SEARCH, &g_search, sizeof(g_search));
+}
+
+// The client: pragmaSearch("query", function (results) {...}) calls back with
+// [{t: title, u: url, score: n}, ...], best match first. Every query term must match.
+static const wchar_t *search_client_js =
+L"var pragmaSearch = (function () {\n"
+L"  var base = document.currentScript.src.replace(/[^\\/]*$/, \"\"), cache = {};\n"
+L"  function get(name) {\n"
+L"    if (!cache[name])\n"
+L"      cache[name] = fetch(base + name).then(function (r) { return r.ok ? r.json() : {}; });\n"
+L"    return cache[name];\n"
+L"  }\n"
+L"  function shard(term) {\n"
+L"    return Array.from(term).slice(0, " NUMBER_TEXT(SEARCH_SHARD_PREFIX) L").map(function (c) {\n"
+L"      return /^[a-z0-9]$/.test(c) ? c : \"_\" + c.codePointAt(0).toString(16) + \"_\";\n"
+L"    }).join(\"\") + \".json\";\n"
+L"  }\n"
+L"  return function (query, done) {\n"
+L"    var terms = query.toLowerCase().split(/[^\\p{L}\\p{N}]+/u).filter(function (t) {\n"
+L"      var n = Array.from(t).length;\n"
+L"      return n >= " NUMBER_TEXT(SEARCH_TERM_MIN) L" && n <= " NUMBER_TEXT(SEARCH_TERM_MAX) L";\n"
+L"    });\n"
+L"    if (!terms.length) { done([]); return; }\n"
+L"    Promise.all([get(\"meta.json\")].concat(terms.map(function (t) { return get(shard(t)); })))\n"
+L"      .then(function (loaded) {\n"
+L"        var docs = loaded[0].docs || [], scores = null;\n"
+L"        terms.forEach(function (t, i) {\n"
+L"          var list = loaded[i + 1][t] || [], next = {};\n"
+L"          for (var j = 0; j + 1 < list.length; j += 2)\n"
+L"            if (!scores || list[j] in scores)\n"
+L"              next[list[j]] = (scores ? scores[list[j]] : 0) + list[j + 1];\n"
+L"          scores = next;\n"
+L"        });\n"
+L"        done(Object.keys(scores).map(function (id) {\n"
+L"          var d = docs[id];\n"
+L"          return { t: d.t, u: d.u, score: scores[id] };\n"
+L"        }).sort(function (a, b) { return b.score - a.score; }));\n"
+L"      }, function () { done([]); });\n"
+L"  };\n"
+L"})();\n";
+
+/**
+ * compare_terms(): qsort comparator for an array of wide strings.
+ */
+static int compare_terms(const void *a, const void *b) {
+	return wcscmp(*(const wchar_t* const*)a, *(const wchar_t* const*)b);
+}
+
+/**
+ * compare_postings(): qsort comparator: by term, then by post ID.
+ */
+static int compare_postings(const void *a, const void *b) {
+	const search_posting *x = a, *y = b;
+	int c = wcscmp(x->term, y->term);
+	return c != 0 ? c : x->doc - y->doc;
+}
+
+/**
+ * compare_docs(): qsort comparator: posts by source file name.
+ */
+static int compare_docs(const void *a, const void *b) {
+	const search_doc *x = *(const search_doc* const*)a, *y = *(const search_doc* const*)b;
+	return wcscmp(x->page->source_filename ? x->page->source_filename : L"",
+	              y->page->source_filename ? y->page->source_filename : L"");
+}
+
+/**
+ * entity_length(): Length of an HTML entity (&#39;, &rsquo;) starting at `text`; 0 if none.
+ * strip_html_tags() only decodes a few entities, and the rest shouldn't become terms.
+ */
+static size_t entity_length(const wchar_t *text) {
+	if (*text != L'&')
+		return 0;
+	for (size_t i = 1; i < 12 && text[i]; i++) {
+		if (text[i] == L';')
+			return i > 1 ? i + 1 : 0;
+		if (!iswalnum(text[i]) && text[i] != L'#')
+			return 0;
+	}
+	return 0;
+}
+
+/**
+ * tokenize_job(): Worker job: strip one post's HTML and count its terms.
+ *
+ * arguments:
+ *  void *arg (search_doc*; owned by g_search, `text` is freed here)
+ */
+static void tokenize_job(void *arg) {
+	search_doc *doc = arg;
+	wchar_t *plain = strip_html_tags(doc->text);
+	free(doc->text);
+	doc->text = NULL;
+	if (!plain)
+		return;
+
+	// Collect every term occurrence, then sort so duplicates are adjacent
+	int used = 0, size = 0;
+	wchar_t **all = NULL;
+	wchar_t term[SEARCH_TERM_MAX + 1];
+	size_t length = 0;
+	bool too_long = false;
+
+	for (const wchar_t *c = plain; ; c++) {
+		size_t skip = entity_length(c);
+		if (*c && !skip && iswalnum(*c)) {
+			if (length < SEARCH_TERM_MAX)
+				term[length++] = towlower(*c);
+			else
+				too_long = true;
+			continue;
+		}
+
+		if (length >= SEARCH_TERM_MIN && !too_long) {
+			term[length] = L'\0';
+			if (used == size) {
+				int new_size = size ? size * 2 : 256;
+				wchar_t **grown = realloc(all, new_size * sizeof(wchar_t*));
+				if (!grown)
+					break;
+				all = grown;
+				size = new_size;
+			}
+			wchar_t *copy = wcsdup(term);
+			if (!copy)
+				break;
+			all[used++] = copy;
+		}
+		length = 0;
+		too_long = false;
+
+		if (!*c)
+			break;
+		if (skip)
+			c += skip - 1;
+	}
+	free(plain);
+
+	if (used > 0) {
+		qsort(all, used, sizeof(wchar_t*), compare_terms);
+		doc->terms = malloc(used * sizeof(wchar_t*));
+		doc->counts = malloc(used * sizeof(int));
+	}
+	if (!doc->terms || !doc->counts) {
+		for (int i = 0; i < used; i++)
+			free(all[i]);
+		free(all);
+		free(doc->terms);
+		free(doc->counts);
+		doc->terms = NULL;
+		doc->counts = NULL;
+		return;
+	}
+
+	int unique = 0;
+	for (int i = 0; i < used; i++) {
+		if (unique > 0 && wcscmp(doc->terms[unique - 1], all[i]) == 0) {
+			doc->counts[unique - 1]++;
+			free(all[i]);
+		} else {
+			doc->terms[unique] = all[i];
+			doc->counts[unique++] = 1;
+		}
+	}
+	doc->term_count = unique;
+	free(all);
+}
+
+/**
+ * search_index_init(): Start a build's search index.
+ *
+ * arguments:
+ *  bool enabled (search:yes in the config, not a dry run, and every post loaded: an index
+ *   written from a partial load (-u) would drop the other posts)
+ *
+ * returns:
+ *  void
+ */
+void search_index_init(bool enabled) {
+	current_search()->enabled = enabled;
+	current_search()->docs = NULL;
+	current_search()->doc_count = 0;
+}
+
+/**
+ * search_index_queue(): Queue every post (title and content) for tokenizing on the worker pool.
+ * Call once the content is final HTML (after parse_site_markdown()); the jobs work on copies.
+ *
+ * arguments:
+ *  pp_page *pages (head of the page list)
+ *
+ * returns:
+ *  void
+ */
+void search_index_queue(pp_page *pages) {
+	if (!current_search()->enabled)
+		return;
+
+	work_pool *pool = work_pool_get_global();
+	for (pp_page *page = pages; page != NULL; page = page->next) {
+		search_doc *doc = calloc(1, sizeof(search_doc));
+		if (!doc)
+			return;
+		doc->page = page;
+		// Titles are searchable too: index them as part of the text
+		const wchar_t *title = page->title ? page->title : L"";
+		const wchar_t *content = page->content ? page->content : L"";
+		size_t length = wcslen(title) + wcslen(content) + 2;
+		doc->text = malloc(length * sizeof(wchar_t));
+		if (doc->text)
+			swprintf(doc->text, length, L"%ls\n%ls", title, content);
+		if (!doc->text) {
+			free(doc);
+			return;
+		}
+		doc->next = current_search()->docs;
+		current_search()->docs = doc;
+		current_search()->doc_count++;
+
+		if (pool)
+			work_pool_submit(pool, tokenize_job, doc);
+		else
+			tokenize_job(doc);
+	}
+}
+
+/**
+ * shard_name(): Relative output path of the shard for `term`, like "search/fo.json".
+ *
+ * arguments:
+ *  const wchar_t *term (index term, at least SEARCH_SHARD_PREFIX characters)
+ *  char *name, size_t size (receives the path)
+ */
+static void shard_name(const wchar_t *term, char *name, size_t size) {
+	size_t at = snprintf(name, size, "%s", SITE_SEARCH);
+	for (int i = 0; i < SEARCH_SHARD_PREFIX && term[i] && at < size; i++) {
+		wchar_t c = term[i];
+		if ((c >= L'a' && c <= L'z') || (c >= L'0' && c <= L'9'))
+			at += snprintf(name + at, size - at, "%c", (char)c);
+		else
+			at += snprintf(name + at, size - at, "_%x_", (unsigned)c);
+	}
+	if (at < size)
+		snprintf(name + at, size - at, ".json");
+}
+
+/**
+ * written_shard(): True if `name` (a file in search/) is one of this build's shards.
+ */
+static bool written_shard(const char *name, char **written, int count) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s%s", SITE_SEARCH, name);
+	for (int i = 0; i < count; i++)
+		if (strcmp(written[i], path) == 0)
+			return true;
+	return false;
+}
+
+/**
+ * remove_stale_shards(): Delete shards (and their .gz copies) left from earlier builds whose
+ * prefixes no longer occur, so the client never reads postings for renumbered posts.
+ */
+static void remove_stale_shards(char **written, int count) {
+	char *dir = output_full_path(SITE_SEARCH);
+	if (!dir)
+		return;
+
+	char **names = NULL;
+	int name_count = 0;
+	directory_to_array((utf8_path)dir, &names, &name_count);
+	for (int i = 0; i < name_count; i++) {
+		char shard[256];
+		snprintf(shard, sizeof(shard), "%s", names[i]);
+		size_t len = strlen(shard);
+		if (len > 3 && strcmp(shard + len - 3, ".gz") == 0)
+			shard[len - 3] = '\0';
+
+		if (has_extension(shard, ".json") && strcmp(shard, "meta.json") != 0 &&
+		    !written_shard(shard, written, count)) {
+			char path[1024];
+			snprintf(path, sizeof(path), "%s%s", dir, names[i]);
+			if (unlink(path) == 0)
+				log_debug("removed stale search shard %s", path);
+		}
+		free(names[i]);
+	}
+	free(names);
+	free(dir);
+}
+
+/**
+ * search_index_free(): Release the per-post term lists once every target is written.
+ *
+ * returns:
+ *  void
+ */
+void search_index_free(void) {
+	search_doc *doc = current_search()->docs;
+	while (doc) {
+		search_doc *next = doc->next;
+		for (int i = 0; i < doc->term_count; i++)
+			free(doc->terms[i]);
+		free(doc->terms);
+		free(doc->counts);
+		free(doc->text);
+		free(doc);
+		doc = next;
+	}
+	current_search()->docs = NULL;
+	current_search()->doc_count = 0;
+}
+
+/**
+ * search_index_write(): Wait for the tokenizing jobs, then write search/meta.json, the
+ * shards and the client script through the write stage. Can be called once per output
+ * target; the term lists are kept until search_index_free().
+ *
+ * arguments:
+ *  site_info *site (for the base URL)
+ *
+ * returns:
+ *  int (number of shards; -1 on error or when search is off)
+ */
+int search_index_write(site_info *site) {
+	if (!current_search()->enabled)
+		return -1;
+
+	work_pool *pool = work_pool_get_global();
+	if (pool)
+		work_pool_wait(pool);
+
+	// Number the posts by file name so IDs (and so shards) only change when posts do
+	int count = current_search()->doc_count;
+	search_doc **docs = malloc((count > 0 ? count : 1) * sizeof(search_doc*));
+	if (!docs)
+		return -1;
+	size_t postings_count = 0;
+	int n = 0;
+	for (search_doc *doc = current_search()->docs; doc != NULL; doc = doc->next) {
+		docs[n++] = doc;
+		postings_count += doc->term_count;
+	}
+	qsort(docs, count, sizeof(search_doc*), compare_docs);
+
+	// meta.json: the post table
+	safe_buffer *buf = buffer_pool_get_global();
+	safe_append(L"{\"shard_prefix\":" NUMBER_TEXT(SEARCH_SHARD_PREFIX) L",\"docs\":[", buf);
+	for (int i = 0; i < count; i++) {
+		pp_page *page = docs[i]->page;
+		wchar_t path[512];
+		swprintf(path, SIZE_OF(path), L"%s%ls.html", SITE_POSTS,
+		         page->source_filename ? page->source_filename : L"");
+		wchar_t *url = build_url(site->base_url, path);
+
+		safe_append(i > 0 ? L",\n{\"t\":" : L"\n{\"t\":", buf);
+		safe_append_json(page->title, buf);
+		safe_append(L",\"u\":", buf);
+		safe_append_json(url ? url : path, buf);
+		safe_append_char(L'}', buf);
+		free(url);
+	}
+	safe_append(L"]}\n", buf);
+	write_output(SITE_SEARCH "meta.json", buf->buffer);
+
+	// Every (term, post) pair, sorted by term: each shard is then one contiguous run
+	search_posting *postings = malloc((postings_count > 0 ? postings_count : 1) * sizeof(search_posting));
+	if (!postings) {
+		buffer_pool_return_global(buf);
+		free(docs);
+		return -1;
+	}
+	size_t p = 0;
+	for (int i = 0; i < count; i++) {
+		for (int t = 0; t < docs[i]->term_count; t++) {
+			postings[p].term = docs[i]->terms[t];
+			postings[p].doc = i;
+			postings[p++].count = docs[i]->counts[t];
+		}
+	}
+	qsort(postings, postings_count, sizeof(search_posting), compare_postings);
+
+	char **written = NULL;
+	int shard_count = 0, shard_size = 0, term_count = 0;
+	size_t i = 0;
+	while (i < postings_count) {
+		char name[128];
+		shard_name(postings[i].term, name, sizeof(name));
+
+		safe_buffer_reset(buf);
+		safe_append_char(L'{', buf);
+		bool first_term = true;
+		while (i < postings_count) {
+			char next_name[128];
+			shard_name(postings[i].term, next_name, sizeof(next_name));
+			if (strcmp(next_name, name) != 0)
+				break;
+
+			// One term: "term":[id,tf,id,tf,...]
+			const wchar_t *term = postings[i].term;
+			safe_append(first_term ? L"\n\"" : L",\n\"", buf);
+			safe_append(term, buf);
+			safe_append(L"\":[", buf);
+			first_term = false;
+			term_count++;
+			for (bool first = true; i < postings_count && wcscmp(postings[i].term, term) == 0; i++) {
+				wchar_t pair[32];
+				swprintf(pair, SIZE_OF(pair), first ? L"%d,%d" : L",%d,%d",
+				         postings[i].doc, postings[i].count);
+				safe_append(pair, buf);
+				first = false;
+			}
+			safe_append_char(L']', buf);
+		}
+		safe_append(L"}\n", buf);
+		write_output(name, buf->buffer);
+
+		if (shard_count == shard_size) {
+			int new_size = shard_size ? shard_size * 2 : 64;
+			char **grown = realloc(written, new_size * sizeof(char*));
+			if (grown) {
+				written = grown;
+				shard_size = new_size;
+			}
+		}
+		if (shard_count < shard_size)
+			written[shard_count++] = strdup(name);
+	}
+	buffer_pool_return_global(buf);
+
+	write_output(SITE_SEARCH "search.js", search_client_js);
+	// An archive holds only this build's shards; the output directory isn't ours to prune
+	if (!output_stage_archiving())
+		remove_stale_shards(written, shard_count);
+
+	log_info("search index: %d posts, %d terms in %d shards", count, term_count, shard_count);
+
+	for (int s = 0; s < shard_count; s++)
+		free(written[s]);
+	free(written);
+	free(postings);
+	free(docs);
+	return shard_count;
+}
@@ -0,0 +1,325 @@
+/**
+ * pragma_service_worker.c - Service worker and precache manifest (service_worker:yes)
+ *
+ * Returning readers shouldn't have to fetch the stylesheet, icons and the posts they've
+ * already seen all over again. With `service_worker:yes` the build writes:
+ *
+ * - precache-manifest.json: [{"url": "/index.html", "revision": "<hash>"}, ...] for the
+ *   front index pages, the `precache_posts` most recent posts, the stylesheet and script
+ *   (fingerprinted names with `fingerprint:yes`) and the icons pages link to;
+ * - sw.js: a service worker with the same list built in. It caches every entry on install,
+ *   answers requests for them from the cache, and drops entries whose revision changed.
+ *
+ * Revisions are the write stage's content hashes (or a hash of the file, for assets pragma
+ * doesn't write), so sw.js only changes when something on the list does. Browsers compare
+ * sw.js byte for byte on each visit; a changed one installs in the background and fetches
+ * just the entries with new revisions.
+ *
+ * Pages register the worker through the {SERVICE_WORKER} token (in the default footer).
+ * When the option is switched off, sw.js is replaced with a worker that clears its cache
+ * and unregisters itself, so readers aren't left with a cache that never updates.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define SERVICE_WORKER_MARKER	"// pragma service worker"	// first line of every sw.js we write
+
+// One precached URL and the hash of its content
+typedef struct precache_entry {
+	wchar_t *url;		// site-relative, with a leading "/"
+	uint64_t revision;
+} precache_entry;
+
+typedef struct precache_list {
+	precache_entry *entries;
+	int count;
+	int size;
+} precache_list;
+
+// Everything after the manifest: install, activate and fetch handlers. Cache keys carry
+// the revision ("/p.css?__pragma=<hash>"), so a changed entry is a cache miss.
+static const wchar_t *service_worker_js =
+L"var CACHE = \"pragma-precache\";\n"
+L"function key(entry) { return entry.url + \"?__pragma=\" + entry.revision; }\n"
+L"var KEYS = {}, BY_URL = {};\n"
+L"PRECACHE.forEach(function (entry) { KEYS[key(entry)] = true; BY_URL[entry.url] = key(entry); });\n"
+L"function cachedPath(request) { var u = new URL(request.url); return u.pathname + u.search; }\n"
+L"\n"
+L"self.addEventListener(\"install\", function (event) {\n"
+L"  event.waitUntil(caches.open(CACHE).then(function (cache) {\n"
+L"    return cache.keys().then(function (requests) {\n"
+L"      var have = {};\n"
+L"      requests.forEach(function (r) { have[cachedPath(r)] = true; });\n"
+L"      return Promise.all(PRECACHE.filter(function (entry) { return !have[key(entry)]; })\n"
+L"        .map(function (entry) {\n"
+L"          return fetch(entry.url, { cache: \"no-cache\" }).then(function (response) {\n"
+L"            if (response.ok && !response.redirected)\n"
+L"              return cache.put(key(entry), response);\n"
+L"          }, function () {});\n"
+L"        }));\n"
+L"    });\n"
+L"  }).then(function () { return self.skipWaiting(); }));\n"
+L"});\n"
+L"\n"
+L"self.addEventListener(\"activate\", function (event) {\n"
+L"  event.waitUntil(caches.open(CACHE).then(function (cache) {\n"
+L"    return cache.keys().then(function (requests) {\n"
+L"      return Promise.all(requests.filter(function (r) { return !KEYS[cachedPath(r)]; })\n"
+L"        .map(function (r) { return cache.delete(r); }));\n"
+L"    });\n"
+L"  }).then(function () { return self.clients.claim(); }));\n"
+L"});\n"
+L"\n"
+L"self.addEventListener(\"fetch\", function (event) {\n"
+L"  var request = event.request, url = new URL(request.url);\n"
+L"  if (request.method !== \"GET\" || url.origin !== self.location.origin)\n"
+L"    return;\n"
+L"  var path = url.pathname.replace(/\\/$/, \"/index.html\");\n"
+L"  if (!BY_URL[path])\n"
+L"    return;\n"
+L"  event.respondWith(caches.open(CACHE).then(function (cache) {\n"
+L"    return cache.match(BY_URL[path]);\n"
+L"  }).then(function (hit) { return hit || fetch(request); }));\n"
+L"});\n";
+
+// Replaces sw.js when service_worker is switched off: empty the cache and step aside
+static const wchar_t *retired_worker_js =
+L"" SERVICE_WORKER_MARKER L" (retired)\n"
+L"self.addEventListener(\"install\", function () { self.skipWaiting(); });\n"
+L"self.addEventListener(\"activate\", function (event) {\n"
+L"  event.waitUntil(caches.delete(\"pragma-precache\").then(function () {\n"
+L"    return self.registration.unregister();\n"
+L"  }));\n"
+L"});\n";
+
+/**
+ * add_entry(): Add a URL to the precache list unless it's already there.
+ */
+static void add_entry(precache_list *list, const wchar_t *url, uint64_t revision) {
+	for (int i = 0; i < list->count; i++)
+		if (wcscmp(list->entries[i].url, url) == 0)
+			return;
+
+	if (list->count == list->size) {
+		int new_size = list->size ? list->size * 2 : 64;
+		precache_entry *grown = realloc(list->entries, new_size * sizeof(precache_entry));
+		if (!grown)
+			return;
+		list->entries = grown;
+		list->size = new_size;
+	}
+
+	wchar_t *copy = wcsdup(url);
+	if (!copy)
+		return;
+	list->entries[list->count].url = copy;
+	list->entries[list->count++].revision = revision;
+}
+
+/**
+ * file_revision(): Hash of a file pragma doesn't write itself (a plain stylesheet or icon),
+ * read from the output directory or, failing that, the source directory.
+ *
+ * arguments:
+ *  const char *relative_path (path within the site, no leading "/")
+ *  const char *source_dir (site source directory)
+ *  uint64_t *revision (receives the hash)
+ *
+ * returns:
+ *  bool (false if the file can't be read in either place)
+ */
+static bool file_revision(const char *relative_path, const char *source_dir, uint64_t *revision) {
+	char *paths[2] = { output_full_path(relative_path), NULL };
+	if (source_dir) {
+		char path[PATH_MAX];
+		bool slash = source_dir[0] && source_dir[strlen(source_dir) - 1] == '/';
+		snprintf(path, sizeof(path), "%s%s%s", source_dir, slash ? "" : "/", relative_path);
+		paths[1] = strdup(path);
+	}
+
+	bool found = false;
+	for (size_t i = 0; i < SIZE_OF(paths) && !found; i++) {
+		size_t length = 0;
+		char *bytes = paths[i] ? read_file_bytes(paths[i], &length) : NULL;
+		if (bytes) {
+			*revision = hash_bytes(bytes, length);
+			found = true;
+			free(bytes);
+		}
+	}
+	free(paths[0]);
+	free(paths[1]);
+	return found;
+}
+
+/**
+ * add_asset(): Add a stylesheet, script or icon by the path pages use for it ("/p.css"),
+ * switched to its fingerprinted name when there is one. Anything after "?" or "#" is
+ * dropped, so sprite references ("/icons.svg#icon-fox") all add the sheet once.
+ */
+static void add_asset(precache_list *list, const wchar_t *path, const char *source_dir) {
+	while (*path == L'/')
+		path++;
+	size_t length = wcscspn(path, L"?#");
+	if (length == 0)
+		return;
+
+	wchar_t *plain = malloc((length + 1) * sizeof(wchar_t));
+	if (!plain)
+		return;
+	wmemcpy(plain, path, length);
+	plain[length] = L'\0';
+	const wchar_t *fingerprinted = fingerprinted_path(plain);
+	const wchar_t *name = fingerprinted ? fingerprinted : plain;
+
+	char *relative = char_convert(name);
+	uint64_t revision = 0;
+	if (relative && (output_hash(relative, &revision) || file_revision(relative, source_dir, &revision))) {
+		size_t size = wcslen(name) + 2;
+		wchar_t *url = malloc(size * sizeof(wchar_t));
+		if (url) {
+			swprintf(url, size, L"/%ls", name);
+			add_entry(list, url, revision);
+			free(url);
+		}
+	} else if (relative) {
+		log_warn("service worker: can't find %s to precache", relative);
+	}
+
+	free(relative);
+	free(plain);
+}
+
+/**
+ * add_output(): Add a page the write stage produced this build, like "c/fido.html".
+ */
+static void add_output(precache_list *list, const char *relative_path) {
+	uint64_t revision = 0;
+	if (!output_hash(relative_path, &revision))
+		return;
+
+	wchar_t *path = wchar_convert(relative_path);
+	if (!path)
+		return;
+	size_t size = wcslen(path) + 2;
+	wchar_t *url = malloc(size * sizeof(wchar_t));
+	if (url) {
+		swprintf(url, size, L"/%ls", path);
+		add_entry(list, url, revision);
+		free(url);
+	}
+	free(path);
+}
+
+/**
+ * write_service_worker(): Write precache-manifest.json and sw.js for this build. Call
+ * after every page, index and asset has gone through the write stage (their hashes are
+ * the revisions) and before output_stage_finish().
+ *
+ * With service_worker off, only replaces an sw.js left by an earlier build with one that
+ * unregisters itself.
+ *
+ * arguments:
+ *  pp_page *pages (sorted page list, newest first)
+ *  site_info *site (site configuration)
+ *  const char *source_dir (site source directory, for assets that live there)
+ *
+ * returns:
+ *  int (number of precached URLs; -1 on error or when the option is off)
+ */
+int write_service_worker(pp_page *pages, site_info *site, const char *source_dir) {
+	if (!site->service_worker) {
+		char *path = output_full_path(SERVICE_WORKER_FILENAME);
+		size_t length = 0;
+		char *existing = path ? read_file_bytes(path, &length) : NULL;
+		if (existing && strncmp(existing, SERVICE_WORKER_MARKER, strlen(SERVICE_WORKER_MARKER)) == 0)
+			write_output(SERVICE_WORKER_FILENAME, retired_worker_js);
+		free(existing);
+		free(path);
+		return -1;
+	}
+
+	precache_list list = { NULL, 0, 0 };
+
+	// Front index pages: enough to cover the recent posts, and always the first one
+	int total_posts = 0;
+	for (pp_page *p = pages; p != NULL; p = p->next)
+		total_posts++;
+	if (site->index_size > 0) {
+		int index_pages = (site->precache_posts + site->index_size - 1) / site->index_size;
+		int total_index_pages = (total_posts + site->index_size - 1) / site->index_size;
+		if (index_pages < 1)
+			index_pages = 1;
+		for (int i = 0; i < index_pages && i < total_index_pages; i++) {
+			char index_path[64];
+			if (i == 0)
+				snprintf(index_path, sizeof(index_path), "index.html");
+			else
+				snprintf(index_path, sizeof(index_path), "index%d.html", i);
+			add_output(&list, index_path);
+		}
+	}
+
+	// The most recent posts
+	int posts = 0;
+	for (pp_page *p = pages; p != NULL && posts < site->precache_posts; p = p->next, posts++) {
+		char *slug = p->source_filename ? char_convert(p->source_filename) : NULL;
+		if (!slug)
+			continue;
+		char post_path[PATH_MAX];
+		snprintf(post_path, sizeof(post_path), "%s%s.html", SITE_POSTS, slug);
+		add_output(&list, post_path);
+		free(slug);
+	}
+
+	// Header assets; an inlined stylesheet travels inside the pages
+	bool css_inlined = site->stylesheet && wcsncmp(site->stylesheet, L"<style", 6) == 0;
+	if (!css_inlined && site->css && wcslen(site->css) > 0)
+		add_asset(&list, site->css, source_dir);
+	if (site->include_js && site->js && wcslen(site->js) > 0)
+		add_asset(&list, site->js, source_dir);
+
+	// Icons, as pages refer to them: files, the sprite sheet, or nothing for data: URIs
+	for (int i = 0; i < site->icon_sentinel; i++) {
+		wchar_t *name = wchar_convert(site->icons[i]);
+		const wchar_t *src = name ? icon_src(name) : NULL;
+		if (src && wcsncmp(src, L"data:", 5) != 0)
+			add_asset(&list, src, source_dir);
+		free(name);
+	}
+
+	// The manifest, then the worker with the manifest built in
+	safe_buffer *buf = buffer_pool_get_global();
+	safe_append(L"[", buf);
+	for (int i = 0; i < list.count; i++) {
+		wchar_t revision[32];
+		swprintf(revision, SIZE_OF(revision), L"%016llx", (unsigned long long)list.entries[i].revision);
+		safe_append(i > 0 ? L",\n{\"url\":" : L"\n{\"url\":", buf);
+		safe_append_json(list.entries[i].url, buf);
+		safe_append(L",\"revision\":", buf);
+		safe_append_json(revision, buf);
+		safe_append_char(L'}', buf);
+	}
+	safe_append(L"\n]\n", buf);
+	write_output(PRECACHE_MANIFEST_FILENAME, buf->buffer);
+
+	wchar_t *manifest = wcsdup(buf->buffer);
+	safe_buffer_reset(buf);
+	safe_append(L"" SERVICE_WORKER_MARKER " (generated; see " PRECACHE_MANIFEST_FILENAME ")\n", buf);
+	safe_append(L"var PRECACHE = ", buf);
+	safe_append(manifest ? manifest : L"[]\n", buf);
+	safe_append(L";\n", buf);
+	safe_append(service_worker_js, buf);
+	write_output(SERVICE_WORKER_FILENAME, buf->buffer);
+	buffer_pool_return_global(buf);
+	free(manifest);
+
+	log_info("service worker: %d precached URL%s", list.count, list.count == 1 ? "" : "s");
+
+	for (int i = 0; i < list.count; i++)
+		free(list.entries[i].url);
+	free(list.entries);
+	return list.count;
+}
@@ -39,43 +39,27 @@ void append(wchar_t *string, wchar_t *result, size_t *j) {
 }
 
 /**
- * char_convert(): Convert a wide-character string to a newly allocated narrow string.
+ * char_convert(): Convert a wide-character string to a newly allocated UTF-8 string.
  *
- * Uses wcstombs() to produce a UTF-8/locale-encoded char*.
+ * Always UTF-8, whatever the locale (see pragma_utf8.c).
  *
  * arguments:
  *  const wchar_t *w (source wide string; must not be NULL)
  *
  * returns:
- *  char* (heap-allocated narrow string; NULL on allocation failure)
+ *  char* (heap-allocated narrow string; NULL on invalid characters or allocation failure)
  */
 char* char_convert(const wchar_t* w) {
-	size_t len = wcstombs(NULL, w, 0);
-	if (len == (size_t)-1) {
-		log_error("invalid wide character sequence in char_convert()");
-		return NULL;
-	}
-
-	char *out_str = malloc(len + 1);
-
-	if (out_str != NULL) {
-		size_t result = wcstombs(out_str, w, len + 1);
-		if (result == (size_t)-1) {
-			log_error("conversion failed in char_convert()");
-			free(out_str);
-			return NULL;
-		}
-		return out_str;
-	} else {
-		log_error("malloc() failed while converting string types in char_convert()!");
-		return NULL;
-	}
+	char *out_str = utf8_encode(w, wcslen(w), NULL);
+	if (out_str == NULL)
+		log_error("invalid wide character sequence (or malloc() failure) in char_convert()");
+	return out_str;
 }
 
 /**
- * wchar_convert(): Convert a narrow string to a newly allocated wide-character string.
+ * wchar_convert(): Convert a UTF-8 string to a newly allocated wide-character string.
  *
- * Uses mbstowcs() to produce a wchar_t*.
+ * Malformed UTF-8 is an error rather than being guessed at.
  *
  * arguments:
  *  const char *c (source char*; must not be NULL)
@@ -84,29 +68,10 @@ char* char_convert(const wchar_t* w) {
  *  wchar_t* (heap-allocated wide string; NULL on error)
  */
 wchar_t* wchar_convert(const char* c) {
-
-	size_t len = mbstowcs(NULL, c, 0);
-
-	if (len < 0) {
+	wchar_t *w = utf8_decode(c, strlen(c), NULL, false);
+	if (w == NULL)
 		log_error("Can't convert character string to wide characters (wchar_convert())");
-		return NULL;
-	}
-
-	wchar_t* w = malloc((len + 1) * sizeof(wchar_t));
-
-	if (w == NULL) {
-		log_error("malloc() failure in wchar_convert!");
-		return NULL;
-	}
-
-	if (mbstowcs(w, c, len + 1) < 0 ) {
-        	log_error("Error converting character to wide char");
-		free(w);
-        	return NULL;
-	}
-
 	return w;
-
 }
 
 /**
@@ -289,17 +289,17 @@ static bool page_has_tag(page_tags *parsed, const wchar_t *tag) {
  * Uses site header/footer templates and replaces common {TOKENS}.
  *
  * Memory:
- *  Returns a heap-allocated wide-character buffer containing the Tag Index HTML.
- *  Caller must free(). Per-tag pages are written to disk as a side effect.
+ *  Returns the Tag Index HTML as a rope that borrows the site header and footer.
+ *  Caller must rope_free(). Per-tag pages are written to disk as a side effect.
  *
  * arguments:
  *  pp_page  *pages (head of linked list of posts; must not be NULL)
- *  site_info*site  (site configuration, including header/footer/base_dir; must not be NULL)
+ *  site_info*site  (site configuration, including header/footer; must not be NULL)
  *
  * returns:
- *  wchar_t* (heap-allocated HTML for the Tag Index; NULL on error)
+ *  pp_rope* (the Tag Index; NULL on error)
  */
-wchar_t* build_tag_index(pp_page* pages, site_info* site) {
+pp_rope* build_tag_index(pp_page* pages, site_info* site) {
 	if (!pages)
 		return NULL;
 
@@ -336,93 +336,91 @@ wchar_t* build_tag_index(pp_page* pages, site_info* site) {
 		}
 	}
 
-	printf("=> found %d unique tags, sorting...\n", unique_tags->key_count);
+	log_info("found %d unique tags, sorting...", unique_tags->key_count);
 
 	// Sort tags using qsort (O(n log n))
 	qsort(unique_tags->keys, unique_tags->key_count, sizeof(wchar_t*), compare_wchar_strings);
 
-	printf("=> generating tag index pages (0/%d)", unique_tags->key_count);
-	fflush(stdout);  // Ensure output appears immediately
+	pp_rope *tag_output = rope_new();
+	rope_frame(tag_output, site, site->header);
 
-	wchar_t *tag_output = malloc(123456 * sizeof(wchar_t));
-	wcscpy(tag_output, site->header);
+	rope_append(tag_output, L"<div class=\"post_card\"><h3>View as: <a href=\"/s/\">scroll</a> | tag index</h3>\n");
 
-	wcscat(tag_output, L"<div class=\"post_card\"><h3>View as: <a href=\"/s/\">scroll</a> | tag index</h3>\n");
-
-	wcscat(tag_output, L"<h2>Tag Index</h2>\n<ul>\n");
+	rope_append(tag_output, L"<h2>Tag Index</h2>\n<ul>\n");
 	
 	bool in_list = false;
 
+	// Posts for the current tag, collected for its JSON listing
+	pp_page **tagged_pages = site->json_api ? malloc((parsed_count > 0 ? parsed_count : 1) * sizeof(pp_page*)) : NULL;
+
 	// Prepare the output canvas for an index of all the pages tagged with a given term
 	for (int tag_idx = 0; tag_idx < unique_tags->key_count; tag_idx++) {
 		wchar_t *current_tag = unique_tags->keys[tag_idx];
 
-		// Progress indicator - update every 100 tags or at significant milestones
-		if ((tag_idx + 1) % 100 == 0 || tag_idx + 1 == unique_tags->key_count) {
-			printf("\r=> generating tag index pages (%d/%d)", tag_idx + 1, unique_tags->key_count);
-			fflush(stdout);
-		}
+		// Progress bar (the logger limits how often it's redrawn)
+		log_progress("tag index pages", tag_idx + 1, unique_tags->key_count);
 
-		wchar_t *single_tag_index_output = malloc(65536 * sizeof(wchar_t));
-		wcscpy(single_tag_index_output, site->header);
-		wcscat(single_tag_index_output, L"<h2>Pages tagged \"");
-		wcscat(single_tag_index_output, current_tag);
-		wcscat(single_tag_index_output, L"\"</h2>\n<ul>\n");
+		pp_rope *single_tag_index_output = rope_new();
+		rope_frame(single_tag_index_output, site, site->header);
+		rope_append(single_tag_index_output, L"<h2>Pages tagged \"");
+		rope_append(single_tag_index_output, current_tag);
+		rope_append(single_tag_index_output, L"\"</h2>\n<ul>\n");
 
-		wcscat(tag_output, L"<li><b>");
-		wcscat(tag_output, current_tag);
-		wcscat(tag_output, L"</b></li>\n");
+		rope_append(tag_output, L"<li><b>");
+		rope_append(tag_output, current_tag);
+		rope_append(tag_output, L"</b></li>\n");
+		int tagged_count = 0;
 		for (int i = 0; i < parsed_count; i++) {
 			if (page_has_tag(parsed_pages[i], current_tag)) {
 				pp_page *p = parsed_pages[i]->page;	
+				if (tagged_pages)
+					tagged_pages[tagged_count++] = p;
 				if (!in_list) {
-					wcscat(tag_output, L"<ul>\n");
+					rope_append(tag_output, L"<ul>\n");
 					in_list = true;
 				}
 				// TODO: there is some needless verbosity around generating links, and I don't just mean the
 				// hard-coded paths -- need a convenience function in general
-				wcscat(single_tag_index_output, L"<li><a href=\"/c/");
-				wcscat(tag_output, L"<li><a href=\"/c/");
+				rope_append(single_tag_index_output, L"<li><a href=\"/c/");
+				rope_append(tag_output, L"<li><a href=\"/c/");
 				
 				if (p->source_filename) {
-					wcscat(tag_output, p->source_filename);
-					wcscat(single_tag_index_output, p->source_filename);
+					rope_append(tag_output, p->source_filename);
+					rope_append(single_tag_index_output, p->source_filename);
 				}
 
-				wcscat(single_tag_index_output, L".html\">");
-				wcscat(tag_output, L".html\">");
+				rope_append(single_tag_index_output, L".html\">");
+				rope_append(tag_output, L".html\">");
 
-				wcscat(single_tag_index_output, p->title);
-				wcscat(tag_output, p->title);			
+				rope_append(single_tag_index_output, p->title);
+				rope_append(tag_output, p->title);			
 			
-				wcscat(single_tag_index_output, L"</a> on ");	
-				wcscat(tag_output, L"</a> on ");
+				rope_append(single_tag_index_output, L"</a> on ");	
+				rope_append(tag_output, L"</a> on ");
 			
                 link_date = legible_date(p->date_stamp);
-                wcscat(tag_output, link_date);
-				wcscat(single_tag_index_output, link_date);
+                rope_append(tag_output, link_date);
+				rope_append(single_tag_index_output, link_date);
                 free(link_date);
 				
-				wcscat(single_tag_index_output, L"</li>\n");	
-				wcscat(tag_output, L"</li>\n");
+				rope_append(single_tag_index_output, L"</li>\n");	
+				rope_append(tag_output, L"</li>\n");
 			}
 		}
 		if (in_list) {
-			wcscat(tag_output, L"</ul><p></p>\n");
+			rope_append(tag_output, L"</ul><p></p>\n");
 			in_list = false;
 		}
-		wcscat(single_tag_index_output, L"</ul>\n");
-		wcscat(single_tag_index_output, site->footer);
-
-		char *tag_destination = malloc(wcslen(site->base_dir) + 64);
-		strcpy(tag_destination, char_convert(site->base_dir));
-		strcat(tag_destination, "t/");
-		strcat(tag_destination, char_convert(current_tag));
-		strcat(tag_destination, ".html");
+		rope_append(single_tag_index_output, L"</ul>\n");
+		rope_frame(single_tag_index_output, site, site->footer);
 
 		// Build URL for this individual tag page
 		char *base_url_str = char_convert(site->base_url);
 		char *tag_str = char_convert(current_tag);
+
+		// Destination, relative to the output directory
+		char *tag_destination = malloc(strlen(SITE_TAG_INDEX) + strlen(tag_str) + 6);
+		sprintf(tag_destination, "%s%s.html", SITE_TAG_INDEX, tag_str);
 		char *tag_url_str = malloc(256);
 		snprintf(tag_url_str, 256, "%st/%s.html", base_url_str, tag_str);
 		wchar_t *tag_url = wchar_convert(tag_url_str);
@@ -430,25 +428,28 @@ wchar_t* build_tag_index(pp_page* pages, site_info* site) {
 		// Apply common token replacements
 		wchar_t tag_description[256];
 		swprintf(tag_description, 256, L"Posts tagged with '%ls' on %ls", current_tag, site->site_name);
-		wchar_t *temp_output = apply_common_tokens(single_tag_index_output, site, tag_url, current_tag, tag_description, NULL, NULL, NULL);
-		free(single_tag_index_output);
-		single_tag_index_output = temp_output;
+		rope_apply_common_tokens(single_tag_index_output, site, tag_url, current_tag, tag_description, NULL, NULL, NULL);
 		
 		free(base_url_str);
 		free(tag_str);
 		free(tag_url_str);
 		free(tag_url);
 
-		write_file_contents(tag_destination, single_tag_index_output);
+		write_output_rope(tag_destination, single_tag_index_output);
 		free(tag_destination);
-		free(single_tag_index_output);
+		rope_free(single_tag_index_output);
+
+		// The same listing as JSON, for json_api:yes
+		if (tagged_pages)
+			write_tag_json(current_tag, tagged_pages, tagged_count, site);
 	}
+	free(tagged_pages);
 
-	printf("\n=> tag index generation complete\n");
+	log_info("tag index generation complete");
 
-	wcscat(tag_output, L"</ul>\n</div>\n");
-	wcscat(tag_output, L"<hr>\n");
-	wcscat(tag_output, site->footer);
+	rope_append(tag_output, L"</ul>\n</div>\n");
+	rope_append(tag_output, L"<hr>\n");
+	rope_frame(tag_output, site, site->footer);
 	// Cleanup pre-parsed page data
 	for (int i = 0; i < parsed_count; i++) {
 		free_page_tags(parsed_pages[i]);
@@ -466,9 +467,7 @@ wchar_t* build_tag_index(pp_page* pages, site_info* site) {
 	// Apply common token replacements (this handles memory management internally)
 	wchar_t tag_index_description[256];
 	swprintf(tag_index_description, 256, L"Index of tags on %ls", site->site_name);
-	wchar_t *old_output = tag_output;
-	tag_output = apply_common_tokens(tag_output, site, tag_index_url, L"All posts", tag_index_description, NULL, NULL, NULL);
-	free(old_output);  // Free the original since apply_common_tokens returns new memory
+	rope_apply_common_tokens(tag_output, site, tag_index_url, L"All posts", tag_index_description, NULL, NULL, NULL);
 	
 	free(tag_index_url);
 
@@ -0,0 +1,272 @@
+/**
+ * pragma_tar.c - The generated site as a tar stream
+ *
+ * `pragma -s site -o - --tar | ssh host tar -x -C /var/www` deploys without writing the
+ * site to disk first. With an archive attached (output_stage_archive()), the write stage
+ * hands every output here instead of writing a file, and it goes into the stream right
+ * away, so entries appear in the order pages are produced.
+ *
+ * Entries are POSIX ustar. Headers are the same from build to build: mode 0644 (0755 for
+ * directories), owner 0:0 with no names, and every mtime set to SOURCE_DATE_EPOCH when that
+ * is set, 0 otherwise. A directory entry goes out before the first file in it. Paths that
+ * don't fit the ustar name and prefix fields get a pax "path" record. With --tar-gz the
+ * stream is gzipped (zlib leaves the gzip mtime at 0, so that's reproducible too).
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#define TAR_BLOCK	512
+#define TAR_DIR_TABLE	1031	// prime; one entry per directory in the site (t/<tag>/ adds up)
+#define TAR_BUFFER	(128 * 1024)
+
+typedef struct tar_dir {
+	char *path;		// with trailing slash, as it appears in the archive
+	struct tar_dir *next;
+} tar_dir;
+
+struct pp_tar {
+	gzFile out;		// transparent (uncompressed) unless --tar-gz
+	time_t mtime;
+	bool failed;
+	tar_dir *dirs[TAR_DIR_TABLE];
+};
+
+/**
+ * write_raw(): Append bytes to the stream; remembers a failure for tar_close().
+ */
+static void write_raw(pp_tar *tar, const void *data, size_t length) {
+	const char *p = data;
+	while (length > 0 && !tar->failed) {
+		unsigned int chunk = length > INT_MAX ? INT_MAX : (unsigned int)length;
+		if (gzwrite(tar->out, p, chunk) != (int)chunk)
+			tar->failed = true;
+		p += chunk;
+		length -= chunk;
+	}
+}
+
+/**
+ * pad_block(): Zero-fill to the end of the block after `length` bytes of data.
+ */
+static void pad_block(pp_tar *tar, size_t length) {
+	static const char zeros[TAR_BLOCK];
+	if (length % TAR_BLOCK)
+		write_raw(tar, zeros, TAR_BLOCK - length % TAR_BLOCK);
+}
+
+/**
+ * put_octal(): Write `value` into a header field as zero-padded octal with a NUL.
+ */
+static void put_octal(char *field, size_t size, unsigned long long value) {
+	snprintf(field, size, "%0*llo", (int)(size - 1), value);
+}
+
+/**
+ * write_header(): Write one header block. Names that don't fit are split at a slash into
+ * the prefix field; if that doesn't work either, a pax record carries the whole path and
+ * the header keeps what fits.
+ */
+static void write_header(pp_tar *tar, const char *name, unsigned long long size, char type, int mode) {
+	size_t length = strlen(name);
+	const char *prefix_end = NULL;
+	if (length > 100) {
+		for (const char *slash = strchr(name, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+			size_t prefix = slash - name;
+			if (prefix > 155)
+				break;
+			if (length - prefix - 1 <= 100 && length - prefix - 1 > 0) {
+				prefix_end = slash;
+				break;
+			}
+		}
+		if (!prefix_end) {
+			// "<length> path=<name>\n", where the length counts its own digits
+			size_t body = strlen(" path=\n") + length;
+			size_t record = body + 1;
+			while (record != body + snprintf(NULL, 0, "%zu", record))
+				record = body + snprintf(NULL, 0, "%zu", record);
+			char *pax = malloc(record + 1);
+			if (!pax) {
+				tar->failed = true;
+				return;
+			}
+			snprintf(pax, record + 1, "%zu path=%s\n", record, name);
+			write_header(tar, "././@PaxHeader", record, 'x', 0644);
+			write_raw(tar, pax, record);
+			pad_block(tar, record);
+			free(pax);
+		}
+	}
+
+	char header[TAR_BLOCK];
+	memset(header, 0, sizeof(header));
+	if (prefix_end) {
+		memcpy(header + 345, name, prefix_end - name);
+		memcpy(header, prefix_end + 1, length - (prefix_end - name) - 1);
+	} else {
+		memcpy(header, name, length > 100 ? 100 : length);
+	}
+	put_octal(header + 100, 8, (unsigned long long)mode);
+	put_octal(header + 108, 8, 0);
+	put_octal(header + 116, 8, 0);
+	put_octal(header + 124, 12, size);
+	put_octal(header + 136, 12, (unsigned long long)tar->mtime);
+	header[156] = type;
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+
+	// The checksum is taken with its own field full of spaces
+	memset(header + 148, ' ', 8);
+	unsigned int sum = 0;
+	for (int i = 0; i < TAR_BLOCK; i++)
+		sum += (unsigned char)header[i];
+	snprintf(header + 148, 8, "%06o", sum);
+	header[155] = ' ';
+
+	write_raw(tar, header, sizeof(header));
+}
+
+/**
+ * add_parent_dirs(): Write a directory entry for each directory above `path` that doesn't
+ * have one yet.
+ */
+static void add_parent_dirs(pp_tar *tar, const char *path) {
+	for (const char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		size_t length = slash - path + 1;
+		unsigned int b = (unsigned int)(hash_bytes(path, length) % TAR_DIR_TABLE);
+		bool seen = false;
+		for (tar_dir *d = tar->dirs[b]; d != NULL && !seen; d = d->next)
+			seen = strlen(d->path) == length && strncmp(d->path, path, length) == 0;
+		if (seen)
+			continue;
+
+		tar_dir *d = malloc(sizeof(tar_dir));
+		char *dir = strndup(path, length);
+		if (!d || !dir) {
+			free(d);
+			free(dir);
+			tar->failed = true;
+			return;
+		}
+		d->path = dir;
+		d->next = tar->dirs[b];
+		tar->dirs[b] = d;
+		write_header(tar, dir, 0, '5', 0755);
+	}
+}
+
+/**
+ * tar_open(): Start a tar stream. "-" writes to standard output; since the archive then
+ * owns it, anything else the process prints (log messages, a publish hook's output) goes
+ * to standard error from here on.
+ *
+ * arguments:
+ *  const char *path (file to write, or "-" for standard output)
+ *  bool gzip (compress the stream)
+ *
+ * returns:
+ *  pp_tar* (open archive; NULL on error; caller must tar_close())
+ */
+pp_tar* tar_open(const char *path, bool gzip) {
+	if (!path)
+		return NULL;
+
+	int fd;
+	if (strcmp(path, "-") == 0) {
+		fflush(stdout);
+		fd = dup(STDOUT_FILENO);
+		if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+	if (fd < 0) {
+		log_error("can't open %s for the archive: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	pp_tar *tar = calloc(1, sizeof(pp_tar));
+	gzFile out = tar ? gzdopen(fd, gzip ? "wb" : "wbT") : NULL;
+	if (!out) {
+		log_error("can't start the archive in %s", path);
+		close(fd);
+		free(tar);
+		return NULL;
+	}
+	gzbuffer(out, TAR_BUFFER);
+	tar->out = out;
+
+	const char *epoch = getenv("SOURCE_DATE_EPOCH");
+	char *end = NULL;
+	long long seconds = epoch ? strtoll(epoch, &end, 10) : 0;
+	tar->mtime = (epoch && *epoch && end && *end == '\0' && seconds > 0) ? (time_t)seconds : 0;
+	return tar;
+}
+
+/**
+ * tar_add(): Append one file to the archive, with entries for any directories above it
+ * that aren't in the archive yet.
+ *
+ * arguments:
+ *  pp_tar *tar (open archive)
+ *  const char *path (path within the site, like "c/fido.html"; no leading slash)
+ *  const struct iovec *parts (the file's bytes, in order)
+ *  int count (number of ranges)
+ *
+ * returns:
+ *  int (0 on success; -1 if the stream can't be written)
+ */
+int tar_add(pp_tar *tar, const char *path, const struct iovec *parts, int count) {
+	if (!tar || !path || tar->failed)
+		return -1;
+
+	size_t length = 0;
+	for (int i = 0; i < count; i++)
+		length += parts[i].iov_len;
+
+	add_parent_dirs(tar, path);
+	write_header(tar, path, length, '0', 0644);
+	for (int i = 0; i < count; i++)
+		write_raw(tar, parts[i].iov_base, parts[i].iov_len);
+	pad_block(tar, length);
+	return tar->failed ? -1 : 0;
+}
+
+/**
+ * tar_close(): Finish the archive (two zero blocks), flush it and free it.
+ *
+ * arguments:
+ *  pp_tar *tar (archive; may be NULL)
+ *
+ * returns:
+ *  int (0 on success; -1 if anything couldn't be written)
+ */
+int tar_close(pp_tar *tar) {
+	if (!tar)
+		return 0;
+
+	static const char end[TAR_BLOCK * 2];
+	write_raw(tar, end, sizeof(end));
+	if (gzclose(tar->out) != Z_OK)
+		tar->failed = true;
+
+	for (int i = 0; i < TAR_DIR_TABLE; i++) {
+		tar_dir *d = tar->dirs[i];
+		while (d) {
+			tar_dir *next = d->next;
+			free(d->path);
+			free(d);
+			d = next;
+		}
+	}
+	int result = tar->failed ? -1 : 0;
+	free(tar);
+	return result;
+}
@@ -9,6 +9,24 @@
 
 #include "pragma_poison.h"
 
+/**
+ * apply_site_template(): apply_template() with a template from the site's templates/
+ * directory (site->base_dir), so rendering doesn't depend on the working directory.
+ */
+static wchar_t* apply_site_template(site_info *site, const char *name, template_data *data) {
+    char *base_dir = (site->base_dir && *site->base_dir) ? char_convert(site->base_dir) : NULL;
+    char path[1024];
+    if (base_dir) {
+        size_t length = strlen(base_dir);
+        snprintf(path, sizeof(path), "%s%stemplates/%s", base_dir,
+                 (length > 0 && base_dir[length - 1] == '/') ? "" : "/", name);
+        free(base_dir);
+    } else {
+        snprintf(path, sizeof(path), "templates/%s", name);
+    }
+    return apply_template(path, data);
+}
+
 /**
  * render_post_card_with_template(): Render a post card using the template system.
  *
@@ -31,7 +49,7 @@ wchar_t* render_post_card_with_template(pp_page *page, site_info *site) {
     if (!data) return NULL;
 
     // Apply template
-    wchar_t *result = apply_template("templates/post_card.html", data);
+    wchar_t *result = apply_site_template(site, "post_card.html", data);
 
     // Clean up
     template_free(data);
@@ -57,7 +75,7 @@ wchar_t* render_navigation_with_template(pp_page *page, site_info *site) {
     template_data *data = template_data_from_page(page, site);
     if (!data) return NULL;
 
-    wchar_t *result = apply_template("templates/navigation.html", data);
+    wchar_t *result = apply_site_template(site, "navigation.html", data);
 
     template_free(data);
     return result;
@@ -68,15 +86,16 @@ wchar_t* render_navigation_with_template(pp_page *page, site_info *site) {
  *
  * This shows how the page builder could be simplified using the template system.
  * Instead of manual HTML construction and token replacement, we use structured data.
+ * The header and footer are borrowed into the page rather than copied.
  *
  * arguments:
  *  pp_page *page (page to render; must not be NULL)
  *  site_info *site (site configuration; must not be NULL)
  *
  * returns:
- *  wchar_t* (heap-allocated complete page HTML; NULL on error)
+ *  pp_rope* (complete page; NULL on error; free with rope_free())
  */
-wchar_t* render_page_with_template(pp_page *page, site_info *site) {
+pp_rope* render_page_with_template(pp_page *page, site_info *site) {
     if (!page || !site) return NULL;
 
     // Get template data
@@ -84,40 +103,27 @@ wchar_t* render_page_with_template(pp_page *page, site_info *site) {
     if (!data) return NULL;
 
     // Render the main content using single page template
-    wchar_t *page_content = apply_template("templates/single_page.html", data);
+    wchar_t *page_content = apply_site_template(site, "single_page.html", data);
     if (!page_content) {
         template_free(data);
         return NULL;
     }
 
-    // Render navigation
-    wchar_t *navigation = render_navigation_with_template(page, site);
-
     // Build complete page (could also be templated)
-    size_t total_size = wcslen(site->header) + wcslen(page_content) +
-                        (navigation ? wcslen(navigation) : 0) +
-                        wcslen(site->footer) + 100;
-
-    wchar_t *complete_page = malloc(total_size * sizeof(wchar_t));
+    pp_rope *complete_page = rope_new();
     if (complete_page) {
-        wcscpy(complete_page, site->header);
-        wcscat(complete_page, page_content);
-        if (navigation) {
-            wcscat(complete_page, navigation);
-        }
-        wcscat(complete_page, site->footer);
+        rope_frame(complete_page, site, site->header);
+        rope_take(complete_page, page_content);
+        rope_take(complete_page, render_navigation_with_template(page, site));
+        rope_frame(complete_page, site, page_footer(site, page->has_gallery));
 
         // Apply common token replacements
-        wchar_t *final_page = apply_common_tokens(complete_page, site, data->post_url, data->title, data->description, data->icon, data->author, data->featured_image);
-        if (final_page) {
-            free(complete_page);
-            complete_page = final_page;
-        }
+        rope_apply_common_tokens(complete_page, site, data->post_url, data->title, data->description, data->icon, data->author, data->featured_image);
+    } else {
+        free(page_content);
     }
 
     // Clean up
-    free(page_content);
-    free(navigation);
     template_free(data);
 
     return complete_page;
@@ -174,7 +180,7 @@ wchar_t* render_index_item_with_template(pp_page *page, site_info *site) {
     }
 
     // Render using template
-    wchar_t *result = apply_template("templates/index_item.html", data);
+    wchar_t *result = apply_site_template(site, "index_item.html", data);
 
     template_free(data);
     return result;
@@ -56,9 +56,53 @@ void template_free(template_data *data) {
         free(data->tag_urls);
     }
 
+    for (int i = 0; i < data->related_count; i++) {
+        free(data->related_titles[i]);
+        free(data->related_urls[i]);
+    }
+    free(data->related_titles);
+    free(data->related_urls);
+
+    for (int i = 0; i < data->backlink_count; i++) {
+        free(data->backlink_titles[i]);
+        free(data->backlink_urls[i]);
+    }
+    free(data->backlink_titles);
+    free(data->backlink_urls);
+
     free(data);
 }
 
+/**
+ * page_link_items(): Build the title and "<name>.html" url lists for a LOOP over other posts.
+ *
+ * arguments:
+ *  pp_page **pages (posts to list)
+ *  int count (number of posts)
+ *  wchar_t ***titles (receives the titles; caller frees)
+ *  wchar_t ***urls (receives the urls, relative to c/; caller frees)
+ *
+ * returns:
+ *  int (number of items filled in; 0 if there are none or allocation fails)
+ */
+static int page_link_items(pp_page **pages, int count, wchar_t ***titles, wchar_t ***urls) {
+    if (!pages || count <= 0) return 0;
+
+    *titles = calloc(count, sizeof(wchar_t*));
+    *urls = calloc(count, sizeof(wchar_t*));
+    if (!*titles || !*urls) return 0;
+
+    for (int i = 0; i < count; i++) {
+        const wchar_t *name = pages[i]->source_filename ? pages[i]->source_filename : L"";
+        size_t url_len = wcslen(name) + 10;
+        (*titles)[i] = wcsdup(pages[i]->title ? pages[i]->title : L"");
+        (*urls)[i] = malloc(url_len * sizeof(wchar_t));
+        if ((*urls)[i])
+            swprintf((*urls)[i], url_len, L"%ls.html", name);
+    }
+    return count;
+}
+
 /**
  * template_data_from_page(): Create template data from a pragma page.
  *
@@ -164,6 +208,12 @@ template_data* template_data_from_page(pp_page *page, site_info *site) {
         }
     }
 
+    // Related posts (relative URLs, like prev/next: they live in c/ too)
+    data->related_count = page_link_items(page->related, page->related_count, &data->related_titles, &data->related_urls);
+
+    // Posts that link here (backlinks:yes), also in c/
+    data->backlink_count = page_link_items(page->backlinks, page->backlink_count, &data->backlink_titles, &data->backlink_urls);
+
     // Get description
     data->description = get_page_description(page);
 
@@ -173,12 +223,14 @@ template_data* template_data_from_page(pp_page *page, site_info *site) {
     data->has_navigation = data->has_prev || data->has_next;
     data->has_next_only = data->has_next && !data->has_prev;
     data->has_tags = (data->tag_count > 0);
+    data->has_related = (data->related_count > 0);
+    data->has_backlinks = (data->backlink_count > 0);
 
     return data;
 }
 
 /**
- * load_template_file(): Load a template file from disk.
+ * load_template_file(): Load a template file from disk (or the file cache).
  *
  * Reads the entire template file into memory as a wide-character string.
  *
@@ -191,35 +243,8 @@ template_data* template_data_from_page(pp_page *page, site_info *site) {
 wchar_t* load_template_file(const char *template_path) {
     if (!template_path) return NULL;
 
-    FILE *file = fopen(template_path, "r");
-    if (!file) return NULL;
-
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    if (file_size < 0) {
-        fclose(file);
-        return NULL;
-    }
-
-    // Read file content
-    char *buffer = malloc(file_size + 1);
-    if (!buffer) {
-        fclose(file);
-        return NULL;
-    }
-
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    buffer[bytes_read] = '\0';
-    fclose(file);
-
-    // Convert to wide characters
-    wchar_t *wide_content = utf8_to_wchar(buffer);
-    free(buffer);
-
-    return wide_content;
+    // Read once per process while the file is unchanged, not once per page
+    return file_cache_text(template_path);
 }
 
 /**
@@ -261,106 +286,124 @@ wchar_t* template_replace_token(wchar_t *template, const wchar_t *token_name, co
 }
 
 /**
- * template_process_loop(): Process a loop construct in template.
- *
- * Handles <!-- LOOP array_name --> ... <!-- END LOOP --> constructs.
- * Currently supports 'tags' array.
+ * append_loop_items(): Expand one loop body once per item of the named array.
  *
  * arguments:
- *  wchar_t *template (template string; must not be NULL)
+ *  const wchar_t *name (array name from <!-- LOOP name -->)
+ *  wchar_t *body (loop body; must not be NULL)
  *  template_data *data (template data; must not be NULL)
+ *  safe_buffer *buf (destination)
  *
  * returns:
- *  wchar_t* (heap-allocated result; NULL on error)
+ *  bool (false if the array name isn't known)
  */
-wchar_t* template_process_loop(wchar_t *template, template_data *data) {
-    if (!template || !data) return NULL;
-
-    // Look for <!-- LOOP tags --> ... <!-- END LOOP -->
-    wchar_t *loop_start = wcsstr(template, L"<!-- LOOP tags -->");
-    if (!loop_start) {
-        return wcsdup(template); // No loops to process
-    }
-
-    wchar_t *loop_end = wcsstr(loop_start, L"<!-- END LOOP -->");
-    if (!loop_end) {
-        return wcsdup(template); // Malformed loop
+static bool append_loop_items(const wchar_t *name, wchar_t *body, template_data *data, safe_buffer *buf) {
+    if (wcscmp(name, L"tags") == 0) {
+        // {TAG} and {TAG_URL}, separated by ", "
+        for (int i = 0; i < data->tag_count; i++) {
+            wchar_t *item = template_replace_token(body, L"TAG", data->tags[i]);
+            wchar_t *item_with_url = item ? template_replace_token(item, L"TAG_URL", data->tag_urls[i]) : NULL;
+            free(item);
+            if (item_with_url) {
+                safe_append(item_with_url, buf);
+                if (i < data->tag_count - 1)
+                    safe_append(L", ", buf);
+                free(item_with_url);
+            }
+        }
+        return true;
     }
 
-    // Calculate positions and lengths
-    size_t before_loop_len = loop_start - template;
-    wchar_t *loop_content_start = loop_start + wcslen(L"<!-- LOOP tags -->");
-    size_t loop_content_len = loop_end - loop_content_start;
-    wchar_t *after_loop_start = loop_end + wcslen(L"<!-- END LOOP -->");
-
-    // Extract loop content
-    wchar_t *loop_content = malloc((loop_content_len + 1) * sizeof(wchar_t));
-    if (!loop_content) return NULL;
-
-    wcsncpy(loop_content, loop_content_start, loop_content_len);
-    loop_content[loop_content_len] = L'\0';
-
-    // Build expanded loop content
-    size_t expanded_size = 1; // Start with null terminator
-    wchar_t *expanded_content = malloc(expanded_size * sizeof(wchar_t));
-    if (!expanded_content) {
-        free(loop_content);
-        return NULL;
+    if (wcscmp(name, L"related") == 0) {
+        // {RELATED_TITLE} and {RELATED_URL}
+        for (int i = 0; i < data->related_count; i++) {
+            wchar_t *item = template_replace_token(body, L"RELATED_TITLE", data->related_titles[i]);
+            wchar_t *item_with_url = item ? template_replace_token(item, L"RELATED_URL", data->related_urls[i]) : NULL;
+            free(item);
+            if (item_with_url) {
+                safe_append(item_with_url, buf);
+                free(item_with_url);
+            }
+        }
+        return true;
     }
-    expanded_content[0] = L'\0';
-
-    // Process each tag
-    for (int i = 0; i < data->tag_count; i++) {
-        // Replace {TAG} and {TAG_URL} in loop content
-        wchar_t *item_content = template_replace_token(loop_content, L"TAG", data->tags[i]);
-        if (item_content) {
-            wchar_t *item_with_url = template_replace_token(item_content, L"TAG_URL", data->tag_urls[i]);
-            free(item_content);
 
+    if (wcscmp(name, L"backlinks") == 0) {
+        // {BACKLINK_TITLE} and {BACKLINK_URL}
+        for (int i = 0; i < data->backlink_count; i++) {
+            wchar_t *item = template_replace_token(body, L"BACKLINK_TITLE", data->backlink_titles[i]);
+            wchar_t *item_with_url = item ? template_replace_token(item, L"BACKLINK_URL", data->backlink_urls[i]) : NULL;
+            free(item);
             if (item_with_url) {
-                // Append to expanded content
-                size_t comma_space_len = (i < data->tag_count - 1) ? 2 : 0; // ", " for non-last items
-                size_t new_size = wcslen(expanded_content) + wcslen(item_with_url) + comma_space_len + 1;
-                wchar_t *new_expanded = realloc(expanded_content, new_size * sizeof(wchar_t));
-                if (new_expanded) {
-                    expanded_content = new_expanded;
-                    wcscat(expanded_content, item_with_url);
-                    // Add comma and space after each tag except the last one
-                    if (i < data->tag_count - 1) {
-                        wcscat(expanded_content, L", ");
-                    }
-                }
+                safe_append(item_with_url, buf);
                 free(item_with_url);
             }
         }
+        return true;
     }
 
-    // Assemble final result
-    size_t result_size = before_loop_len + wcslen(expanded_content) + wcslen(after_loop_start) + 1;
-    wchar_t *result = malloc(result_size * sizeof(wchar_t));
+    return false;
+}
+
+/**
+ * template_process_loop(): Process loop constructs in template.
+ *
+ * Handles <!-- LOOP array_name --> ... <!-- END LOOP --> constructs.
+ * Supports the 'tags', 'related' and 'backlinks' arrays; loops over unknown arrays are left as they are.
+ *
+ * arguments:
+ *  wchar_t *template (template string; must not be NULL)
+ *  template_data *data (template data; must not be NULL)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated result; NULL on error)
+ */
+wchar_t* template_process_loop(wchar_t *template, template_data *data) {
+    if (!template || !data) return NULL;
 
-    if (result) {
-        // Copy before loop
-        wcsncpy(result, template, before_loop_len);
-        result[before_loop_len] = L'\0';
+    const wchar_t *start_marker = L"<!-- LOOP ";
+    const wchar_t *end_marker = L"<!-- END LOOP -->";
 
-        // Add expanded content
-        wcscat(result, expanded_content);
+    safe_buffer buf;
+    if (safe_buffer_init(&buf, wcslen(template) + 1) != 0)
+        return NULL;
 
-        // Add after loop
-        wcscat(result, after_loop_start);
+    const wchar_t *p = template;
+    const wchar_t *loop_start;
+    while ((loop_start = wcsstr(p, start_marker)) != NULL) {
+        const wchar_t *name = loop_start + wcslen(start_marker);
+        const wchar_t *name_end = wcsstr(name, L" -->");
+        const wchar_t *loop_end = name_end ? wcsstr(name_end, end_marker) : NULL;
+        if (!loop_end || name_end - name > 32)
+            break;  // malformed loop
+
+        wchar_t array_name[33];
+        wcsncpy(array_name, name, name_end - name);
+        array_name[name_end - name] = L'\0';
+
+        const wchar_t *body_start = name_end + wcslen(L" -->");
+        wchar_t *body = malloc((loop_end - body_start + 1) * sizeof(wchar_t));
+        if (!body)
+            break;
+        wcsncpy(body, body_start, loop_end - body_start);
+        body[loop_end - body_start] = L'\0';
+
+        safe_append_n(p, loop_start - p, &buf);
+        if (!append_loop_items(array_name, body, data, &buf))
+            safe_append_n(loop_start, loop_end + wcslen(end_marker) - loop_start, &buf);
+        free(body);
+        p = loop_end + wcslen(end_marker);
     }
+    safe_append(p, &buf);
 
-    free(loop_content);
-    free(expanded_content);
-    return result;
+    return buf.buffer;
 }
 
 /**
  * template_process_conditionals(): Process conditional constructs in template.
  *
  * Handles <!-- IF condition --> ... <!-- END IF --> constructs.
- * Supports: has_navigation, has_tags, has_prev, has_next
+ * Supports: has_navigation, has_tags, has_prev, has_next, has_next_only, has_related, has_backlinks
  *
  * arguments:
  *  wchar_t *template (template string; must not be NULL)
@@ -377,7 +420,7 @@ wchar_t* template_process_conditionals(wchar_t *template, template_data *data) {
 
     // Process each conditional type (process nested conditions multiple times)
     const wchar_t *conditionals[] = {
-        L"has_navigation", L"has_tags", L"has_prev", L"has_next", L"has_next_only", NULL
+        L"has_navigation", L"has_tags", L"has_prev", L"has_next", L"has_next_only", L"has_related", L"has_backlinks", NULL
     };
 
     // Process multiple times to handle nested conditions
@@ -413,6 +456,10 @@ wchar_t* template_process_conditionals(wchar_t *template, template_data *data) {
                     condition_true = data->has_next;
                 } else if (wcscmp(conditionals[i], L"has_next_only") == 0) {
                     condition_true = data->has_next_only;
+                } else if (wcscmp(conditionals[i], L"has_related") == 0) {
+                    condition_true = data->has_related;
+                } else if (wcscmp(conditionals[i], L"has_backlinks") == 0) {
+                    condition_true = data->has_backlinks;
                 }
 
                 // Replace conditional block
@@ -460,6 +507,55 @@ wchar_t* template_process_conditionals(wchar_t *template, template_data *data) {
     return result;
 }
 
+/**
+ * template_apply_condition(): Resolve every <!-- IF condition --> block for one condition.
+ *
+ * Unlike template_process_conditionals(), which evaluates the template_data flags, this
+ * takes the value directly and leaves blocks for other conditions alone, so it can be used
+ * on text that isn't a template, like the site footer.
+ *
+ * arguments:
+ *  const wchar_t *text (text to process; must not be NULL)
+ *  const wchar_t *condition (condition name, like L"has_gallery"; must not be NULL)
+ *  bool value (keep the blocks' contents if true, drop the blocks if false)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated result; NULL on error)
+ */
+wchar_t* template_apply_condition(const wchar_t *text, const wchar_t *condition, bool value) {
+    if (!text || !condition) return NULL;
+
+    size_t marker_len = wcslen(condition) + 20;
+    wchar_t *start_marker = malloc(marker_len * sizeof(wchar_t));
+    if (!start_marker) return NULL;
+    swprintf(start_marker, marker_len, L"<!-- IF %ls -->", condition);
+    const wchar_t *end_marker = L"<!-- END IF -->";
+
+    safe_buffer buf;
+    if (safe_buffer_init(&buf, wcslen(text) + 1) != 0) {
+        free(start_marker);
+        return NULL;
+    }
+
+    const wchar_t *p = text;
+    const wchar_t *cond_start;
+    while ((cond_start = wcsstr(p, start_marker)) != NULL) {
+        const wchar_t *content_start = cond_start + wcslen(start_marker);
+        const wchar_t *cond_end = wcsstr(content_start, end_marker);
+        if (!cond_end)
+            break;
+
+        safe_append_n(p, cond_start - p, &buf);
+        if (value)
+            safe_append_n(content_start, cond_end - content_start, &buf);
+        p = cond_end + wcslen(end_marker);
+    }
+    safe_append(p, &buf);
+
+    free(start_marker);
+    return buf.buffer;
+}
+
 /**
  * apply_template(): Apply template data to a template string.
  *
@@ -504,13 +600,14 @@ wchar_t* apply_template(const char *template_path, template_data *data) {
     wchar_t *result = after_conditionals;
 
     const wchar_t *tokens[] = {
-        L"TITLE", L"DATE", L"ICON", L"CONTENT", L"POST_URL",
+        L"TITLE", L"DATE", L"ICON", L"ICON_SRC", L"ICON_HTML", L"CONTENT", L"POST_URL",
         L"PREV_URL", L"NEXT_URL", L"PREV_TITLE", L"NEXT_TITLE", 
         L"DESCRIPTION", L"AUTHOR", NULL
     };
 
     const wchar_t *values[] = {
-        data->title, data->date, data->icon, data->content, data->post_url,
+        data->title, data->date, data->icon, icon_src(data->icon), icon_html(data->icon),
+        data->content, data->post_url,
         data->prev_url, data->next_url, data->prev_title, data->next_title, 
         data->description, data->author
     };
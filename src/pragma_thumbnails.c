@@ -0,0 +1,468 @@
+/**
+ * pragma_thumbnails.c - Gallery thumbnails, generated during the build
+ *
+ * Every !!(directory) gallery found during Markdown parsing is queued here. Each JPEG or PNG
+ * in the directory gets a thumbnail next to it, named the same way helpers/make_gallery.py
+ * used to name them ("fox.jpg" => "thumbfox.jpg"), so existing galleries keep working.
+ *
+ * Decoding, resizing and encoding happen on the worker pool while the main thread renders.
+ * A thumbnail is only regenerated when its source is newer. Thumbnails fit within
+ * THUMBNAIL_MAX x THUMBNAIL_MAX and keep the source's aspect ratio; small images are not
+ * enlarged.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <png.h>
+
+#define THUMBNAIL_JPEG_QUALITY	85
+
+// One image to thumbnail; owned by the job
+typedef struct thumbnail_job {
+	char *source;
+	char *destination;
+	bool is_png;
+} thumbnail_job;
+
+// Galleries already queued this build (the same gallery can appear in several posts)
+typedef struct queued_gallery {
+	char *path;
+	struct queued_gallery *next;
+} queued_gallery;
+
+static struct thumbnail_state {
+	bool enabled;
+	queued_gallery *queued;
+	int queued_count;
+	pthread_mutex_t lock;	// guards the counters below, which jobs update
+	int generated;
+	int failed;
+} g_thumbs = { .enabled = false };
+
+/**
+ * current_thumbnail(): Thumbnail pipeline state for the calling thread's site.
+ */
+static struct thumbnail_state* current_thumbnail(void) {
+	return context_state(CONTEXT_THUMBNAILS, &g_thumbs, sizeof(g_thumbs));
+}
+
+// libjpeg reports fatal errors through a callback that must not return
+typedef struct {
+	struct jpeg_error_mgr base;
+	jmp_buf escape;
+} jpeg_error_escape;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+	jpeg_error_escape *err = (jpeg_error_escape*)cinfo->err;
+	longjmp(err->escape, 1);
+}
+
+static void jpeg_quiet(j_common_ptr cinfo, int level) {
+	(void)cinfo;
+	(void)level;	// corrupt-data warnings aren't worth a line per image
+}
+
+/**
+ * is_thumbnail_name(): True if `name` is a generated thumbnail ("thumbfox.jpg").
+ */
+bool is_thumbnail_name(const char *name) {
+	return strncmp(name, THUMBNAIL_PREFIX, strlen(THUMBNAIL_PREFIX)) == 0;
+}
+
+/**
+ * is_thumbnail_source(): True if `name` is an image we make thumbnails for.
+ */
+bool is_thumbnail_source(const char *name) {
+	return !is_thumbnail_name(name) && !is_image_variant(name) &&
+		(has_extension(name, ".jpg") || has_extension(name, ".jpeg") || has_extension(name, ".png"));
+}
+
+/**
+ * thumbnail_size(): Size of the thumbnail for an image of the given size.
+ *
+ * arguments:
+ *  int width, int height (source dimensions)
+ *  int *thumb_width, int *thumb_height (receive the thumbnail dimensions)
+ *
+ * returns:
+ *  void
+ */
+void thumbnail_size(int width, int height, int *thumb_width, int *thumb_height) {
+	*thumb_width = width;
+	*thumb_height = height;
+	if (width <= THUMBNAIL_MAX && height <= THUMBNAIL_MAX)
+		return;
+
+	if (width >= height) {
+		*thumb_width = THUMBNAIL_MAX;
+		*thumb_height = (int)(((long)height * THUMBNAIL_MAX + width / 2) / width);
+	} else {
+		*thumb_height = THUMBNAIL_MAX;
+		*thumb_width = (int)(((long)width * THUMBNAIL_MAX + height / 2) / height);
+	}
+	if (*thumb_width < 1) *thumb_width = 1;
+	if (*thumb_height < 1) *thumb_height = 1;
+}
+
+/**
+ * resize_area(): Downscale an 8-bit image by averaging each destination pixel's source box.
+ * With 4 channels, color is weighted by alpha so transparent pixels don't bleed in.
+ *
+ * returns:
+ *  unsigned char* (heap-allocated dst_w x dst_h image; NULL on allocation failure)
+ */
+static unsigned char* resize_area(const unsigned char *src, int src_w, int src_h, int channels,
+                                  int dst_w, int dst_h) {
+	unsigned char *dst = malloc((size_t)dst_w * dst_h * channels);
+	if (!dst)
+		return NULL;
+
+	for (int y = 0; y < dst_h; y++) {
+		int y0 = (int)((long)y * src_h / dst_h);
+		int y1 = (int)((long)(y + 1) * src_h / dst_h);
+		if (y1 <= y0) y1 = y0 + 1;
+
+		for (int x = 0; x < dst_w; x++) {
+			int x0 = (int)((long)x * src_w / dst_w);
+			int x1 = (int)((long)(x + 1) * src_w / dst_w);
+			if (x1 <= x0) x1 = x0 + 1;
+
+			unsigned long sum[4] = { 0, 0, 0, 0 };
+			unsigned long count = (unsigned long)(x1 - x0) * (y1 - y0);
+			for (int sy = y0; sy < y1; sy++) {
+				const unsigned char *p = src + ((size_t)sy * src_w + x0) * channels;
+				for (int sx = x0; sx < x1; sx++, p += channels) {
+					if (channels == 4) {
+						sum[0] += p[0] * p[3];
+						sum[1] += p[1] * p[3];
+						sum[2] += p[2] * p[3];
+						sum[3] += p[3];
+					} else {
+						for (int c = 0; c < channels; c++)
+							sum[c] += p[c];
+					}
+				}
+			}
+
+			unsigned char *out = dst + ((size_t)y * dst_w + x) * channels;
+			if (channels == 4) {
+				for (int c = 0; c < 3; c++)
+					out[c] = sum[3] ? (unsigned char)((sum[c] + sum[3] / 2) / sum[3]) : 0;
+				out[3] = (unsigned char)((sum[3] + count / 2) / count);
+			} else {
+				for (int c = 0; c < channels; c++)
+					out[c] = (unsigned char)((sum[c] + count / 2) / count);
+			}
+		}
+	}
+	return dst;
+}
+
+/**
+ * thumbnail_jpeg(): Decode, shrink and re-encode a JPEG.
+ *
+ * returns:
+ *  bool (true on success)
+ */
+static bool thumbnail_jpeg(const char *source, const char *destination) {
+	FILE *in = utf8_fopen((utf8_path)source, "rb");
+	if (!in)
+		return false;
+
+	struct jpeg_decompress_struct dinfo;
+	jpeg_error_escape derr;
+	unsigned char * volatile pixels = NULL;	// volatile: live across longjmp()
+	unsigned char *small = NULL;
+	FILE * volatile out = NULL;
+
+	dinfo.err = jpeg_std_error(&derr.base);
+	derr.base.error_exit = jpeg_error_exit;
+	derr.base.emit_message = jpeg_quiet;
+	if (setjmp(derr.escape)) {
+		jpeg_destroy_decompress(&dinfo);
+		fclose(in);
+		free(pixels);
+		return false;
+	}
+
+	jpeg_create_decompress(&dinfo);
+	jpeg_stdio_src(&dinfo, in);
+	jpeg_read_header(&dinfo, TRUE);
+	dinfo.out_color_space = JCS_RGB;
+
+	// Let the decoder do most of the shrinking: the DCT can scale by 1/2, 1/4 or 1/8 for free
+	int tw, th;
+	thumbnail_size(dinfo.image_width, dinfo.image_height, &tw, &th);
+	dinfo.scale_num = 1;
+	dinfo.scale_denom = 1;
+	while (dinfo.scale_denom < 8 &&
+	       dinfo.image_width / (dinfo.scale_denom * 2) >= (unsigned)tw &&
+	       dinfo.image_height / (dinfo.scale_denom * 2) >= (unsigned)th)
+		dinfo.scale_denom *= 2;
+
+	jpeg_start_decompress(&dinfo);
+	int w = dinfo.output_width, h = dinfo.output_height, channels = dinfo.output_components;
+	pixels = malloc((size_t)w * h * channels);
+	if (!pixels)
+		longjmp(derr.escape, 1);
+	while (dinfo.output_scanline < dinfo.output_height) {
+		JSAMPROW row = pixels + (size_t)dinfo.output_scanline * w * channels;
+		jpeg_read_scanlines(&dinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&dinfo);
+	jpeg_destroy_decompress(&dinfo);
+	fclose(in);
+
+	small = resize_area(pixels, w, h, channels, tw, th);
+	free(pixels);
+	pixels = NULL;
+	if (!small)
+		return false;
+
+	struct jpeg_compress_struct cinfo;
+	jpeg_error_escape cerr;
+	cinfo.err = jpeg_std_error(&cerr.base);
+	cerr.base.error_exit = jpeg_error_exit;
+	if (setjmp(cerr.escape)) {
+		jpeg_destroy_compress(&cinfo);
+		if (out)
+			fclose(out);
+		free(small);
+		return false;
+	}
+
+	out = utf8_fopen((utf8_path)destination, "wb");
+	if (!out) {
+		free(small);
+		return false;
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, out);
+	cinfo.image_width = tw;
+	cinfo.image_height = th;
+	cinfo.input_components = channels;
+	cinfo.in_color_space = channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, THUMBNAIL_JPEG_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW row = small + (size_t)cinfo.next_scanline * tw * channels;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	free(small);
+	return fclose(out) == 0;
+}
+
+/**
+ * thumbnail_png(): Decode, shrink and re-encode a PNG (as 8-bit RGBA).
+ *
+ * returns:
+ *  bool (true on success)
+ */
+static bool thumbnail_png(const char *source, const char *destination) {
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+
+	if (!png_image_begin_read_from_file(&image, source))
+		return false;
+
+	image.format = PNG_FORMAT_RGBA;
+	unsigned char *pixels = malloc(PNG_IMAGE_SIZE(image));
+	if (!pixels) {
+		png_image_free(&image);
+		return false;
+	}
+	if (!png_image_finish_read(&image, NULL, pixels, 0, NULL)) {
+		free(pixels);
+		return false;
+	}
+
+	int tw, th;
+	thumbnail_size(image.width, image.height, &tw, &th);
+	unsigned char *small = resize_area(pixels, image.width, image.height, 4, tw, th);
+	free(pixels);
+	if (!small)
+		return false;
+
+	png_image thumb;
+	memset(&thumb, 0, sizeof(thumb));
+	thumb.version = PNG_IMAGE_VERSION;
+	thumb.width = tw;
+	thumb.height = th;
+	thumb.format = PNG_FORMAT_RGBA;
+
+	bool ok = png_image_write_to_file(&thumb, destination, 0, small, 0, NULL) != 0;
+	free(small);
+	return ok;
+}
+
+/**
+ * thumbnail_job_run(): Worker job: write one thumbnail via a temporary file, so an
+ * interrupted build never leaves a truncated thumbnail that looks up to date.
+ *
+ * arguments:
+ *  void *arg (thumbnail_job*, freed here)
+ */
+static void thumbnail_job_run(void *arg) {
+	thumbnail_job *job = arg;
+
+	size_t len = strlen(job->destination) + 5;
+	char *temporary = malloc(len);
+	bool ok = false;
+	if (temporary) {
+		snprintf(temporary, len, "%s.tmp", job->destination);
+		ok = job->is_png ? thumbnail_png(job->source, temporary)
+		                 : thumbnail_jpeg(job->source, temporary);
+		if (ok)
+			ok = rename(temporary, job->destination) == 0;
+		if (!ok)
+			unlink(temporary);
+		free(temporary);
+	}
+
+	if (!ok)
+		log_warn("couldn't make a thumbnail for %s", job->source);
+
+	pthread_mutex_lock(&current_thumbnail()->lock);
+	if (ok)
+		current_thumbnail()->generated++;
+	else
+		current_thumbnail()->failed++;
+	pthread_mutex_unlock(&current_thumbnail()->lock);
+
+	free(job->source);
+	free(job->destination);
+	free(job);
+}
+
+/**
+ * thumbnail_pipeline_init(): Start a build's thumbnail pipeline.
+ *
+ * arguments:
+ *  bool enabled (false for dry runs: galleries are still rendered, nothing is written)
+ *
+ * returns:
+ *  void
+ */
+void thumbnail_pipeline_init(bool enabled) {
+	current_thumbnail()->enabled = enabled;
+	current_thumbnail()->queued = NULL;
+	current_thumbnail()->queued_count = 0;
+	current_thumbnail()->generated = 0;
+	current_thumbnail()->failed = 0;
+	pthread_mutex_init(&current_thumbnail()->lock, NULL);
+}
+
+/**
+ * queue_gallery_thumbnails(): Queue thumbnails for every image in a gallery directory
+ * whose thumbnail is missing or older than the image. Each gallery is only scanned once
+ * per build.
+ *
+ * arguments:
+ *  const wchar_t *gallery (gallery directory as written in the post: !!(img/trip))
+ *
+ * returns:
+ *  void
+ */
+void queue_gallery_thumbnails(const wchar_t *gallery) {
+	if (!current_thumbnail()->enabled || !gallery)
+		return;
+
+	char *dir = image_resolve_directory(gallery);
+	if (!dir)
+		return;
+
+	for (queued_gallery *q = current_thumbnail()->queued; q != NULL; q = q->next) {
+		if (strcmp(q->path, dir) == 0) {
+			free(dir);
+			return;
+		}
+	}
+
+	queued_gallery *q = malloc(sizeof(queued_gallery));
+	if (!q) {
+		free(dir);
+		return;
+	}
+	q->path = dir;
+	q->next = current_thumbnail()->queued;
+	current_thumbnail()->queued = q;
+
+	const image_listing *listing = image_directory_listing(dir);
+	if (!listing)
+		return;
+
+	bool slash = strlen(dir) > 0 && dir[strlen(dir) - 1] == '/';
+	for (int i = 0; i < listing->count; i++) {
+		const char *name = listing->names[i];
+		if (!is_thumbnail_source(name))
+			continue;
+
+		size_t len = strlen(dir) + strlen(THUMBNAIL_PREFIX) + strlen(name) + 2;
+		char *source = malloc(len);
+		char *destination = malloc(len);
+		thumbnail_job *job = malloc(sizeof(thumbnail_job));
+		if (!source || !destination || !job) {
+			free(source);
+			free(destination);
+			free(job);
+			continue;
+		}
+		snprintf(source, len, "%s%s%s", dir, slash ? "" : "/", name);
+		snprintf(destination, len, "%s%s%s%s", dir, slash ? "" : "/", THUMBNAIL_PREFIX, name);
+
+		struct stat src_st, dst_st;
+		if (utf8_stat(source, &src_st) != 0 ||
+		    (utf8_stat(destination, &dst_st) == 0 && dst_st.st_mtime >= src_st.st_mtime)) {
+			// missing source, or thumbnail already up to date
+			free(source);
+			free(destination);
+			free(job);
+			continue;
+		}
+
+		job->source = source;
+		job->destination = destination;
+		job->is_png = has_extension(name, ".png");
+		current_thumbnail()->queued_count++;
+		work_pool_submit(work_pool_get_global(), thumbnail_job_run, job);
+	}
+}
+
+/**
+ * thumbnail_pipeline_finish(): Wait for queued thumbnails and report.
+ *
+ * returns:
+ *  int (number of thumbnails that failed)
+ */
+int thumbnail_pipeline_finish(void) {
+	if (!current_thumbnail()->enabled)
+		return 0;
+
+	work_pool_wait(work_pool_get_global());
+
+	if (current_thumbnail()->queued_count > 0)
+		log_info("Generated %d gallery thumbnail%s%s.", current_thumbnail()->generated,
+			current_thumbnail()->generated == 1 ? "" : "s", current_thumbnail()->failed ? " (some failed)" : "");
+
+	queued_gallery *q = current_thumbnail()->queued;
+	while (q) {
+		queued_gallery *next = q->next;
+		free(q->path);
+		free(q);
+		q = next;
+	}
+	current_thumbnail()->queued = NULL;
+	pthread_mutex_destroy(&current_thumbnail()->lock);
+	current_thumbnail()->enabled = false;
+
+	return current_thumbnail()->failed;
+}
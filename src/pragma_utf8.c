@@ -0,0 +1,343 @@
+/**
+ * pragma_utf8.c - UTF-8 <=> wchar_t conversion that doesn't depend on the locale
+ *
+ * Every path, every output and every source line crosses between UTF-8 bytes and wide
+ * strings. mbstowcs()/wcstombs() did that in whatever LC_CTYPE the process had (so a build
+ * host without en_US.UTF-8 mis-converted everything), and needed a second pass to size the
+ * result. The converters here:
+ *
+ * - always speak UTF-8, and validate it: overlong forms, surrogates and anything above
+ *   U+10FFFF are rejected (or replaced with U+FFFD where the caller asks for that);
+ * - decide what a lead byte needs from a 256-entry table (sequence length plus the allowed
+ *   range of the second byte, after Table 3-7 of the Unicode standard);
+ * - copy runs of ASCII 16 characters at a time with SSE2 where it's available (everything
+ *   x86-64), which is most of the bytes in HTML and Markdown;
+ * - convert in one pass into a worst-case buffer, then trim it to the exact size.
+ *
+ * Where wchar_t is 16 bits wide, characters outside the BMP become surrogate pairs.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define UTF8_SSE2	(WCHAR_MAX > 0xFFFF)	// the widening below assumes 32-bit wchar_t
+#else
+#define UTF8_SSE2	0
+#endif
+
+#define UTF8_REPLACEMENT	0xFFFD
+
+// What a lead byte starts: sequence length (0 = can't start one) and the range of the
+// byte after it. The narrow ranges after E0, ED, F0 and F4 are what rule out overlong
+// forms, surrogates and code points past U+10FFFF.
+typedef struct utf8_lead_info {
+	unsigned char length;
+	unsigned char low;
+	unsigned char high;
+} utf8_lead_info;
+
+#define A1	{ 1, 0, 0 }		// ASCII
+#define XX	{ 0, 0, 0 }		// continuation byte, or never valid
+#define L2	{ 2, 0x80, 0xBF }
+#define L3	{ 3, 0x80, 0xBF }
+#define L4	{ 4, 0x80, 0xBF }
+#define ROW(x)	x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x
+
+static const utf8_lead_info utf8_lead[256] = {
+	ROW(A1), ROW(A1), ROW(A1), ROW(A1), ROW(A1), ROW(A1), ROW(A1), ROW(A1),	// 00-7F
+	ROW(XX), ROW(XX), ROW(XX), ROW(XX),					// 80-BF
+	XX, XX, L2, L2, L2, L2, L2, L2, L2, L2, L2, L2, L2, L2, L2, L2,		// C0-CF (C0, C1 overlong)
+	ROW(L2),								// D0-DF
+	{ 3, 0xA0, 0xBF }, L3, L3, L3, L3, L3, L3, L3,				// E0-E7
+	L3, L3, L3, L3, L3, { 3, 0x80, 0x9F }, L3, L3,				// E8-EF (ED: no surrogates)
+	{ 4, 0x90, 0xBF }, L4, L4, L4, { 4, 0x80, 0x8F },			// F0-F4
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX				// F5-FF
+};
+
+#undef A1
+#undef XX
+#undef L2
+#undef L3
+#undef L4
+#undef ROW
+
+/**
+ * put_code_point(): Store one code point at out[o]; returns the number of wchar_t used.
+ */
+static size_t put_code_point(wchar_t *out, uint32_t cp) {
+#if WCHAR_MAX <= 0xFFFF
+	if (cp > 0xFFFF) {
+		cp -= 0x10000;
+		out[0] = (wchar_t)(0xD800 + (cp >> 10));
+		out[1] = (wchar_t)(0xDC00 + (cp & 0x3FF));
+		return 2;
+	}
+#endif
+	out[0] = (wchar_t)cp;
+	return 1;
+}
+
+/**
+ * decode_into(): Decode `length` bytes into `out`, which must have room for `length`
+ * wide characters.
+ *
+ * arguments:
+ *  const unsigned char *s (UTF-8 bytes)
+ *  size_t length (number of bytes)
+ *  wchar_t *out (destination; not terminated)
+ *  bool replace_invalid (U+FFFD for each bad sequence instead of failing)
+ *
+ * returns:
+ *  size_t (wide characters written; (size_t)-1 on invalid input when not replacing)
+ */
+static size_t decode_into(const unsigned char *s, size_t length, wchar_t *out, bool replace_invalid) {
+	size_t i = 0, o = 0;
+
+	while (i < length) {
+#if UTF8_SSE2
+		// ASCII runs: 16 bytes with no high bit set => 16 code points, zero-extended
+		while (i + 16 <= length) {
+			__m128i bytes = _mm_loadu_si128((const __m128i*)(s + i));
+			if (_mm_movemask_epi8(bytes) != 0)
+				break;
+			__m128i zero = _mm_setzero_si128();
+			__m128i low = _mm_unpacklo_epi8(bytes, zero), high = _mm_unpackhi_epi8(bytes, zero);
+			_mm_storeu_si128((__m128i*)(out + o), _mm_unpacklo_epi16(low, zero));
+			_mm_storeu_si128((__m128i*)(out + o + 4), _mm_unpackhi_epi16(low, zero));
+			_mm_storeu_si128((__m128i*)(out + o + 8), _mm_unpacklo_epi16(high, zero));
+			_mm_storeu_si128((__m128i*)(out + o + 12), _mm_unpackhi_epi16(high, zero));
+			i += 16;
+			o += 16;
+		}
+		if (i >= length)
+			break;
+#endif
+		unsigned char b = s[i];
+		if (b < 0x80) {
+			out[o++] = (wchar_t)b;
+			i++;
+			continue;
+		}
+
+		const utf8_lead_info *lead = &utf8_lead[b];
+		size_t n = lead->length;
+		size_t valid = 1;	// bytes of this sequence that check out so far
+		if (n > 0 && i + 1 < length && s[i + 1] >= lead->low && s[i + 1] <= lead->high) {
+			valid = 2;
+			while (valid < n && i + valid < length && (s[i + valid] & 0xC0) == 0x80)
+				valid++;
+		}
+
+		if (n == 0 || valid < n) {
+			if (!replace_invalid)
+				return (size_t)-1;
+			// One U+FFFD for the whole broken sequence (its "maximal subpart")
+			o += put_code_point(out + o, UTF8_REPLACEMENT);
+			i += valid;
+			continue;
+		}
+
+		uint32_t cp = b & (0x7F >> n);
+		for (size_t k = 1; k < n; k++)
+			cp = (cp << 6) | (s[i + k] & 0x3F);
+		o += put_code_point(out + o, cp);
+		i += n;
+	}
+	return o;
+}
+
+/**
+ * utf8_decode(): Convert UTF-8 bytes to a new wide string.
+ *
+ * arguments:
+ *  const char *bytes (UTF-8 text; needn't be terminated)
+ *  size_t length (number of bytes)
+ *  size_t *out_length (receives the wide length; may be NULL)
+ *  bool replace_invalid (put U+FFFD in place of malformed sequences instead of failing)
+ *
+ * returns:
+ *  wchar_t* (heap-allocated, terminated; NULL on invalid input or allocation failure)
+ */
+wchar_t* utf8_decode(const char *bytes, size_t length, size_t *out_length, bool replace_invalid) {
+	if (!bytes)
+		return NULL;
+
+	// Never more wide characters than bytes (a surrogate pair takes 4 bytes)
+	wchar_t *out = malloc((length + 1) * sizeof(wchar_t));
+	if (!out)
+		return NULL;
+
+	size_t n = decode_into((const unsigned char*)bytes, length, out, replace_invalid);
+	if (n == (size_t)-1) {
+		free(out);
+		return NULL;
+	}
+	out[n] = L'\0';
+
+	if (n < length) {
+		wchar_t *trimmed = realloc(out, (n + 1) * sizeof(wchar_t));
+		if (trimmed)
+			out = trimmed;
+	}
+	if (out_length)
+		*out_length = n;
+	return out;
+}
+
+/**
+ * utf8_encode_char(): Encode one character as UTF-8.
+ *
+ * arguments:
+ *  wchar_t c (character; surrogates and values past U+10FFFF are invalid)
+ *  char *out (room for 4 bytes)
+ *
+ * returns:
+ *  size_t (bytes written; 0 if c isn't a valid character)
+ */
+size_t utf8_encode_char(wchar_t c, char *out) {
+	if (c < 0)
+		return 0;
+	uint32_t cp = (uint32_t)c;
+
+	if (cp < 0x80) {
+		out[0] = (char)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = (char)(0xC0 | (cp >> 6));
+		out[1] = (char)(0x80 | (cp & 0x3F));
+		return 2;
+	}
+	if (cp >= 0xD800 && cp <= 0xDFFF)
+		return 0;
+	if (cp < 0x10000) {
+		out[0] = (char)(0xE0 | (cp >> 12));
+		out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (cp & 0x3F));
+		return 3;
+	}
+	if (cp <= 0x10FFFF) {
+		out[0] = (char)(0xF0 | (cp >> 18));
+		out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+		out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		out[3] = (char)(0x80 | (cp & 0x3F));
+		return 4;
+	}
+	return 0;
+}
+
+/**
+ * utf8_encode(): Convert a wide string to new UTF-8 bytes.
+ *
+ * arguments:
+ *  const wchar_t *text (wide text; needn't be terminated)
+ *  size_t length (number of wide characters)
+ *  size_t *out_length (receives the byte length; may be NULL)
+ *
+ * returns:
+ *  char* (heap-allocated, terminated; NULL on invalid characters or allocation failure)
+ */
+char* utf8_encode(const wchar_t *text, size_t length, size_t *out_length) {
+	if (!text)
+		return NULL;
+
+	// Worst case: 3 bytes per BMP character, 4 per (32-bit) supplementary one
+	size_t per_char = WCHAR_MAX > 0xFFFF ? 4 : 3;
+	if (length > (SIZE_MAX - 1) / per_char)
+		return NULL;
+	char *out = malloc(length * per_char + 1);
+	if (!out)
+		return NULL;
+
+	size_t i = 0, o = 0;
+	while (i < length) {
+#if UTF8_SSE2
+		// ASCII runs: 16 characters below 0x80 => 16 bytes, narrowed with saturating packs
+		while (i + 16 <= length) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(text + i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(text + i + 4));
+			__m128i c = _mm_loadu_si128((const __m128i*)(text + i + 8));
+			__m128i d = _mm_loadu_si128((const __m128i*)(text + i + 12));
+			__m128i high_bits = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)),
+			                                  _mm_set1_epi32(~0x7F));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(high_bits, _mm_setzero_si128())) != 0xFFFF)
+				break;
+			__m128i narrow = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+			_mm_storeu_si128((__m128i*)(out + o), narrow);
+			i += 16;
+			o += 16;
+		}
+		if (i >= length)
+			break;
+#endif
+		wchar_t c = text[i++];
+		if (c >= 0 && c < 0x80) {
+			out[o++] = (char)c;
+			continue;
+		}
+
+#if WCHAR_MAX <= 0xFFFF
+		if (c >= 0xD800 && c <= 0xDBFF && i < length && text[i] >= 0xDC00 && text[i] <= 0xDFFF) {
+			uint32_t cp = 0x10000 + (((uint32_t)c - 0xD800) << 10) + ((uint32_t)text[i++] - 0xDC00);
+			out[o++] = (char)(0xF0 | (cp >> 18));
+			out[o++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+			out[o++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+			out[o++] = (char)(0x80 | (cp & 0x3F));
+			continue;
+		}
+#endif
+		size_t n = utf8_encode_char(c, out + o);
+		if (n == 0) {
+			free(out);
+			return NULL;
+		}
+		o += n;
+	}
+	out[o] = '\0';
+
+	char *trimmed = realloc(out, o + 1);
+	if (trimmed)
+		out = trimmed;
+	if (out_length)
+		*out_length = o;
+	return out;
+}
+
+/**
+ * utf8_fgets(): fgetws() for UTF-8 files, whatever the locale: read one line (or as much
+ * of it as fits) into `line`. Malformed bytes come back as U+FFFD.
+ *
+ * arguments:
+ *  wchar_t *line (destination)
+ *  int size (capacity of line, in wide characters, including the terminator)
+ *  FILE *file (open for reading)
+ *
+ * returns:
+ *  wchar_t* (line; NULL at end of file or on error)
+ */
+wchar_t* utf8_fgets(wchar_t *line, int size, FILE *file) {
+	char bytes[MAX_LINE_LENGTH];
+	int capacity = size < (int)sizeof(bytes) ? size : (int)sizeof(bytes);
+	if (capacity < 2 || !fgets(bytes, capacity, file))
+		return NULL;
+
+	size_t length = strlen(bytes);
+	if (length > 0 && bytes[length - 1] != '\n') {
+		// Cut short: don't split a sequence across two calls. Put its bytes back.
+		size_t start = length;
+		while (start > 0 && length - start < 3 && ((unsigned char)bytes[start - 1] & 0xC0) == 0x80)
+			start--;
+		if (start > 0) {
+			size_t needed = utf8_lead[(unsigned char)bytes[start - 1]].length;
+			if (needed > 1 && length - (start - 1) < needed && start - 1 > 0 &&
+			    fseek(file, -(long)(length - (start - 1)), SEEK_CUR) == 0)
+				length = start - 1;
+		}
+	}
+
+	size_t n = decode_into((const unsigned char*)bytes, length, line, true);
+	line[n] = L'\0';
+	return line;
+}
@@ -1,4 +1,5 @@
 #include "pragma_poison.h"
+#include <ctype.h>
 
 /**
  * check_dir(): Verify that a directory exists and has the requested permission bit.
@@ -96,7 +97,8 @@ wchar_t* build_url(const wchar_t *base_url, const wchar_t *path) {
 /**
  * legible_date(): Convert an epoch timestamp to a formatted wide-character date string.
  *
- * Uses localtime() and wcsftime() with the format "%Y-%m-%d %H:%M:%S".
+ * Uses localtime_r() (libpragma hosts render from several threads) and wcsftime() with
+ * the format "%Y-%m-%d %H:%M:%S".
  * Caller must free the returned buffer.
  *
  * arguments:
@@ -109,7 +111,65 @@ wchar_t* legible_date(time_t when) {
 	struct tm t;
 	wchar_t *output = malloc(64 * sizeof(wchar_t));
 
-	t = *localtime(&when);
+	localtime_r(&when, &t);
 	wcsftime(output, 64, L"%Y-%m-%d %H:%M:%S", &t);
 	return output;
 }
+
+/**
+ * has_extension(): Case-insensitive check of a file name's extension.
+ *
+ * arguments:
+ *  const char *name (file name or path; must not be NULL)
+ *  const char *ext (lowercase extension including the dot, e.g. ".png")
+ *
+ * returns:
+ *  bool (true if `name` ends in `ext` and has something before it)
+ */
+bool has_extension(const char *name, const char *ext) {
+	size_t n = strlen(name), e = strlen(ext);
+	if (n <= e)
+		return false;
+	for (size_t i = 0; i < e; i++)
+		if (tolower((unsigned char)name[n - e + i]) != ext[i])
+			return false;
+	return true;
+}
+
+/**
+ * hash_update(): Fold `length` bytes into a running 64-bit FNV-1a hash.
+ *
+ * Start from HASH_SEED; feeding a buffer in pieces gives the same result as
+ * hashing it in one go.
+ *
+ * arguments:
+ *  uint64_t hash (running hash, or HASH_SEED to start)
+ *  const void *data (bytes to hash; must not be NULL unless length is 0)
+ *  size_t length (number of bytes)
+ *
+ * returns:
+ *  uint64_t (updated hash)
+ */
+uint64_t hash_update(uint64_t hash, const void *data, size_t length) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * hash_bytes(): 64-bit FNV-1a hash of a byte buffer. Used to tell whether a generated
+ * output changed since the last build; not suitable for anything security-related.
+ *
+ * arguments:
+ *  const void *data (bytes to hash)
+ *  size_t length (number of bytes)
+ *
+ * returns:
+ *  uint64_t (hash)
+ */
+uint64_t hash_bytes(const void *data, size_t length) {
+	return hash_update(HASH_SEED, data, length);
+}
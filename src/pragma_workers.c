@@ -0,0 +1,264 @@
+/**
+ * pragma_workers.c - Small fixed-size worker pool for background build jobs
+ *
+ * Rendering is strictly sequential (the page list, buffer pool and template code are not
+ * thread-safe), but a few stages of the build only need bytes that are already finished:
+ * compressing outputs, for instance. Those jobs go to this pool so the main thread can keep
+ * rendering while they run.
+ *
+ * Jobs must not touch the global buffer pool or any site/page data that the main thread
+ * may still modify; give each job everything it needs in its argument and let the job
+ * free it.
+ *
+ * The queue is bounded, so a fast renderer feeding slow jobs blocks in work_pool_submit()
+ * instead of piling every finished page into memory.
+ *
+ * By Will Shaw <wsshaw@gmail.com>
+ */
+
+#include "pragma_poison.h"
+
+#define WORK_QUEUE_LIMIT	64	// pending jobs before work_pool_submit() blocks
+
+typedef struct work_item {
+	work_fn fn;
+	void *arg;
+	pragma_context *context;	// bound while the job runs (the submitting thread's context)
+	struct work_item *next;
+} work_item;
+
+struct work_pool {
+	pthread_t *threads;
+	int thread_count;
+	work_item *head;
+	work_item *tail;
+	int pending;		// queued, not yet picked up
+	int active;		// picked up, still running
+	bool shutting_down;
+	pthread_mutex_t lock;
+	pthread_cond_t has_work;	// signalled when a job is queued (or on shutdown)
+	pthread_cond_t has_room;	// signalled when the queue drops below the limit
+	pthread_cond_t idle;		// signalled when pending == active == 0
+};
+
+// Global worker pool, created on first use (same pattern as the global buffer pool)
+static work_pool *global_work_pool = NULL;
+
+/**
+ * current_work_pool(): The calling thread's shared pool slot: global_work_pool, or the
+ * bound context's.
+ */
+static work_pool** current_work_pool(void) {
+	return context_state(CONTEXT_WORKERS, &global_work_pool, sizeof(global_work_pool));
+}
+
+/**
+ * work_pool_thread(): Worker loop. Takes jobs off the queue until the pool shuts down.
+ *
+ * arguments:
+ *  void *arg (the owning work_pool)
+ *
+ * returns:
+ *  void* (always NULL)
+ */
+static void* work_pool_thread(void *arg) {
+	work_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->head && !pool->shutting_down)
+			pthread_cond_wait(&pool->has_work, &pool->lock);
+
+		if (!pool->head && pool->shutting_down)
+			break;
+
+		work_item *item = pool->head;
+		pool->head = item->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pool->pending--;
+		pool->active++;
+		pthread_cond_signal(&pool->has_room);
+		pthread_mutex_unlock(&pool->lock);
+
+		context_bind(item->context);
+		item->fn(item->arg);
+		context_bind(NULL);
+		free(item);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->active--;
+		if (pool->pending == 0 && pool->active == 0)
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * work_pool_default_threads(): Number of worker threads to use when none is configured.
+ *
+ * returns:
+ *  int (online CPU count, at least 1)
+ */
+int work_pool_default_threads(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (int)cpus : 1;
+}
+
+/**
+ * work_pool_create(): Start a pool of worker threads.
+ *
+ * arguments:
+ *  int threads (number of worker threads; values < 1 use work_pool_default_threads())
+ *
+ * returns:
+ *  work_pool* (running pool; NULL on error; caller must work_pool_destroy())
+ */
+work_pool* work_pool_create(int threads) {
+	if (threads < 1)
+		threads = work_pool_default_threads();
+
+	work_pool *pool = calloc(1, sizeof(work_pool));
+	if (!pool)
+		return NULL;
+
+	pool->threads = malloc(threads * sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->has_work, NULL);
+	pthread_cond_init(&pool->has_room, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, work_pool_thread, pool) != 0) {
+			log_warn("could only start %d of %d worker threads", i, threads);
+			break;
+		}
+		pool->thread_count++;
+	}
+
+	if (pool->thread_count == 0) {
+		log_error("couldn't start any worker threads; background jobs will run inline");
+	}
+
+	return pool;
+}
+
+/**
+ * work_pool_submit(): Queue a job. Blocks while the queue is full. If the pool has no
+ * threads (or pool is NULL), the job runs immediately on the calling thread.
+ *
+ * arguments:
+ *  work_pool *pool (pool to use; may be NULL)
+ *  work_fn fn (job function; must not be NULL)
+ *  void *arg (job argument, owned by the job from here on)
+ *
+ * returns:
+ *  void
+ */
+void work_pool_submit(work_pool *pool, work_fn fn, void *arg) {
+	if (!fn)
+		return;
+
+	work_item *item = (pool && pool->thread_count > 0) ? malloc(sizeof(work_item)) : NULL;
+	if (!item) {
+		fn(arg);
+		return;
+	}
+	item->fn = fn;
+	item->arg = arg;
+	item->context = context_current();
+	item->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending >= WORK_QUEUE_LIMIT)
+		pthread_cond_wait(&pool->has_room, &pool->lock);
+
+	if (pool->tail)
+		pool->tail->next = item;
+	else
+		pool->head = item;
+	pool->tail = item;
+	pool->pending++;
+	pthread_cond_signal(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * work_pool_wait(): Block until every queued job has finished.
+ *
+ * arguments:
+ *  work_pool *pool (pool to drain; may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void work_pool_wait(work_pool *pool) {
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0 || pool->active > 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * work_pool_destroy(): Finish all queued jobs, stop the threads and free the pool.
+ *
+ * arguments:
+ *  work_pool *pool (pool to destroy; may be NULL)
+ *
+ * returns:
+ *  void
+ */
+void work_pool_destroy(work_pool *pool) {
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutting_down = true;
+	pthread_cond_broadcast(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->has_work);
+	pthread_cond_destroy(&pool->has_room);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->threads);
+	free(pool);
+}
+
+/**
+ * work_pool_get_global(): Get the shared worker pool, starting it on first use.
+ *
+ * returns:
+ *  work_pool* (shared pool; NULL if it couldn't be created, in which case
+ *   work_pool_submit() runs jobs inline)
+ */
+work_pool* work_pool_get_global(void) {
+	work_pool **pool = current_work_pool();
+	if (!*pool)
+		*pool = work_pool_create(0);
+	return *pool;
+}
+
+/**
+ * work_pool_cleanup_global(): Drain and stop the shared worker pool.
+ * This should be called once at program shutdown.
+ */
+void work_pool_cleanup_global(void) {
+	work_pool **pool = current_work_pool();
+	if (*pool) {
+		work_pool_destroy(*pool);
+		*pool = NULL;
+	}
+}